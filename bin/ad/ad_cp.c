@@ -629,12 +629,7 @@ static int ftw_copy_file(const struct FTW *entp,
 {
     static char *buf = NULL;
     static size_t bufsize;
-    ssize_t wcount;
-    size_t wresid;
-    off_t wtotal;
-    int ch, checkch, from_fd = 0, rcount, rval, to_fd = 0;
-    char *bufp;
-    char *p;
+    int ch, checkch, from_fd = 0, rval, to_fd = 0;
 
     if ((from_fd = open(spath, O_RDONLY, 0)) == -1) {
         SLOG("%s: %s", spath, strerror(errno));
@@ -693,75 +688,26 @@ static int ftw_copy_file(const struct FTW *entp,
 
     rval = 0;
 
-    /*
-     * Mmap and write if less than 8M (the limit is so we don't totally
-     * trash memory on big files.  This is really a minor hack, but it
-     * wins some CPU back.
-     * Some filesystems, such as smbnetfs, don't support mmap,
-     * so this is a best-effort attempt.
-     */
-
-    if (S_ISREG(sp->st_mode) && sp->st_size > 0 &&
-        sp->st_size <= 8 * 1024 * 1024 &&
-        (p = mmap(NULL, (size_t)sp->st_size, PROT_READ,
-                  MAP_SHARED, from_fd, (off_t)0)) != MAP_FAILED) {
-        wtotal = 0;
-        for (bufp = p, wresid = sp->st_size; ;
-             bufp += wcount, wresid -= (size_t)wcount) {
-            wcount = write(to_fd, bufp, wresid);
-            if (wcount <= 0)
-                break;
-            wtotal += wcount;
-            if (wcount >= (ssize_t)wresid)
-                break;
-        }
-        if (wcount != (ssize_t)wresid) {
-            SLOG("%s: %s", to.p_path, strerror(errno));
-            rval = 1;
-        }
-        /* Some systems don't unmap on close(2). */
-        if (munmap(p, sp->st_size) < 0) {
-            SLOG("%s: %s", spath, strerror(errno));
-            rval = 1;
-        }
-    } else {
-        if (buf == NULL) {
-            /*
-             * Note that buf and bufsize are static. If
-             * malloc() fails, it will fail at the start
-             * and not copy only some files.
-             */
-            if (sysconf(_SC_PHYS_PAGES) >
-                PHYSPAGES_THRESHOLD)
-                bufsize = MIN(BUFSIZE_MAX, MAXPHYS * 8);
-            else
-                bufsize = BUFSIZE_SMALL;
-            buf = malloc(bufsize);
-            if (buf == NULL)
-                ERROR("Not enough memory");
-
-        }
-        wtotal = 0;
-        while ((rcount = read(from_fd, buf, bufsize)) > 0) {
-            for (bufp = buf, wresid = rcount; ;
-                 bufp += wcount, wresid -= wcount) {
-                wcount = write(to_fd, bufp, wresid);
-                if (wcount <= 0)
-                    break;
-                wtotal += wcount;
-                if (wcount >= (ssize_t)wresid)
-                    break;
-            }
-            if (wcount != (ssize_t)wresid) {
-                SLOG("%s: %s", to.p_path, strerror(errno));
-                rval = 1;
-                break;
-            }
-        }
-        if (rcount < 0) {
-            SLOG("%s: %s", spath, strerror(errno));
-            rval = 1;
-        }
+    if (buf == NULL) {
+        /*
+         * Note that buf and bufsize are static. If
+         * malloc() fails, it will fail at the start
+         * and not copy only some files.
+         */
+        if (sysconf(_SC_PHYS_PAGES) >
+            PHYSPAGES_THRESHOLD)
+            bufsize = MIN(BUFSIZE_MAX, MAXPHYS * 8);
+        else
+            bufsize = BUFSIZE_SMALL;
+        buf = malloc(bufsize);
+        if (buf == NULL)
+            ERROR("Not enough memory");
+    }
+
+    /* clones the file or lets the filesystem copy it if possible */
+    if (copy_file_data(from_fd, to_fd, buf, bufsize) != 0) {
+        SLOG("%s -> %s: %s", spath, to.p_path, strerror(errno));
+        rval = 1;
     }
 
     /*
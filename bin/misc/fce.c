@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -19,7 +20,7 @@
 #include <atalk/fce_api.h>
 #include <atalk/util.h>
 
-#define MAXBUFLEN 1024
+#define MAXBUFLEN 65536
 
 static char *fce_ev_names[] = {
     "",
@@ -34,70 +35,173 @@ static char *fce_ev_names[] = {
     "FCE_LOGOUT"
 };
 
-static int unpack_fce_packet(unsigned char *buf, struct fce_packet *packet)
+/* Bail out of an unpack function if fewer than n bytes are left */
+#define NEED(n) do { if (end - p < (ptrdiff_t)(n)) return -1; } while (0)
+
+/*
+ * Unpack a length prefixed string into dst, which holds MAXPATHLEN bytes.
+ * Fails if the string runs past end or does not fit into dst.
+ */
+static int unpack_fce_string(unsigned char **pp, const unsigned char *end,
+                             uint16_t *lenp, char *dst)
+{
+    unsigned char *p = *pp;
+    uint16_t len;
+
+    NEED(sizeof(len));
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    len = ntohs(len);
+
+    if (len >= MAXPATHLEN)
+        return -1;
+    NEED(len);
+    memcpy(dst, p, len);
+    dst[len] = 0; /* 0 terminate strings */
+    p += len;
+
+    *lenp = len;
+    *pp = p;
+    return 0;
+}
+
+/*
+ * Unpack a packet of buflen bytes, returns the number of bytes consumed
+ * or -1 for a truncated or malformed packet
+ */
+static int unpack_fce_packet(unsigned char *buf, size_t buflen, struct fce_packet *packet)
 {
     unsigned char *p = buf;
-    uint16_t uint16;
-    uint32_t uint32;
-    uint64_t uint64;
+    const unsigned char *end = buf + buflen;
 
+    NEED(sizeof(packet->fcep_magic) + 1);
     memcpy(&packet->fcep_magic[0], p, sizeof(packet->fcep_magic));
     p += sizeof(packet->fcep_magic);
 
     packet->fcep_version = *p++;
 
-    if (packet->fcep_version > 1)
+    if (packet->fcep_version > 1) {
+        NEED(1);
         packet->fcep_options = *p++;
+    } else {
+        packet->fcep_options = 0;
+    }
 
-    packet->fcep_event = *p++;
+    if (packet->fcep_version > 2) {
+        /* event count */
+        NEED(sizeof(uint16_t));
+        p += sizeof(uint16_t);
+    }
 
-    if (packet->fcep_version > 1)
-        /* padding */
-        p++;
+    if (packet->fcep_version > 2 && (packet->fcep_options & FCE_EV_INFO_PID)) {
+        NEED(sizeof(packet->fcep_pid));
+        memcpy(&packet->fcep_pid, p, sizeof(packet->fcep_pid));
+        packet->fcep_pid = hton64(packet->fcep_pid);
+        p += sizeof(packet->fcep_pid);
+    }
+
+    if (packet->fcep_version > 2 && (packet->fcep_options & FCE_EV_INFO_USER)) {
+        if (unpack_fce_string(&p, end, &packet->fcep_userlen, packet->fcep_user) != 0)
+            return -1;
+    }
 
-    if (packet->fcep_version > 1)
-        /* reserved */
-        p += 8;
+    if (packet->fcep_version > 2)
+        /* the event records follow, see unpack_fce_batch_record() */
+        return p - buf;
 
+    NEED(1);
+    packet->fcep_event = *p++;
+
+    if (packet->fcep_version > 1) {
+        /* padding and reserved */
+        NEED(1 + 8);
+        p += 1 + 8;
+    }
+
+    NEED(sizeof(packet->fcep_event_id));
     memcpy(&packet->fcep_event_id, p, sizeof(packet->fcep_event_id));
     p += sizeof(packet->fcep_event_id);
     packet->fcep_event_id = ntohl(packet->fcep_event_id);
 
     if (packet->fcep_options & FCE_EV_INFO_PID) {
+        NEED(sizeof(packet->fcep_pid));
         memcpy(&packet->fcep_pid, p, sizeof(packet->fcep_pid));
         packet->fcep_pid = hton64(packet->fcep_pid);
         p += sizeof(packet->fcep_pid);
     }
 
     if (packet->fcep_options & FCE_EV_INFO_USER) {
-        memcpy(&packet->fcep_userlen, p, sizeof(packet->fcep_userlen));
-        packet->fcep_userlen = ntohs(packet->fcep_userlen);
-        p += sizeof(packet->fcep_userlen);
-
-        memcpy(&packet->fcep_user[0], p, packet->fcep_userlen);
-        packet->fcep_user[packet->fcep_userlen] = 0; /* 0 terminate strings */
-        p += packet->fcep_userlen;
+        if (unpack_fce_string(&p, end, &packet->fcep_userlen, packet->fcep_user) != 0)
+            return -1;
     }
 
     /* path */
-    memcpy(&packet->fcep_pathlen1, p, sizeof(packet->fcep_pathlen1));
-    p += sizeof(packet->fcep_pathlen1);
-    packet->fcep_pathlen1 = ntohs(packet->fcep_pathlen1);
+    if (unpack_fce_string(&p, end, &packet->fcep_pathlen1, packet->fcep_path1) != 0)
+        return -1;
+
+    if (packet->fcep_options & FCE_EV_INFO_SRCPATH) {
+        if (unpack_fce_string(&p, end, &packet->fcep_pathlen2, packet->fcep_path2) != 0)
+            return -1;
+    }
+
+    return p - buf;
+}
+
+/*
+ * Unpack one event record of a version 3 packet, pid and username have already been
+ * unpacked from the packet header. Returns the number of bytes consumed or -1 if the
+ * record runs past end.
+ */
+static int unpack_fce_batch_record(unsigned char *rec, const unsigned char *end,
+                                   struct fce_packet *packet)
+{
+    unsigned char *p = rec;
+
+    NEED(2 + sizeof(packet->fcep_event_id));
+    packet->fcep_event = *p++;
+    packet->fcep_options = (packet->fcep_options & ~FCE_EV_INFO_SRCPATH) | (*p++ & FCE_EV_INFO_SRCPATH);
 
-    memcpy(&packet->fcep_path1[0], p, packet->fcep_pathlen1);
-    packet->fcep_path1[packet->fcep_pathlen1] = 0; /* 0 terminate strings */
-    p += packet->fcep_pathlen1;
+    memcpy(&packet->fcep_event_id, p, sizeof(packet->fcep_event_id));
+    p += sizeof(packet->fcep_event_id);
+    packet->fcep_event_id = ntohl(packet->fcep_event_id);
+
+    if (unpack_fce_string(&p, end, &packet->fcep_pathlen1, packet->fcep_path1) != 0)
+        return -1;
 
     if (packet->fcep_options & FCE_EV_INFO_SRCPATH) {
-        memcpy(&packet->fcep_pathlen2, p, sizeof(packet->fcep_pathlen2));
-        p += sizeof(packet->fcep_pathlen2);
-        packet->fcep_pathlen2 = ntohs(packet->fcep_pathlen2);
-        memcpy(&packet->fcep_path2[0], p, packet->fcep_pathlen2);
-        packet->fcep_path2[packet->fcep_pathlen2] = 0; /* 0 terminate strings */
-        p += packet->fcep_pathlen2;
+        if (unpack_fce_string(&p, end, &packet->fcep_pathlen2, packet->fcep_path2) != 0)
+            return -1;
     }
 
-    return 0;
+    return p - rec;
+}
+
+#undef NEED
+
+static void print_fce_packet(struct fce_packet *packet)
+{
+    switch (packet->fcep_event) {
+    case FCE_CONN_START:
+        printf("FCE Start\n");
+        break;
+
+    case FCE_CONN_BROKEN:
+        printf("Broken FCE connection\n");
+        break;
+
+    default:
+        printf("ID: %" PRIu32 ", Event: %s", packet->fcep_event_id, fce_ev_names[packet->fcep_event]);
+        if (packet->fcep_options & FCE_EV_INFO_PID)
+            printf(", pid: %" PRId64, packet->fcep_pid);
+        if (packet->fcep_options & FCE_EV_INFO_USER)
+            printf(", user: %s", packet->fcep_user);
+
+        if (packet->fcep_options & FCE_EV_INFO_SRCPATH)
+            printf(", source: %s", packet->fcep_path2);
+
+        printf(", Path: %s\n", packet->fcep_path1);
+        break;
+    }
 }
 
 int main(int argc, char **argv)
@@ -110,6 +214,9 @@ int main(int argc, char **argv)
     socklen_t addr_len;
     char s[INET6_ADDRSTRLEN];
     char *host = "localhost";
+    unsigned char *rec, *end;
+    uint16_t count;
+    int len;
 
     while ((c = getopt(argc, argv, "h:")) != -1) {
         switch(c) {
@@ -168,32 +275,27 @@ int main(int argc, char **argv)
             exit(1);
         }
 
-        unpack_fce_packet((unsigned char *)buf, &packet);
-
-        if (memcmp(packet.fcep_magic, FCE_PACKET_MAGIC, sizeof(packet.fcep_magic)) == 0) {
-
-            switch (packet.fcep_event) {
-            case FCE_CONN_START:
-                printf("FCE Start\n");
-                break;
-
-            case FCE_CONN_BROKEN:
-                printf("Broken FCE connection\n");
-                break;
+        if ((len = unpack_fce_packet((unsigned char *)buf, numbytes, &packet)) < 0)
+            continue;
 
-            default:
-                printf("ID: %" PRIu32 ", Event: %s", packet.fcep_event_id, fce_ev_names[packet.fcep_event]);
-                if (packet.fcep_options & FCE_EV_INFO_PID)
-                    printf(", pid: %" PRId64, packet.fcep_pid);
-                if (packet.fcep_options & FCE_EV_INFO_USER)
-                    printf(", user: %s", packet.fcep_user);
+        if (memcmp(packet.fcep_magic, FCE_PACKET_MAGIC, sizeof(packet.fcep_magic)) != 0)
+            continue;
 
-                if (packet.fcep_options & FCE_EV_INFO_SRCPATH)
-                    printf(", source: %s", packet.fcep_path2);
+        if (packet.fcep_version < 3) {
+            print_fce_packet(&packet);
+            continue;
+        }
 
-                printf(", Path: %s\n", packet.fcep_path1);
+        /* version 3 packets carry a batch of events */
+        memcpy(&count, buf + 10, sizeof(count));
+        count = ntohs(count);
+        rec = (unsigned char *)buf + len;
+        end = (unsigned char *)buf + numbytes;
+        for (; count > 0 && rec < end; count--) {
+            if ((len = unpack_fce_batch_record(rec, end, &packet)) < 0)
                 break;
-            }
+            rec += len;
+            print_fce_packet(&packet);
         }
     }
 
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <atalk/unicode.h>
 
@@ -41,8 +42,12 @@ int main(int argc, char **argv)
     char *string, *macName = MACCHARSET;
     char *f = NULL, *t = NULL;
     charset_t from, to, mac;
+    long count = 0;
+    uint16_t bflags, cflags;
+    struct timespec start, end;
+    double secs;
 
-    while ((opt = getopt(argc, argv, "m:o:f:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "b:m:o:f:t:")) != -1) {
         switch(opt) {
         case 'm':
             macName = strdup(optarg);
@@ -58,12 +63,16 @@ int main(int argc, char **argv)
         case 't':
             t = strdup(optarg);
             break;
+        case 'b':
+            count = atol(optarg);
+            break;
         }
     }
 
     if ((optind + 1) != argc) {
-        printf("Usage: test [-o <conversion option> [...]] [-f <from charset>] [-t <to charset>] [-m legacy Mac charset] <string>\n");
+        printf("Usage: test [-o <conversion option> [...]] [-f <from charset>] [-t <to charset>] [-m legacy Mac charset] [-b <count>] <string>\n");
         printf("Defaults: -f: UTF8-MAC, -t: UTF8, -m MAC_ROMAN\n");
+        printf("-b: convert the string <count> times and print the conversion rate\n");
         printf("Available conversion options:\n");
         for (int i = 0; i < (sizeof(flag_map)/sizeof(struct flag_map) - 1); i++) {
             printf("%s\n", flag_map[i].flagname);
@@ -91,6 +100,7 @@ int main(int argc, char **argv)
     }
 
 
+    bflags = flags;
     if ((size_t)-1 == (convert_charset(from, to, mac,
                                        string, strlen(string),
                                        buffer, MAXPATHLEN,
@@ -101,5 +111,16 @@ int main(int argc, char **argv)
 
     printf("from: %s\nto: %s\n", string, buffer);
 
+    if (count > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < count; i++) {
+            cflags = bflags;
+            convert_charset(from, to, mac, string, strlen(string), buffer, MAXPATHLEN, &cflags);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%ld conversions in %.3f s, %.0f names/s\n", count, secs, count / secs);
+    }
+
     return 0;
 }
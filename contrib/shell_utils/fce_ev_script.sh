@@ -1,6 +1,6 @@
 #!/bin/sh
 
-usage="$(basename $0) [-h] [-v version] [-e event] [-P path] [-S source path] -- FCE sample script
+usage="$(basename $0) [-h] [-s] [-v version] [-e event] [-P path] [-S source path] -- FCE sample script
 
 where:
     -h  show this help text
@@ -11,9 +11,12 @@ where:
     -u  username
     -p  pid
     -i  event ID
+    -s  read events from stdin, one tab separated line per event:
+        event ID, event, pid, username, path, source path
+        (fce version 3, the script is started once per session)
 "
 
-while getopts ':hs:v:e:P:S:u:p:i:' option; do
+while getopts ':hsv:e:P:S:u:p:i:' option; do
   case "$option" in
     h) echo "$usage"
        exit
@@ -32,6 +35,8 @@ while getopts ':hs:v:e:P:S:u:p:i:' option; do
        ;;
     i) evid=$OPTARG
        ;;
+    s) stream=1
+       ;;
     ?) printf "illegal option: '%s'\n" "$OPTARG" >&2
        echo "$usage" >&2
        exit 1
@@ -40,6 +45,21 @@ while getopts ':hs:v:e:P:S:u:p:i:' option; do
 done
 shift $((OPTIND - 1))
 
+if [ -n "$stream" ] ; then
+    tab=$(printf '\t')
+    while IFS="$tab" read -r evid event pid user path srcpath ; do
+        printf "FCE Event: $event, protocol: $version, ID: $evid, pid: $pid, user: $user" >> /tmp/fce.log
+        if [ -n "$srcpath" ] ; then
+            printf ", source: %s" "$srcpath" >> /tmp/fce.log
+        fi
+        if [ -n "$path" ] ; then
+            printf ", path: %s" "$path" >> /tmp/fce.log
+        fi
+        printf "\n" >> /tmp/fce.log
+    done
+    exit
+fi
+
 printf "FCE Event: $event" >> /tmp/fce.log 
 if [ -n "$version" ] ; then
     printf ", protocol: $version" >> /tmp/fce.log
@@ -35,6 +35,8 @@
 #include <atalk/dsi.h>
 #include <atalk/compat.h>
 #include <atalk/util.h>
+#include <atalk/cnid.h>
+#include <atalk/adouble.h>
 #include <atalk/uuid.h>
 #include <atalk/paths.h>
 #include <atalk/server_ipc.h>
@@ -42,6 +44,8 @@
 #include <atalk/globals.h>
 #include <atalk/netatalk_conf.h>
 #include <atalk/spotlight.h>
+#include <atalk/uring.h>
+#include <atalk/cmdstats.h>
 
 #include "switch.h"
 #include "auth.h"
@@ -76,11 +80,80 @@ typedef struct {
 static rc_elem_t replaycache[REPLAYCACHE_SIZE];
 
 static sigjmp_buf recon_jmp;
+
+/* AFP command statistics, sent to the master every CMDSTATS_INTERVAL seconds */
+static cmdstats_t cmdstats;
+static time_t cmdstats_sent;
+
+/*
+ * Count an AFP command that was started at start, read_count and
+ * write_count are the DSI byte counters at that time
+ */
+static void afp_cmdstats(AFPObj *obj, const DSI *dsi, uint8_t function, uint32_t err,
+                         const struct timespec *start, off_t read_count, off_t write_count)
+{
+    struct timespec now;
+    int64_t usec;
+    uint64_t out;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usec = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+    if (usec < 0)
+        usec = 0;
+    if (usec > UINT32_MAX)
+        usec = UINT32_MAX;
+
+    out = dsi->write_count - write_count;
+    if (!(dsi->flags & DSI_NOREPLY))
+        out += dsi->datalen;
+
+    cmdstats_record(&cmdstats, function, (uint32_t)usec, err != AFP_OK,
+                    dsi->cmdlen + dsi->read_count - read_count, out);
+
+    if (now.tv_sec - cmdstats_sent >= CMDSTATS_INTERVAL) {
+        cmdstats_send(&cmdstats, obj->ipc_fd);
+        cmdstats_sent = now.tv_sec;
+    }
+}
+
+/*
+ * AFP commands whose replies can be queued while further requests are
+ * pipelined in the DSI readahead buffer: read-only commands that only
+ * ever reply via dsi_cmdreply(). FPGetIcon is not one of them, it streams
+ * its reply with dsi_readinit() which would overtake the queued replies.
+ */
+static int afp_pipelinable(uint8_t function)
+{
+    switch (function) {
+    case AFP_ENUMERATE:
+    case AFP_ENUMERATE_EXT:
+    case AFP_ENUMERATE_EXT2:
+    case AFP_GETFLDRPARAM:
+    case AFP_GETFORKPARAM:
+    case AFP_GETVOLPARAM:
+    case AFP_GETSRVPARAM:
+    case AFP_GETUSERINFO:
+    case AFP_MAPID:
+    case AFP_MAPNAME:
+    case AFP_RESOLVEID:
+    case AFP_GETEXTATTR:
+    case AFP_LISTEXTATTR:
+    case AFP_GETACL:
+    case AFP_GETCMT:
+    case AFP_GTICNINFO:
+    case AFP_GETAPPL:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 static void afp_dsi_close(AFPObj *obj)
 {
     DSI *dsi = obj->dsi;
     sigset_t sigs;
-    
+
+    cmdstats_send(&cmdstats, obj->ipc_fd);
     close(obj->ipc_fd);
     obj->ipc_fd = -1;
 
@@ -97,6 +170,8 @@ static void afp_dsi_close(AFPObj *obj)
     }
 
     close_all_vol(obj);
+    /* send events still queued in the FCE event ring */
+    fce_cleanup(obj);
     if (obj->logout) {
         /* Block sigs, PAM/systemd/whoever might send us a SIG??? in (*obj->logout)() -> pam_close_session() */
         sigfillset(&sigs);
@@ -107,6 +182,13 @@ static void afp_dsi_close(AFPObj *obj)
     LOG(log_note, logtype_afpd, "AFP statistics: %.2f KB read, %.2f KB written",
         dsi->read_count/1024.0, dsi->write_count/1024.0);
     log_dircache_stat();
+    ad_cache_log_stat();
+    cnid_shm_log_stat();
+    ad_shmlock_log_stat();
+    log_readahead_stat();
+#ifdef WITH_IO_URING
+    uring_close();
+#endif
 
     dsi_close(dsi);
 }
@@ -171,6 +253,7 @@ static void afp_dsi_transfer_session(int sig _U_)
     dsi->flags = DSI_RECONSOCKET;
     dsi->datalen = 0;
     dsi->eof = dsi->start = dsi->buffer;
+    dsi->replyqlen = 0;
     dsi->in_write = 0;
     dsi->header.dsi_requestID = dsiID;
     dsi->header.dsi_command = DSIFUNC_CMD;
@@ -448,6 +531,36 @@ void afp_over_dsi_sighandlers(AFPObj *obj)
     }
 }
 
+/*!
+ * Set up the per session caches, pre-forked session workers do this before
+ * they get a connection
+ */
+int afp_over_dsi_init(AFPObj *obj)
+{
+    static int initialized;
+
+    if (initialized)
+        return 0;
+
+    if (dircache_init(obj->options.dircachesize) != 0)
+        return -1;
+
+    if (ad_cache_init(obj->options.mdcachesize) != 0)
+        LOG(log_warning, logtype_afpd, "afp_over_dsi: metadata cache not available");
+
+    if ((obj->options.flags & OPTION_DIRCACHE_NOTIFY)
+        && dircache_notify_init(obj->options.dircache_watches) != 0)
+        LOG(log_warning, logtype_afpd, "afp_over_dsi: dircache notify not available, using ctime validation");
+
+#ifdef WITH_IO_URING
+    if ((obj->options.flags & OPTION_IO_URING) && uring_init() != 0)
+        LOG(log_warning, logtype_afpd, "afp_over_dsi: io_uring not available, using default I/O");
+#endif
+
+    initialized = 1;
+    return 0;
+}
+
 /* -------------------------------------------
  afp over dsi. this never returns. 
 */
@@ -457,6 +570,8 @@ void afp_over_dsi(AFPObj *obj)
     int rc_idx;
     uint32_t err, cmd;
     uint8_t function;
+    struct timespec start;
+    off_t read_count, write_count;
 
     AFPobj = obj;
     obj->exit = afp_dsi_die;
@@ -466,7 +581,7 @@ void afp_over_dsi(AFPObj *obj)
 
     afp_over_dsi_sighandlers(obj);
 
-    if (dircache_init(obj->options.dircachesize) != 0)
+    if (afp_over_dsi_init(obj) != 0)
         afp_dsi_die(EXITERR_SYS);
 
     /* set TCP snd/rcv buf */
@@ -495,12 +610,17 @@ void afp_over_dsi(AFPObj *obj)
 
     ipc_child_state(obj, DSI_RUNNING);
 
+    /* the loop below flushes the log ring before each blocking read */
+    setuplog_async(obj->options.logbuffer);
+
     /* get stuck here until the end */
     while (1) {
         if (sigsetjmp(recon_jmp, 1) != 0)
             /* returning from SIGALARM handler for a primary reconnect */
             continue;
 
+        log_flush();
+
         /* Blocking read on the network socket */
         cmd = dsi_stream_receive(dsi);
 
@@ -573,6 +693,8 @@ void afp_over_dsi(AFPObj *obj)
         }
 
 
+        dircache_notify_process();
+
         dsi->flags |= DSI_DATA;
         dsi->tickle = 0;
 
@@ -604,6 +726,14 @@ void afp_over_dsi(AFPObj *obj)
 
             function = (u_char) dsi->commands[0];
 
+            /* Send queued replies of pipelined requests before anything that might write to the socket itself */
+            if (!afp_pipelinable(function) && dsi_replyq_flush(dsi) != 0) {
+                LOG(log_error, logtype_afpd, "dsi_replyq_flush(%d): %s", dsi->socket, strerror(errno) );
+                if (dsi_disconnect(dsi) != 0)
+                    afp_dsi_die(EXITERR_CLNT);
+                break;
+            }
+
             /* AFP replay cache */
             rc_idx = dsi->clientID % REPLAYCACHE_SIZE;
             LOG(log_debug, logtype_dsi, "DSI request ID: %u", dsi->clientID);
@@ -623,12 +753,17 @@ void afp_over_dsi(AFPObj *obj)
 
                     LOG(log_debug, logtype_afpd, "<== Start AFP command: %s", AfpNum2name(function));
 
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                    read_count = dsi->read_count;
+                    write_count = dsi->write_count;
+
                     AFP_AFPFUNC_START(function, (char *)AfpNum2name(function));
                     err = (*afp_switch[function])(obj,
                                                   (char *)dsi->commands, dsi->cmdlen,
                                                   (char *)&dsi->data, &dsi->datalen);
 
                     AFP_AFPFUNC_DONE(function, (char *)AfpNum2name(function));
+                    afp_cmdstats(obj, dsi, function, err, &start, read_count, write_count);
                     LOG(log_debug, logtype_afpd, "==> Finished AFP command: %s -> %s",
                         AfpNum2name(function), AfpErr2name(err));
 
@@ -651,6 +786,14 @@ void afp_over_dsi(AFPObj *obj)
             if (dsi->flags & DSI_NOREPLY) {
                 dsi->flags &= ~DSI_NOREPLY;
                 break;
+            } else if (afp_pipelinable(function)) {
+                /* queue the reply, flush the queue unless the next request is already buffered */
+                if (!dsi_cmdreply_queue(dsi, err)
+                    || (!dsi_stream_pending(dsi) && dsi_replyq_flush(dsi) != 0)) {
+                    LOG(log_error, logtype_afpd, "dsi_cmdreply_queue(%d): %s", dsi->socket, strerror(errno) );
+                    if (dsi_disconnect(dsi) != 0)
+                        afp_dsi_die(EXITERR_CLNT);
+                }
             } else if (!dsi_cmdreply(dsi, err)) {
                 LOG(log_error, logtype_afpd, "dsi_cmdreply(%d): %s", dsi->socket, strerror(errno) );
                 if (dsi_disconnect(dsi) != 0)
@@ -666,6 +809,10 @@ void afp_over_dsi(AFPObj *obj)
 
                 LOG(log_debug, logtype_afpd, "<== Start AFP command: %s", AfpNum2name(function));
 
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                read_count = dsi->read_count;
+                write_count = dsi->write_count;
+
                 AFP_AFPFUNC_START(function, (char *)AfpNum2name(function));
 
                 err = (*afp_switch[function])(obj,
@@ -673,6 +820,7 @@ void afp_over_dsi(AFPObj *obj)
                                               (char *)&dsi->data, &dsi->datalen);
 
                 AFP_AFPFUNC_DONE(function, (char *)AfpNum2name(function));
+                afp_cmdstats(obj, dsi, function, err, &start, read_count, write_count);
 
                 LOG(log_debug, logtype_afpd, "==> Finished AFP command: %s -> %s",
                     AfpNum2name(function), AfpErr2name(err));
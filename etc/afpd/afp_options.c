@@ -172,9 +172,9 @@ static void show_version_extended(void )
 
 	printf( "     Spotlight support:\t" );
 #ifdef HAVE_TRACKER
-	puts( "Yes" );
+	puts( "Yes (Tracker, native)" );
 #else
-	puts( "No" );
+	puts( "Yes (native)" );
 #endif
 
 	printf( "         DTrace probes:\t" );
@@ -31,6 +31,7 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/param.h>  
 #include <string.h>
@@ -318,3 +319,79 @@ int afprun_bg(int root, char *cmd)
     exit(82);
     return 1;
 }
+
+/*
+ * Run a command in the background without waiting, being careful about
+ * uid/gid handling, with its stdin connected to a pipe. The non-blocking
+ * write end of the pipe is returned in infd.
+ */
+int afprun_pipe(int root, char *cmd, int *infd)
+{
+    pid_t pid;
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    int fd, fdlimit = sysconf(_SC_OPEN_MAX);
+    int pfd[2];
+
+    LOG(log_debug, logtype_afpd, "running %s as user %d with stdin pipe", cmd, root ? 0 : uid);
+
+    if (pipe(pfd) != 0) {
+        LOG(log_error, logtype_afpd, "afprun_pipe: pipe failed with error %s", strerror(errno) );
+        return errno;
+    }
+
+    if ((pid = fork()) < 0) {
+        LOG(log_error, logtype_afpd, "afprun_pipe: fork failed with error %s", strerror(errno) );
+        close(pfd[0]);
+        close(pfd[1]);
+        return errno;
+    }
+
+    if (pid) {
+        /* parent, keep the write end */
+        close(pfd[0]);
+        if (fcntl(pfd[1], F_SETFL, O_NONBLOCK) == -1
+            || fcntl(pfd[1], F_SETFD, FD_CLOEXEC) == -1) {
+            LOG(log_error, logtype_afpd, "afprun_pipe: fcntl: %s", strerror(errno) );
+            close(pfd[1]);
+            return -1;
+        }
+        *infd = pfd[1];
+        return 0;
+    }
+
+    /* we are in the child, point stdin at the pipe */
+    close(pfd[1]);
+    if (pfd[0] != 0) {
+        if (dup2(pfd[0], 0) != 0)
+            exit(80);
+        close(pfd[0]);
+    }
+
+    if (chdir("/") < 0) {
+        LOG(log_error, logtype_afpd, "afprun_pipe: can't change directory to \"/\" %s", strerror(errno) );
+        exit(83);
+    }
+
+    if (root) {
+        become_user_permanently(0, 0);
+        uid = gid = 0;
+    } else {
+        become_user_permanently(uid, gid);
+    }
+
+    if (getuid() != uid || geteuid() != uid || getgid() != gid || getegid() != gid) {
+        /* we failed to lose our privileges - do not execute the command */
+        exit(81);
+    }
+
+    fd = 3;
+    while (fd < fdlimit)
+        close(fd++);
+
+    execl("/bin/sh","sh","-c", cmd, NULL);
+
+    /* not reached */
+    exit(82);
+    return 1;
+}
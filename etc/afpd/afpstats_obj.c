@@ -25,6 +25,8 @@
 
 #include <atalk/logger.h>
 #include <atalk/dsi.h>
+#include <atalk/globals.h>
+#include <atalk/cmdstats.h>
 
 #include "afpstats.h"
 #include "afpstats_obj.h"
@@ -108,3 +110,27 @@ gboolean afpstats_obj_get_users(AFPStatsObj *obj, gchar ***ret, GError **error)
 
     return TRUE;
 }
+
+gboolean afpstats_obj_get_command_stats(AFPStatsObj *obj, gchar ***ret, GError **error)
+{
+    gchar **lines;
+    server_child_t *childs = afpstats_get_and_lock_childs();
+    const struct cmdstat *cs;
+    int i = 0, j;
+    char buf[512];
+
+    lines = g_new(char *, 256 + 1);
+
+    for (j = 0; j < 256; j++) {
+        if ((cs = childs->servch_stats.cs_cmd[j]) == NULL || cs->cs_calls == 0)
+            continue;
+        cmdstats_format(cs, AfpNum2name(j), buf, sizeof(buf));
+        lines[i++] = g_strdup(buf);
+    }
+    lines[i] = NULL;
+    *ret = lines;
+
+    afpstats_unlock_childs();
+
+    return TRUE;
+}
@@ -8,6 +8,7 @@ typedef struct AFPStatsObjClass AFPStatsObjClass;
 
 GType    afpstats_obj_get_type(void);
 gboolean afpstats_obj_get_users(AFPStatsObj *obj, gchar ***ret, GError **error);
+gboolean afpstats_obj_get_command_stats(AFPStatsObj *obj, gchar ***ret, GError **error);
 
 #define AFPSTATS_TYPE_OBJECT              (afpstats_obj_get_type ())
 #define AFPSTATS_OBJECT(object)           (G_TYPE_CHECK_INSTANCE_CAST((object), AFPSTATS_TYPE_OBJECT, AFPStatsObj))
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ *
+ * FPCatSearch index
+ * =================
+ *
+ * Searching a volume by walking the filesystem has to stat() every object and
+ * read the metadata of most of them. For volumes with "catsearch index = yes"
+ * afpd maintains a file ".AppleDB/catsearch.idx" beside the CNID database
+ * with a fixed size record for every object: name, FinderInfo type, creator
+ * and flags, AFP attributes, size and dates. The record of an object is
+ * stored at the offset of its CNID, so updates are a single pwrite().
+ *
+ * Record 0 is a header with the CNID database stamp and a complete flag. The
+ * index is only complete after a filesystem search has visited the whole
+ * volume once, from then on FPCatSearch scans the index and only checks
+ * objects whose records match the search criteria. The index is kept current
+ * by the afpd functions that create, rename or change objects, records of
+ * deleted objects are removed when a search finds that they don't resolve
+ * anymore.
+ *
+ * Changes not made via AFP are detected by the modification time of the
+ * directories, records of directories hold the mtime they had when they
+ * were indexed. A search that starts checks the mtime of every indexed
+ * directory, at most every CATIDX_CHECK seconds. If it changed, every entry
+ * of the directory must have a record, which is the case if afpd made the
+ * change, or the search falls back to walking the volume, which rebuilds
+ * the index. The ctime isn't used, afpd changes it when it writes metadata.
+ * Content changes made elsewhere don't touch the directory, so an index is
+ * rebuilt once it is CATIDX_MAXAGE seconds old.
+ *
+ * If the stamp of the CNID database changes, the index is reset.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include <atalk/adouble.h>
+#include <atalk/afp.h>
+#include <atalk/bstrlib.h>
+#include <atalk/bstradd.h>
+#include <atalk/cnid.h>
+#include <atalk/logger.h>
+#include <atalk/unicode.h>
+#include <atalk/unix.h>
+#include <atalk/util.h>
+#include <atalk/volume.h>
+
+#include "catidx.h"
+#include "desktop.h"
+#include "directory.h"
+#include "file.h"
+
+#define CATIDX_FILE     "/.AppleDB/catsearch.idx"
+#define CATIDX_MAGIC    0x43494458 /* "CIDX" */
+#define CATIDX_VERSION  2
+#define CATIDX_CHECK    10          /* seconds between directory checks */
+#define CATIDX_MAXAGE   (24 * 3600) /* seconds until the index is rebuilt */
+
+struct catidx_hdr {
+    uint32_t ch_magic;
+    uint32_t ch_version;
+    uint32_t ch_reclen;
+    uint32_t ch_complete;
+    char     ch_stamp[ADEDLEN_PRIVSYN];
+    uint32_t ch_built;          /* when the index was completed */
+    uint32_t ch_checked;        /* last check of the directories */
+    uint32_t ch_rootmtime;      /* mtime of the volume root, it has no record */
+    uint32_t ch_pad;
+};
+
+struct catidx {
+    int ci_fd;
+};
+
+#define CI_FD(vol) (((struct catidx *)(vol)->v_catidx)->ci_fd)
+
+static int catidx_write_hdr(int fd, const struct vol *vol, int complete)
+{
+    struct catidx_hdr hdr;
+
+    struct stat st;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ch_magic = CATIDX_MAGIC;
+    hdr.ch_version = CATIDX_VERSION;
+    hdr.ch_reclen = sizeof(struct catidx_rec);
+    hdr.ch_complete = complete;
+    memcpy(hdr.ch_stamp, vol->v_stamp, ADEDLEN_PRIVSYN);
+    if (complete) {
+        hdr.ch_built = hdr.ch_checked = time(NULL);
+        if (lstat(vol->v_path, &st) == 0)
+            hdr.ch_rootmtime = st.st_mtime;
+    }
+
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return -1;
+    return 0;
+}
+
+static off_t catidx_offset(cnid_t id)
+{
+    return (off_t)ntohl(id) * sizeof(struct catidx_rec);
+}
+
+/* Write one uint32_t field of the header or a record in place */
+static int catidx_write_field(const struct vol *vol, off_t off, uint32_t val)
+{
+    if (pwrite(CI_FD(vol), &val, sizeof(val), off) != sizeof(val)) {
+        LOG(log_error, logtype_afpd, "catidx: pwrite: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * Open the index of vol, creating or resetting it if necessary
+ *
+ * Must be called after the CNID database stamp has been fetched.
+ */
+int catidx_open(struct vol *vol)
+{
+    struct catidx_hdr hdr;
+    struct catidx *ci;
+    char path[MAXPATHLEN + 1];
+    int fd;
+
+    if (!(vol->v_flags & AFPVOL_CATIDX) || vol->v_catidx != NULL)
+        return 0;
+    if (vol->v_cdb == NULL || !(vol->v_cdb->cnid_db_flags & CNID_FLAG_PERSISTENT))
+        return 0;
+
+    if (strlen(vol->v_dbpath) + strlen(CATIDX_FILE) > MAXPATHLEN)
+        return -1;
+    strcpy(path, vol->v_dbpath);
+    strcat(path, CATIDX_FILE);
+
+    /* the index is shared by all users of the volume */
+    become_root();
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    unbecome_root();
+
+    if (fd < 0) {
+        LOG(log_error, logtype_afpd, "catidx_open(\"%s\"): %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+        || hdr.ch_magic != CATIDX_MAGIC
+        || hdr.ch_version != CATIDX_VERSION
+        || hdr.ch_reclen != sizeof(struct catidx_rec)
+        || memcmp(hdr.ch_stamp, vol->v_stamp, ADEDLEN_PRIVSYN) != 0) {
+        LOG(log_info, logtype_afpd, "catidx_open(\"%s\"): initializing index", path);
+        if (ftruncate(fd, 0) != 0 || catidx_write_hdr(fd, vol, 0) != 0) {
+            LOG(log_error, logtype_afpd, "catidx_open(\"%s\"): %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    if ((ci = malloc(sizeof(struct catidx))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    ci->ci_fd = fd;
+    vol->v_catidx = ci;
+
+    return 0;
+}
+
+void catidx_close(struct vol *vol)
+{
+    if (vol->v_catidx == NULL)
+        return;
+
+    close(CI_FD(vol));
+    free(vol->v_catidx);
+    vol->v_catidx = NULL;
+}
+
+/*!
+ * Whether the index of vol is complete and can be used for searching
+ *
+ * The flag is read from the file as other sessions may have completed it.
+ */
+int catidx_valid(const struct vol *vol)
+{
+    struct catidx_hdr hdr;
+
+    if (vol->v_catidx == NULL)
+        return 0;
+    if (vol->v_cdb == NULL || !(vol->v_cdb->cnid_db_flags & CNID_FLAG_PERSISTENT))
+        return 0;
+    if (pread(CI_FD(vol), &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return 0;
+
+    return hdr.ch_complete != 0;
+}
+
+void catidx_set_valid(struct vol *vol, int valid)
+{
+    if (vol->v_catidx == NULL)
+        return;
+
+    LOG(log_debug, logtype_afpd, "catidx_set_valid(\"%s\"): %d", vol->v_path, valid);
+
+    if (catidx_write_hdr(CI_FD(vol), vol, valid) != 0)
+        LOG(log_error, logtype_afpd, "catidx_set_valid: %s", strerror(errno));
+}
+
+/*!
+ * Whether every entry of a directory whose mtime changed has a record
+ *
+ * Objects that are gone are fine, their records are removed by searches.
+ */
+static int catidx_dir_indexed(const struct vol *vol, cnid_t did, const char *path)
+{
+    struct catidx_rec rec;
+    struct dirent *de;
+    struct stat st;
+    DIR *dp;
+    char fullpath[MAXPATHLEN + 1];
+    cnid_t id;
+    int ret = 1;
+
+    if ((dp = opendir(path)) == NULL)
+        return 1;
+
+    while (ret && (de = readdir(dp)) != NULL) {
+        if (!check_dirent(vol, de->d_name))
+            continue;
+        id = cnid_get(vol->v_cdb, did, de->d_name, strlen(de->d_name));
+        if (id != CNID_INVALID) {
+            if (pread(CI_FD(vol), &rec, sizeof(rec), catidx_offset(id)) != sizeof(rec)
+                || rec.cr_id != id || rec.cr_did != did)
+                ret = 0;
+            continue;
+        }
+        /* without a CNID it's new, unless it's something searches skip */
+        if ((size_t)snprintf(fullpath, sizeof(fullpath), "%s/%s", path, de->d_name) >= sizeof(fullpath)
+            || ostat(fullpath, &st, vol_syml_opt(vol)) != 0)
+            continue;
+        if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))
+            ret = 0;
+    }
+    closedir(dp);
+
+    if (!ret)
+        LOG(log_info, logtype_afpd, "catidx: \"%s\" changed", path);
+    return ret;
+}
+
+/*
+ * Check a directory whose mtime in the index is indexed_mtime, remember the
+ * new mtime at off if it changed but has no new entries. A change in the
+ * current second may be followed by others with the same mtime, the
+ * directory is checked again next time.
+ *
+ * @returns 0 if the directory is indexed, -1 if not
+ */
+static int catidx_check_dir(const struct vol *vol, cnid_t did, const char *path,
+                            uint32_t indexed_mtime, off_t off, time_t now)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0 || (uint32_t)st.st_mtime == indexed_mtime)
+        return 0;
+    if (!catidx_dir_indexed(vol, did, path))
+        return -1;
+    if (st.st_mtime < now)
+        catidx_write_field(vol, off, st.st_mtime);
+    return 0;
+}
+
+/*!
+ * Check a complete index for changes not made via AFP
+ *
+ * Checks every indexed directory whose mtime changed, unless that was done
+ * less than CATIDX_CHECK seconds ago. A stale index is marked incomplete,
+ * the next filesystem search rebuilds it.
+ *
+ * @returns 1 if the index is stale, 0 if it can be used
+ */
+int catidx_stale(struct vol *vol)
+{
+    static struct catidx_rec recs[256];
+    struct catidx_hdr hdr;
+    struct dir *dir;
+    uint32_t pos = 1;
+    time_t now = time(NULL);
+    int count, i;
+
+    if (vol->v_catidx == NULL)
+        return 1;
+    if (pread(CI_FD(vol), &hdr, sizeof(hdr), 0) != sizeof(hdr) || !hdr.ch_complete)
+        return 1;
+
+    if (now - (time_t)hdr.ch_built > CATIDX_MAXAGE) {
+        LOG(log_info, logtype_afpd, "catidx: index of \"%s\" too old", vol->v_path);
+        goto stale;
+    }
+    if (now - (time_t)hdr.ch_checked < CATIDX_CHECK)
+        return 0;
+
+    if (catidx_check_dir(vol, DIRDID_ROOT, vol->v_path, hdr.ch_rootmtime,
+                         offsetof(struct catidx_hdr, ch_rootmtime), now) != 0)
+        goto stale;
+
+    while ((count = catidx_read(vol, pos, recs, sizeof(recs) / sizeof(recs[0]))) > 0) {
+        for (i = 0; i < count; i++) {
+            if (recs[i].cr_id == 0 || !(recs[i].cr_flags & CATIDX_DIR))
+                continue;
+            /* directories that are gone changed their parent */
+            if ((dir = dirlookup(vol, recs[i].cr_id)) == NULL)
+                continue;
+            if (catidx_check_dir(vol, recs[i].cr_id, cfrombstr(dir->d_fullpath), recs[i].cr_mdate,
+                                 catidx_offset(recs[i].cr_id) + offsetof(struct catidx_rec, cr_mdate),
+                                 now) != 0)
+                goto stale;
+        }
+        pos += count;
+    }
+    if (count < 0)
+        return 1;
+
+    catidx_write_field(vol, offsetof(struct catidx_hdr, ch_checked), now);
+    return 0;
+
+stale:
+    catidx_set_valid(vol, 0);
+    return 1;
+}
+
+/*!
+ * Update the record of an object
+ *
+ * @param vol    (rw) volume
+ * @param id     (r)  CNID of the object, 0 to look it up
+ * @param did    (r)  CNID of the parent directory
+ * @param path   (r)  path of the object, relative to the cwd or absolute
+ *
+ * @returns CNID of the object, CNID_INVALID if it has none or there's no index
+ */
+cnid_t catidx_update(struct vol *vol, cnid_t id, cnid_t did, const char *path)
+{
+    struct catidx_rec rec;
+    struct adouble ad, *adp = NULL;
+    struct stat st;
+    const char *name;
+    char *m_name;
+    char finfo[ADEDLEN_FINDERI];
+    char *fp;
+    char convbuf[514]; /* for convert_charset dest_len parameter +2 */
+    char u8buf[MAXPATHLEN + 1];
+    uint16_t flags = CONV_PRECOMPOSE;
+    uint32_t date;
+    size_t len;
+    int isdir, islnk;
+
+    if (vol->v_catidx == NULL || did == 0)
+        return CNID_INVALID;
+
+    if ((name = strrchr(path, '/')) != NULL && name[1] != '\0')
+        name++;
+    else
+        name = path;
+
+    if (lstat(path, &st) != 0)
+        return CNID_INVALID;
+    if (S_ISLNK(st.st_mode) && (vol->v_flags & AFPVOL_FOLLOWSYM) && stat(path, &st) != 0)
+        return CNID_INVALID;
+    isdir = S_ISDIR(st.st_mode);
+    islnk = S_ISLNK(st.st_mode);
+
+    ad_init(&ad, vol);
+    if (ad_metadata_st(path, isdir ? ADFLAGS_DIR : 0, &st, &ad) == 0)
+        adp = &ad;
+
+    if (id == 0)
+        id = get_id(vol, adp, &st, did, name, strlen(name));
+    if (id == CNID_INVALID)
+        goto exit;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.cr_id = id;
+    rec.cr_did = did;
+    rec.cr_size = isdir ? 0 : st.st_size;
+    if (isdir)
+        rec.cr_flags |= CATIDX_DIR;
+
+    fp = get_finderinfo(vol, name, adp, finfo, islnk);
+    memcpy(&rec.cr_type, fp + FINDERINFO_FRTYPEOFF, sizeof(rec.cr_type));
+    memcpy(&rec.cr_creator, fp + FINDERINFO_FRCREATOFF, sizeof(rec.cr_creator));
+    memcpy(&rec.cr_fflags, fp + FINDERINFO_FRFLAGOFF, sizeof(rec.cr_fflags));
+
+    if (adp)
+        ad_getattr(adp, &rec.cr_attr);
+
+    rec.cr_mdate = st.st_mtime;
+    rec.cr_cdate = st.st_mtime;
+    if (adp && ad_getdate(adp, AD_DATE_CREATE, &date) >= 0)
+        rec.cr_cdate = AD_DATE_TO_UNIX(date);
+    rec.cr_bdate = st.st_mtime;
+    if (adp && ad_getdate(adp, AD_DATE_BACKUP, &date) >= 0)
+        rec.cr_bdate = AD_DATE_TO_UNIX(date);
+
+    /* the name as crit_check() compares it for UTF8 searches */
+    if ((m_name = utompath(vol, (char *)name, id, 1)) == NULL)
+        goto exit;
+    strlcpy(u8buf, m_name, sizeof(u8buf));
+    len = convert_charset(CH_UTF8_MAC, CH_UCS2, CH_UTF8, u8buf, strlen(u8buf),
+                          convbuf, 512, &flags);
+    if (len == (size_t)-1) {
+        /* unconvertable, let the search check the object */
+        rec.cr_flags |= CATIDX_TRUNC;
+        len = 0;
+    }
+    len /= sizeof(ucs2_t);
+    if (len > CATIDX_NAMELEN) {
+        rec.cr_flags |= CATIDX_TRUNC;
+        len = CATIDX_NAMELEN;
+    }
+    memcpy(rec.cr_name, convbuf, len * sizeof(ucs2_t));
+    rec.cr_namelen = len;
+
+    if (pwrite(CI_FD(vol), &rec, sizeof(rec), catidx_offset(id)) != sizeof(rec)) {
+        LOG(log_error, logtype_afpd, "catidx_update(\"%s\"): %s", path, strerror(errno));
+        catidx_set_valid(vol, 0);
+    }
+
+exit:
+    if (adp)
+        ad_close(adp, ADFLAGS_HF);
+    return id;
+}
+
+/* Remove the record of an object that doesn't exist anymore */
+void catidx_remove(struct vol *vol, cnid_t id)
+{
+    struct catidx_rec rec;
+
+    if (vol->v_catidx == NULL || id == CNID_INVALID)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    if (pwrite(CI_FD(vol), &rec, sizeof(rec), catidx_offset(id)) != sizeof(rec))
+        LOG(log_error, logtype_afpd, "catidx_remove: %s", strerror(errno));
+}
+
+/*!
+ * Read count records starting with the record of CNID first (host order)
+ *
+ * @returns number of records read, 0 at the end of the index, -1 on error
+ */
+int catidx_read(const struct vol *vol, uint32_t first, struct catidx_rec *recs, int count)
+{
+    ssize_t len;
+
+    if (vol->v_catidx == NULL)
+        return -1;
+
+    len = pread(CI_FD(vol), recs, count * sizeof(struct catidx_rec),
+                (off_t)first * sizeof(struct catidx_rec));
+    if (len < 0)
+        return -1;
+
+    return len / sizeof(struct catidx_rec);
+}
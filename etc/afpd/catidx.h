@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ */
+
+#ifndef AFPD_CATIDX_H
+#define AFPD_CATIDX_H 1
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <atalk/volume.h>
+#include <atalk/cnid.h>
+#include <atalk/unicode.h>
+
+#define CATIDX_NAMELEN  42      /* UCS2 chars of the name stored in a record */
+
+/* cr_flags */
+#define CATIDX_DIR      (1 << 0)
+#define CATIDX_TRUNC    (1 << 1) /* name longer than CATIDX_NAMELEN */
+
+/*
+ * One record of the catalog index, the record of an object is stored at
+ * the offset of its CNID
+ */
+struct catidx_rec {
+    uint64_t cr_size;           /* data fork size */
+    uint32_t cr_id;             /* CNID, 0 for an unused record */
+    uint32_t cr_did;            /* CNID of the parent directory */
+    uint16_t cr_flags;
+    uint16_t cr_attr;           /* AFP attributes as from ad_getattr() */
+    uint32_t cr_type;           /* FinderInfo type, creator and flags */
+    uint32_t cr_creator;        /* as stored in FinderInfo */
+    uint16_t cr_fflags;
+    uint16_t cr_namelen;        /* chars in cr_name */
+    uint32_t cr_cdate;          /* unix time */
+    uint32_t cr_mdate;
+    uint32_t cr_bdate;
+    ucs2_t   cr_name[CATIDX_NAMELEN]; /* precomposed UTF8 name, not terminated */
+};
+
+extern int  catidx_open     (struct vol *vol);
+extern void catidx_close    (struct vol *vol);
+extern int  catidx_valid    (const struct vol *vol);
+extern int  catidx_stale    (struct vol *vol);
+extern cnid_t catidx_update (struct vol *vol, cnid_t id, cnid_t did, const char *path);
+extern void catidx_remove   (struct vol *vol, cnid_t id);
+extern int  catidx_read     (const struct vol *vol, uint32_t first, struct catidx_rec *recs, int count);
+extern void catidx_set_valid(struct vol *vol, int valid);
+
+#endif /* AFPD_CATIDX_H */
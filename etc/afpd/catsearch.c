@@ -46,7 +46,6 @@
 #include <atalk/adouble.h>
 #include <atalk/logger.h>
 #include <atalk/cnid.h>
-#include <atalk/cnid_bdb_private.h>
 #include <atalk/util.h>
 #include <atalk/bstradd.h>
 #include <atalk/unicode.h>
@@ -60,6 +59,7 @@
 #include "volume.h"
 #include "filedir.h"
 #include "fork.h"
+#include "catidx.h"
 
 
 struct finderinfo {
@@ -200,7 +200,7 @@ static struct adouble *adl_lkup(struct vol *vol, struct path *path, struct adoub
 		adp = &ad;
 	} 
 
-    if ( ad_metadata( path->u_name, ((isdir) ? ADFLAGS_DIR : 0), adp) < 0 ) {
+    if ( ad_metadata_st( path->u_name, ((isdir) ? ADFLAGS_DIR : 0), &path->st, adp) < 0 ) {
         adp = NULL; /* FIXME without resource fork adl_lkup will be call again */
     }
     
@@ -491,6 +491,7 @@ static int catsearch(const AFPObj *obj,
 {
     static uint32_t cur_pos;    /* Saved position index (ID) - used to remember "position" across FPCatSearch calls */
     static DIR *dirpos; 		 /* UNIX structure describing currently opened directory. */
+    static int idx_build;        /* Walk visits the whole volume and completes the index */
     struct dir *currentdir;      /* struct dir of current directory */
 	int cidx, r;
 	struct dirent *entry;
@@ -526,6 +527,7 @@ static int catsearch(const AFPObj *obj,
 			goto catsearch_end;
 		}
 		/* FIXME: Sometimes DID is given by client ! (correct this one above !) */
+		idx_build = (vol->v_catidx != NULL && !catidx_valid(vol));
 	}
 
 	/* Save current path */
@@ -556,6 +558,7 @@ static int catsearch(const AFPObj *obj,
 			switch (errno) {
 			case EACCES:
 				dstack[cidx].ds_checked = 1;
+				idx_build = 0;
 				continue;
 			case EMFILE:
 			case ENFILE:
@@ -585,6 +588,8 @@ static int catsearch(const AFPObj *obj,
 			if (of_stat(vol, &path) != 0) {
 				switch (errno) {
 				case EACCES:
+					idx_build = 0;
+					continue;
 				case ELOOP:
 				case ENOENT:
 					continue;
@@ -632,6 +637,13 @@ static int catsearch(const AFPObj *obj,
                 continue;
             }
 
+			if (idx_build) {
+				if (S_ISDIR(path.st.st_mode))
+					catidx_update(vol, path.d_dir->d_did, currentdir->d_did, path.u_name);
+				else
+					catidx_update(vol, 0, currentdir->d_did, path.u_name);
+			}
+
 			ccr = crit_check(vol, &path);
 
 			/* bit 0 means that criteria has been met */
@@ -665,6 +677,10 @@ static int catsearch(const AFPObj *obj,
 	} /* while (current_idx = reducestack()) != -1) */
 
 	/* We have finished traversing our tree. Return EOF here. */
+	if (idx_build) {
+		catidx_set_valid(vol, 1);
+		idx_build = 0;
+	}
 	result = AFPERR_EOF;
 	goto catsearch_end;
 
@@ -686,6 +702,10 @@ catsearch_end: /* Exiting catsearch: error condition */
 /*!
  * This function performs a CNID db search
  *
+ * The CNID database returns the objects whose names contain uname, they are
+ * checked against the search criteria like in catsearch(). The results of the
+ * database search are fetched in chunks as the search proceeds.
+ *
  * Uses globals c1, c2, the search criteria
  *
  * @param vol       (r)  volume we are searching on ...
@@ -709,14 +729,17 @@ static int catsearch_db(const AFPObj *obj,
                         int *rsize,
                         int ext)
 {
-    static char resbuf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t)];
-    static uint32_t cur_pos;
-    static int num_matches;
+    static char resbuf[CNID_SEARCH_BUFLEN];
+    static char key[MAXPATHLEN + 2];
+    static char *entry;         /* next entry in resbuf */
+    static int entries;         /* entries left in resbuf */
+    static cnid_t next;         /* position of the CNID database search */
+    static int done;            /* CNID database search finished */
+    static uint32_t cur_pos;    /* number of entries processed */
     int ccr ,r;
 	int result = AFP_OK;
     struct path path;
 	char *rrbuf = rbuf;
-    char buffer[MAXPATHLEN +2];
     uint16_t flags = CONV_TOLOWER;
 
     LOG(log_debug, logtype_afpd, "catsearch_db(req pos: %u): {pos: %u, name: %s}",
@@ -727,57 +750,67 @@ static int catsearch_db(const AFPObj *obj,
 		goto catsearch_end;
 	}
 
-    if (cur_pos == 0 || *pos == 0) {
+    if (*pos == 0) {
         if (convert_charset(vol->v_volcharset,
                             vol->v_volcharset,
                             vol->v_maccharset,
                             uname,
                             strlen(uname),
-                            buffer,
+                            key,
                             MAXPATHLEN,
                             &flags) == (size_t)-1) {
             LOG(log_error, logtype_afpd, "catsearch_db: conversion error");
             result = AFPERR_MISC;
             goto catsearch_end;
         }
+        LOG(log_debug, logtype_afpd, "catsearch_db: %s", key);
 
-        LOG(log_debug, logtype_afpd, "catsearch_db: %s", buffer);
-
-        AFP_CNID_START("cnid_find");
-        num_matches = cnid_find(vol->v_cdb,
-                                buffer,
-                                strlen(uname),
-                                resbuf,
-                                sizeof(resbuf));
-        AFP_CNID_DONE();
-        if (num_matches == -1) {
-            result = AFPERR_MISC;
-            goto catsearch_end;
-        }
+        cur_pos = 0;
+        entries = 0;
+        next = CNID_INVALID;
+        done = 0;
     }
 	
-	while (cur_pos < num_matches) {
+	while (1) {
         char *name;
         cnid_t cnid, did;
-        char resolvebuf[12 + MAXPATHLEN + 1];
         struct dir *dir;
 
-        /* Next CNID to process from buffer */
-        memcpy(&cnid, resbuf + cur_pos * sizeof(cnid_t), sizeof(cnid_t));
-        did = cnid;
+        while (entries == 0) {
+            if (done) {
+                /* finished */
+                result = AFPERR_EOF;
+                cur_pos = 0;
+                goto catsearch_end;
+            }
+            AFP_CNID_START("cnid_search");
+            entries = cnid_search(vol->v_cdb, key, strlen(key), &next, resbuf, sizeof(resbuf));
+            AFP_CNID_DONE();
+            if (entries == -1) {
+                entries = 0;
+                cur_pos = 0;
+                result = AFPERR_MISC;
+                goto catsearch_end;
+            }
+            entry = resbuf;
+            if (next == CNID_INVALID)
+                done = 1;
+        }
 
-        AFP_CNID_START("cnid_resolve");
-        name = cnid_resolve(vol->v_cdb, &did, resolvebuf, 12 + MAXPATHLEN + 1);
-        AFP_CNID_DONE();
-        if (name == NULL)
-            goto next;
+        /* Next entry to process from buffer */
+        memcpy(&cnid, entry, sizeof(cnid_t));
+        memcpy(&did, entry + sizeof(cnid_t), sizeof(cnid_t));
+        name = entry + 2 * sizeof(cnid_t);
+        entry = name + strlen(name) + 1;
+        entries--;
+        cur_pos++;
 
         LOG(log_debug, logtype_afpd, "catsearch_db: {pos: %u, name:%s, cnid: %u}",
             cur_pos, name, ntohl(cnid));
         if ((dir = dirlookup(vol, did)) == NULL)
-            goto next;
+            continue;
         if (movecwd(vol, dir) < 0 )
-            goto next;
+            continue;
 
         memset(&path, 0, sizeof(path));
         path.u_name = name;
@@ -787,9 +820,8 @@ static int catsearch_db(const AFPObj *obj,
             switch (errno) {
             case EACCES:
             case ELOOP:
-                goto next;
             case ENOENT:
-                
+                continue;
             default:
                 result = AFPERR_MISC;
                 goto catsearch_end;
@@ -798,7 +830,7 @@ static int catsearch_db(const AFPObj *obj,
         /* For files path.d_dir is the parent dir, for dirs its the dir itself */
         if (S_ISDIR(path.st.st_mode))
             if ((dir = dirlookup(vol, cnid)) == NULL)
-                goto next;
+                continue;
         path.d_dir = dir;
 
         LOG(log_maxdebug, logtype_afpd,"catsearch_db: dir: %s, cwd: %s, name: %s", 
@@ -823,15 +855,8 @@ static int catsearch_db(const AFPObj *obj,
             if (rrbuf - rbuf >= 448)
                 goto catsearch_pause;
         }
-    next:
-        cur_pos++;
     } /* while */
 
-	/* finished */
-	result = AFPERR_EOF;
-    cur_pos = 0;
-	goto catsearch_end;
-
 catsearch_pause:
     *pos = cur_pos;
 
@@ -841,6 +866,200 @@ catsearch_end: /* Exiting catsearch: error condition */
 	return result;
 }
 
+/*!
+ * Check the criteria against a record of the catalog index
+ *
+ * This is a prefilter, matching records are checked with crit_check(), so
+ * anything that can't be decided from the record must pass.
+ */
+static int idx_check(const struct catidx_rec *rec)
+{
+	ucs2_t name[CATIDX_NAMELEN + 1];
+	struct finderinfo finfo;
+	int isdir = rec->cr_flags & CATIDX_DIR;
+
+	if (isdir ? !c1.dbitmap : !c1.fbitmap)
+		return 0;
+
+	if ((c1.rbitmap & (1<<FILPBIT_PDINFO))) {
+		memcpy(name, rec->cr_name, rec->cr_namelen * sizeof(ucs2_t));
+		name[rec->cr_namelen] = 0;
+		if ((c1.rbitmap & (1<<CATPBIT_PARTIAL))) {
+			if (!(rec->cr_flags & CATIDX_TRUNC)
+			    && strcasestr_w(name, (ucs2_t *)c1.utf8name) == NULL)
+				return 0;
+		} else if ((rec->cr_flags & CATIDX_TRUNC)) {
+			if (strncasecmp_w(name, (ucs2_t *)c1.utf8name, rec->cr_namelen) != 0)
+				return 0;
+		} else if (strcasecmp_w(name, (ucs2_t *)c1.utf8name) != 0)
+			return 0;
+	}
+
+	/* the mdate of directories changes with their content */
+	if ((c1.rbitmap & (1<<DIRPBIT_MDATE)) && !isdir) {
+		if ((time_t)rec->cr_mdate < c1.mdate || (time_t)rec->cr_mdate > c2.mdate)
+			return 0;
+	}
+	if ((c1.rbitmap & (1<<DIRPBIT_CDATE))) {
+		if ((time_t)rec->cr_cdate < c1.cdate || (time_t)rec->cr_cdate > c2.cdate)
+			return 0;
+	}
+	if ((c1.rbitmap & (1<<DIRPBIT_BDATE))) {
+		if ((time_t)rec->cr_bdate < c1.bdate || (time_t)rec->cr_bdate > c2.bdate)
+			return 0;
+	}
+	if ((c1.rbitmap & (1<<DIRPBIT_ATTR)) && c2.attr != 0) {
+		if ((rec->cr_attr & c2.attr) != c1.attr)
+			return 0;
+	}
+
+	if ((c1.rbitmap & (1<<DIRPBIT_FINFO))) {
+		memcpy(&finfo.attrs, &rec->cr_fflags, sizeof(finfo.attrs));
+		memcpy(&finfo.label, &rec->cr_fflags, sizeof(finfo.label));
+		finfo.attrs &= 0xff00;
+		finfo.label &= 0xff;
+		if (c2.finfo.f_type != 0 && rec->cr_type != c1.finfo.f_type)
+			return 0;
+		if (c2.finfo.creator != 0 && rec->cr_creator != c1.finfo.creator)
+			return 0;
+		if (c2.finfo.attrs != 0 && (finfo.attrs & c2.finfo.attrs) != c1.finfo.attrs)
+			return 0;
+		if (c2.finfo.label != 0 && (finfo.label & c2.finfo.label) != c1.finfo.label)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*!
+ * This function performs a catalog index search
+ *
+ * Uses globals c1, c2, the search criteria. Records matching the criteria
+ * are checked against the filesystem like in catsearch_db().
+ *
+ * @param vol       (r)  volume we are searching on ...
+ * @param rmatches  (r)  maximum number of matches we can return
+ * @param pos       (r)  position we've stopped recently
+ * @param rbuf      (w)  output buffer
+ * @param nrecs     (w)  number of matches
+ * @param rsize     (w)  length of data written to output buffer
+ * @param ext       (r)  extended search flag
+ */
+#define IDX_CHUNK 256
+static int catsearch_idx(const AFPObj *obj,
+                         struct vol *vol,
+                         int rmatches,
+                         uint32_t *pos,
+                         char *rbuf,
+                         uint32_t *nrecs,
+                         int *rsize,
+                         int ext)
+{
+    static struct catidx_rec recs[IDX_CHUNK];
+    static uint32_t cur_pos;    /* CNID (host order) of the next record to check */
+    int count, i, ccr, r;
+    int result = AFP_OK;
+    struct path path;
+    char *rrbuf = rbuf;
+    time_t start_time;
+
+    LOG(log_debug, logtype_afpd, "catsearch_idx(req pos: %u): {pos: %u}", *pos, cur_pos);
+
+    if (*pos != 0 && *pos != cur_pos) {
+        result = AFPERR_CATCHNG;
+        goto catsearch_end;
+    }
+    if (*pos == 0)
+        cur_pos = 1;
+
+    start_time = time(NULL);
+
+    while ((count = catidx_read(vol, cur_pos, recs, IDX_CHUNK)) > 0) {
+        for (i = 0; i < count; i++, cur_pos++) {
+            char *name;
+            cnid_t cnid, did;
+            char resolvebuf[12 + MAXPATHLEN + 1];
+            struct dir *dir;
+
+            if (recs[i].cr_id == 0 || !idx_check(&recs[i]))
+                continue;
+
+            cnid = did = recs[i].cr_id;
+            AFP_CNID_START("cnid_resolve");
+            name = cnid_resolve(vol->v_cdb, &did, resolvebuf, 12 + MAXPATHLEN + 1);
+            AFP_CNID_DONE();
+            if (name == NULL) {
+                catidx_remove(vol, cnid);
+                continue;
+            }
+            if ((dir = dirlookup(vol, did)) == NULL)
+                continue;
+            if (movecwd(vol, dir) < 0)
+                continue;
+
+            memset(&path, 0, sizeof(path));
+            path.u_name = name;
+            if (of_stat(vol, &path) != 0) {
+                switch (errno) {
+                case ENOENT:
+                    catidx_remove(vol, cnid);
+                    /* fallthrough */
+                case EACCES:
+                case ELOOP:
+                    continue;
+                default:
+                    result = AFPERR_MISC;
+                    goto catsearch_end;
+                }
+            }
+            /* For files path.d_dir is the parent dir, for dirs its the dir itself */
+            if (S_ISDIR(path.st.st_mode)) {
+                if ((dir = dirlookup(vol, cnid)) == NULL)
+                    continue;
+                path.m_name = cfrombstr(dir->d_m_name);
+            } else {
+                path.id = cnid;
+            }
+            path.d_dir = dir;
+
+            ccr = crit_check(vol, &path);
+            if ((ccr & 1)) {
+                r = rslt_add(obj, vol, &path, &rrbuf, ext);
+                if (r == 0) {
+                    result = AFPERR_MISC;
+                    goto catsearch_end;
+                }
+                *nrecs += r;
+                /* Number of matches limit, Block size limit */
+                if (--rmatches == 0 || rrbuf - rbuf >= 448) {
+                    cur_pos++;
+                    goto catsearch_pause;
+                }
+            }
+        }
+        /* MacOS 9 doesn't like servers executing commands longer than few seconds */
+        if (start_time != time(NULL))
+            goto catsearch_pause;
+    }
+    if (count < 0) {
+        result = AFPERR_MISC;
+        goto catsearch_end;
+    }
+
+    /* finished */
+    result = AFPERR_EOF;
+    cur_pos = 0;
+    goto catsearch_end;
+
+catsearch_pause:
+    *pos = cur_pos;
+
+catsearch_end: /* Exiting catsearch: error condition */
+    *rsize = rrbuf - rbuf;
+    LOG(log_debug, logtype_afpd, "catsearch_idx(req pos: %u): {pos: %u}", *pos, cur_pos);
+    return result;
+}
+
 /* -------------------------- */
 static int catsearch_afp(AFPObj *obj _U_, char *ibuf, size_t ibuflen,
                   char *rbuf, size_t *rbuflen, int ext)
@@ -1047,11 +1266,14 @@ static int catsearch_afp(AFPObj *obj _U_, char *ibuf, size_t ibuflen,
     /* Call search */
     *rbuflen = 24;
     if ((c1.rbitmap & (1 << FILPBIT_PDINFO))
-        && !(c1.rbitmap & (1<<CATPBIT_PARTIAL))
-        && (strcmp(vol->v_cnidscheme, "dbd") == 0)
+        && vol->v_cdb && vol->v_cdb->cnid_search
         && (vol->v_flags & AFPVOL_SEARCHDB))
-        /* we've got a name and it's a dbd volume, so search CNID database */
+        /* we've got a name and the CNID backend can search, so search CNID database */
         ret = catsearch_db(obj, vol, vol->v_root, uname, rmatches, &catpos[0], rbuf+24, &nrecs, &rsize, ext);
+    else if (!(c1.rbitmap & (1 << FILPBIT_LNAME)) && catidx_valid(vol)
+             && (catpos[0] != 0 || !catidx_stale(vol)))
+        /* the catalog index is complete and current, scan it instead of the filesystem */
+        ret = catsearch_idx(obj, vol, rmatches, &catpos[0], rbuf+24, &nrecs, &rsize, ext);
     else
         /* perform a slow filesystem tree search */
         ret = catsearch(obj, vol, vol->v_root, rmatches, &catpos[0], rbuf+24, &nrecs, &rsize, ext);
@@ -928,7 +928,8 @@ static int ad_getcomment(struct vol *vol, struct path *path, char *rbuf, size_t
     } else
         adp = of->of_ad;
         
-    if ( ad_metadata( upath, ((isadir) ? ADFLAGS_DIR : 0), adp) < 0 ) {
+    if ( ad_metadata_st( upath, ((isadir) ? ADFLAGS_DIR : 0),
+                         (path->st_valid && !path->st_errno) ? &path->st : NULL, adp) < 0 ) {
         return( AFPERR_NOITEM );
     }
 
@@ -22,6 +22,11 @@
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <atalk/util.h>
 #include <atalk/cnid.h>
@@ -86,6 +91,23 @@
  * Using ctime leads to cache eviction in case 2) where it wouldn't be necessary, because
  * the dir itself (name, CNID, ...) hasn't changed, but there's no other way.
  *
+ * Notification based validation
+ * =============================
+ *
+ * With "dircache notify" enabled, the stat() on every cache hit is replaced by inotify
+ * watches on cached directories. An entry is trusted without a stat() (flag DIRF_NOTIFY)
+ * if its parent directory is watched and, for directories, the directory itself is
+ * watched too, so that changes of its contents (offspring count, ctime) are noticed.
+ * Events are read once per DSI request in dircache_notify_process() and just clear
+ * DIRF_NOTIFY of the affected entries (for renamed or deleted directories of the whole
+ * subtree), which puts them back to the ctime validation described above. An entry that
+ * passes ctime validation is trusted again. The subtree below an entry is found with the
+ * parent DID index, so the subtree of a directory that is removed from the cache goes
+ * back to ctime validation too, it can't be reached from its parents anymore.
+ * The number of watches is bounded, if the budget is exhausted or a watch can't be
+ * added, new entries simply keep using ctime validation. Watches are never removed
+ * before the directory is deleted or the session ends.
+ *
  * Indexes
  * =======
  *
@@ -94,9 +116,11 @@
  * It is a hashtable which we use to store "struct dir"s in. If the cache get full, oldest
  * entries are evicted in chunks of DIRCACHE_FREE.
  *
- * We have/need two indexes:
+ * We have/need three indexes:
  * - a DID/name index on the main dircache, another hashtable
  * - a queue index on the dircache, for evicting the oldest entries
+ * - a parent DID index, a hashtable of lists of the cached entries of a directory,
+ *   used for invalidating a subtree with notifications
  *
  * Debugging
  * =========
@@ -122,6 +146,7 @@ static struct dircache_stat {
     unsigned long long removed;
     unsigned long long expunged;
     unsigned long long evicted;
+    unsigned long long invalidated;     /* entries put back to ctime validation by notifications */
 } dircache_stat;
 
 /* FNV 1a */
@@ -228,6 +253,116 @@ static int hash_comp_didname(const void *k1, const void *k2)
               && (bstrcmp(key1->d_u_name, key2->d_u_name) == 0) );
 }
 
+/*********************************
+ * parent DID index on dircache  */
+
+struct dircache_children {
+    uint16_t    dc_vid;
+    cnid_t      dc_pdid;
+    struct dir  *dc_first;              /* linked with d_next_sibling */
+};
+
+static hash_t *index_pdid;
+
+static hash_val_t hash_vid_pdid(const void *key)
+{
+    const struct dircache_children *k = key;
+    hash_val_t hash = 2166136261;
+
+    hash ^= k->dc_vid;
+    hash *= 16777619;
+    hash ^= k->dc_pdid;
+    hash *= 16777619;
+
+    return hash;
+}
+
+static int hash_comp_vid_pdid(const void *key1, const void *key2)
+{
+    const struct dircache_children *k1 = key1;
+    const struct dircache_children *k2 = key2;
+
+    return !(k1->dc_pdid == k2->dc_pdid && k1->dc_vid == k2->dc_vid);
+}
+
+/*!
+ * @brief Get the first cached entry with parent DID pdid
+ */
+static struct dir *children_first(uint16_t vid, cnid_t pdid)
+{
+    struct dircache_children key;
+    hnode_t *hn;
+
+    key.dc_vid = vid;
+    key.dc_pdid = pdid;
+    if ((hn = hash_lookup(index_pdid, &key)) == NULL)
+        return NULL;
+    return ((struct dircache_children *)hnode_get(hn))->dc_first;
+}
+
+/*!
+ * @brief Add an entry to the list of its parent DID
+ *
+ * @returns 0 on success, -1 on error
+ */
+static int children_add(struct dir *dir)
+{
+    struct dircache_children key, *c;
+    hnode_t *hn;
+
+    key.dc_vid = dir->d_vid;
+    key.dc_pdid = dir->d_pdid;
+    if ((hn = hash_lookup(index_pdid, &key)) != NULL) {
+        c = hnode_get(hn);
+    } else {
+        if ((c = malloc(sizeof(*c))) == NULL)
+            return -1;
+        *c = key;
+        c->dc_first = NULL;
+        if (hash_alloc_insert(index_pdid, c, c) == 0) {
+            free(c);
+            return -1;
+        }
+    }
+
+    dir->d_prev_sibling = NULL;
+    dir->d_next_sibling = c->dc_first;
+    if (c->dc_first)
+        c->dc_first->d_prev_sibling = dir;
+    c->dc_first = dir;
+    return 0;
+}
+
+/*!
+ * @brief Remove an entry from the list of its parent DID
+ */
+static void children_remove(struct dir *dir)
+{
+    struct dircache_children key, *c;
+    hnode_t *hn;
+
+    if (dir->d_next_sibling)
+        dir->d_next_sibling->d_prev_sibling = dir->d_prev_sibling;
+    if (dir->d_prev_sibling) {
+        dir->d_prev_sibling->d_next_sibling = dir->d_next_sibling;
+    } else {
+        key.dc_vid = dir->d_vid;
+        key.dc_pdid = dir->d_pdid;
+        if ((hn = hash_lookup(index_pdid, &key)) == NULL) {
+            LOG(log_error, logtype_afpd, "dircache_remove(%u,\"%s\"): not in parent DID index",
+                ntohl(dir->d_did), cfrombstr(dir->d_u_name));
+            dircache_dump();
+            AFP_PANIC("dircache_remove");
+        }
+        c = hnode_get(hn);
+        if ((c->dc_first = dir->d_next_sibling) == NULL) {
+            hash_delete_free(index_pdid, hn);
+            free(c);
+        }
+    }
+    dir->d_prev_sibling = dir->d_next_sibling = NULL;
+}
+
 /***************************
  * queue index on dircache */
 
@@ -277,6 +412,256 @@ static void dircache_evict(void)
 }
 
 
+/***************************************
+ * notification based validation       */
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define NOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB \
+                     | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct dircache_watch {
+    int      wd;
+    uint16_t vid;
+    cnid_t   did;
+};
+
+static int          notify_fd = -1;
+static unsigned int notify_maxwatches;
+static hash_t       *notify_watches;  /* watch descriptor -> struct dircache_watch */
+
+static hash_val_t hash_wd(const void *key)
+{
+    return (hash_val_t)*(const int *)key * 2654435761U;
+}
+
+static int hash_comp_wd(const void *key1, const void *key2)
+{
+    return *(const int *)key1 != *(const int *)key2;
+}
+
+/*!
+ * @brief Add a watch for a cached directory
+ *
+ * @returns 0 if the directory is watched, -1 if not
+ */
+static int notify_watch(struct dir *dir)
+{
+    struct dircache_watch *w;
+    hnode_t *hn;
+    int wd;
+
+    if (dir->d_flags & DIRF_WATCHED)
+        return 0;
+    if (dir->d_flags & DIRF_ISFILE)
+        return -1;
+
+    /* inotify returns the existing watch descriptor for an already watched inode */
+    if ((wd = inotify_add_watch(notify_fd, cfrombstr(dir->d_fullpath), NOTIFY_MASK)) == -1) {
+        LOG(log_debug, logtype_afpd, "dircache_notify(\"%s\"): %s",
+            cfrombstr(dir->d_fullpath), strerror(errno));
+        return -1;
+    }
+
+    if ((hn = hash_lookup(notify_watches, &wd)) == NULL) {
+        if (hash_count(notify_watches) >= notify_maxwatches
+            || (w = malloc(sizeof(*w))) == NULL) {
+            inotify_rm_watch(notify_fd, wd);
+            return -1;
+        }
+        w->wd = wd;
+        w->vid = dir->d_vid;
+        w->did = dir->d_did;
+        if (hash_alloc_insert(notify_watches, &w->wd, w) == 0) {
+            free(w);
+            inotify_rm_watch(notify_fd, wd);
+            return -1;
+        }
+    }
+
+    dir->d_flags |= DIRF_WATCHED;
+    return 0;
+}
+
+/*!
+ * @brief Put an entry back to ctime validation
+ *
+ * For directories this is done for all cached entries below it too, their fullpaths
+ * may have changed.
+ */
+static void notify_invalidate_children(uint16_t vid, cnid_t did, int depth)
+{
+    struct dir *d;
+
+    /* a corrupt CNID database might contain a loop */
+    if (depth > MAXPATHLEN / 2)
+        return;
+
+    for (d = children_first(vid, did); d; d = d->d_next_sibling) {
+        if (d->d_flags & DIRF_NOTIFY) {
+            d->d_flags &= ~DIRF_NOTIFY;
+            dircache_stat.invalidated++;
+        }
+        if (!(d->d_flags & DIRF_ISFILE))
+            notify_invalidate_children(vid, d->d_did, depth + 1);
+    }
+}
+
+static void notify_invalidate(struct dir *dir, int subtree)
+{
+    if (dir->d_flags & DIRF_NOTIFY) {
+        dir->d_flags &= ~DIRF_NOTIFY;
+        dircache_stat.invalidated++;
+    }
+
+    if (!subtree || (dir->d_flags & DIRF_ISFILE))
+        return;
+
+    notify_invalidate_children(dir->d_vid, dir->d_did, 0);
+}
+
+/*!
+ * @brief Put all entries using a watch back to ctime validation
+ */
+static void notify_invalidate_watch(const struct dircache_watch *w)
+{
+    struct dir key, *d;
+    hnode_t *hn;
+
+    key.d_vid = w->vid;
+    key.d_did = w->did;
+    if ((hn = hash_lookup(dircache, &key)) != NULL) {
+        d = hnode_get(hn);
+        d->d_flags &= ~DIRF_WATCHED;
+        notify_invalidate(d, 0);
+    }
+    notify_invalidate_children(w->vid, w->did, 0);
+}
+
+/*!
+ * @brief Put everything back to ctime validation, eg after an event queue overflow
+ */
+static void notify_invalidate_all(void)
+{
+    qnode_t *n;
+    struct dir *d;
+
+    for (n = index_queue->next; n != index_queue; n = n->next) {
+        d = n->data;
+        if (d->d_flags & DIRF_NOTIFY) {
+            d->d_flags &= ~DIRF_NOTIFY;
+            dircache_stat.invalidated++;
+        }
+    }
+}
+
+static void notify_event(const struct inotify_event *ev)
+{
+    struct dircache_watch *w;
+    struct dir key, *d;
+    hnode_t *hn;
+    static_bstring uname;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        LOG(log_note, logtype_afpd, "dircache_notify: event queue overflow");
+        notify_invalidate_all();
+        return;
+    }
+
+    if ((hn = hash_lookup(notify_watches, &ev->wd)) == NULL)
+        return;
+    w = hnode_get(hn);
+
+    LOG(log_debug, logtype_afpd, "dircache_notify(did:%u,\"%s\"): event: 0x%x",
+        ntohl(w->did), ev->len ? ev->name : "", ev->mask);
+
+    if (ev->mask & IN_IGNORED) {
+        /* watch is gone, the directory was deleted or unmounted */
+        notify_invalidate_watch(w);
+        hash_delete_free(notify_watches, hn);
+        free(w);
+        return;
+    }
+
+    /* the watched directory itself */
+    key.d_vid = w->vid;
+    key.d_did = w->did;
+    if ((hn = hash_lookup(dircache, &key)) != NULL) {
+        d = hnode_get(hn);
+        notify_invalidate(d, (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) ? 1 : 0);
+    }
+
+    /* the child the event is about */
+    if (ev->len > 0) {
+        uname.mlen = -1;
+        uname.slen = strlen(ev->name);
+        uname.data = (unsigned char *)ev->name;
+        key.d_pdid = w->did;
+        key.d_u_name = &uname;
+        if ((hn = hash_lookup(index_didname, &key)) != NULL) {
+            d = hnode_get(hn);
+            notify_invalidate(d, 1);
+        }
+    }
+}
+
+/*!
+ * @brief Enable notification based validation for a cache entry if possible
+ *
+ * @param addwatch (r) add missing watches, else only use existing ones
+ */
+static void dircache_notify_add(const struct vol *vol, struct dir *dir, int addwatch)
+{
+    struct dir key, *pdir;
+    hnode_t *hn;
+
+    if (notify_fd == -1)
+        return;
+
+    /* the parent must be watched, the volume root isn't in the cache */
+    if (dir->d_pdid == DIRDID_ROOT) {
+        pdir = vol->v_root;
+    } else {
+        key.d_vid = dir->d_vid;
+        key.d_did = dir->d_pdid;
+        if ((hn = hash_lookup(dircache, &key)) == NULL)
+            return;
+        pdir = hnode_get(hn);
+    }
+    if (addwatch ? notify_watch(pdir) != 0 : !(pdir->d_flags & DIRF_WATCHED))
+        return;
+
+    /* and directories themselves */
+    if (!(dir->d_flags & DIRF_ISFILE)
+        && (addwatch ? notify_watch(dir) != 0 : !(dir->d_flags & DIRF_WATCHED)))
+        return;
+
+    dir->d_flags |= DIRF_NOTIFY;
+}
+
+/*!
+ * @brief Put the subtree of an entry that is removed from the cache back to ctime validation
+ */
+static void dircache_notify_remove(struct dir *dir)
+{
+    if (notify_fd == -1 || (dir->d_flags & DIRF_ISFILE))
+        return;
+
+    notify_invalidate_children(dir->d_vid, dir->d_did, 0);
+}
+
+#else /* HAVE_SYS_INOTIFY_H */
+
+static void dircache_notify_add(const struct vol *vol _U_, struct dir *dir _U_, int addwatch _U_)
+{
+}
+
+static void dircache_notify_remove(struct dir *dir _U_)
+{
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
 /********************************************************
  * Interface
  ********************************************************/
@@ -324,6 +709,12 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
             return NULL;        /* (1b) */
 
         }
+        if (cdir->d_flags & DIRF_NOTIFY) {
+            LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {cached, notify: path:\"%s\"}",
+                ntohl(cnid), cfrombstr(cdir->d_fullpath));
+            dircache_stat.hits++;
+            return cdir;
+        }
         if (ostat(cfrombstr(cdir->d_fullpath), &st, vol_syml_opt(vol)) != 0) {
             LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {missing:\"%s\"}",
                 ntohl(cnid), cfrombstr(cdir->d_fullpath));
@@ -340,6 +731,8 @@ struct dir *dircache_search_by_did(const struct vol *vol, cnid_t cnid)
         }
         LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {cached: path:\"%s\"}",
             ntohl(cnid), cfrombstr(cdir->d_fullpath));
+        /* passed ctime validation, trust it again if its watches are still there */
+        dircache_notify_add(vol, cdir, 0);
         dircache_stat.hits++;
     } else {
         LOG(log_debug, logtype_afpd, "dircache(cnid:%u): {not in cache}", ntohl(cnid));
@@ -394,6 +787,12 @@ struct dir *dircache_search_by_name(const struct vol *vol,
     }
 
     if (cdir) {
+        if (cdir->d_flags & DIRF_NOTIFY) {
+            LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {found in cache, notify}",
+                ntohl(dir->d_did), name);
+            dircache_stat.hits++;
+            return cdir;
+        }
         if (ostat(cfrombstr(cdir->d_fullpath), &st, vol_syml_opt(vol)) != 0) {
             LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {missing:\"%s\"}",
                 ntohl(dir->d_did), name, cfrombstr(cdir->d_fullpath));
@@ -412,6 +811,8 @@ struct dir *dircache_search_by_name(const struct vol *vol,
         }
         LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {found in cache}",
             ntohl(dir->d_did), name);
+        /* passed ctime validation, trust it again if its watches are still there */
+        dircache_notify_add(vol, cdir, 0);
         dircache_stat.hits++;
     } else {
         LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {not in cache}",
@@ -489,6 +890,14 @@ int dircache_add(const struct vol *vol,
         queue_count++;
     }
 
+    /* Add it to the parent DID index */
+    if (children_add(dir) != 0) {
+        dircache_dump();
+        exit(EXITERR_SYS);
+    }
+
+    dircache_notify_add(vol, dir, 1);
+
     dircache_stat.added++;
     LOG(log_debug, logtype_afpd, "dircache(did:%u,'%s'): {added}",
         ntohl(dir->d_did), cfrombstr(dir->d_u_name));
@@ -536,6 +945,9 @@ void dircache_remove(const struct vol *vol _U_, struct dir *dir, int flags)
             AFP_PANIC("dircache_remove");
         }
         hash_delete_free(dircache, hn);
+
+        children_remove(dir);
+        dircache_notify_remove(dir);
     }
 
     LOG(log_debug, logtype_afpd, "dircache(did:%u,\"%s\"): {removed}",
@@ -578,6 +990,10 @@ int dircache_init(int reqsize)
     if ((index_didname = hash_create(dircache_maxsize, hash_comp_didname, hash_didname)) == NULL)
         return -1;
 
+    /* Initialize parent DID index hashtable */
+    if ((index_pdid = hash_create(dircache_maxsize, hash_comp_vid_pdid, hash_vid_pdid)) == NULL)
+        return -1;
+
     /* Initialize index queue */
     if ((index_queue = queue_init()) == NULL)
         return -1;
@@ -598,13 +1014,78 @@ int dircache_init(int reqsize)
     return 0;
 }
 
+/*!
+ * @brief Enable notification based validation of cache entries
+ *
+ * Called in child afpd initialisation after dircache_init().
+ *
+ * @param maxwatches   (r) maximum number of inotify watches
+ *
+ * @return 0 on success, -1 on error
+ */
+int dircache_notify_init(int maxwatches)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if (maxwatches <= 0)
+        return -1;
+
+    if ((notify_fd = inotify_init()) == -1) {
+        LOG(log_error, logtype_afpd, "dircache_notify_init: inotify_init: %s", strerror(errno));
+        return -1;
+    }
+    if (fcntl(notify_fd, F_SETFL, O_NONBLOCK) == -1
+        || fcntl(notify_fd, F_SETFD, FD_CLOEXEC) == -1
+        || (notify_watches = hash_create(maxwatches, hash_comp_wd, hash_wd)) == NULL) {
+        LOG(log_error, logtype_afpd, "dircache_notify_init: %s", strerror(errno));
+        close(notify_fd);
+        notify_fd = -1;
+        return -1;
+    }
+    notify_maxwatches = maxwatches;
+
+    LOG(log_debug, logtype_afpd, "dircache_notify_init: done. max watches: %u", notify_maxwatches);
+    return 0;
+#else
+    LOG(log_error, logtype_afpd, "dircache_notify_init: not supported on this platform");
+    return -1;
+#endif
+}
+
+/*!
+ * @brief Read pending change notifications and invalidate affected cache entries
+ *
+ * Called once for every DSI request, a single non-blocking read() if nothing changed.
+ */
+void dircache_notify_process(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    if (notify_fd == -1)
+        return;
+
+    while ((len = read(notify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            notify_event(ev);
+        }
+    }
+
+    if (len == -1 && errno != EAGAIN && errno != EINTR)
+        LOG(log_error, logtype_afpd, "dircache_notify_process: %s", strerror(errno));
+#endif
+}
+
 /*!
  * Log dircache statistics
  */
 void log_dircache_stat(void)
 {
     LOG(log_info, logtype_afpd, "dircache statistics: "
-        "entries: %lu, lookups: %llu, hits: %llu, misses: %llu, added: %llu, removed: %llu, expunged: %llu, evicted: %llu",
+        "entries: %lu, lookups: %llu, hits: %llu, misses: %llu, added: %llu, removed: %llu, expunged: %llu, evicted: %llu, invalidated: %llu",
         queue_count,
         dircache_stat.lookups,
         dircache_stat.hits,
@@ -612,7 +1093,8 @@ void log_dircache_stat(void)
         dircache_stat.added,
         dircache_stat.removed,
         dircache_stat.expunged,
-        dircache_stat.evicted);
+        dircache_stat.evicted,
+        dircache_stat.invalidated);
 }
 
 /*!
@@ -37,4 +37,6 @@ extern struct dir *dircache_search_by_did(const struct vol *vol, cnid_t did);
 extern struct dir *dircache_search_by_name(const struct vol *, const struct dir *dir, char *name, int len);
 extern void       dircache_dump(void);
 extern void       log_dircache_stat(void);
+extern int        dircache_notify_init(int maxwatches);
+extern void       dircache_notify_process(void);
 #endif /* DIRCACHE_H */
@@ -44,6 +44,7 @@
 #include "unix.h"
 #include "mangle.h"
 #include "hash.h"
+#include "catidx.h"
 
 /*
  * FIXMEs, loose ends after the dircache rewrite:
@@ -586,7 +587,7 @@ struct dir *dirlookup(const struct vol *vol, cnid_t did)
             ret = NULL;
             goto exit;
         }
-        if (lstat(cfrombstr(ret->d_fullpath), &st) != 0) {
+        if (!(ret->d_flags & DIRF_NOTIFY) && lstat(cfrombstr(ret->d_fullpath), &st) != 0) {
             LOG(log_debug, logtype_afpd, "dirlookup(did: %u, path: \"%s\"): lstat: %s",
                 ntohl(did), cfrombstr(ret->d_fullpath), strerror(errno));
             switch (errno) {
@@ -1442,7 +1443,7 @@ int getdirparams(const AFPObj *obj,
                    (1 << DIRPBIT_FINFO)))) {
 
         ad_init(&ad, vol);
-        if ( !ad_metadata( upath, ADFLAGS_DIR, &ad) ) {
+        if ( !ad_metadata_st( upath, ADFLAGS_DIR, st, &ad) ) {
             isad = 1;
             if (ad.ad_mdp->adf_flags & O_CREAT) {
                 /* We just created it */
@@ -2044,6 +2045,9 @@ setdirparam_done:
     }
 
 setprivdone:
+    if (err == AFP_OK && dir)
+        catidx_update(vol, dir->d_did, dir->d_pdid, cfrombstr(dir->d_fullpath));
+
     if (change_parent_mdate && dir->d_did != DIRDID_ROOT
         && gettimeofday(&tv, NULL) == 0) {
         if (movecwd(vol, dirlookup(vol, dir->d_pdid)) == 0) {
@@ -2218,6 +2222,7 @@ int afp_createdir(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, size_
 
     ad_flush(&ad);
     ad_close(&ad, ADFLAGS_HF);
+    catidx_update(vol, dir->d_did, dir->d_pdid, cfrombstr(dir->d_fullpath));
 
     memcpy( rbuf, &dir->d_did, sizeof( uint32_t ));
     *rbuflen = sizeof( uint32_t );
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <sys/file.h>
 #include <sys/param.h>
+#include <time.h>
 
 #include <atalk/logger.h>
 #include <atalk/afp.h>
@@ -36,55 +37,186 @@
 #define min(a,b)	((a)<(b)?(a):(b))
 
 /*
- * Struct to save directory reading context in. Used to prevent
- * O(n^2) searches on a directory.
+ * Snapshot of a directory listing used to prevent O(n^2) searches on a
+ * directory. The names are stored \0 terminated in sd_buf, sd_off holds
+ * the offset of every name so that any sindex can be positioned in O(1).
+ * A name whose first byte is \0 is an entry stat() already failed on.
+ *
+ * sd_sindex/sd_pos are the cursor of the last request: entries that were
+ * skipped don't count for the client, so a continued enumeration starts
+ * at the cursor, not at sd_off[sindex - 1].
+ *
+ * Each session keeps the ENUM_SNAPSHOTS most recently used snapshots, so
+ * clients alternating between directories don't re-read them every time.
  */
 struct savedir {
-    u_short	 sd_vid;
-    uint32_t	 sd_did;
-    int		 sd_buflen;
-    char	 *sd_buf;
-    char	 *sd_last;
+    uint16_t     sd_vid;
+    uint32_t     sd_did;
+    time_t       sd_mtime;      /* mtime of the directory when it was read */
+    time_t       sd_readtime;   /* time the directory was read */
+    char         *sd_buf;
+    size_t       sd_buflen;
+    size_t       sd_bufused;
+    uint32_t     *sd_off;
+    unsigned int sd_offlen;
+    unsigned int sd_count;
     unsigned int sd_sindex;
+    unsigned int sd_pos;
+    unsigned int sd_lru;
 };
 #define SDBUFBRK	2048
+#define SDOFFBRK	256
+#define ENUM_SNAPSHOTS	8
+
+static struct savedir snapshots[ENUM_SNAPSHOTS];
+static unsigned int snapshot_lru;
+
+/*
+ * Entries stat()ed ahead of the reply by enumerate_prefetch(), the CNIDs of
+ * those not in the dircache have been requested with one cnid_prefetch().
+ */
+#define ENUM_PREFETCH	64
+
+static struct stat prefetch_st[ENUM_PREFETCH];
+static int prefetch_valid[ENUM_PREFETCH];
+static unsigned int prefetch_start, prefetch_end;
 
 static int enumerate_loop(struct dirent *de, char *mname _U_, void *data)
 {
-    struct savedir *sd = data; 
-    char *start, *end;
-    int  len,lenm;
-    
-    end = sd->sd_buf + sd->sd_buflen;
-    len = strlen(de->d_name);
-    *(sd->sd_last)++ = len;
-    lenm = 0; /* strlen(mname);*/
-    if ( sd->sd_last + len +lenm + 4 > end ) {
+    struct savedir *sd = data;
+    size_t len;
+
+    len = strlen(de->d_name) + 1;
+
+    /* grow geometrically, huge directories are read in linear time */
+    if (sd->sd_bufused + len > sd->sd_buflen) {
+        size_t buflen = sd->sd_buflen ? sd->sd_buflen : SDBUFBRK;
         char *buf;
 
-        start = sd->sd_buf;
-        if (!(buf = realloc( sd->sd_buf, sd->sd_buflen +SDBUFBRK )) ) {
+        while (sd->sd_bufused + len > buflen)
+            buflen *= 2;
+        if (buflen > UINT32_MAX || !(buf = realloc(sd->sd_buf, buflen))) {
             LOG(log_error, logtype_afpd, "afp_enumerate: realloc: %s",
                         strerror(errno) );
             errno = ENOMEM;
             return -1;
         }
         sd->sd_buf = buf;
-        sd->sd_buflen += SDBUFBRK;
-        sd->sd_last = ( sd->sd_last - start ) + sd->sd_buf;
-        end = sd->sd_buf + sd->sd_buflen;
+        sd->sd_buflen = buflen;
     }
+    if (sd->sd_count == sd->sd_offlen) {
+        unsigned int offlen = sd->sd_offlen ? sd->sd_offlen * 2 : SDOFFBRK;
+        uint32_t *off;
+
+        if (!(off = realloc(sd->sd_off, offlen * sizeof(uint32_t)))) {
+            LOG(log_error, logtype_afpd, "afp_enumerate: realloc: %s",
+                        strerror(errno) );
+            errno = ENOMEM;
+            return -1;
+        }
+        sd->sd_off = off;
+        sd->sd_offlen = offlen;
+    }
+
+    sd->sd_off[sd->sd_count++] = sd->sd_bufused;
+    memcpy(sd->sd_buf + sd->sd_bufused, de->d_name, len);
+    sd->sd_bufused += len;
 
-    memcpy( sd->sd_last, de->d_name, len + 1 );
-    sd->sd_last += len + 1;
-#if 0
-    *(sd->sd_last)++ = lenm;
-    memcpy( sd->sd_last, mname, lenm + 1 );
-    sd->sd_last += lenm + 1;
-#endif    
     return 0;
 }
 
+static void snapshot_invalidate(struct savedir *sd)
+{
+    sd->sd_did = 0;
+    sd->sd_count = 0;
+    sd->sd_bufused = 0;
+}
+
+/*
+ * Find the snapshot of a directory.
+ * When the client (re)starts an enumeration the snapshot is only used if
+ * the directory hasn't been modified since it was read. If there's none,
+ * the least recently used snapshot is returned invalidated for reuse.
+ */
+static struct savedir *snapshot_get(uint16_t vid, uint32_t did, const struct stat *st, uint32_t sindex)
+{
+    struct savedir *sd, *lru = &snapshots[0];
+    int i;
+
+    for (i = 0; i < ENUM_SNAPSHOTS; i++) {
+        sd = &snapshots[i];
+        if (sd->sd_did == did && sd->sd_vid == vid) {
+            /* a directory modified within the second it was read is racy */
+            if (sindex == 1 && (sd->sd_mtime != st->st_mtime || sd->sd_mtime >= sd->sd_readtime)) {
+                snapshot_invalidate(sd);
+                break;
+            }
+            sd->sd_lru = ++snapshot_lru;
+            return sd;
+        }
+        if (sd->sd_lru < lru->sd_lru)
+            lru = sd;
+    }
+    if (i == ENUM_SNAPSHOTS) {
+        sd = lru;
+        snapshot_invalidate(sd);
+    }
+    sd->sd_lru = ++snapshot_lru;
+    return sd;
+}
+
+static void enumerate_prefetch(const struct vol *vol, struct savedir *sd, unsigned int pos,
+                               unsigned int count, uint16_t fbitmap, uint16_t dbitmap)
+{
+    struct cnid_prefetch_ent ents[ENUM_PREFETCH];
+    struct stat *st;
+    char *name;
+    int i, n = 0;
+
+    prefetch_start = pos;
+    prefetch_end = pos + MIN(count, ENUM_PREFETCH);
+    if (prefetch_end > sd->sd_count)
+        prefetch_end = sd->sd_count;
+
+    for (i = 0; pos + i < prefetch_end; i++) {
+        prefetch_valid[i] = 0;
+        name = sd->sd_buf + sd->sd_off[pos + i];
+        if (*name == 0)
+            continue;
+        if (dircache_search_by_name(vol, curdir, name, strlen(name)) != NULL)
+            continue;
+        st = &prefetch_st[i];
+        if (ostat(name, st, vol_syml_opt(vol)) < 0)
+            continue;
+        prefetch_valid[i] = 1;
+        if (S_ISDIR(st->st_mode) ? dbitmap == 0 : fbitmap == 0)
+            continue;
+        ents[n].st = st;
+        ents[n].did = curdir->d_did;
+        ents[n].name = name;
+        ents[n].len = strlen(name);
+        n++;
+    }
+
+    if (n > 0)
+        (void)cnid_prefetch(vol->v_cdb, ents, n);
+}
+
+static int enumerate_error(void)
+{
+    LOG(log_error, logtype_afpd, "enumerate: loop error: %s (%d)", strerror(errno), errno);
+    switch (errno) {
+    case EACCES:
+        return AFPERR_ACCESS;
+    case ENOTDIR:
+        return AFPERR_BADTYPE;
+    case ENOMEM:
+        return AFPERR_MISC;
+    default:
+        return AFPERR_NODIR;
+    }
+}
+
 /* ----------------------------- 
  * FIXME: 
  * Doesn't work with dangling symlink
@@ -164,27 +296,20 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
     size_t *rbuflen, 
     int ext)
 {
-    static struct savedir	sd = { 0, 0, 0, NULL, NULL, 0 };
+    struct savedir		*sd;
     struct vol			*vol;
     struct dir			*dir;
-    int				did, ret, len, first = 1;
+    int				did, ret, first = 1;
     size_t			esz;
-    char                        *data, *start;
+    char                        *data, *name;
+    unsigned int		pos;
+    int				prefetch;
     uint16_t			vid, fbitmap, dbitmap, reqcnt, actcnt = 0;
     uint16_t			temp16;
     uint32_t			sindex, maxsz, sz = 0;
     struct path                 *o_path;
     struct path                 s_path;
     int                         header;
-        
-    if ( sd.sd_buflen == 0 ) {
-        if (( sd.sd_buf = (char *)malloc( SDBUFBRK )) == NULL ) {
-            LOG(log_error, logtype_afpd, "afp_enumerate: malloc: %s", strerror(errno) );
-            *rbuflen = 0;
-            return AFPERR_MISC;
-        }
-        sd.sd_buflen = SDBUFBRK;
-    }
 
     ibuf += 2;
 
@@ -276,57 +401,46 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
     data = rbuf + 3 * sizeof( uint16_t );
     sz = 3 * sizeof( uint16_t );	/* fbitmap, dbitmap, reqcount */
 
+    /* if dir was in the cache we don't have the inode */
+    if (!o_path->st_valid && ostat(".", &o_path->st, vol_syml_opt(vol)) < 0)
+        return enumerate_error();
+
     /*
-     * Read the directory into a pre-malloced buffer, stored
-     *		len <name> \0
-     * The end is indicated by a len of 0.
+     * Read the directory into a snapshot, unless we have a current one.
      */
-    if ( sindex == 1 || curdir->d_did != sd.sd_did || vid != sd.sd_vid ) {
-        sd.sd_last = sd.sd_buf;
-        /* if dir was in the cache we don't have the inode */
-        if (( !o_path->st_valid && ostat(".", &o_path->st, vol_syml_opt(vol)) < 0 ) ||
-            (ret = for_each_dirent(vol, ".", enumerate_loop, (void *)&sd)) < 0) 
-        {
-            LOG(log_error, logtype_afpd, "enumerate: loop error: %s (%d)", strerror(errno), errno);
-            switch (errno) {
-            case EACCES:
-                return AFPERR_ACCESS;
-            case ENOTDIR:
-                return AFPERR_BADTYPE;
-            case ENOMEM:
-                return AFPERR_MISC;
-            default:
-                return AFPERR_NODIR;
-            }
+    sd = snapshot_get(vid, curdir->d_did, &o_path->st, sindex);
+    if (sd->sd_did == 0) {
+        sd->sd_readtime = time(NULL);
+        if ((ret = for_each_dirent(vol, ".", enumerate_loop, (void *)sd)) < 0) {
+            snapshot_invalidate(sd);
+            return enumerate_error();
         }
         setdiroffcnt(curdir, &o_path->st,  ret);
-        *sd.sd_last = 0;
-
-        sd.sd_last = sd.sd_buf;
-        sd.sd_sindex = 1;
 
-        sd.sd_vid = vid;
-        sd.sd_did = curdir->d_did;
+        sd->sd_mtime = o_path->st.st_mtime;
+        sd->sd_sindex = 1;
+        sd->sd_pos = 0;
+        sd->sd_vid = vid;
+        sd->sd_did = curdir->d_did;
     }
 
     /*
-     * Position sd_last as dictated by sindex.
+     * Position as dictated by sindex.
      */
-    if ( sindex < sd.sd_sindex ) {
-        sd.sd_sindex = 1;
-        sd.sd_last = sd.sd_buf;
-    }
-    while ( sd.sd_sindex < sindex ) {
-        len = (unsigned char)*(sd.sd_last)++;
-        if ( len == 0 ) {
-            sd.sd_did = 0;	/* invalidate sd struct to force re-read */
-            return( AFPERR_NOOBJ );
-        }
-        sd.sd_last += len + 1;
-        sd.sd_sindex++;
+    if (sindex == sd->sd_sindex)
+        pos = sd->sd_pos;
+    else
+        pos = sindex - 1;
+    if (pos >= sd->sd_count) {
+        snapshot_invalidate(sd);	/* force re-read */
+        return( AFPERR_NOOBJ );
     }
 
-    while (( len = (unsigned char)*(sd.sd_last)) != 0 ) {
+    prefetch = vol->v_cdb && vol->v_cdb->cnid_prefetch;
+    prefetch_start = prefetch_end = 0;
+    ret = AFP_OK;
+
+    for (; pos < sd->sd_count; pos++) {
         /*
          * If we've got all we need, send it.
          */
@@ -334,39 +448,37 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
             break;
         }
 
-        /*
-         * Save the start position, in case we exceed the buffer
-         * limitation, and have to back up one.
-         */
-        start = sd.sd_last;
-        sd.sd_last++;
+        if (prefetch && pos >= prefetch_end)
+            enumerate_prefetch(vol, sd, pos, reqcnt - actcnt, fbitmap, dbitmap);
 
-        if (*sd.sd_last == 0) {
+        name = sd->sd_buf + sd->sd_off[pos];
+        if (*name == 0) {
             /* stat() already failed on this one */
-            sd.sd_last += len + 1;
             continue;
         }
 
         memset(&s_path, 0, sizeof(s_path));
-        s_path.u_name = sd.sd_last;
-        if (of_stat(vol, &s_path) < 0 ) {
+        s_path.u_name = name;
+        if (pos >= prefetch_start && pos < prefetch_end && prefetch_valid[pos - prefetch_start]) {
+            s_path.st = prefetch_st[pos - prefetch_start];
+            s_path.st_valid = 1;
+        } else if (of_stat(vol, &s_path) < 0 ) {
             /* so the next time it won't try to stat it again
-             * another solution would be to invalidate the cache with 
-             * sd.sd_did = 0 but if it's not ENOENT error it will start again
+             * another solution would be to invalidate the snapshot
+             * but if it's not ENOENT error it will start again
              */
-            *sd.sd_last = 0;
-            sd.sd_last += len + 1;
+            *name = 0;
             curdir->d_offcnt--;		/* a little lie */
             continue;
         }
 
         /* conversions on the fly */
         const char *convname;
-        if (ad_convert(sd.sd_last, &s_path.st, vol, &convname) == 0) {
+        if (ad_convert(name, &s_path.st, vol, &convname) == 0) {
             if (convname) {
                 s_path.u_name = (char *)convname;
                 AFP_CNID_START("cnid_lookup");
-                s_path.id = cnid_lookup(vol->v_cdb, &s_path.st, curdir->d_did, sd.sd_last, strlen(sd.sd_last));
+                s_path.id = cnid_lookup(vol->v_cdb, &s_path.st, curdir->d_did, name, strlen(name));
                 AFP_CNID_DONE();
                 if (s_path.id != CNID_INVALID) {
                     AFP_CNID_START("cnid_update");
@@ -378,7 +490,6 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
             }
         }
 
-        sd.sd_last += len + 1;
         s_path.m_name = NULL;
 
         /*
@@ -395,11 +506,12 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
                 if ((dir = dir_add(vol, curdir, &s_path, len)) == NULL) {
                     LOG(log_error, logtype_afpd, "enumerate(vid:%u, did:%u, name:'%s'): error adding dir: '%s'",
                         ntohs(vid), ntohl(did), o_path->u_name, s_path.u_name);
-                    return AFPERR_MISC;
+                    ret = AFPERR_MISC;
+                    goto exit;
                 }
             }
             if ((ret = getdirparams(obj, vol, dbitmap, &s_path, dir, data + header , &esz)) != AFP_OK)
-                return( ret );
+                goto exit;
 
         } else {
             if ( fbitmap == 0 ) {
@@ -408,7 +520,7 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
             /* files are added to the dircache in getfilparams() -> getmetadata() */
             if (AFP_OK != ( ret = getfilparams(obj, vol, fbitmap, &s_path, curdir, 
                                                data + header, &esz, 1)) ) {
-                return( ret );
+                goto exit;
             }
         }
 
@@ -426,9 +538,9 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
          */
         if ( maxsz < sz + esz + header) {
             if (first) { /* maxsz can't hold a single reply */
-                return AFPERR_PARAM;
+                ret = AFPERR_PARAM;
+                goto exit;
             }
-            sd.sd_last = start;
             break;
         }
 
@@ -454,8 +566,15 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
         /* FIXME if we rollover 16 bits and it's not FPEnumerateExt2 */
     }
 
+exit:
+    /* drop the prefetched CNIDs on every path out of the loop */
+    if (prefetch)
+        (void)cnid_prefetch(vol->v_cdb, NULL, 0);
+    if (ret != AFP_OK)
+        return ret;
+
     if ( actcnt == 0 ) {
-        sd.sd_did = 0;		/* invalidate sd struct to force re-read */
+        snapshot_invalidate(sd);	/* force re-read */
         /*
          * in case were converting adouble stuff:
          * after enumerating the whole dir we should have converted everything
@@ -467,7 +586,8 @@ static int enumerate(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_,
 
         return( AFPERR_NOOBJ );
     }
-    sd.sd_sindex = sindex + actcnt;
+    sd->sd_sindex = sindex + actcnt;
+    sd->sd_pos = pos;
 
     /*
      * All done, fill in misc junk in rbuf
@@ -6,11 +6,14 @@
  *
  * for every detected filesystem change a UDP packet is sent to an arbitrary list
  * of listeners. Each packet contains unix path of modified filesystem element,
- * event reason, and a consecutive event id (32 bit). Technically we are UDP client and are sending
- * out packets synchronuosly as they are created by the afp functions. This should not affect
- * performance measurably. The only delaying calls occur during initialization, if we have to
- * resolve non-IP hostnames to IP. All numeric data inside the packet is network byte order, so use
- * ntohs / ntohl to resolve length and event id. Ideally a listener receives every packet with
+ * event reason, and a consecutive event id (32 bit). Technically we are UDP client. Packets are
+ * queued in a per session event ring as they are created by the afp functions and the ring is
+ * sent to all listeners in one go (sendmmsg) when it is full, when the client has no further
+ * request pending or when the oldest queued event is older than FCE_FLUSH_MS. With protocol
+ * version 3 several events are packed into one packet and the notify script is started once
+ * and fed one line per event over a pipe. The only delaying calls occur during initialization,
+ * if we have to resolve non-IP hostnames to IP. All numeric data inside the packet is network
+ * byte order, so use ntohs / ntohl to resolve length and event id. Ideally a listener receives every packet with
  * no gaps in event ids, starting with event id 1 and mode FCE_CONN_START followed by
  * data events from id 2 up to 0xFFFFFFFF, followed by 0 to 0xFFFFFFFF and so on.
  *
@@ -32,6 +35,7 @@
 #include <time.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -46,6 +50,7 @@
 #include <atalk/unix.h>
 #include <atalk/fce_api.h>
 #include <atalk/globals.h>
+#include <atalk/dsi.h>
 
 #include "fork.h"
 #include "file.h"
@@ -57,6 +62,7 @@
 #include "fce_api_internal.h"
 
 extern int afprun_bg(int root, char *cmd);
+extern int afprun_pipe(int root, char *cmd, int *infd);
 
 /* We store our connection data here */
 static struct udp_entry udp_socket_list[FCE_MAX_UDP_SOCKS];
@@ -80,6 +86,34 @@ static unsigned char iobuf[MAXIOBUF];
 static const char **skip_files;
 static struct fce_close_event last_close_event;
 
+/* Delete events held back by hold_delete_event() */
+static struct {
+    int   event;
+    char *path;
+} held_deletes[FCE_HELD_DELETES];
+static int nheld_deletes;
+static time_t held_deletes_since;
+static bool held_deletes_touched;      /* a delete was held during this request */
+static char *fce_user;
+static size_t fce_ev_maxlen;   /* upper bound for the size of one event in the ring */
+
+/* The event ring, queued packets are sent by flush_fce_events() */
+static char fce_ring[FCE_RING_SIZE];
+static size_t fce_ring_len;
+static struct iovec fce_dgrams[FCE_RING_DGRAMS];
+static int fce_ndgrams;
+static uint16_t fce_batch_count;        /* events in the last version 3 packet */
+static struct timespec fce_ring_since;  /* time the oldest queued event was added */
+
+/* Version 3 notify script, started once and fed over a pipe */
+static char fce_script_buf[FCE_RING_SIZE];
+static size_t fce_script_len;
+static int fce_script_fd = -1;
+static time_t fce_script_retry;
+
+static void flush_fce_events(const AFPObj *obj);
+static void release_held_deletes(const AFPObj *obj);
+
 static char *fce_event_names[] = {
     [FCE_FILE_MODIFY] = "FCE_FILE_MODIFY",
     [FCE_FILE_DELETE] = "FCE_FILE_DELETE",
@@ -148,8 +182,16 @@ void fce_init_udp()
     udp_initialized = true;
 }
 
-void fce_cleanup()
+void fce_cleanup(const AFPObj *obj)
 {
+    release_held_deletes(obj);
+    flush_fce_events(obj);
+
+    if (fce_script_fd != -1) {
+        close(fce_script_fd);
+        fce_script_fd = -1;
+    }
+
     if (udp_initialized == false )
         return;
 
@@ -283,29 +325,414 @@ static ssize_t build_fce_packet(const AFPObj *obj,
 }
 
 /*
- * Send the fce information to all (connected) listeners
+ * Start a version 3 packet with count events and return the header size
+ * */
+static size_t build_fce_batch_header(char *buf, pid_t pid, const char *user, uint16_t count)
+{
+    char *p = buf;
+    uint16_t uint16;
+    uint64_t uint64;
+
+    /* FCE magic */
+    memcpy(p, FCE_PACKET_MAGIC, 8);
+    p += 8;
+
+    /* version */
+    *p++ = 3;
+
+    /* options */
+    *p++ = fce_ev_info;
+
+    /* event count */
+    uint16 = htons(count);
+    memcpy(p, &uint16, sizeof(uint16));
+    p += sizeof(uint16);
+
+    /* optional: pid */
+    if (fce_ev_info & FCE_EV_INFO_PID) {
+        uint64 = pid;
+        uint64 = hton64(uint64);
+        memcpy(p, &uint64, sizeof(uint64));
+        p += sizeof(uint64);
+    }
+
+    /* optional: username */
+    if (fce_ev_info & FCE_EV_INFO_USER) {
+        uint16 = strlen(user);
+        uint16 = htons(uint16);
+        memcpy(p, &uint16, sizeof(uint16));
+        p += sizeof(uint16);
+        memcpy(p, user, strlen(user));
+        p += strlen(user);
+    }
+
+    return p - buf;
+}
+
+/*
+ * Construct one event record of a version 3 packet and return its size
+ * */
+static size_t build_fce_batch_record(char *buf,
+                                     fce_ev_t event,
+                                     const char *path,
+                                     const char *oldpath,
+                                     uint32_t event_id)
+{
+    char *p = buf;
+    size_t pathlen;
+    uint16_t uint16;
+    uint32_t uint32;
+
+    /* event */
+    *p++ = event;
+
+    /* flags */
+    *p++ = oldpath ? FCE_EV_INFO_SRCPATH : 0;
+
+    /* event ID */
+    uint32 = htonl(event_id);
+    memcpy(p, &uint32, sizeof(uint32));
+    p += sizeof(uint32);
+
+    /* path */
+    if ((pathlen = strlen(path)) >= MAXPATHLEN)
+        pathlen = MAXPATHLEN - 1;
+    uint16 = htons(pathlen);
+    memcpy(p, &uint16, sizeof(uint16));
+    p += sizeof(uint16);
+    memcpy(p, path, pathlen);
+    p += pathlen;
+
+    /* optional: source path */
+    if (oldpath) {
+        if ((pathlen = strlen(oldpath)) >= MAXPATHLEN)
+            pathlen = MAXPATHLEN - 1;
+        uint16 = htons(pathlen);
+        memcpy(p, &uint16, sizeof(uint16));
+        p += sizeof(uint16);
+        memcpy(p, oldpath, pathlen);
+        p += pathlen;
+    }
+
+    return p - buf;
+}
+
+/*
+ * Construct a packet with a single event in the configured protocol version
+ * */
+static ssize_t build_fce_single(const AFPObj *obj, char *buf, fce_ev_t event, uint32_t event_id)
+{
+    size_t len;
+
+    if (obj->fce_version < 3)
+        return build_fce_packet(obj, buf, event, "", NULL, getpid(), fce_user, event_id);
+
+    len = build_fce_batch_header(buf, getpid(), fce_user, 1);
+    len += build_fce_batch_record(buf + len, event, "", NULL, event_id);
+    return len;
+}
+
+/*
+ * Send queued packets to one listener, returns 0 on success, -1 on error
+ * */
+static int send_fce_packets(struct udp_entry *udp_entry, struct iovec *iov, int count)
+{
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[FCE_RING_DGRAMS];
+    int sent;
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (int i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = &udp_entry->sockaddr;
+        msgs[i].msg_hdr.msg_namelen = udp_entry->addrinfo.ai_addrlen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (int i = 0; i < count; i += sent) {
+        if ((sent = sendmmsg(udp_entry->sock, msgs + i, count - i, 0)) <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                sent = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        if (sendto(udp_entry->sock,
+                   iov[i].iov_base,
+                   iov[i].iov_len,
+                   0,
+                   (struct sockaddr *)&udp_entry->sockaddr,
+                   udp_entry->addrinfo.ai_addrlen) != (ssize_t)iov[i].iov_len)
+            return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Write queued lines to the notify script, whatever the pipe doesn't take
+ * without blocking stays queued
+ * */
+static void flush_fce_script(void)
+{
+    size_t off = 0;
+    ssize_t len;
+
+    if (fce_script_len == 0)
+        return;
+
+    if (fce_script_fd == -1) {
+        fce_script_len = 0;
+        return;
+    }
+
+    while (off < fce_script_len) {
+        if ((len = write(fce_script_fd, fce_script_buf + off, fce_script_len - off)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* script is gone, restart it later */
+            LOG(log_error, logtype_fce, "flush_fce_script: error writing to notify script: %s",
+                strerror(errno));
+            close(fce_script_fd);
+            fce_script_fd = -1;
+            fce_script_retry = time(NULL) + FCE_SOCKET_RETRY_DELAY_S;
+            off = fce_script_len;
+            break;
+        }
+        off += len;
+    }
+
+    memmove(fce_script_buf, fce_script_buf + off, fce_script_len - off);
+    fce_script_len -= off;
+}
+
+/*
+ * Send the event ring to all (connected) listeners
+ * We dont give return code because all errors are handled internally (I hope..)
+ * */
+static void flush_fce_events(const AFPObj *obj)
+{
+    time_t now;
+    ssize_t data_len;
+
+    flush_fce_script();
+
+    if (fce_ndgrams == 0)
+        return;
+
+    now = time(NULL);
+
+    for (int i = 0; i < udp_sockets; i++) {
+        struct udp_entry *udp_entry = udp_socket_list + i;
+
+        /* we had a problem earlier ? */
+        if (udp_entry->sock == -1) {
+            /* We still have to wait ?*/
+            if (now < udp_entry->next_try_on_error)
+                continue;
+
+            /* Reopen socket */
+            udp_entry->sock = socket(udp_entry->addrinfo.ai_family,
+                                     udp_entry->addrinfo.ai_socktype,
+                                     udp_entry->addrinfo.ai_protocol);
+            
+            if (udp_entry->sock == -1) {
+                /* failed again, so go to rest again */
+                LOG(log_error, logtype_fce, "Cannot recreate socket for fce UDP connection: errno %d", errno  );
+
+                udp_entry->next_try_on_error = now + FCE_SOCKET_RETRY_DELAY_S;
+                continue;
+            }
+
+            udp_entry->next_try_on_error = 0;
+
+            /* Okay, we have a running socket again, send server that we had a problem on our side*/
+            data_len = build_fce_single(obj, (char *)iobuf, FCE_CONN_BROKEN, 0);
+
+            sendto(udp_entry->sock,
+                   iobuf,
+                   data_len,
+                   0,
+                   (struct sockaddr *)&udp_entry->sockaddr,
+                   udp_entry->addrinfo.ai_addrlen);
+        }
+
+        /* Problems ? */
+        if (send_fce_packets(udp_entry, fce_dgrams, fce_ndgrams) != 0) {
+            /* Argh, socket broke, we close and retry later */
+            LOG(log_error, logtype_fce, "flush_fce_events: error sending %d packets to %s:%s: %s",
+                fce_ndgrams, udp_entry->addr, udp_entry->port, strerror(errno));
+
+            close( udp_entry->sock );
+            udp_entry->sock = -1;
+            udp_entry->next_try_on_error = now + FCE_SOCKET_RETRY_DELAY_S;
+        }
+    }
+
+    fce_ndgrams = 0;
+    fce_ring_len = 0;
+    fce_batch_count = 0;
+}
+
+/*
+ * Add an event to the event ring, the ring is flushed first if it might not
+ * have room for it. Version 3 events are appended to the last packet as long
+ * as it stays below FCE_DGRAM_LEN.
+ * */
+static void queue_fce_event(const AFPObj *obj,
+                            fce_ev_t event,
+                            const char *path,
+                            const char *oldpath,
+                            uint32_t event_id)
+{
+    struct iovec *dgram;
+    size_t len;
+    uint16_t uint16;
+
+    if (udp_sockets == 0)
+        return;
+
+    if (fce_ndgrams == FCE_RING_DGRAMS || fce_ring_len + fce_ev_maxlen > FCE_RING_SIZE)
+        flush_fce_events(obj);
+
+    if (obj->fce_version < 3) {
+        dgram = &fce_dgrams[fce_ndgrams++];
+        dgram->iov_base = fce_ring + fce_ring_len;
+        dgram->iov_len = build_fce_packet(obj, dgram->iov_base, event, path, oldpath, getpid(), fce_user, event_id);
+        fce_ring_len += dgram->iov_len;
+        return;
+    }
+
+    len = FCE_BATCH_REC_LEN + strlen(path) + (oldpath ? 2 + strlen(oldpath) : 0);
+    dgram = fce_ndgrams ? &fce_dgrams[fce_ndgrams - 1] : NULL;
+
+    if (dgram == NULL || fce_batch_count == UINT16_MAX || dgram->iov_len + len > FCE_DGRAM_LEN) {
+        dgram = &fce_dgrams[fce_ndgrams++];
+        dgram->iov_base = fce_ring + fce_ring_len;
+        dgram->iov_len = build_fce_batch_header(dgram->iov_base, getpid(), fce_user, 0);
+        fce_ring_len += dgram->iov_len;
+        fce_batch_count = 0;
+    }
+
+    /* the last packet always ends at the end of the ring */
+    len = build_fce_batch_record(fce_ring + fce_ring_len, event, path, oldpath, event_id);
+    dgram->iov_len += len;
+    fce_ring_len += len;
+
+    fce_batch_count++;
+    uint16 = htons(fce_batch_count);
+    memcpy((char *)dgram->iov_base + 10, &uint16, sizeof(uint16));
+}
+
+/*
+ * Copy src to dst escaping backslash, tab and newline, returns the end of dst
+ * */
+static char *fce_script_escape(char *dst, const char *src)
+{
+    for (; *src; src++) {
+        switch (*src) {
+        case '\\':
+            *dst++ = '\\';
+            *dst++ = '\\';
+            break;
+        case '\t':
+            *dst++ = '\\';
+            *dst++ = 't';
+            break;
+        case '\n':
+            *dst++ = '\\';
+            *dst++ = 'n';
+            break;
+        default:
+            *dst++ = *src;
+            break;
+        }
+    }
+    return dst;
+}
+
+/*
+ * Queue an event for the version 3 notify script. The script is started once
+ * with "-v 3 -s" and reads one tab separated line per event from stdin:
+ *
+ *   event ID, event name, pid, username, path, source path
+ * */
+static void queue_fce_script(const AFPObj *obj,
+                             fce_ev_t event,
+                             const char *path,
+                             const char *oldpath,
+                             uint32_t event_id)
+{
+    size_t len;
+    char *p;
+
+    if (fce_script_fd == -1) {
+        time_t now = time(NULL);
+        bstring cmd;
+
+        if (now < fce_script_retry)
+            return;
+
+        cmd = bformat("%s -v %d -s", obj->fce_notify_script, obj->fce_version);
+        if (afprun_pipe(1, bdata(cmd), &fce_script_fd) != 0) {
+            LOG(log_error, logtype_fce, "Cannot start fce notify script: %s", bdata(cmd));
+            fce_script_fd = -1;
+            fce_script_retry = now + FCE_SOCKET_RETRY_DELAY_S;
+        }
+        bdestroy(cmd);
+        if (fce_script_fd == -1)
+            return;
+    }
+
+    len = 64 + strlen(fce_user) + 2 * (strlen(path) + (oldpath ? strlen(oldpath) : 0));
+    if (fce_script_len + len > sizeof(fce_script_buf)) {
+        flush_fce_script();
+        if (fce_script_len + len > sizeof(fce_script_buf)) {
+            LOG(log_warning, logtype_fce, "fce notify script is not keeping up, dropping event %" PRIu32,
+                event_id);
+            return;
+        }
+    }
+
+    p = fce_script_buf + fce_script_len;
+    p += sprintf(p, "%" PRIu32 "\t%s\t%" PRIu64 "\t%s\t",
+                 event_id, fce_event_names[event], (uint64_t)getpid(), fce_user);
+    p = fce_script_escape(p, path);
+    *p++ = '\t';
+    if (oldpath)
+        p = fce_script_escape(p, oldpath);
+    *p++ = '\n';
+    fce_script_len = p - fce_script_buf;
+}
+
+/*
+ * Queue the fce information for all (connected) listeners and the notify script
  * We dont give return code because all errors are handled internally (I hope..)
  * */
 static void send_fce_event(const AFPObj *obj, int event, const char *path, const char *oldpath)
 {    
     static bool first_event = true;
     static uint32_t event_id = 0; /* the unique packet couter to detect packet/data loss. Going from 0xFFFFFFFF to 0x0 is a valid increment */
-    static char *user;
-    time_t now = time(NULL);
-    ssize_t data_len;
 
     /* initialized ? */
     if (first_event == true) {
         first_event = false;
 
         struct passwd *pwd = getpwuid(obj->uid);
-        user = strdup(pwd->pw_name);
+        fce_user = strdup(pwd->pw_name);
 
         switch (obj->fce_version) {
         case 1:
             /* fce_ev_info unused */
             break;
         case 2:
+        case 3:
             fce_ev_info = FCE_EV_INFO_PID | FCE_EV_INFO_USER;
             break;
         default:
@@ -314,13 +741,21 @@ static void send_fce_event(const AFPObj *obj, int event, const char *path, const
             break;
         }
 
+        /* header, pid, username and two paths with their length */
+        fce_ev_maxlen = 48 + strlen(fce_user) + 2 * MAXPATHLEN;
+
         fce_init_udp();
         /* Notify listeners the we start from the beginning */
         send_fce_event(obj, FCE_CONN_START, "", NULL);
     }
 
+    if (fce_ndgrams == 0 && fce_script_len == 0)
+        clock_gettime(CLOCK_MONOTONIC, &fce_ring_since);
+
     /* run script */
-    if (obj->fce_notify_script) {
+    if (obj->fce_notify_script && obj->fce_version > 2) {
+        queue_fce_script(obj, event, path, oldpath, event_id);
+    } else if (obj->fce_notify_script) {
         static bstring quote = NULL;
         static bstring quoterep = NULL;
         static bstring slash = NULL;
@@ -349,7 +784,7 @@ static void send_fce_event(const AFPObj *obj, int event, const char *path, const
         if (fce_ev_info | FCE_EV_INFO_PID)
             bformata(cmd, " -p %" PRIu64 "", (uint64_t)getpid());
         if (fce_ev_info | FCE_EV_INFO_USER)
-            bformata(cmd, " -u %s", user);
+            bformata(cmd, " -u %s", fce_user);
         if (oldpath) {
             bstring boldpath = bfromcstr(oldpath);
             bfindreplace(boldpath, slash, slashrep, 0);
@@ -361,63 +796,7 @@ static void send_fce_event(const AFPObj *obj, int event, const char *path, const
         bdestroy(cmd);
     }
 
-    for (int i = 0; i < udp_sockets; i++) {
-        int sent_data = 0;
-        struct udp_entry *udp_entry = udp_socket_list + i;
-
-        /* we had a problem earlier ? */
-        if (udp_entry->sock == -1) {
-            /* We still have to wait ?*/
-            if (now < udp_entry->next_try_on_error)
-                continue;
-
-            /* Reopen socket */
-            udp_entry->sock = socket(udp_entry->addrinfo.ai_family,
-                                     udp_entry->addrinfo.ai_socktype,
-                                     udp_entry->addrinfo.ai_protocol);
-            
-            if (udp_entry->sock == -1) {
-                /* failed again, so go to rest again */
-                LOG(log_error, logtype_fce, "Cannot recreate socket for fce UDP connection: errno %d", errno  );
-
-                udp_entry->next_try_on_error = now + FCE_SOCKET_RETRY_DELAY_S;
-                continue;
-            }
-
-            udp_entry->next_try_on_error = 0;
-
-            /* Okay, we have a running socket again, send server that we had a problem on our side*/
-            data_len = build_fce_packet(obj, iobuf, FCE_CONN_BROKEN, "", NULL, getpid(), user, 0);
-
-            sendto(udp_entry->sock,
-                   iobuf,
-                   data_len,
-                   0,
-                   (struct sockaddr *)&udp_entry->sockaddr,
-                   udp_entry->addrinfo.ai_addrlen);
-        }
-
-        /* build our data packet */
-        data_len = build_fce_packet(obj, iobuf, event, path, oldpath, getpid(), user, event_id);
-
-        sent_data = sendto(udp_entry->sock,
-                           iobuf,
-                           data_len,
-                           0,
-                           (struct sockaddr *)&udp_entry->sockaddr,
-                           udp_entry->addrinfo.ai_addrlen);
-
-        /* Problems ? */
-        if (sent_data != data_len) {
-            /* Argh, socket broke, we close and retry later */
-            LOG(log_error, logtype_fce, "send_fce_event: error sending packet to %s:%s, transfered %d of %d: %s",
-                udp_entry->addr, udp_entry->port, sent_data, data_len, strerror(errno));
-
-            close( udp_entry->sock );
-            udp_entry->sock = -1;
-            udp_entry->next_try_on_error = now + FCE_SOCKET_RETRY_DELAY_S;
-        }
-    }
+    queue_fce_event(obj, event, path, oldpath, event_id);
 
     event_id++;
 }
@@ -461,6 +840,55 @@ static void save_close_event(const AFPObj *obj, const char *path)
     strncpy(last_close_event.path, path, MAXPATHLEN);
 }
 
+/*
+ * Hold back a delete event so it can be folded into the delete of its parent
+ *
+ * Clients delete a directory tree bottom-up, one FPDelete per object, so when a
+ * directory is deleted the held deletes of the objects below it are dropped and
+ * only the directory delete is reported.
+ */
+static void hold_delete_event(const AFPObj *obj, int event, const char *path)
+{
+    size_t len = strlen(path);
+    int i, n;
+
+    if (event == FCE_DIR_DELETE) {
+        for (i = n = 0; i < nheld_deletes; i++) {
+            if (strncmp(held_deletes[i].path, path, len) == 0 && held_deletes[i].path[len] == '/') {
+                LOG(log_debug9, logtype_fce, "Coalesced fc event <%d> for <%s>",
+                    held_deletes[i].event, held_deletes[i].path);
+                free(held_deletes[i].path);
+                continue;
+            }
+            held_deletes[n++] = held_deletes[i];
+        }
+        nheld_deletes = n;
+    }
+
+    if (nheld_deletes == FCE_HELD_DELETES)
+        release_held_deletes(obj);
+
+    if ((held_deletes[nheld_deletes].path = strdup(path)) == NULL) {
+        release_held_deletes(obj);
+        send_fce_event(obj, event, path, NULL);
+        return;
+    }
+    if (nheld_deletes == 0)
+        held_deletes_since = time(NULL);
+    held_deletes[nheld_deletes++].event = event;
+    held_deletes_touched = true;
+}
+
+/* Send the held delete events in the order they happened */
+static void release_held_deletes(const AFPObj *obj)
+{
+    for (int i = 0; i < nheld_deletes; i++) {
+        send_fce_event(obj, held_deletes[i].event, held_deletes[i].path, NULL);
+        free(held_deletes[i].path);
+    }
+    nheld_deletes = 0;
+}
+
 static void fce_init_ign_names(const char *ignores)
 {
     int count = 0;
@@ -534,7 +962,16 @@ int fce_register(const AFPObj *obj, fce_ev_t event, const char *path, const char
     case FCE_FILE_MODIFY:
         save_close_event(obj, path);
         break;
+    case FCE_FILE_DELETE:
+    case FCE_DIR_DELETE:
+        if (fce_coalesce_deletes()) {
+            hold_delete_event(obj, event, path);
+            break;
+        }
+        /* fall through */
     default:
+        /* keep the order of events */
+        release_held_deletes(obj);
         send_fce_event(obj, event, path, oldpath);
         break;
     }
@@ -563,9 +1000,30 @@ static void check_saved_close_events(const AFPObj *obj)
  * */
 void fce_pending_events(const AFPObj *obj)
 {
-    if (!udp_sockets)
+    struct timespec now;
+
+    if (!udp_sockets && !obj->fce_notify_script)
         return;
     check_saved_close_events(obj);
+
+    /* hold deletes while the client keeps deleting, but not for too long */
+    if (nheld_deletes
+        && (!held_deletes_touched || time(NULL) - held_deletes_since >= FCE_COALESCE_MAX_AGE_S))
+        release_held_deletes(obj);
+    held_deletes_touched = false;
+
+    if (fce_ndgrams == 0 && fce_script_len == 0)
+        return;
+
+    /* keep on batching while the client has already sent the next request, but not for too long */
+    if (obj->dsi && dsi_stream_pending(obj->dsi)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - fce_ring_since.tv_sec) * 1000
+            + (now.tv_nsec - fce_ring_since.tv_nsec) / 1000000 < FCE_FLUSH_MS)
+            return;
+    }
+
+    flush_fce_events(obj);
 }
 
 /*
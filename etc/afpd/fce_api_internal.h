@@ -14,8 +14,14 @@
 
 #define FCE_MAX_UDP_SOCKS 5     /* Allow a maximum of udp listeners for file change events */
 #define FCE_SOCKET_RETRY_DELAY_S 600 /* Pause this time in s after socket was broken */
-#define FCE_HISTORY_LEN 10  /* This is used to coalesce events */
-#define MAX_COALESCE_TIME_MS 1000  /* Events oldeer than this are not coalesced */
+#define FCE_RING_SIZE (64 * 1024) /* Size of the event ring in bytes */
+#define FCE_RING_DGRAMS 64      /* Max number of datagrams queued in the event ring */
+#define FCE_DGRAM_LEN 1400      /* Version 3 packets are filled up to this size */
+#define FCE_FLUSH_MS 100        /* Queued events are sent after this time in ms at the latest */
+#define FCE_COALESCE_BUCKET_S 1     /* Reported paths are remembered for one to two buckets */
+#define FCE_COALESCE_MAX_AGE_S 30   /* Coalescing below a busy path ends after this time */
+#define FCE_COALESCE_MAX_NODES 8192 /* Max path elements remembered per bucket */
+#define FCE_HELD_DELETES 256        /* Max delete events held back for folding */
 
 #define FCE_COALESCE_CREATE (1 << 0)
 #define FCE_COALESCE_DELETE (1 << 1)
@@ -30,10 +36,24 @@ struct udp_entry {
     time_t next_try_on_error;      /* In case of error set next timestamp to retry */
 };
 
-struct fce_history {
-    fce_ev_t       fce_h_event;
-	char           fce_h_path[MAXPATHLEN + 1];
-	struct timeval fce_h_tv;
+/* One path element in the coalescing trie */
+struct fce_trie_node {
+    uint32_t ftn_parent;        /* index of the parent node, the root is 0 */
+    uint32_t ftn_name;          /* offset of the name in the name pool */
+    uint16_t ftn_namelen;
+    uint8_t  ftn_flags;         /* FCE_TRIE_xxx marks */
+    time_t   ftn_since;         /* time the path was reported first */
+};
+
+/* Paths reported in one time bucket */
+struct fce_trie {
+    time_t                ft_bucket;    /* start of the bucket */
+    uint32_t              ft_size;      /* allocated nodes, a power of 2 */
+    uint32_t              ft_used;      /* nodes in use including the root */
+    struct fce_trie_node *ft_nodes;
+    uint32_t             *ft_hash;      /* (parent, name) -> node, 0 is an empty slot */
+    char                 *ft_names;     /* name pool */
+    size_t                ft_namesused;
 };
 
 struct fce_close_event {
@@ -44,6 +64,7 @@ struct fce_close_event {
 #define PACKET_HDR_LEN (sizeof(struct fce_packet) - FCE_MAX_PATH_LEN)
 
 bool fce_handle_coalescation(int event, const char *path);
+bool fce_coalesce_deletes(void);
 void fce_initialize_history();
 
 
@@ -54,9 +54,18 @@
 // ONLY USED IN THIS FILE
 #include "fce_api_internal.h"
 
+#define FCE_TRIE_MIN_NODES 256         /* initial size, tries grow up to FCE_COALESCE_MAX_NODES */
+#define FCE_TRIE_HASHSIZE(t) (2 * (t)->ft_size)
+#define FCE_TRIE_NAMESIZE(t) (32 * (t)->ft_size)
+
+/* marks on trie nodes */
+#define FCE_TRIE_DIRCREATE (1 << 0)     /* directory created */
+#define FCE_TRIE_REPORTED  (1 << 1)     /* any event reported */
+
 /* We store our connection data here */
 static uint32_t coalesce = 0;
-static struct fce_history fce_history_list[FCE_HISTORY_LEN];
+static struct fce_trie fce_tries[2];    /* current and previous bucket */
+static int fce_cur;
 
 /****
 * With coalesce we try to reduce the events over UDP, the eventlistener would throw these 
@@ -64,18 +73,212 @@ static struct fce_history fce_history_list[FCE_HISTORY_LEN];
 * This works only, if the connected listener uses the events on a "per directory" base
 * It is a very simple aproach, but saves a lot of events sent to listeners.
 * Every "child element" event is ignored as long as its parent event is not older 
-* than MAX_COALESCE_TIME_MS ms. If large directory trees or large files are created or deleted, 
-* this probably will not work recursive, because the time to copy data will exceed this 
-* event timeout. 
+* than one to two FCE_COALESCE_BUCKET_S buckets.
+*
+* Reported paths are kept in two tries of path elements, one for the current and one for
+* the previous time bucket, so checking all parents of a path costs one hash lookup per
+* path element. When a child event is coalesced because of a parent from the previous
+* bucket the parent is copied to the current bucket, so large directory trees which are
+* created or deleted stay coalesced while the operation goes on, but at most for
+* FCE_COALESCE_MAX_AGE_S seconds. The tries start small and grow while a bucket fills up,
+* when a bucket is full the previous one is dropped early.
+*
+* Clients delete directory trees bottom-up, so deletes are held back by fce_register()
+* and folded into the delete of their parent directory, see hold_delete_event().
 * 
 ****/
 
-static long get_ms_difftime (  struct timeval *tv1, struct timeval *tv2 )
+static uint32_t trie_hash(uint32_t parent, const char *name, size_t len)
+{
+    uint32_t h = 2166136261U ^ parent;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Return the next path element before end and advance p, NULL at the end */
+static const char *trie_next_elem(const char **p, const char *end, size_t *len)
+{
+    const char *name = *p;
+    const char *sep;
+
+    while (name < end && *name == '/')
+        name++;
+    if (name >= end)
+        return NULL;
+    if ((sep = memchr(name, '/', end - name)) == NULL)
+        sep = end;
+    *len = sep - name;
+    *p = sep;
+    return name;
+}
+
+/*
+ * Find the child of parent with name, returns 0 if there is none. The hash slot
+ * of the child, or where it has to be added, is returned in slot.
+ */
+static uint32_t trie_child(struct fce_trie *t, uint32_t parent, const char *name, size_t len, uint32_t **slot)
+{
+    uint32_t i = trie_hash(parent, name, len) & (FCE_TRIE_HASHSIZE(t) - 1);
+    uint32_t n;
+
+    while ((n = t->ft_hash[i]) != 0) {
+        struct fce_trie_node *node = &t->ft_nodes[n];
+        if (node->ftn_parent == parent
+            && node->ftn_namelen == len
+            && memcmp(t->ft_names + node->ftn_name, name, len) == 0)
+            break;
+        i = (i + 1) & (FCE_TRIE_HASHSIZE(t) - 1);
+    }
+
+    if (slot)
+        *slot = &t->ft_hash[i];
+    return n;
+}
+
+/*
+ * Look for a node with one of flags on the path from the root to end. Returns the
+ * first one and the length of its path in len, or NULL.
+ */
+static struct fce_trie_node *trie_lookup(struct fce_trie *t, const char *path, const char *end,
+                                         uint8_t flags, size_t *len)
+{
+    const char *p = path;
+    const char *name;
+    size_t namelen;
+    uint32_t n = 0;
+
+    if (t->ft_used == 0)
+        return NULL;
+
+    while ((name = trie_next_elem(&p, end, &namelen))) {
+        if ((n = trie_child(t, n, name, namelen, NULL)) == 0)
+            return NULL;
+        if (t->ft_nodes[n].ftn_flags & flags) {
+            *len = p - path;
+            return &t->ft_nodes[n];
+        }
+    }
+
+    return NULL;
+}
+
+/* Double the size of t, returns -1 if it's at its maximum size or out of memory */
+static int trie_grow(struct fce_trie *t)
+{
+    struct fce_trie_node *nodes;
+    uint32_t *hash, *slot, size, n;
+    char *names;
+
+    if (t->ft_size >= FCE_COALESCE_MAX_NODES)
+        return -1;
+    size = t->ft_size ? 2 * t->ft_size : FCE_TRIE_MIN_NODES;
+
+    if ((nodes = realloc(t->ft_nodes, size * sizeof(struct fce_trie_node))) == NULL)
+        return -1;
+    t->ft_nodes = nodes;
+    if ((names = realloc(t->ft_names, 32 * size)) == NULL)
+        return -1;
+    t->ft_names = names;
+    if ((hash = calloc(2 * size, sizeof(uint32_t))) == NULL)
+        return -1;
+    free(t->ft_hash);
+    t->ft_hash = hash;
+    t->ft_size = size;
+
+    /* rehash, a parent always comes before its children */
+    for (n = 1; n < t->ft_used; n++) {
+        struct fce_trie_node *node = &t->ft_nodes[n];
+        (void)trie_child(t, node->ftn_parent, t->ft_names + node->ftn_name, node->ftn_namelen, &slot);
+        *slot = n;
+    }
+    return 0;
+}
+
+static void trie_free(struct fce_trie *t)
 {
-	unsigned long s = tv2->tv_sec - tv1->tv_sec;
-	long us = tv2->tv_usec - tv1->tv_usec;
+    free(t->ft_nodes);
+    free(t->ft_hash);
+    free(t->ft_names);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Add the path up to end to t and mark it with flags, returns -1 if the bucket is full */
+static int trie_mark(struct fce_trie *t, const char *path, const char *end, uint8_t flags, time_t since)
+{
+    const char *p = path;
+    const char *name;
+    size_t namelen;
+    uint32_t n = 0, child, *slot;
+    struct fce_trie_node *node;
+
+    if (t->ft_size == 0 && trie_grow(t) != 0)
+        return -1;
+    if (t->ft_used == 0)
+        t->ft_used = 1;         /* the root */
+
+    while ((name = trie_next_elem(&p, end, &namelen))) {
+        if ((child = trie_child(t, n, name, namelen, &slot)) == 0) {
+            while (t->ft_used == t->ft_size
+                   || t->ft_namesused + namelen > FCE_TRIE_NAMESIZE(t)) {
+                if (trie_grow(t) != 0)
+                    return -1;
+                (void)trie_child(t, n, name, namelen, &slot);
+            }
+            child = t->ft_used++;
+            node = &t->ft_nodes[child];
+            node->ftn_parent = n;
+            node->ftn_name = t->ft_namesused;
+            node->ftn_namelen = namelen;
+            node->ftn_flags = 0;
+            node->ftn_since = 0;
+            memcpy(t->ft_names + t->ft_namesused, name, namelen);
+            t->ft_namesused += namelen;
+            *slot = child;
+        }
+        n = child;
+    }
 
-	return s * 1000 + us/1000;
+    if (n == 0)
+        return 0;
+
+    node = &t->ft_nodes[n];
+    node->ftn_flags |= flags;
+    if (node->ftn_since == 0 || since < node->ftn_since)
+        node->ftn_since = since;
+    return 0;
+}
+
+static void trie_clear(struct fce_trie *t, time_t now)
+{
+    if (t->ft_used)
+        memset(t->ft_hash, 0, FCE_TRIE_HASHSIZE(t) * sizeof(uint32_t));
+    t->ft_used = 0;
+    t->ft_namesused = 0;
+    t->ft_bucket = now;
+}
+
+/* Start a new bucket, the previous one is dropped */
+static void fce_rotate_buckets(time_t now)
+{
+    bool stale = now - fce_tries[fce_cur].ft_bucket >= 2 * FCE_COALESCE_BUCKET_S;
+
+    fce_cur ^= 1;
+    trie_clear(&fce_tries[fce_cur], now);
+    if (stale)
+        trie_clear(&fce_tries[fce_cur ^ 1], now);
+}
+
+/* Remember a path in the current bucket */
+static void fce_remember(const char *path, const char *end, uint8_t flags, time_t since, time_t now)
+{
+    if (trie_mark(&fce_tries[fce_cur], path, end, flags, since) != 0) {
+        fce_rotate_buckets(now);
+        (void)trie_mark(&fce_tries[fce_cur], path, end, flags, since);
+    }
 }
 
 /******************************************************************************
@@ -84,80 +287,77 @@ static long get_ms_difftime (  struct timeval *tv1, struct timeval *tv2 )
 
 void fce_initialize_history()
 {
-	for (int i = 0; i < FCE_HISTORY_LEN; i++) {
-		memset( &fce_history_list[i], 0, sizeof(fce_history_list[i]) );
-	}
+    if (coalesce == 0)
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        if (trie_grow(&fce_tries[i]) != 0) {
+            LOG(log_error, logtype_fce, "fce_initialize_history: out of memory, not coalescing events");
+            trie_free(&fce_tries[0]);
+            trie_free(&fce_tries[1]);
+            coalesce = 0;
+            return;
+        }
+        trie_clear(&fce_tries[i], 0);
+    }
 }
 
 bool fce_handle_coalescation(int event, const char *path)
 {
-	/* These two are used to eval our next index in history */
-	/* the history is unsorted, speed should not be a problem, length is 10 */
-	unsigned long oldest_entry = (unsigned long )((long)-1);
-	int oldest_entry_idx = -1;
-	struct timeval tv;
+    struct fce_trie_node *node;
+    const char *parent;
+    uint8_t flags = 0;
+    size_t len;
+    time_t now;
 
-	if (coalesce == 0)
-		return false;
+    if (coalesce == 0)
+        return false;
 
-	/* After a file creation *ALWAYS* a file modification is produced */
-	if ((event == FCE_FILE_CREATE) && (coalesce & FCE_COALESCE_CREATE))
+    /* After a file creation *ALWAYS* a file modification is produced */
+    if ((event == FCE_FILE_CREATE) && (coalesce & FCE_COALESCE_CREATE))
         return true;
 
-	/* get timestamp */
-	gettimeofday(&tv, 0);
-
-	/* Now detect events in the very near history */
-	for (int i = 0; i < FCE_HISTORY_LEN; i++) {
-		struct fce_history *fh = &fce_history_list[i];
-
-		/* Not inited ? */
-		if (fh->fce_h_tv.tv_sec == 0) {
-			/* we can use it for new elements */
-			oldest_entry = 0;
-			oldest_entry_idx = i;
-			continue;
-		}
-
-		/* Too old ? */
-		if (get_ms_difftime(&fh->fce_h_tv, &tv ) > MAX_COALESCE_TIME_MS) {
-			/* Invalidate entry */
-			fh->fce_h_tv.tv_sec = 0;
-			oldest_entry = 0;
-			oldest_entry_idx = i;			
-			continue;
-		}
-
-
-		/* If we find a parent dir wich was created we are done */
-		if ((coalesce & FCE_COALESCE_CREATE) && (fh->fce_h_event == FCE_DIR_CREATE)) {
-			/* Parent dir ? */
-			if (!strncmp(fh->fce_h_path, path, strlen(fh->fce_h_path)))
-				return true;
-		}
-
-		/* If we find a parent dir we should be DELETED we are done */
-		if ((coalesce & FCE_COALESCE_DELETE)
-            && (event == FCE_FILE_DELETE || event == FCE_DIR_DELETE)) {
-			/* Parent dir ? */
-			if (!strncmp(fh->fce_h_path, path, strlen(fh->fce_h_path)))
-				return true;
-		}
-
-		/* Detect oldest entry for next new entry */
-		if (oldest_entry_idx == -1 || fh->fce_h_tv.tv_sec < oldest_entry) {
-			oldest_entry = fh->fce_h_tv.tv_sec;
-			oldest_entry_idx = i;
-		}
-	}
-
-	/* We have a new entry for the history, register it */
-	fce_history_list[oldest_entry_idx].fce_h_tv = tv;
-	fce_history_list[oldest_entry_idx].fce_h_event = event;
-    strncpy(fce_history_list[oldest_entry_idx].fce_h_path, path, MAXPATHLEN);
-
-	/* we have to handle this event */
-	return false;
+    now = time(NULL);
+    if (now - fce_tries[fce_cur].ft_bucket >= FCE_COALESCE_BUCKET_S)
+        fce_rotate_buckets(now);
+
+    /* If we find a parent dir wich was created we are done */
+    if (coalesce & FCE_COALESCE_CREATE)
+        flags |= FCE_TRIE_DIRCREATE;
+
+    /* If we find a parent dir we should be DELETED we are done */
+    if ((coalesce & FCE_COALESCE_DELETE)
+        && (event == FCE_FILE_DELETE || event == FCE_DIR_DELETE))
+        flags |= FCE_TRIE_REPORTED;
+
+    if (flags && (parent = strrchr(path, '/')) != NULL) {
+        if (trie_lookup(&fce_tries[fce_cur], path, parent, flags, &len))
+            return true;
+        if ((node = trie_lookup(&fce_tries[fce_cur ^ 1], path, parent, flags, &len))) {
+            /* still busy below this parent, keep it in the current bucket */
+            if (now - node->ftn_since < FCE_COALESCE_MAX_AGE_S)
+                fce_remember(path, path + len, node->ftn_flags, node->ftn_since, now);
+            return true;
+        }
+    }
+
+    /* We have a new entry for the history, register it */
+    flags = 0;
+    if (event == FCE_DIR_CREATE)
+        flags |= FCE_TRIE_DIRCREATE;
+    if (coalesce & FCE_COALESCE_DELETE)
+        flags |= FCE_TRIE_REPORTED;
+    if (flags)
+        fce_remember(path, path + strlen(path), flags, now, now);
+
+    /* we have to handle this event */
+    return false;
+}
+
+/* Whether deletes are folded into the delete of their parent directory */
+bool fce_coalesce_deletes(void)
+{
+    return (coalesce & FCE_COALESCE_DELETE) != 0;
 }
 
 /*
@@ -36,6 +36,8 @@
 #include "file.h"
 #include "filedir.h"
 #include "unix.h"
+#include "catidx.h"
+#include "tmused.h"
 
 /* the format for the finderinfo fields (from IM: Toolbox Essentials):
  * field         bytes        subfield    bytes
@@ -639,7 +641,7 @@ int getfilparams(const AFPObj *obj, struct vol *vol, uint16_t bitmap, struct pat
         adp = of_ad(vol, path, &ad);
         upath = path->u_name;
 
-        if ( ad_metadata( upath, flags, adp) < 0 ) {
+        if ( ad_metadata_st( upath, flags, &path->st, adp) < 0 ) {
             switch (errno) {
             case EACCES:
                 LOG(log_error, logtype_afpd, "getfilparams(%s): %s: check resource fork permission?",
@@ -674,6 +676,7 @@ int afp_createfile(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_,
     int			creatf, did, openf, retvalue = AFP_OK;
     uint16_t		vid;
     struct path		*s_path;
+    struct timespec	tm_mtime;
     
     *rbuflen = 0;
     ibuf++;
@@ -717,6 +720,7 @@ int afp_createfile(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_,
     	   because open syscall is not called */
         openf = ADFLAGS_RDWR | ADFLAGS_CREATE | ADFLAGS_EXCL;
 
+    tmused_prepare(vol, dir, &tm_mtime);
     if (ad_open(&ad, upath, ADFLAGS_DF | ADFLAGS_HF | ADFLAGS_NOHF | openf, 0666) < 0) {
         switch ( errno ) {
         case EROFS:
@@ -765,6 +769,10 @@ int afp_createfile(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_,
 createfile_iderr:
     ad_flush(&ad);
     ad_close(&ad, ADFLAGS_DF|ADFLAGS_HF );
+    catidx_update(vol, id, dir->d_did, upath);
+    /* a hard create of an existing file only truncates it, cname() stat'ed it */
+    if (s_path->st_valid && s_path->st_errno == ENOENT)
+        tmused_update(vol, dir, 1, &tm_mtime);
     fce_register(obj, FCE_FILE_CREATE, fullpathname(upath), NULL);
 
     curdir->d_offcnt++;
@@ -1091,6 +1099,9 @@ setfilparam_done:
         ad_close(adp, ADFLAGS_HF);
     }
 
+    if (err == AFP_OK)
+        catidx_update(vol, path->id, curdir->d_did, upath);
+
     if (change_parent_mdate && gettimeofday(&tv, NULL) == 0) {
         newdate = AD_DATE_FROM_UNIX(tv.tv_sec);
         bitmap = 1<<FILPBIT_MDATE;
@@ -1379,6 +1390,7 @@ int afp_copyfile(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, si
         goto copy_exit;
     }
     curdir->d_offcnt++;
+    catidx_update(d_vol, 0, curdir->d_did, upath);
 
     setvoltime(obj, d_vol );
 
@@ -2284,6 +2296,9 @@ int afp_exchangefiles(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U
 
     unbecome_root();
 
+    catidx_update(vol, 0, sdir->d_did, p);
+    catidx_update(vol, 0, curdir->d_did, upath);
+
     err = AFP_OK;
     goto err_exchangefile;
 
@@ -36,6 +36,8 @@
 #include "file.h"
 #include "filedir.h"
 #include "unix.h"
+#include "catidx.h"
+#include "tmused.h"
 
 int afp_getfildirparams(AFPObj *obj _U_, char *ibuf, size_t ibuflen _U_, char *rbuf, size_t *rbuflen)
 {
@@ -390,6 +392,7 @@ static int moveandrename(const AFPObj *obj,
         AFP_CNID_START("cnid_update");
         cnid_update(vol->v_cdb, id, st, curdir->d_did, upath, strlen(upath));
         AFP_CNID_DONE();
+        catidx_update(vol, id, curdir->d_did, upath);
 
         /* Send FCE event */
         if (isdir) {
@@ -651,8 +654,11 @@ int afp_delete(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf _U_, size
         if (s_path->st_valid && s_path->st_errno == ENOENT) {
             rc = AFPERR_NOOBJ;
         } else {
+            struct timespec tm_mtime;
+            tmused_prepare(vol, curdir, &tm_mtime);
             if ((rc = deletefile(vol, -1, upath, 1)) == AFP_OK) {
 				fce_register(obj, FCE_FILE_DELETE, fullpathname(upath), NULL);
+                tmused_update(vol, curdir, -1, &tm_mtime);
                 if (vol->v_tm_used < s_path->st.st_size)
                     vol->v_tm_used = 0;
                 else 
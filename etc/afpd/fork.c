@@ -15,6 +15,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <inttypes.h>
+#include <fcntl.h>
 
 #include <atalk/dsi.h>
 #include <atalk/afp.h>
@@ -27,6 +28,7 @@
 #include <atalk/globals.h>
 #include <atalk/netatalk_conf.h>
 #include <atalk/ea.h>
+#include <atalk/uring.h>
 
 #include "fork.h"
 #include "file.h"
@@ -775,6 +777,83 @@ static int read_file(const struct ofork *ofork, int eid, off_t offset, char *rbu
     return AFP_OK;
 }
 
+/* FPRead read-ahead statistics */
+static struct readahead_stat {
+    unsigned long long reads;       /* FPRead requests */
+    unsigned long long sequential;  /* requests that continued the previous one */
+    unsigned long long prefetches;  /* number of prefetch requests issued */
+    unsigned long long bytes;       /* number of bytes prefetched */
+} readahead_stat;
+
+/*!
+ * Sequential read detection and read-ahead for FPRead
+ *
+ * If a read continues where the previous read on the fork ended, tell the
+ * kernel to start reading the next "read ahead" requests worth of data into
+ * the page cache, so the disk keeps streaming while the current request is
+ * sent to the client. Prefetching is done in chunks of half the window in
+ * order to not issue a syscall for every request.
+ */
+static void read_ahead(const AFPObj *obj, struct ofork *ofork, off_t offset, off_t reqcount, off_t size)
+{
+#ifdef HAVE_POSIX_FADVISE
+    off_t next, start, window;
+    int fd, ret;
+
+    readahead_stat.reads++;
+
+    if (obj->options.readahead <= 0 || !(ofork->of_flags & AFPFORK_DATA))
+        return;
+    if ((fd = ad_data_fileno(ofork->of_ad)) < 0)
+        return;
+
+    next = offset + reqcount;
+
+    if (offset != ofork->of_ra_next) {
+        /* random access, restart detection */
+        ofork->of_ra_next = next;
+        ofork->of_ra_end = 0;
+        return;
+    }
+    ofork->of_ra_next = next;
+    readahead_stat.sequential++;
+
+    window = reqcount * obj->options.readahead;
+    start = MAX(next, ofork->of_ra_end);
+    if (start >= size || start - next >= window / 2)
+        /* enough data already prefetched */
+        return;
+    window = MIN(next + window, size) - start;
+
+    /* posix_fadvise() returns the error instead of setting errno */
+    if ((ret = posix_fadvise(fd, start, window, POSIX_FADV_WILLNEED)) != 0) {
+        LOG(log_debug, logtype_afpd, "read_ahead(%s): posix_fadvise: %s",
+            of_name(ofork), strerror(ret));
+        return;
+    }
+
+    LOG(log_maxdebug, logtype_afpd, "read_ahead(%s): off: %jd, len: %jd",
+        of_name(ofork), (intmax_t)start, (intmax_t)window);
+
+    ofork->of_ra_end = start + window;
+    readahead_stat.prefetches++;
+    readahead_stat.bytes += window;
+#endif
+}
+
+/*!
+ * Log FPRead read-ahead statistics
+ */
+void log_readahead_stat(void)
+{
+    LOG(log_info, logtype_afpd, "read-ahead statistics: "
+        "reads: %llu, sequential: %llu, prefetches: %llu, prefetched: %.2f KB",
+        readahead_stat.reads,
+        readahead_stat.sequential,
+        readahead_stat.prefetches,
+        readahead_stat.bytes / 1024.0);
+}
+
 static int read_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, size_t *rbuflen, int is64)
 {
     DSI          *dsi = obj->dsi;
@@ -847,6 +926,8 @@ static int read_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, si
         goto afp_read_err;
     }
 
+    read_ahead(obj, ofork, offset, reqcount, size);
+
     if (obj->options.flags & OPTION_AFP_READ_LOCK) {
         if (ad_tmplock(ofork->of_ad, eid, ADLOCK_RD, offset, reqcount, ofork->of_refnum) < 0) {
             err = AFPERR_LOCK;
@@ -856,9 +937,16 @@ static int read_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, si
 
 #ifdef WITH_SENDFILE
     if (!(eid == ADEID_DFORK && ad_data_fileno(ofork->of_ad) == AD_SYMLINK) &&
-        !(obj->options.flags & OPTION_NOSENDFILE)) {
+        (!(obj->options.flags & OPTION_NOSENDFILE) || uring_enabled())) {
         int fd = ad_readfile_init(ofork->of_ad, eid, &offset, 0);
-        if (dsi_stream_read_file(dsi, fd, offset, reqcount, err) < 0) {
+        ssize_t ret;
+#ifdef WITH_IO_URING
+        if (uring_enabled())
+            ret = dsi_uring_read_file(dsi, fd, offset, reqcount, err);
+        else
+#endif
+            ret = dsi_stream_read_file(dsi, fd, offset, reqcount, err);
+        if (ret < 0) {
             LOG(log_error, logtype_afpd, "afp_read(%s): ad_readfile: %s",
                 of_name(ofork), strerror(errno));
             goto afp_read_exit;
@@ -1126,7 +1214,9 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
     ssize_t         cc;
     DSI             *dsi = obj->dsi;
     char            *rcvbuf = (char *)dsi->commands;
+    char            *headbuf;
     size_t          rcvbuflen = dsi->server_quantum;
+    int             zerocopy = 0;
 
     /* figure out parameters */
     ibuf++;
@@ -1201,10 +1291,23 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
         }
     }
 
-    /* find out what we have already */
-    if ((cc = dsi_writeinit(dsi, rcvbuf, rcvbuflen)) > 0) {
+    /*
+     * find out what we have already. If the rest is going to be received
+     * with a zero-copy method, write the buffered head straight from the
+     * DSI readahead buffer instead of copying it to rcvbuf first.
+     */
+#ifdef WITH_RECVFILE
+    zerocopy = uring_enabled() || (obj->options.flags & OPTION_RECVFILE);
+#endif
+    if (zerocopy) {
+        cc = dsi_writeinit_buf(dsi, &headbuf);
+    } else {
+        cc = dsi_writeinit(dsi, rcvbuf, rcvbuflen);
+        headbuf = rcvbuf;
+    }
+    if (cc > 0) {
         ssize_t written;
-        if ((written = write_file(ofork, eid, offset, rcvbuf, cc)) != cc) {
+        if ((written = write_file(ofork, eid, offset, headbuf, cc)) != cc) {
             dsi_writeflush(dsi);
             *rbuflen = 0;
             if (obj->options.flags & OPTION_AFP_READ_LOCK)
@@ -1219,24 +1322,40 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
     offset += cc;
 
 #ifdef WITH_RECVFILE
-    if (obj->options.flags & OPTION_RECVFILE) {
+    if (zerocopy) {
+        size_t len = dsi->datasize;
+
         LOG(log_maxdebug, logtype_afpd, "afp_write(fork: %" PRIu16 " [%s], off: %" PRIu64 ", size: %" PRIu32 ")",
             ofork->of_refnum, (ofork->of_flags & AFPFORK_DATA) ? "data" : "reso", offset, dsi->datasize);
 
-        if ((cc = ad_recvfile(ofork->of_ad, eid, dsi->socket, offset, dsi->datasize, obj->options.splice_size)) < dsi->datasize) {
-            switch (errno) {
-            case EDQUOT:
-            case EFBIG:
-            case ENOSPC:
-                cc = AFPERR_DFULL;
-                dsi_writeflush(dsi);
-                break;
-            case ENOSYS:
-                goto afp_write_loop;
-            default:
-                /* Low level error, can't do much to back up */
+#ifdef WITH_IO_URING
+        if (uring_enabled())
+            cc = ad_recvfile_uring(ofork->of_ad, eid, dsi->socket, offset, len);
+        else
+#endif
+            cc = ad_recvfile(ofork->of_ad, eid, dsi->socket, offset, len, obj->options.splice_size);
+
+        if (cc >= 0)
+            /* all data has been read from the socket, even if writing the file failed */
+            dsi->datasize = 0;
+
+        if (cc < (ssize_t)len) {
+            if (cc < 0) {
+                /* socket error, the session is going down */
                 cc = AFPERR_MISC;
-                LOG(log_error, logtype_afpd, "afp_write: ad_writefile: %s", strerror(errno));
+                LOG(log_error, logtype_afpd, "afp_write: ad_recvfile: %s", strerror(errno));
+            } else {
+                switch (errno) {
+                case EDQUOT:
+                case EFBIG:
+                case ENOSPC:
+                    cc = AFPERR_DFULL;
+                    break;
+                default:
+                    /* Low level error, can't do much to back up */
+                    cc = AFPERR_MISC;
+                    LOG(log_error, logtype_afpd, "afp_write: ad_recvfile: %s", strerror(errno));
+                }
             }
             *rbuflen = 0;
             if (obj->options.flags & OPTION_AFP_READ_LOCK)
@@ -1249,7 +1368,6 @@ static int write_fork(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, s
     }
 #endif
 
-afp_write_loop:
     /* loop until everything gets written. currently
      * dsi_write handles the end case by itself. */
     while ((cc = dsi_write(dsi, rcvbuf, rcvbuflen))) {
@@ -25,6 +25,8 @@ struct ofork {
     cnid_t              of_did;
     uint16_t            of_refnum;
     int                 of_flags;
+    off_t               of_ra_next;     /* read-ahead: expected offset of next sequential read */
+    off_t               of_ra_end;      /* read-ahead: end of the prefetched range */
     struct ofork        **prevp, *next;
 };
 
@@ -80,6 +82,7 @@ extern int of_fstatat(int dirfd, struct path *path);
 
 /* in fork.c */
 extern int          flushfork    (struct ofork *);
+extern void         log_readahead_stat(void);
 
 /* FP functions */
 int afp_openfork (AFPObj *obj, char *ibuf, size_t ibuflen, char *rbuf,  size_t *rbuflen);
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <sys/time.h>
@@ -27,6 +28,7 @@
 #include <atalk/afp.h>
 #include <atalk/paths.h>
 #include <atalk/util.h>
+#include <atalk/cnid.h>
 #include <atalk/server_child.h>
 #include <atalk/server_ipc.h>
 #include <atalk/errchk.h>
@@ -38,6 +40,7 @@
 #include "fork.h"
 #include "uam_auth.h"
 #include "afpstats.h"
+#include "prefork.h"
 
 #define ASEV_THRESHHOLD 10
 
@@ -47,6 +50,7 @@ static AFPObj obj;
 static server_child_t *server_children;
 static sig_atomic_t reloadconfig = 0;
 static sig_atomic_t gotsigchld = 0;
+static sig_atomic_t dumpstats = 0;
 static struct asev *asev;
 
 static afp_child_t *dsi_start(AFPObj *obj, DSI *dsi, server_child_t *server_children);
@@ -69,7 +73,8 @@ static bool init_listening_sockets(const AFPObj *config)
         numlisteners++;
     }
 
-    asev = asev_init(config->options.connections + numlisteners + ASEV_THRESHHOLD);
+    asev = asev_init(config->options.connections + config->options.prefork
+                     + numlisteners + ASEV_THRESHHOLD);
     if (asev == NULL) {
         return false;
     }
@@ -127,12 +132,34 @@ static void afp_goaway(int sig)
         gotsigchld = 1;
         break;
 
+    case SIGUSR2:
+        dumpstats = 1;
+        break;
+
     default :
         LOG(log_error, logtype_afpd, "afp_goaway: bad signal" );
     }
     return;
 }
 
+/* Read the IPC messages a child sent before it exited */
+static void drain_ipc(pid_t pid)
+{
+    afp_child_t *child;
+    struct pollfd pfd;
+
+    if ((child = server_child_resolve(server_children, pid)) == NULL || child->afpch_ipc_fd == -1)
+        return;
+
+    pfd.fd = child->afpch_ipc_fd;
+    pfd.events = POLLIN;
+
+    while (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN)) {
+        if (ipc_server_read(server_children, child->afpch_ipc_fd) != 0)
+            break;
+    }
+}
+
 static void child_handler(void)
 {
     int fd;
@@ -156,6 +183,9 @@ static void child_handler(void)
                 LOG(log_info, logtype_afpd, "child[%d]: died", pid);
         }
 
+        prefork_remove(pid);
+        ad_shmlock_reap(pid);
+        drain_ipc(pid);
         fd = server_child_remove(server_children, pid);
         if (fd == -1) {
             continue;
@@ -166,6 +196,45 @@ static void child_handler(void)
     }
 }
 
+/* Write the AFP command statistics of all sessions to a text file */
+static void dump_stats(void)
+{
+    const char *path = _PATH_STATEDIR "afpd.stats";
+    char tmp[MAXPATHLEN + 1], line[512];
+    const struct cmdstat *cs;
+    FILE *fp;
+    int fd, i;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) == -1) {
+        LOG(log_error, logtype_afpd, "dump_stats: %s: %s", tmp, strerror(errno));
+        return;
+    }
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        LOG(log_error, logtype_afpd, "dump_stats: fdopen: %s", strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    pthread_mutex_lock(&server_children->servch_lock);
+    for (i = 0; i < 256; i++) {
+        if ((cs = server_children->servch_stats.cs_cmd[i]) == NULL || cs->cs_calls == 0)
+            continue;
+        cmdstats_format(cs, AfpNum2name(i), line, sizeof(line));
+        fprintf(fp, "%s\n", line);
+    }
+    pthread_mutex_unlock(&server_children->servch_lock);
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        LOG(log_error, logtype_afpd, "dump_stats: %s: %s", path, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+
+    LOG(log_note, logtype_afpd, "AFP command statistics written to %s", path);
+}
+
 static int setlimits(void)
 {
     struct rlimit rlim;
@@ -207,6 +276,16 @@ int main(int ac, char **av)
     /* Save the user's current umask */
     obj.options.save_mask = umask(obj.options.umask);
 
+    /* Shared dircache, must be setup before forking session processes */
+    if (obj.options.shdircachesize > 0 && cnid_shm_init(obj.options.shdircachesize) != 0)
+        LOG(log_error, logtype_afpd, "main: can't setup shared dircache");
+
+    /* Shared byte range lock table, likewise */
+    if (obj.options.shlocktablesize > 0
+        && ad_shmlock_init(obj.options.shlocktablesize,
+                           !(obj.options.flags & OPTION_NOLOCKINTEROP)) != 0)
+        LOG(log_error, logtype_afpd, "main: can't setup shared lock table");
+
     /* install child handler for asp and dsi. we do this before afp_goaway
      * as afp_goaway references stuff from here. 
      * XXX: this should really be setup after the initial connections. */
@@ -262,6 +341,10 @@ int main(int ac, char **av)
         LOG(log_error, logtype_afpd, "main: sigaction: %s", strerror(errno) );
         afp_exit(EXITERR_SYS);
     }
+    if ( sigaction( SIGUSR2, &sv, NULL ) < 0 ) {
+        LOG(log_error, logtype_afpd, "main: sigaction: %s", strerror(errno) );
+        afp_exit(EXITERR_SYS);
+    }
 
     sigemptyset( &sv.sa_mask );
     sigaddset(&sv.sa_mask, SIGALRM);
@@ -311,6 +394,7 @@ int main(int ac, char **av)
     sigaddset(&sigs, SIGALRM);
     sigaddset(&sigs, SIGHUP);
     sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
 #if 0
     /* don't block SIGTERM */
     sigaddset(&sigs, SIGTERM);
@@ -343,6 +427,7 @@ int main(int ac, char **av)
 
     afp_child_t *child;
     int saveerrno;
+    int timeout;
 
     /* wait for an appleshare connection. parent remains in the loop
      * while the children get handled by afp_over_{asp,dsi}.  this is
@@ -351,8 +436,22 @@ int main(int ac, char **av)
      * afterwards. establishing timeouts for logins is a possible 
      * solution. */
     while (1) {
+        /* refill the pool of pre-forked session workers */
+        for (int n = nologin ? 0 : prefork_needed(&obj); n > 0; n--) {
+            if ((child = prefork_spawn(&obj, server_children)) == NULL)
+                break;
+            if (!(asev_add_fd(asev, child->afpch_ipc_fd, IPC_FD, child))) {
+                LOG(log_error, logtype_afpd, "out of asev slots");
+                close(child->afpch_ipc_fd);
+                child->afpch_ipc_fd = -1;
+                kill(child->afpch_pid, SIGKILL);
+                break;
+            }
+        }
+        timeout = nologin ? -1 : prefork_timeout(&obj);
+
         pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
-        ret = poll(asev->fdset, asev->used, -1);
+        ret = poll(asev->fdset, asev->used, timeout);
         pthread_sigmask(SIG_BLOCK, &sigs, NULL);
         saveerrno = errno;
 
@@ -393,12 +492,19 @@ int main(int ac, char **av)
             errno = saveerrno;
 
             if (server_children) {
+                prefork_flush();
                 server_child_kill(server_children, SIGHUP);
             }
 
             continue;
         }
 
+        if (dumpstats) {
+            dumpstats = 0;
+            dump_stats();
+            continue;
+        }
+
         if (ret == 0)
             continue;
         
@@ -414,6 +520,9 @@ int main(int ac, char **av)
                 switch (asev->data[i].fdtype) {
 
                 case LISTEN_FD:
+                    if (!nologin
+                        && prefork_handoff(&obj, (DSI *)(asev->data[i].private), server_children) == 0)
+                        break;
                     if ((child = dsi_start(&obj, (DSI *)(asev->data[i].private), server_children))) {
                         if (!(asev_add_fd(asev, child->afpch_ipc_fd, IPC_FD, child))) {
                             LOG(log_error, logtype_afpd, "out of asev slots");
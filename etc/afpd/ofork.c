@@ -29,6 +29,7 @@
 #include "directory.h"
 #include "fork.h"
 #include "desktop.h"
+#include "catidx.h"
 
 /* we need to have a hashed list of oforks (by dev inode) */
 #define OFORK_HASHSIZE  64
@@ -207,6 +208,8 @@ of_alloc(struct vol *vol,
     of->of_ad = ad;
     of->of_vol = vol;
     of->of_did = dir->d_did;
+    of->of_ra_next = 0;
+    of->of_ra_end = 0;
 
     *ofrefnum = refnum;
     of->of_refnum = refnum;
@@ -472,6 +475,13 @@ int of_closefork(const AFPObj *obj, struct ofork *ofork)
         ret = -1;
     }
 
+    if ((ofork->of_flags & AFPFORK_MODIFIED) && dir && ofork->of_vol->v_catidx) {
+        bstring upath = bformat("%s/%s", bdata(dir->d_fullpath),
+                                mtoupath(ofork->of_vol, of_name(ofork), ofork->of_did, utf8_encoding(obj)));
+        catidx_update(ofork->of_vol, 0, ofork->of_did, bdata(upath));
+        bdestroy(upath);
+    }
+
     of_dealloc(ofork);
 
     if (forkpath)
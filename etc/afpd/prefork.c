@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ *
+ * Pre-forked session workers
+ * ==========================
+ *
+ * Normally the afpd master forks a session process for every connection and
+ * the client waits until the child has set itself up. With "prefork sessions"
+ * the master keeps a pool of idle session workers that are forked and
+ * initialized in advance. They wait on their IPC socket, when a connection
+ * arrives the master accepts it and passes the socket and a struct
+ * prefork_msg to an idle worker which then continues like a forked session
+ * process. The master refills the pool from its main loop, at most
+ * "prefork refill" workers per pass so that accepting connections isn't
+ * held up during a login storm. If the pool is empty the master forks per
+ * connection as usual.
+ *
+ * Forking backs off after a failure: the master stops forking for
+ * SPAWN_BACKOFF_MIN ms, doubling up to SPAWN_BACKOFF_MAX ms while failures
+ * continue. A worker that exits while it is still idle, e.g. because
+ * afp_over_dsi_init failed, counts as a failure. The delay is reset when a
+ * connection has been passed to a worker. Independent of failures at most
+ * SPAWN_RATE workers are forked per second.
+ *
+ * Idle workers have the default signal handlers, they terminate on SIGHUP,
+ * SIGUSR1 and SIGTERM. The master forgets about idle workers before it
+ * signals its children on a configuration reload so that no connection is
+ * passed to a dying worker.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/dsi.h>
+#include <atalk/globals.h>
+#include <atalk/server_child.h>
+
+#include "afp_config.h"
+#include "prefork.h"
+
+/* sent by the master before the socket of the connection */
+struct prefork_msg {
+    int pm_listener;            /* index of the DSI listener in obj->dsi */
+    int pm_cnx_cnt;             /* sessions without the new one */
+    int pm_cnx_max;
+};
+
+#define SPAWN_BACKOFF_MIN 100     /* ms without forking after a failure */
+#define SPAWN_BACKOFF_MAX 30000
+#define SPAWN_RATE        32        /* workers forked per second at most */
+
+static pid_t *idle;             /* idle workers, last forked last */
+static int    nidle;
+static int    idlesize;
+static int    spawn_backoff;    /* current delay in ms, 0 if the last spawn worked */
+static long long spawn_next;    /* don't fork before this time in ms */
+static long long spawn_second;  /* start of the second spawn_count is for */
+static int    spawn_count;      /* workers forked in that second */
+
+/* Monotonic time in ms */
+static long long spawn_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Forking or starting a worker failed, delay further forks */
+static void spawn_failure(void)
+{
+    long long now = spawn_now();
+
+    /* workers of the same pass fail together, count them once */
+    if (now < spawn_next)
+        return;
+    if (spawn_backoff == 0)
+        spawn_backoff = SPAWN_BACKOFF_MIN;
+    else if ((spawn_backoff *= 2) > SPAWN_BACKOFF_MAX)
+        spawn_backoff = SPAWN_BACKOFF_MAX;
+    spawn_next = now + spawn_backoff;
+    LOG(log_warning, logtype_afpd, "prefork: not forking session workers for %d ms", spawn_backoff);
+}
+
+/*!
+ * Wait for a connection and run its session, never returns
+ */
+static void prefork_worker(AFPObj *obj, server_child_t *children, int ipc_fd)
+{
+    struct prefork_msg msg;
+    struct sigaction sv;
+    DSI *dsi;
+    size_t stored = 0;
+    ssize_t len;
+    int sock, i;
+
+    server_reset_signal();
+    memset(&sv, 0, sizeof(sv));
+    sv.sa_handler = SIG_DFL;
+    sigemptyset(&sv.sa_mask);
+    sigaction(SIGQUIT, &sv, NULL);
+
+    for (dsi = obj->dsi; dsi; dsi = dsi->next) {
+        close(dsi->serversock);
+        dsi->serversock = -1;
+    }
+    server_child_free(children);
+    free(idle);
+    idle = NULL;
+    obj->ipc_fd = ipc_fd;
+
+    if (afp_over_dsi_init(obj) != 0)
+        exit(EXITERR_SYS);
+
+    while (stored < sizeof(msg)) {
+        len = read(ipc_fd, (char *)&msg + stored, sizeof(msg) - stored);
+        if (len == 0)
+            exit(0);            /* master is gone */
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(log_error, logtype_afpd, "prefork_worker: read: %s", strerror(errno));
+            exit(EXITERR_SYS);
+        }
+        stored += len;
+    }
+
+    if ((sock = recv_fd(ipc_fd, 0)) < 0) {
+        LOG(log_error, logtype_afpd, "prefork_worker: recv_fd: %s", strerror(errno));
+        exit(EXITERR_SYS);
+    }
+    setnonblock(ipc_fd, 1);
+
+    for (i = 0, dsi = obj->dsi; dsi && i < msg.pm_listener; i++)
+        dsi = dsi->next;
+    if (dsi == NULL) {
+        LOG(log_error, logtype_afpd, "prefork_worker: no listener %d", msg.pm_listener);
+        exit(EXITERR_SYS);
+    }
+
+    obj->cnx_cnt = msg.pm_cnx_cnt;
+    obj->cnx_max = msg.pm_cnx_max;
+
+    if (dsi_worksession(dsi, sock, obj->options.tickleval) != 0)
+        exit(EXITERR_CLNT);
+
+    configfree(obj, dsi);
+    afp_over_dsi(obj); /* start a session */
+    exit(0);
+}
+
+/*!
+ * Fork an idle session worker
+ *
+ * @returns the child in the master, NULL on error
+ */
+afp_child_t *prefork_spawn(AFPObj *obj, server_child_t *children)
+{
+    afp_child_t *child;
+    pid_t *tmp;
+    pid_t pid;
+    int ipc_fds[2];
+
+    if (nidle >= idlesize) {
+        if ((tmp = realloc(idle, (idlesize + 16) * sizeof(pid_t))) == NULL) {
+            LOG(log_error, logtype_afpd, "prefork_spawn: out of memory");
+            spawn_failure();
+            return NULL;
+        }
+        idle = tmp;
+        idlesize += 16;
+    }
+
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, ipc_fds) < 0) {
+        LOG(log_error, logtype_afpd, "prefork_spawn: %s", strerror(errno));
+        spawn_failure();
+        return NULL;
+    }
+
+    if (setnonblock(ipc_fds[0], 1) != 0) {
+        LOG(log_error, logtype_afpd, "prefork_spawn: setnonblock: %s", strerror(errno));
+        close(ipc_fds[0]);
+        close(ipc_fds[1]);
+        spawn_failure();
+        return NULL;
+    }
+
+    switch (pid = fork()) {
+    case -1:
+        LOG(log_error, logtype_afpd, "prefork_spawn: fork: %s", strerror(errno));
+        close(ipc_fds[0]);
+        close(ipc_fds[1]);
+        spawn_failure();
+        return NULL;
+
+    case 0:
+        close(ipc_fds[0]);
+        prefork_worker(obj, children, ipc_fds[1]);
+        exit(0);
+
+    default:
+        break;
+    }
+
+    close(ipc_fds[1]);
+    if ((child = server_child_add(children, pid, ipc_fds[0])) == NULL) {
+        LOG(log_error, logtype_afpd, "prefork_spawn: can't add child[%d]", pid);
+        close(ipc_fds[0]);
+        kill(pid, SIGKILL);
+        spawn_failure();
+        return NULL;
+    }
+
+    spawn_count++;
+    idle[nidle++] = pid;
+    LOG(log_debug, logtype_afpd, "prefork_spawn: worker[%d], idle: %d", pid, nidle);
+
+    return child;
+}
+
+/*!
+ * Accept a connection on dsi and pass it to an idle session worker
+ *
+ * @returns 0 if the connection was handled, -1 if there's no idle worker
+ */
+int prefork_handoff(AFPObj *obj, DSI *dsi, server_child_t *children)
+{
+    struct prefork_msg msg;
+    afp_child_t *child;
+    const DSI *p;
+    pid_t pid;
+    int index;
+
+    if (nidle == 0)
+        return -1;
+
+    if (dsi->proto_accept(dsi) < 0) {
+        LOG(log_error, logtype_afpd, "prefork_handoff: accept: %s", strerror(errno));
+        return 0;
+    }
+
+    for (index = 0, p = obj->dsi; p && p != dsi; p = p->next)
+        index++;
+
+    while (nidle > 0) {
+        pid = idle[--nidle];
+        if ((child = server_child_resolve(children, pid)) == NULL || child->afpch_ipc_fd == -1)
+            continue;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.pm_listener = index;
+        msg.pm_cnx_cnt = children->servch_count - nidle - 1;
+        msg.pm_cnx_max = children->servch_nsessions;
+
+        if (write(child->afpch_ipc_fd, &msg, sizeof(msg)) != sizeof(msg)
+            || send_fd(child->afpch_ipc_fd, dsi->socket) != 0) {
+            LOG(log_error, logtype_afpd, "prefork_handoff: worker[%d]: %s", pid, strerror(errno));
+            kill(pid, SIGTERM);
+            continue;
+        }
+
+        child->afpch_logintime = time(NULL);
+        spawn_backoff = 0;
+        LOG(log_debug, logtype_afpd, "prefork_handoff: connection passed to worker[%d], idle: %d",
+            pid, nidle);
+        dsi->proto_close(dsi);
+        return 0;
+    }
+
+    LOG(log_error, logtype_afpd, "prefork_handoff: no usable session worker");
+    dsi->proto_close(dsi);
+    return 0;
+}
+
+/*!
+ * Number of session workers to fork in this pass of the main loop
+ */
+int prefork_needed(const AFPObj *obj)
+{
+    long long now;
+    int n;
+
+    if (obj->options.prefork <= 0 || nidle >= obj->options.prefork)
+        return 0;
+
+    now = spawn_now();
+    if (now < spawn_next)
+        return 0;
+    if (now - spawn_second >= 1000) {
+        spawn_second = now;
+        spawn_count = 0;
+    }
+
+    n = obj->options.prefork - nidle;
+    if (n > obj->options.prefork_refill)
+        n = obj->options.prefork_refill > 0 ? obj->options.prefork_refill : 1;
+    if (n > SPAWN_RATE - spawn_count)
+        n = SPAWN_RATE - spawn_count;
+
+    return n > 0 ? n : 0;
+}
+
+/*!
+ * Poll timeout for the main loop
+ *
+ * @returns 0 if workers should be forked now, the ms until forking is allowed
+ *          again or -1 if the pool is full
+ */
+int prefork_timeout(const AFPObj *obj)
+{
+    long long now;
+
+    if (obj->options.prefork <= 0 || nidle >= obj->options.prefork)
+        return -1;
+    if (prefork_needed(obj) > 0)
+        return 0;
+
+    now = spawn_now();
+    if (now < spawn_next)
+        return spawn_next - now;
+    return now - spawn_second < 1000 ? spawn_second + 1000 - now : 0;
+}
+
+/* Forget a worker that exited, one that was still idle didn't start up */
+void prefork_remove(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < nidle; i++) {
+        if (idle[i] == pid) {
+            memmove(&idle[i], &idle[i + 1], (nidle - i - 1) * sizeof(pid_t));
+            nidle--;
+            LOG(log_error, logtype_afpd, "prefork: idle worker[%d] exited", pid);
+            spawn_failure();
+            return;
+        }
+    }
+}
+
+/* Forget all idle workers, the caller signals them to terminate */
+void prefork_flush(void)
+{
+    nidle = 0;
+}
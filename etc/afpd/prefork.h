@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ */
+
+#ifndef AFPD_PREFORK_H
+#define AFPD_PREFORK_H 1
+
+#include <sys/types.h>
+
+#include <atalk/globals.h>
+#include <atalk/dsi.h>
+#include <atalk/server_child.h>
+
+extern afp_child_t *prefork_spawn  (AFPObj *obj, server_child_t *children);
+extern int          prefork_handoff(AFPObj *obj, DSI *dsi, server_child_t *children);
+extern int          prefork_needed (const AFPObj *obj);
+extern int          prefork_timeout(const AFPObj *obj);
+extern void         prefork_remove (pid_t pid);
+extern void         prefork_flush  (void);
+
+#endif /* AFPD_PREFORK_H */
@@ -40,9 +40,12 @@
 #include <atalk/spotlight.h>
 
 #include "directory.h"
+
+#ifdef HAVE_TRACKER
 #include "etc/spotlight/sparql_parser.h"
 
 #include <glib.h>
+#endif
 
 #define MAX_SL_RESULTS 20
 
@@ -63,7 +66,9 @@ static struct slq_state_names slq_state_names[] = {
 };
 
 
+#ifdef HAVE_TRACKER
 static char *tracker_to_unix_path(TALLOC_CTX *mem_ctx, const char *uri);
+#endif
 static int cnid_comp_fn(const void *p1, const void *p2);
 static bool create_result_handle(slq_t *slq);
 static bool add_filemeta(sl_array_t *reqinfo,
@@ -268,6 +273,7 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
+#ifdef HAVE_TRACKER
 static char *tracker_to_unix_path(TALLOC_CTX *mem_ctx, const char *uri)
 {
     GFile *f;
@@ -291,6 +297,7 @@ static char *tracker_to_unix_path(TALLOC_CTX *mem_ctx, const char *uri)
 
     return talloc_path;
 }
+#endif
 
 /**
  * Add requested metadata for a query result element
@@ -528,9 +535,11 @@ static void slq_cancel(slq_t *slq)
  **/
 static int slq_free_cb(slq_t *slq)
 {
+#ifdef HAVE_TRACKER
     if (slq->tracker_cursor) {
         g_object_unref(slq->tracker_cursor);
     }
+#endif
     return 0;
 }
 
@@ -581,6 +590,8 @@ static void slq_dump(void)
  * Tracker async callbacks
  ************************************************/
 
+#ifdef HAVE_TRACKER
+
 static void tracker_con_cb(GObject      *object,
                            GAsyncResult *res,
                            gpointer      user_data)
@@ -753,6 +764,85 @@ static void tracker_query_cb(GObject      *object,
                                      tracker_cursor_cb,
                                      slq);
 }
+#endif /* HAVE_TRACKER */
+
+/************************************************
+ * Native backend
+ ************************************************/
+
+/**
+ * Fill the result queue of a query from the native index
+ *
+ * Counterpart of tracker_cursor_cb(), called synchronously when the query is
+ * opened and after its results have been fetched. Leaves the query FULL,
+ * DONE, or RESULTS if the scan budget of sl_native_next() was used up first.
+ **/
+static void sl_native_fill(slq_t *slq)
+{
+    char *path;
+    int result;
+    struct stat sb;
+    uint64_t uint64var;
+    bool ok;
+    cnid_t did, id;
+
+    while (slq->query_results->num_results < MAX_SL_RESULTS) {
+        result = sl_native_next(slq, slq->query_results, &path);
+        switch (result) {
+        case SL_NATIVE_MATCH:
+            break;
+        case SL_NATIVE_DONE:
+            LOG(log_debug, logtype_sl, "sl_native_fill: done");
+            slq->slq_state = SLQ_STATE_DONE;
+            return;
+        case SL_NATIVE_AGAIN:
+            slq->slq_state = SLQ_STATE_RESULTS;
+            return;
+        default:
+            slq->slq_state = SLQ_STATE_ERROR;
+            return;
+        }
+
+        if (access(path, R_OK) != 0 || stat(path, &sb) != 0) {
+            talloc_free(path);
+            continue;
+        }
+
+        id = cnid_for_path(slq->slq_vol->v_cdb, slq->slq_vol->v_path, path, &did);
+        if (id == CNID_INVALID) {
+            LOG(log_error, logtype_sl, "cnid_for_path error: %s", path);
+            talloc_free(path);
+            continue;
+        }
+        uint64var = ntohl(id);
+
+        if (slq->slq_cnids) {
+            ok = bsearch(&uint64var, slq->slq_cnids, slq->slq_cnids_num,
+                         sizeof(uint64_t), cnid_comp_fn);
+            if (!ok) {
+                talloc_free(path);
+                continue;
+            }
+        }
+
+        dalloc_add_copy(slq->query_results->cnids->ca_cnids,
+                        &uint64var, uint64_t);
+        ok = add_filemeta(slq->slq_reqinfo, slq->query_results->fm_array,
+                          path, &sb);
+        if (!ok) {
+            LOG(log_error, logtype_sl, "add_filemeta error");
+            slq->slq_state = SLQ_STATE_ERROR;
+            return;
+        }
+
+        slq->query_results->num_results++;
+    }
+
+    LOG(log_debug, logtype_sl,
+        "sl_native_fill: ctx1: %" PRIx64 ", ctx2: %" PRIx64 ": full",
+        slq->slq_ctx1, slq->slq_ctx2);
+    slq->slq_state = SLQ_STATE_FULL;
+}
 
 /*******************************************************************************
  * Spotlight RPC functions
@@ -823,22 +913,28 @@ static int sl_rpc_openQuery(AFPObj *obj,
     DALLOC_CTX *reqinfo;
     sl_array_t *array;
     sl_cnids_t *cnids;
-    slq_t *slq;
+    slq_t *slq = NULL;
     char slq_host[MAXPATHLEN + 1];
     uint16_t convflags = v->v_mtou_flags;
     uint64_t result;
+#ifdef HAVE_TRACKER
     gchar *sparql_query;
     GError *error = NULL;
+    char *escaped;
+#endif
     bool ok;
     sl_array_t *scope_array;
-    char *scope = NULL;
+    const char *scope;
 
     array = talloc_zero(reply, sl_array_t);
 
-    if (obj->sl_ctx->tracker_con == NULL) {
+#ifdef HAVE_TRACKER
+    if (obj->sl_ctx->sl_backend == SL_BACKEND_TRACKER
+        && obj->sl_ctx->tracker_con == NULL) {
         LOG(log_error, logtype_sl, "no tracker connection");
         EC_FAIL;
     }
+#endif
 
     /* Allocate and initialize query object */
     slq = talloc_zero(obj->sl_ctx, slq_t);
@@ -895,20 +991,25 @@ static int sl_rpc_openQuery(AFPObj *obj,
     scope_array = dalloc_value_for_key(query, "DALLOC_CTX", 0, "DALLOC_CTX", 1,
                                        "kMDScopeArray");
     if (scope_array == NULL) {
-        scope = g_uri_escape_string(v->v_path,
-                                    G_URI_RESERVED_CHARS_ALLOWED_IN_PATH, TRUE);
+        scope = v->v_path;
     } else {
-        scope = g_uri_escape_string(scope_array->dd_talloc_array[0],
-                                    G_URI_RESERVED_CHARS_ALLOWED_IN_PATH, TRUE);
+        scope = scope_array->dd_talloc_array[0];
     }
 
-    if (scope == NULL) {
-        LOG(log_error, logtype_sl, "failed to setup search scope");
-        EC_FAIL;
+    if (obj->sl_ctx->sl_backend == SL_BACKEND_NATIVE) {
+        slq->slq_scope = talloc_strdup(slq, scope);
+    } else {
+#ifdef HAVE_TRACKER
+        escaped = g_uri_escape_string(scope,
+                                      G_URI_RESERVED_CHARS_ALLOWED_IN_PATH, TRUE);
+        if (escaped == NULL) {
+            LOG(log_error, logtype_sl, "failed to setup search scope");
+            EC_FAIL;
+        }
+        slq->slq_scope = talloc_strdup(slq, escaped);
+        g_free(escaped);
+#endif
     }
-
-    slq->slq_scope = talloc_strdup(slq, scope);
-    g_free(scope);
     if (slq->slq_scope == NULL) {
         LOG(log_error, logtype_sl, "talloc_strdup failed");
         EC_FAIL;
@@ -923,27 +1024,6 @@ static int sl_rpc_openQuery(AFPObj *obj,
         EC_ZERO_LOG( sl_createCNIDArray(slq, cnids->ca_cnids) );
     }
 
-    ret = map_spotlight_to_sparql_query(slq, &sparql_query);
-    if (ret != 0) {
-        LOG(log_debug, logtype_sl, "mapping retured non-zero");
-        EC_FAIL;
-    }
-    LOG(log_debug, logtype_sl, "SPARQL query: \"%s\"", sparql_query);
-
-    tracker_sparql_connection_query_async(obj->sl_ctx->tracker_con,
-                                          sparql_query,
-                                          slq->slq_obj->sl_ctx->cancellable,
-                                          tracker_query_cb,
-                                          slq);
-    if (error) {
-        LOG(log_error, logtype_sl, "Couldn't query the Tracker Store: '%s'",
-            error->message);
-        g_clear_error(&error);
-        EC_FAIL;
-    }
-
-    slq->slq_state = SLQ_STATE_RUNNING;
-
     ok = create_result_handle(slq);
     if (!ok) {
         LOG(log_error, logtype_sl, "create_result_handle error");
@@ -951,6 +1031,38 @@ static int sl_rpc_openQuery(AFPObj *obj,
         EC_FAIL;
     }
 
+    if (obj->sl_ctx->sl_backend == SL_BACKEND_NATIVE) {
+        ret = sl_native_open(slq);
+        if (ret != 0) {
+            EC_FAIL;
+        }
+        slq->slq_state = SLQ_STATE_RUNNING;
+        sl_native_fill(slq);
+    } else {
+#ifdef HAVE_TRACKER
+        ret = map_spotlight_to_sparql_query(slq, &sparql_query);
+        if (ret != 0) {
+            LOG(log_debug, logtype_sl, "mapping retured non-zero");
+            EC_FAIL;
+        }
+        LOG(log_debug, logtype_sl, "SPARQL query: \"%s\"", sparql_query);
+
+        tracker_sparql_connection_query_async(obj->sl_ctx->tracker_con,
+                                              sparql_query,
+                                              slq->slq_obj->sl_ctx->cancellable,
+                                              tracker_query_cb,
+                                              slq);
+        if (error) {
+            LOG(log_error, logtype_sl, "Couldn't query the Tracker Store: '%s'",
+                error->message);
+            g_clear_error(&error);
+            EC_FAIL;
+        }
+
+        slq->slq_state = SLQ_STATE_RUNNING;
+#endif
+    }
+
     slq_add(slq);
 
 EC_CLEANUP:
@@ -1011,6 +1123,13 @@ static int sl_rpc_fetchQueryResultsForContext(const AFPObj *obj,
             LOG(log_error, logtype_sl, "error adding results");
             EC_FAIL;
         }
+        if (obj->sl_ctx->sl_backend == SL_BACKEND_NATIVE) {
+            if (slq->slq_state != SLQ_STATE_DONE) {
+                sl_native_fill(slq);
+            }
+            break;
+        }
+#ifdef HAVE_TRACKER
         if (slq->slq_state == SLQ_STATE_FULL) {
             slq->slq_state = SLQ_STATE_RESULTS;
 
@@ -1020,6 +1139,7 @@ static int sl_rpc_fetchQueryResultsForContext(const AFPObj *obj,
                 tracker_cursor_cb,
                 slq);
         }
+#endif
         break;
 
     case SLQ_STATE_ERROR:
@@ -1271,6 +1391,15 @@ static int sl_rpc_closeQueryForContext(const AFPObj *obj,
         EC_FAIL;
     }
 
+    if (obj->sl_ctx->sl_backend == SL_BACKEND_NATIVE) {
+        /* nothing runs in the background, no need to cancel */
+        LOG(log_debug, logtype_sl, "close: destroying query: state %s",
+            slq_state_names[slq->slq_state].state_name);
+        slq_destroy(slq);
+        sl_result = 0;
+        goto EC_CLEANUP;
+    }
+
     switch (slq->slq_state) {
     case SLQ_STATE_FULL:
     case SLQ_STATE_DONE:
@@ -1317,13 +1446,30 @@ int spotlight_init(AFPObj *obj)
         return 0;
     }
 
-    LOG(log_info, logtype_sl, "Initializing Spotlight");
-
     sl_ctx = talloc_zero(NULL, struct sl_ctx);
     obj->sl_ctx = sl_ctx;
 
+    if (obj->options.flags & OPTION_SPOTLIGHT_NATIVE) {
+        sl_ctx->sl_backend = SL_BACKEND_NATIVE;
+    } else {
+        sl_ctx->sl_backend = SL_BACKEND_TRACKER;
+    }
+
+    LOG(log_info, logtype_sl, "Initializing Spotlight (%s)",
+        sl_ctx->sl_backend == SL_BACKEND_NATIVE ? "native" : "Tracker");
+
     attributes = atalk_iniparser_getstring(obj->iniconfig, INISEC_GLOBAL,
                                            "spotlight attributes", NULL);
+
+    if (sl_ctx->sl_backend == SL_BACKEND_NATIVE) {
+        if (attributes) {
+            sl_native_attributes(attributes);
+        }
+        initialized = true;
+        return 0;
+    }
+
+#ifdef HAVE_TRACKER
     if (attributes) {
         configure_spotlight_attributes(attributes);
     }
@@ -1344,6 +1490,7 @@ int spotlight_init(AFPObj *obj)
 
     tracker_sparql_connection_get_async(sl_ctx->cancellable,
                                         tracker_con_cb, sl_ctx);
+#endif
 
     initialized = true;
     return 0;
@@ -1365,7 +1512,9 @@ int afp_spotlight_rpc(AFPObj *obj, char *ibuf, size_t ibuflen,
     DALLOC_CTX *reply;
     char *rpccmd;
     int len;
+#ifdef HAVE_TRACKER
     bool event;
+#endif
 
     *rbuflen = 0;
 
@@ -1376,13 +1525,15 @@ int afp_spotlight_rpc(AFPObj *obj, char *ibuf, size_t ibuflen,
     spotlight_init(obj);
     slq_dump();
 
+#ifdef HAVE_TRACKER
     /*
      * Process finished glib events
      */
     event = true;
-    while (event) {
+    while (event && obj->sl_ctx->sl_backend == SL_BACKEND_TRACKER) {
         event = g_main_context_iteration(NULL, false);
     }
+#endif
     slq_cancelled_cleanup();
 
     ibuf += 2;
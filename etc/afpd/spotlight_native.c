@@ -0,0 +1,1091 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Native Spotlight backend
+ * ========================
+ *
+ * Answers Spotlight queries without Tracker. The raw query string is parsed
+ * into a tree of AND/OR nodes with attribute matches at the leaves, the tree
+ * is evaluated against the records of the catalog index of the volume, see
+ * catidx.c: name, FinderInfo type, size and dates of every object. The
+ * catalog index is one file per volume that all sessions share and keep
+ * current, so sessions don't build indexes of their own. With the native
+ * backend, volumes with Spotlight get a catalog index.
+ *
+ * Queries don't hold up the session: sl_native_next() tests at most
+ * SLN_SCAN_BUDGET records per call and returns SL_NATIVE_AGAIN when the
+ * budget is used up, the RPC layer in spotlight.c then pages the matches
+ * found so far to the client, which asks for more. If the catalog index is
+ * incomplete or stale, the query first walks the volume and indexes
+ * SLN_WALK_BUDGET objects per call, the completed index then serves the
+ * queries and FPCatSearch of all sessions.
+ *
+ * Names are matched as the client sees them, as precomposed UTF8 and, for
+ * case insensitive matches, lowercased by convert_charset(). Content types
+ * are derived from the FinderInfo type, which extmap.conf provides for files
+ * without metadata, and from the file extension. Full text matches only look
+ * at the words of names, file content is not indexed. Matches are checked
+ * against the search scope and turned into paths with the directory cache
+ * and the CNID database.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include <atalk/errchk.h>
+#include <atalk/util.h>
+#include <atalk/logger.h>
+#include <atalk/talloc.h>
+#include <atalk/bstrlib.h>
+#include <atalk/bstradd.h>
+#include <atalk/cnid.h>
+#include <atalk/unicode.h>
+#include <atalk/netatalk_conf.h>
+#include <atalk/volume.h>
+#include <atalk/spotlight.h>
+
+#include "catidx.h"
+#include "desktop.h"
+#include "directory.h"
+
+#define SPRAW_TIME_OFFSET 978307200 /* 2001-01-01, the epoch of raw query dates */
+#define SLN_SCAN_BUDGET   100000    /* records tested per sl_native_next() call */
+#define SLN_WALK_BUDGET   2000      /* objects indexed per sl_native_next() call */
+#define SLN_CHUNK         256       /* records read at once */
+#define SLP_MAXDEPTH      64        /* nesting of parentheses in a query */
+
+/******************************************************************************
+ * Attributes and content types
+ ******************************************************************************/
+
+enum sla_type {
+    SLA_NAME,                   /* file name, glob match */
+    SLA_FTS,                    /* full text, matched against name words */
+    SLA_SIZE,                   /* file size */
+    SLA_DATE,                   /* one of the timestamps */
+    SLA_TYPE                    /* content type */
+};
+
+enum sla_date {
+    SLD_MDATE,                  /* modification date */
+    SLD_CDATE                   /* creation date */
+};
+
+struct sl_native_attr {
+    const char    *sa_name;
+    bool           sa_enabled;
+    enum sla_type  sa_type;
+    enum sla_date  sa_date;
+};
+
+static struct sl_native_attr sl_native_attrs[] = {
+    {"*",                               true, SLA_FTS,  0},
+    {"kMDItemTextContent",              true, SLA_FTS,  0},
+    {"kMDItemDisplayName",              true, SLA_NAME, 0},
+    {"kMDItemFSName",                   true, SLA_NAME, 0},
+    {"kMDItemFSSize",                   true, SLA_SIZE, 0},
+    {"kMDItemLogicalSize",              true, SLA_SIZE, 0},
+    {"kMDItemFSContentChangeDate",      true, SLA_DATE, SLD_MDATE},
+    {"kMDItemContentModificationDate",  true, SLA_DATE, SLD_MDATE},
+    {"kMDItemContentCreationDate",      true, SLA_DATE, SLD_CDATE},
+    {"kMDItemFSCreationDate",           true, SLA_DATE, SLD_CDATE},
+    /* the catalog index has no change and access times */
+    {"kMDItemAttributeChangeDate",      true, SLA_DATE, SLD_MDATE},
+    {"kMDItemLastUsedDate",             true, SLA_DATE, SLD_MDATE},
+    {"_kMDItemGroupId",                 true, SLA_TYPE, 0},
+    {"kMDItemContentTypeTree",          true, SLA_TYPE, 0},
+    {"kMDItemContentType",              true, SLA_TYPE, 0},
+    {NULL, false, SLA_NAME, 0}
+};
+
+#define SLK_DIR  1              /* directories only */
+#define SLK_FILE 2              /* files only */
+#define SLK_ANY  3
+
+/*
+ * Content types, at most 32. An entry belongs to a type if it's of the right
+ * kind and extmap.conf maps its extension to one of sk_types, or the
+ * extension is one of sk_exts. Types without both match every entry of the
+ * right kind.
+ */
+static const struct sl_kind {
+    const char *sk_uti;         /* kMDItemContentTypeTree value */
+    const char *sk_group;       /* _kMDItemGroupId value */
+    int         sk_what;
+    const char *sk_types;       /* four character type codes */
+    const char *sk_exts;        /* ",ext,ext," */
+} sl_kinds[] = {
+    {"public.folder",        "9",  SLK_DIR,  NULL, NULL},
+    {"public.image",         "13", SLK_FILE, "JPEGTIFFGIFfPNG PNGfBMPpPICT8BPS",
+     ",jpg,jpeg,tif,tiff,gif,png,bmp,pict,psd,heic,webp,"},
+    {"public.jpeg",          NULL, SLK_FILE, "JPEG", ",jpg,jpeg,"},
+    {"public.tiff",          NULL, SLK_FILE, "TIFF", ",tif,tiff,"},
+    {"com.compuserve.gif",   NULL, SLK_FILE, "GIFf", ",gif,"},
+    {"public.png",           NULL, SLK_FILE, "PNG PNGf", ",png,"},
+    {"com.microsoft.bmp",    NULL, SLK_FILE, "BMPp", ",bmp,"},
+    {"public.movie",         "7",  SLK_FILE, "MooVMPEGVfW ",
+     ",mov,mp4,m4v,avi,mpg,mpeg,mkv,"},
+    {"public.audio",         "10", SLK_FILE, "MPG3AIFFAIFCWAVE",
+     ",mp3,m4a,aac,aif,aiff,aifc,wav,flac,ogg,"},
+    {"public.mp3",           NULL, SLK_FILE, "MPG3", ",mp3,"},
+    {"public.mpeg-4-audio",  NULL, SLK_FILE, NULL, ",m4a,aac,"},
+    {"com.adobe.pdf",        "11", SLK_FILE, "PDF ", ",pdf,"},
+    {"public.presentation",  "12", SLK_FILE, NULL, ",ppt,pptx,key,odp,"},
+    {"public.font",          "4",  SLK_FILE, "FFILtfilLWFN", ",ttf,otf,ttc,dfont,"},
+    {"com.apple.application", "8", SLK_ANY,  "APPL", ",app,"},
+    {"public.text",          NULL, SLK_FILE, "TEXT",
+     ",txt,text,rtf,html,htm,xml,csv,md,c,h,cpp,m,java,pl,py,sh,js,"},
+    {"public.plain-text",    NULL, SLK_FILE, NULL, ",txt,text,"},
+    {"public.rtf",           NULL, SLK_FILE, NULL, ",rtf,"},
+    {"public.html",          NULL, SLK_FILE, NULL, ",html,htm,"},
+    {"public.xml",           NULL, SLK_FILE, NULL, ",xml,"},
+    {"public.source-code",   NULL, SLK_FILE, NULL, ",c,h,cpp,m,java,pl,py,sh,js,"},
+    {"public.archive",       NULL, SLK_FILE, "ZIP ", ",zip,tar,gz,tgz,bz2,xz,7z,"},
+    {"public.content",       NULL, SLK_FILE, NULL, NULL},
+    {"public.data",          NULL, SLK_FILE, NULL, NULL},
+    {"public.item",          NULL, SLK_ANY,  NULL, NULL},
+    {NULL, NULL, 0, NULL, NULL}
+};
+
+#define TOKCHAR(c) ((unsigned char)(c) >= 0x80 || isalnum((unsigned char)(c)))
+
+/******************************************************************************
+ * Catalog index
+ ******************************************************************************/
+
+/* An object of the catalog index as the query tree sees it */
+struct sl_ent {
+    struct vol              *se_vol;
+    const struct catidx_rec *se_rec;
+    bool                     se_loaded;  /* names and kind are set */
+    size_t                   se_nlen;
+    size_t                   se_lnlen;
+    uint32_t                 se_kind;    /* bitmap of sl_kinds */
+    char                     se_name[MAXPATHLEN + 2];
+    char                     se_lname[MAXPATHLEN + 2];  /* lowercased */
+};
+
+static uint32_t ent_kind(const char *name, bool isdir, const char *ftype)
+{
+    const char *ext;
+    char ebuf[16];
+    const char *type = NULL;
+    uint32_t kind = 0;
+    int what, i;
+    size_t len, j;
+
+    what = isdir ? SLK_DIR : SLK_FILE;
+
+    ebuf[0] = 0;
+    if ((ext = strrchr(name, '.')) && ext[1] && (len = strlen(ext + 1)) < sizeof(ebuf) - 2) {
+        ebuf[0] = ',';
+        for (j = 0; j < len; j++)
+            ebuf[j + 1] = tolower((unsigned char)ext[j + 1]);
+        ebuf[len + 1] = ',';
+        ebuf[len + 2] = 0;
+    }
+    /* files without metadata get the type extmap.conf maps the extension to */
+    if (what == SLK_FILE && memcmp(ftype, "\0\0\0\0", 4) != 0 && memcmp(ftype, "????", 4) != 0)
+        type = ftype;
+
+    for (i = 0; sl_kinds[i].sk_uti; i++) {
+        const struct sl_kind *k = &sl_kinds[i];
+        bool match;
+
+        if (!(k->sk_what & what))
+            continue;
+        match = (k->sk_types == NULL && k->sk_exts == NULL);
+        if (!match && type && k->sk_types) {
+            for (const char *t = k->sk_types; *t && !match; t += 4)
+                match = (memcmp(t, type, 4) == 0);
+        }
+        if (!match && ebuf[0] && k->sk_exts)
+            match = (strstr(k->sk_exts, ebuf) != NULL);
+        if (match)
+            kind |= (1U << i);
+    }
+
+    return kind;
+}
+
+/**
+ * Convert the name of a record to UTF8 and lowercased UTF8, get its kind
+ *
+ * Names that didn't fit into the record are taken from the CNID database.
+ **/
+static bool ent_load(struct sl_ent *e)
+{
+    const struct catidx_rec *rec = e->se_rec;
+    char ubuf[MAXPATHLEN + 1];
+    const char *src;
+    charset_t from;
+    size_t srclen;
+    uint16_t flags;
+    cnid_t id;
+
+    if (e->se_loaded)
+        return e->se_nlen != 0;
+    e->se_loaded = true;
+    e->se_nlen = 0;
+
+    if (rec->cr_flags & CATIDX_TRUNC) {
+        id = rec->cr_id;
+        if (cnid_resolve(e->se_vol->v_cdb, &id, ubuf, sizeof(ubuf)) == NULL
+            || (src = utompath(e->se_vol, ubuf, rec->cr_id, 1)) == NULL)
+            return false;
+        from = CH_UTF8_MAC;
+        srclen = strlen(src);
+    } else {
+        src = (const char *)rec->cr_name;
+        from = CH_UCS2;
+        srclen = rec->cr_namelen * sizeof(ucs2_t);
+    }
+
+    flags = CONV_PRECOMPOSE;
+    e->se_nlen = convert_charset(from, CH_UTF8, CH_UTF8, src, srclen,
+                                 e->se_name, sizeof(e->se_name) - 2, &flags);
+    flags = CONV_PRECOMPOSE | CONV_TOLOWER;
+    e->se_lnlen = convert_charset(from, CH_UTF8, CH_UTF8, src, srclen,
+                                  e->se_lname, sizeof(e->se_lname) - 2, &flags);
+    if (e->se_nlen == (size_t)-1 || e->se_lnlen == (size_t)-1 || e->se_nlen == 0) {
+        e->se_nlen = 0;
+        return false;
+    }
+    e->se_name[e->se_nlen] = 0;
+    e->se_lname[e->se_lnlen] = 0;
+
+    e->se_kind = ent_kind(e->se_name, rec->cr_flags & CATIDX_DIR, (const char *)&rec->cr_type);
+    return true;
+}
+
+/**
+ * Path of the parent directory of a record, NULL if it's gone or outside scope
+ **/
+static char *ent_parent(TALLOC_CTX *mem_ctx, const struct vol *vol,
+                        const struct catidx_rec *rec, const char *scope)
+{
+    const struct dir *dir;
+    const char *path;
+    size_t len = strlen(scope);
+
+    if ((dir = dirlookup(vol, rec->cr_did)) == NULL)
+        return NULL;
+    path = cfrombstr(dir->d_fullpath);
+    if (strncmp(path, scope, len) != 0 || (path[len] != 0 && path[len] != '/'))
+        return NULL;
+    return talloc_strdup(mem_ctx, path);
+}
+
+/**
+ * Unix path of a record below scope, NULL if it doesn't exist anymore
+ **/
+static char *ent_path(TALLOC_CTX *mem_ctx, struct vol *vol,
+                      const struct catidx_rec *rec, const char *scope)
+{
+    char buf[MAXPATHLEN + 1];
+    char *parent, *path;
+    const char *name;
+    cnid_t id = rec->cr_id;
+
+    if ((parent = ent_parent(mem_ctx, vol, rec, scope)) == NULL)
+        return NULL;
+
+    /* the unix name is in the CNID database */
+    if ((name = cnid_resolve(vol->v_cdb, &id, buf, sizeof(buf))) == NULL || id != rec->cr_did) {
+        LOG(log_debug, logtype_sl, "ent_path: CNID %u is gone", ntohl(rec->cr_id));
+        catidx_remove(vol, rec->cr_id);
+        talloc_free(parent);
+        return NULL;
+    }
+    path = talloc_asprintf(mem_ctx, "%s/%s", parent, name);
+    talloc_free(parent);
+    return path;
+}
+
+/**
+ * A directory the indexing walk hasn't finished
+ **/
+struct sl_walkdir {
+    struct sl_walkdir *wd_next;
+    cnid_t             wd_did;
+    char              *wd_path;
+    char             **wd_names;    /* NULL until read */
+    size_t             wd_nnames;
+    size_t             wd_pos;
+};
+
+static bool walk_push(TALLOC_CTX *mem_ctx, struct sl_walkdir **stack, cnid_t did, const char *path)
+{
+    struct sl_walkdir *wd;
+
+    if ((wd = talloc_zero(mem_ctx, struct sl_walkdir)) == NULL
+        || (wd->wd_path = talloc_strdup(wd, path)) == NULL) {
+        talloc_free(wd);
+        return false;
+    }
+    wd->wd_did = did;
+    wd->wd_next = *stack;
+    *stack = wd;
+    return true;
+}
+
+static bool walk_readdir(const struct vol *vol, struct sl_walkdir *wd)
+{
+    DIR *dp;
+    struct dirent *de;
+    size_t alloc = 0;
+    char **p;
+
+    if ((wd->wd_names = talloc_array(wd, char *, 0)) == NULL)
+        return false;
+    if ((dp = opendir(wd->wd_path)) == NULL) {
+        LOG(log_debug, logtype_sl, "walk_readdir: opendir(\"%s\"): %s", wd->wd_path, strerror(errno));
+        return true;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (!check_dirent(vol, de->d_name))
+            continue;
+        if (wd->wd_nnames == alloc) {
+            alloc = alloc ? 2 * alloc : 64;
+            if ((p = talloc_realloc(wd, wd->wd_names, char *, alloc)) == NULL)
+                break;
+            wd->wd_names = p;
+        }
+        if ((wd->wd_names[wd->wd_nnames] = talloc_strdup(wd->wd_names, de->d_name)) == NULL)
+            break;
+        wd->wd_nnames++;
+    }
+    closedir(dp);
+    return de == NULL;
+}
+
+/**
+ * Index up to budget objects of the volume
+ *
+ * @returns 1 when the walk is complete, 0 if there's more to do, -1 on error
+ **/
+static int walk_step(struct vol *vol, struct sl_walkdir **stack, dev_t dev, int budget)
+{
+    struct sl_walkdir *wd;
+    struct stat st;
+    char *path;
+    cnid_t id;
+
+    while ((wd = *stack) != NULL) {
+        if (wd->wd_names == NULL) {
+            /* someone else may have completed the index meanwhile */
+            if (catidx_valid(vol))
+                return 1;
+            if (!walk_readdir(vol, wd))
+                return -1;
+        }
+        if (wd->wd_pos == wd->wd_nnames) {
+            *stack = wd->wd_next;
+            talloc_free(wd);
+            continue;
+        }
+        if (budget-- == 0)
+            return 0;
+
+        path = talloc_asprintf(wd, "%s/%s", wd->wd_path, wd->wd_names[wd->wd_pos++]);
+        if (path == NULL)
+            return -1;
+        if (lstat(path, &st) != 0 || st.st_dev != dev
+            || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+            talloc_free(path);
+            continue;
+        }
+        id = catidx_update(vol, 0, wd->wd_did, path);
+        if (S_ISDIR(st.st_mode) && id != CNID_INVALID && !walk_push(wd, stack, id, path))
+            return -1;
+        talloc_free(path);
+    }
+
+    catidx_set_valid(vol, 1);
+    return 1;
+}
+
+/******************************************************************************
+ * Query parser
+ ******************************************************************************/
+
+enum sln_type {
+    SLN_AND,
+    SLN_OR,
+    SLN_CONST,
+    SLN_MATCH,
+    SLN_RANGE
+};
+
+#define SLN_NOCASE 1            /* "c" modifier */
+#define SLN_WORDS  2            /* "w" modifier */
+
+struct sln {
+    enum sln_type                sln_type;
+    struct sln                  *sln_left;
+    struct sln                  *sln_right;
+    bool                         sln_bool;   /* SLN_CONST */
+    const struct sl_native_attr *sln_attr;   /* NULL: unsupported attribute */
+    char                         sln_op;     /* '=', '!', '<', '>' */
+    int                          sln_flags;
+    char                        *sln_str;    /* lowercased with SLN_NOCASE */
+    int64_t                      sln_num;
+    int64_t                      sln_num2;   /* SLN_RANGE upper bound */
+    uint32_t                     sln_kind;   /* bit in ie_kind */
+};
+
+enum slp_tok {
+    T_END, T_WORD, T_STRING, T_LP, T_RP, T_COMMA, T_AND, T_OR,
+    T_EQ, T_NE, T_LT, T_GT, T_ERR
+};
+
+struct slp {
+    slq_t         *p_slq;
+    const char    *p_s;         /* next input */
+    enum slp_tok   p_tok;       /* current token */
+    char          *p_val;       /* value of T_WORD and T_STRING */
+    int            p_depth;     /* open parentheses */
+};
+
+static void slp_next(struct slp *p)
+{
+    const char *s = p->p_s, *e;
+    char *v;
+
+    while (*s == ' ' || *s == '\t' || *s == '\n')
+        s++;
+
+    p->p_val = NULL;
+    switch (*s) {
+    case 0:   p->p_tok = T_END; break;
+    case '(': p->p_tok = T_LP; s++; break;
+    case ')': p->p_tok = T_RP; s++; break;
+    case ',': p->p_tok = T_COMMA; s++; break;
+    case '<': p->p_tok = T_LT; s++; break;
+    case '>': p->p_tok = T_GT; s++; break;
+    case '&':
+        p->p_tok = s[1] == '&' ? T_AND : T_ERR;
+        s += 2;
+        break;
+    case '|':
+        p->p_tok = s[1] == '|' ? T_OR : T_ERR;
+        s += 2;
+        break;
+    case '=':
+        p->p_tok = T_EQ;
+        s += s[1] == '=' ? 2 : 1;
+        break;
+    case '!':
+        p->p_tok = s[1] == '=' ? T_NE : T_ERR;
+        s += 2;
+        break;
+    case '"':
+        /* quoted string, backslash escapes the next character */
+        if ((v = p->p_val = talloc_array(p->p_slq, char, strlen(s))) == NULL) {
+            p->p_tok = T_ERR;
+            break;
+        }
+        for (s++; *s && *s != '"'; s++) {
+            if (*s == '\\' && s[1])
+                s++;
+            *v++ = *s;
+        }
+        *v = 0;
+        p->p_tok = *s == '"' ? T_STRING : T_ERR;
+        if (*s)
+            s++;
+        break;
+    default:
+        for (e = s; *e && !strchr(" \t\n()<>,&|=!\"", *e); e++)
+            ;
+        p->p_tok = T_WORD;
+        p->p_val = talloc_strndup(p->p_slq, s, e - s);
+        s = e;
+        break;
+    }
+    p->p_s = s;
+}
+
+static struct sln *sln_new(struct slp *p, enum sln_type type)
+{
+    struct sln *n = talloc_zero(p->p_slq, struct sln);
+    if (n)
+        n->sln_type = type;
+    return n;
+}
+
+static const struct sl_native_attr *sl_native_attr(const char *name)
+{
+    for (struct sl_native_attr *a = sl_native_attrs; a->sa_name; a++) {
+        if (a->sa_enabled && strcmp(a->sa_name, name) == 0)
+            return a;
+    }
+    return NULL;
+}
+
+static time_t isodate2unix(const char *s)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(s, "%Y-%m-%dT%H:%M:%SZ", &tm) == NULL)
+        return (time_t)-1;
+    return mktime(&tm);
+}
+
+/**
+ * Date value: "$time.iso(ISODATE)" or seconds since 2001-01-01
+ **/
+static bool sl_date(const char *s, int64_t *t)
+{
+    char buf[64];
+    const char *e;
+    char *end;
+    double d;
+
+    if (strncmp(s, "$time.iso(", 10) == 0 && (e = strchr(s, ')')) && e - s - 10 < sizeof(buf)) {
+        memcpy(buf, s + 10, e - s - 10);
+        buf[e - s - 10] = 0;
+        if ((*t = isodate2unix(buf)) == -1)
+            return false;
+        return true;
+    }
+    d = strtod(s, &end);
+    if (end == s)
+        return false;
+    *t = (int64_t)d + SPRAW_TIME_OFFSET;
+    return true;
+}
+
+static bool slp_date(struct slp *p, int64_t *t)
+{
+    char *buf;
+
+    if (p->p_tok != T_WORD)
+        return false;
+    if (strcmp(p->p_val, "$time.iso") == 0) {
+        slp_next(p);
+        if (p->p_tok != T_LP)
+            return false;
+        slp_next(p);
+        if (p->p_tok != T_WORD)
+            return false;
+        buf = talloc_asprintf(p->p_slq, "$time.iso(%s)", p->p_val);
+        slp_next(p);
+        if (buf == NULL || p->p_tok != T_RP)
+            return false;
+        slp_next(p);
+        return sl_date(buf, t);
+    }
+    if (!sl_date(p->p_val, t))
+        return false;
+    slp_next(p);
+    return true;
+}
+
+/* InRange(ATTR, DATE, DATE) */
+static struct sln *slp_inrange(struct slp *p)
+{
+    struct sln *n;
+
+    if ((n = sln_new(p, SLN_RANGE)) == NULL)
+        return NULL;
+    slp_next(p);
+    if (p->p_tok != T_LP)
+        return NULL;
+    slp_next(p);
+    if (p->p_tok != T_WORD)
+        return NULL;
+    n->sln_attr = sl_native_attr(p->p_val);
+    if (n->sln_attr && n->sln_attr->sa_type != SLA_DATE && n->sln_attr->sa_type != SLA_SIZE)
+        n->sln_attr = NULL;
+    slp_next(p);
+    if (p->p_tok != T_COMMA)
+        return NULL;
+    slp_next(p);
+    if (!slp_date(p, &n->sln_num) || p->p_tok != T_COMMA)
+        return NULL;
+    slp_next(p);
+    if (!slp_date(p, &n->sln_num2) || p->p_tok != T_RP)
+        return NULL;
+    slp_next(p);
+    return n;
+}
+
+/* ATTR OP "VALUE" [MODIFIERS] */
+static struct sln *slp_match(struct slp *p)
+{
+    struct sln *n;
+    const struct sl_kind *k;
+    uint16_t flags;
+    size_t len;
+    char *s;
+
+    if ((n = sln_new(p, SLN_MATCH)) == NULL)
+        return NULL;
+    n->sln_attr = sl_native_attr(p->p_val);
+    if (n->sln_attr == NULL)
+        LOG(log_debug, logtype_sl, "unsupported Spotlight attribute: %s", p->p_val);
+
+    slp_next(p);
+    switch (p->p_tok) {
+    case T_EQ: n->sln_op = '='; break;
+    case T_NE: n->sln_op = '!'; break;
+    case T_LT: n->sln_op = '<'; break;
+    case T_GT: n->sln_op = '>'; break;
+    default:
+        return NULL;
+    }
+    slp_next(p);
+    if (p->p_tok != T_STRING)
+        return NULL;
+    n->sln_str = p->p_val;
+    slp_next(p);
+
+    if (p->p_tok == T_WORD) {
+        if (strchr(p->p_val, 'c'))
+            n->sln_flags |= SLN_NOCASE;
+        if (strchr(p->p_val, 'w'))
+            n->sln_flags |= SLN_WORDS;
+        slp_next(p);
+    }
+
+    if (n->sln_attr == NULL)
+        return n;
+
+    switch (n->sln_attr->sa_type) {
+    case SLA_FTS:
+        n->sln_flags |= SLN_NOCASE | SLN_WORDS;
+        /* fall through */
+    case SLA_NAME:
+        if (n->sln_flags & SLN_NOCASE) {
+            /* lowercased like the names, see ent_load() */
+            flags = CONV_PRECOMPOSE | CONV_TOLOWER;
+            len = strlen(n->sln_str);
+            if ((s = talloc_array(p->p_slq, char, 2 * len + 3)) == NULL)
+                return NULL;
+            if ((len = convert_charset(CH_UTF8, CH_UTF8, CH_UTF8, n->sln_str, len,
+                                       s, 2 * len + 1, &flags)) == (size_t)-1)
+                n->sln_attr = NULL;
+            else
+                s[len] = 0;
+            n->sln_str = s;
+        }
+        break;
+    case SLA_SIZE:
+        n->sln_num = strtoll(n->sln_str, NULL, 10);
+        break;
+    case SLA_DATE:
+        if (!sl_date(n->sln_str, &n->sln_num))
+            n->sln_attr = NULL;
+        break;
+    case SLA_TYPE:
+        for (k = sl_kinds; k->sk_uti; k++) {
+            if (strcmp(n->sln_str, k->sk_uti) == 0
+                || (k->sk_group && strcmp(n->sln_str, k->sk_group) == 0))
+                break;
+        }
+        if (k->sk_uti)
+            n->sln_kind = 1U << (k - sl_kinds);
+        else
+            n->sln_attr = NULL;
+        break;
+    }
+
+    return n;
+}
+
+static struct sln *slp_expr(struct slp *p);
+
+static struct sln *slp_primary(struct slp *p)
+{
+    struct sln *n;
+
+    switch (p->p_tok) {
+    case T_LP:
+        /* the client controls the nesting, don't let it exhaust the stack */
+        if (++p->p_depth > SLP_MAXDEPTH) {
+            LOG(log_error, logtype_sl, "Spotlight query nested too deep");
+            return NULL;
+        }
+        slp_next(p);
+        if ((n = slp_expr(p)) == NULL || p->p_tok != T_RP)
+            return NULL;
+        p->p_depth--;
+        slp_next(p);
+        return n;
+    case T_WORD:
+        if (strcmp(p->p_val, "true") == 0 || strcmp(p->p_val, "false") == 0) {
+            if ((n = sln_new(p, SLN_CONST)) == NULL)
+                return NULL;
+            n->sln_bool = p->p_val[0] == 't';
+            slp_next(p);
+            return n;
+        }
+        if (strcmp(p->p_val, "InRange") == 0)
+            return slp_inrange(p);
+        return slp_match(p);
+    default:
+        return NULL;
+    }
+}
+
+static struct sln *slp_binop(struct slp *p, enum sln_type type, struct sln *l, struct sln *r)
+{
+    struct sln *n;
+
+    if (l == NULL || r == NULL)
+        return NULL;
+    /* same as the SPARQL mapping: without "spotlight expr" only "match || match" */
+    if (!p->p_slq->slq_allow_expr
+        && (type == SLN_AND || l->sln_type != SLN_MATCH || r->sln_type != SLN_MATCH)) {
+        LOG(log_error, logtype_sl, "Spotlight queries with logic expressions are disabled");
+        return NULL;
+    }
+    if ((n = sln_new(p, type)) == NULL)
+        return NULL;
+    n->sln_left = l;
+    n->sln_right = r;
+    return n;
+}
+
+static struct sln *slp_and(struct slp *p)
+{
+    struct sln *n = slp_primary(p);
+
+    while (n && p->p_tok == T_AND) {
+        slp_next(p);
+        n = slp_binop(p, SLN_AND, n, slp_primary(p));
+    }
+    return n;
+}
+
+static struct sln *slp_expr(struct slp *p)
+{
+    struct sln *n = slp_and(p);
+
+    while (n && p->p_tok == T_OR) {
+        slp_next(p);
+        n = slp_binop(p, SLN_OR, n, slp_and(p));
+    }
+    return n;
+}
+
+/******************************************************************************
+ * Evaluation
+ ******************************************************************************/
+
+static bool glob_match(const char *p, const char *pe, const char *s, const char *se)
+{
+    const char *star = NULL, *ss = NULL;
+
+    while (s < se) {
+        if (p < pe && *p == '*') {
+            star = ++p;
+            ss = s;
+        } else if (p < pe && *p == *s) {
+            p++;
+            s++;
+        } else if (star) {
+            p = star;
+            s = ++ss;
+        } else {
+            return false;
+        }
+    }
+    while (p < pe && *p == '*')
+        p++;
+    return p == pe;
+}
+
+/* does the pattern match a run of words of s */
+static bool word_match(const char *p, size_t plen, const char *s, size_t slen)
+{
+    for (size_t i = 0; i < slen; i++) {
+        if (!TOKCHAR(s[i]) || (i > 0 && TOKCHAR(s[i - 1])))
+            continue;
+        if (plen && p[0] != '*' && p[0] != s[i])
+            continue;
+        for (size_t j = i + 1; j <= slen; j++) {
+            if (j < slen && !(TOKCHAR(s[j - 1]) && !TOKCHAR(s[j])))
+                continue;
+            if (glob_match(p, p + plen, s + i, s + j))
+                return true;
+        }
+    }
+    return false;
+}
+
+static bool num_cmp(char op, int64_t v, int64_t ref)
+{
+    switch (op) {
+    case '=': return v == ref;
+    case '!': return v != ref;
+    case '<': return v < ref;
+    case '>': return v > ref;
+    }
+    return false;
+}
+
+static int64_t ent_num(const struct sl_ent *e, const struct sl_native_attr *a)
+{
+    if (a->sa_type == SLA_SIZE)
+        return e->se_rec->cr_size;
+    if (a->sa_date == SLD_CDATE)
+        return e->se_rec->cr_cdate;
+    return e->se_rec->cr_mdate;
+}
+
+static bool sln_eval(struct sl_ent *e, const struct sln *n)
+{
+    const char *name;
+    size_t len;
+    bool match;
+    int64_t v;
+    int c;
+
+    switch (n->sln_type) {
+    case SLN_AND:
+        return sln_eval(e, n->sln_left) && sln_eval(e, n->sln_right);
+    case SLN_OR:
+        return sln_eval(e, n->sln_left) || sln_eval(e, n->sln_right);
+    case SLN_CONST:
+        return n->sln_bool;
+    case SLN_RANGE:
+        if (n->sln_attr == NULL)
+            return false;
+        v = ent_num(e, n->sln_attr);
+        return v > n->sln_num && v < n->sln_num2;
+    case SLN_MATCH:
+        break;
+    }
+
+    if (n->sln_attr == NULL)
+        return false;
+
+    switch (n->sln_attr->sa_type) {
+    case SLA_NAME:
+    case SLA_FTS:
+        if (!ent_load(e))
+            return false;
+        if (n->sln_flags & SLN_NOCASE) {
+            name = e->se_lname;
+            len = e->se_lnlen;
+        } else {
+            name = e->se_name;
+            len = e->se_nlen;
+        }
+        if (n->sln_op == '<' || n->sln_op == '>') {
+            c = strcmp(name, n->sln_str);
+            return n->sln_op == '<' ? c < 0 : c > 0;
+        }
+        if (n->sln_flags & SLN_WORDS)
+            match = word_match(n->sln_str, strlen(n->sln_str), name, len);
+        else
+            match = glob_match(n->sln_str, n->sln_str + strlen(n->sln_str), name, name + len);
+        return n->sln_op == '!' ? !match : match;
+    case SLA_SIZE:
+    case SLA_DATE:
+        return num_cmp(n->sln_op, ent_num(e, n->sln_attr), n->sln_num);
+    case SLA_TYPE:
+        if (!ent_load(e))
+            return false;
+        match = (e->se_kind & n->sln_kind) != 0;
+        return n->sln_op == '!' ? !match : match;
+    }
+    return false;
+}
+
+/******************************************************************************
+ * Interface
+ ******************************************************************************/
+
+struct sl_native_query {
+    struct vol        *nq_vol;
+    struct sln        *nq_tree;
+    char              *nq_scope;    /* search scope without trailing slash */
+    struct sl_walkdir *nq_walk;     /* indexing walk, NULL when done */
+    dev_t              nq_dev;      /* of the volume root */
+    struct catidx_rec *nq_recs;     /* records read last */
+    int                nq_nrecs;
+    int                nq_rec;      /* next of them */
+    uint32_t           nq_pos;      /* next record to read */
+    uint64_t           nq_matches;
+    struct sl_ent      nq_ent;
+};
+
+/**
+ * Restrict the native backend to a comma separated list of attributes
+ **/
+void sl_native_attributes(const char *attributes_in)
+{
+    char *attr, *attributes;
+    struct sl_native_attr *a;
+
+    for (a = sl_native_attrs; a->sa_name; a++)
+        a->sa_enabled = false;
+
+    attributes = strdup(attributes_in);
+
+    for (attr = strtok(attributes, ","); attr; attr = strtok(NULL, ",")) {
+        for (a = sl_native_attrs; a->sa_name; a++) {
+            if (strcmp(attr, a->sa_name) == 0) {
+                LOG(log_info, logtype_sl, "Enabling Spotlight attribute: %s", a->sa_name);
+                a->sa_enabled = true;
+                break;
+            }
+        }
+    }
+
+    free(attributes);
+}
+
+/**
+ * Parse the query string of a query and prepare its evaluation
+ *
+ * @param[in] slq     query, slq_qstring and slq_scope must be set
+ * @return            0 on success, -1 on error
+ **/
+int sl_native_open(slq_t *slq)
+{
+    EC_INIT;
+    struct sl_native_query *nq;
+    struct slp p;
+    struct stat st;
+    size_t len;
+
+    EC_NULL( nq = talloc_zero(slq, struct sl_native_query) );
+    slq->slq_native = nq;
+
+    p.p_slq = slq;
+    p.p_s = slq->slq_qstring;
+    p.p_depth = 0;
+    slp_next(&p);
+    if ((nq->nq_tree = slp_expr(&p)) == NULL || p.p_tok != T_END) {
+        LOG(log_error, logtype_sl, "Spotlight query parse error: \"%s\"", slq->slq_qstring);
+        EC_FAIL;
+    }
+    if (nq->nq_tree->sln_type == SLN_CONST) {
+        /*
+         * A lone "false" is sent when the share is selected in a Finder
+         * window but no search string has been entered yet, OS X returns
+         * a failure for it, so does the SPARQL mapping.
+         */
+        EC_FAIL;
+    }
+
+    nq->nq_vol = getvolbyvid(slq->slq_vol->v_vid);
+    if (nq->nq_vol == NULL || nq->nq_vol->v_catidx == NULL) {
+        LOG(log_error, logtype_sl, "Spotlight: volume \"%s\" has no catalog index",
+            slq->slq_vol->v_localname);
+        EC_FAIL;
+    }
+
+    EC_NULL( nq->nq_scope = talloc_strdup(nq, slq->slq_scope) );
+    for (len = strlen(nq->nq_scope); len > 0 && nq->nq_scope[len - 1] == '/'; )
+        nq->nq_scope[--len] = 0;
+    EC_NULL( nq->nq_recs = talloc_array(nq, struct catidx_rec, SLN_CHUNK) );
+    nq->nq_pos = 1;             /* record 0 is the header */
+
+    if (!catidx_valid(nq->nq_vol) || catidx_stale(nq->nq_vol)) {
+        if (lstat(nq->nq_vol->v_path, &st) != 0) {
+            LOG(log_error, logtype_sl, "Spotlight: \"%s\": %s", nq->nq_vol->v_path, strerror(errno));
+            EC_FAIL;
+        }
+        nq->nq_dev = st.st_dev;
+        EC_NULL( nq->nq_walk = talloc_zero(nq, struct sl_walkdir) );
+        EC_NULL( nq->nq_walk->wd_path = talloc_strdup(nq->nq_walk, nq->nq_vol->v_path) );
+        for (len = strlen(nq->nq_walk->wd_path); len > 1 && nq->nq_walk->wd_path[len - 1] == '/'; )
+            nq->nq_walk->wd_path[--len] = 0;
+        nq->nq_walk->wd_did = DIRDID_ROOT;
+        LOG(log_info, logtype_sl, "Spotlight: indexing volume \"%s\"", nq->nq_vol->v_localname);
+    }
+
+EC_CLEANUP:
+    EC_EXIT;
+}
+
+/**
+ * Get the next match of a query
+ *
+ * @param[in]  slq       query opened with sl_native_open()
+ * @param[in]  mem_ctx   talloc context for path
+ * @param[out] path      path of the match
+ * @return               SL_NATIVE_MATCH, SL_NATIVE_DONE after the last match
+ *                       or when the result limit is reached, SL_NATIVE_AGAIN
+ *                       when the scan budget of one call is used up or -1
+ *                       on error
+ **/
+int sl_native_next(slq_t *slq, TALLOC_CTX *mem_ctx, char **path)
+{
+    struct sl_native_query *nq = slq->slq_native;
+    struct sl_ent *e = &nq->nq_ent;
+    const struct catidx_rec *rec;
+    int count;
+
+    if (slq->slq_result_limit && nq->nq_matches >= slq->slq_result_limit)
+        return SL_NATIVE_DONE;
+
+    if (nq->nq_walk) {
+        switch (walk_step(nq->nq_vol, &nq->nq_walk, nq->nq_dev, SLN_WALK_BUDGET)) {
+        case 0:
+            return SL_NATIVE_AGAIN;
+        case -1:
+            LOG(log_error, logtype_sl, "Spotlight: indexing volume \"%s\" failed",
+                nq->nq_vol->v_localname);
+            return -1;
+        }
+        while (nq->nq_walk) {
+            struct sl_walkdir *wd = nq->nq_walk;
+            nq->nq_walk = wd->wd_next;
+            talloc_free(wd);
+        }
+        LOG(log_info, logtype_sl, "Spotlight: indexed volume \"%s\"", nq->nq_vol->v_localname);
+        return SL_NATIVE_AGAIN;
+    }
+
+    for (int n = 0; n < SLN_SCAN_BUDGET; n++) {
+        if (nq->nq_rec == nq->nq_nrecs) {
+            if ((count = catidx_read(nq->nq_vol, nq->nq_pos, nq->nq_recs, SLN_CHUNK)) < 0)
+                return -1;
+            if (count == 0)
+                return SL_NATIVE_DONE;
+            nq->nq_pos += count;
+            nq->nq_nrecs = count;
+            nq->nq_rec = 0;
+        }
+        rec = &nq->nq_recs[nq->nq_rec++];
+        if (rec->cr_id == 0 || (rec->cr_namelen > 0 && rec->cr_name[0] == '.'))
+            continue;
+
+        e->se_vol = nq->nq_vol;
+        e->se_rec = rec;
+        e->se_loaded = false;
+        if (!sln_eval(e, nq->nq_tree))
+            continue;
+
+        if ((*path = ent_path(mem_ctx, nq->nq_vol, rec, nq->nq_scope)) == NULL)
+            continue;
+        nq->nq_matches++;
+        return SL_NATIVE_MATCH;
+    }
+
+    return SL_NATIVE_AGAIN;
+}
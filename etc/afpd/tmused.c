@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ *
+ * Used size of Time Machine volumes
+ * =================================
+ *
+ * The used size of a volume with "vol size limit" is calculated from the
+ * sparsebundles at its top level as (number of bands - 1) * band-size. With
+ * hundreds of thousands of bands counting them is expensive, so the band
+ * count and band-size of every sparsebundle are cached.
+ *
+ * A cache entry is valid as long as the mtime of the bands directory and of
+ * Info.plist are unchanged, so only sparsebundles changed by others are
+ * rescanned. When afpd itself creates or deletes a band, the count is updated
+ * and the new mtime of the bands directory is taken over, provided the mtime
+ * before the change is the one the count belongs to. Otherwise someone else
+ * changed the directory in between and the bands are counted again.
+ *
+ * The cache is saved in ".AppleDB/tmused.cache" beside the CNID database, so
+ * new sessions don't have to rescan unchanged sparsebundles.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <atalk/bstrlib.h>
+#include <atalk/bstradd.h>
+#include <atalk/errchk.h>
+#include <atalk/logger.h>
+#include <atalk/unix.h>
+#include <atalk/util.h>
+#include <atalk/volume.h>
+
+#include "directory.h"
+#include "tmused.h"
+
+#define TMUSED_FILE     "/.AppleDB/tmused.cache"
+#define TMUSED_MAGIC    "tmused 1"
+#define TM_USED_CACHETIME 60    /* cache for 60 seconds */
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+#define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+struct tm_bundle {
+    char          *tb_name;         /* name of the sparsebundle */
+    long long int  tb_bandsize;
+    long long int  tb_bands;        /* entries in bands/ */
+    ino_t          tb_ino;          /* of bands/ */
+    time_t         tb_mtime;        /* mtime of bands/ when tb_bands was counted */
+    long           tb_mtime_nsec;
+    time_t         tb_plist_mtime;  /* mtime of Info.plist when tb_bandsize was read */
+    int            tb_seen;
+};
+
+struct tm_cache {
+    struct tm_bundle *tc_bundles;
+    int               tc_count;
+    int               tc_alloc;
+    int               tc_dirty;
+};
+
+/*!
+ * Read band-size info from Info.plist XML file of an TM sparsebundle
+ *
+ * @param path   (r) path to Info.plist file
+ * @return           band-size in bytes, -1 on error
+ */
+static long long int get_tm_bandsize(const char *path)
+{
+    EC_INIT;
+    FILE *file = NULL;
+    char buf[512];
+    long long int bandsize = -1;
+
+    EC_NULL_LOGSTR( file = fopen(path, "r"),
+                    "get_tm_bandsize(\"%s\"): %s",
+                    path, strerror(errno) );
+
+    while (fgets(buf, sizeof(buf), file) != NULL) {
+        if (strstr(buf, "band-size") == NULL)
+            continue;
+
+        if (fscanf(file, " <integer>%lld</integer>", &bandsize) != 1) {
+            LOG(log_error, logtype_afpd, "get_tm_bandsize(\"%s\"): can't parse band-size", path);
+            EC_FAIL;
+        }
+        break;
+    }
+
+EC_CLEANUP:
+    if (file)
+        fclose(file);
+    LOG(log_debug, logtype_afpd, "get_tm_bandsize(\"%s\"): bandsize: %lld", path, bandsize);
+    return bandsize;
+}
+
+/*!
+ * Return number on entries in a directory
+ *
+ * @param path   (r) path to dir
+ * @return           number of entries, -1 on error
+ */
+static long long int get_tm_bands(const char *path)
+{
+    EC_INIT;
+    long long int count = 0;
+    DIR *dir = NULL;
+    const struct dirent *entry;
+
+    EC_NULL( dir = opendir(path) );
+
+    while ((entry = readdir(dir)) != NULL)
+        count++;
+    count -= 2; /* All OSens I'm aware of return "." and "..", so just substract them, avoiding string comparison in loop */
+
+EC_CLEANUP:
+    if (dir)
+        closedir(dir);
+    if (ret != 0)
+        return -1;
+    return count;
+}
+
+static struct tm_bundle *tm_lookup(struct tm_cache *tc, const char *name)
+{
+    int i;
+
+    for (i = 0; i < tc->tc_count; i++)
+        if (strcmp(tc->tc_bundles[i].tb_name, name) == 0)
+            return &tc->tc_bundles[i];
+    return NULL;
+}
+
+static struct tm_bundle *tm_add(struct tm_cache *tc, const char *name)
+{
+    struct tm_bundle *tb;
+
+    if (tc->tc_count == tc->tc_alloc) {
+        int alloc = tc->tc_alloc ? 2 * tc->tc_alloc : 16;
+        if ((tb = realloc(tc->tc_bundles, alloc * sizeof(struct tm_bundle))) == NULL)
+            return NULL;
+        tc->tc_bundles = tb;
+        tc->tc_alloc = alloc;
+    }
+
+    tb = &tc->tc_bundles[tc->tc_count];
+    memset(tb, 0, sizeof(*tb));
+    if ((tb->tb_name = strdup(name)) == NULL)
+        return NULL;
+    tb->tb_bandsize = -1;
+    tb->tb_bands = -1;
+    tc->tc_count++;
+    return tb;
+}
+
+static void tm_load(const struct vol *vol, struct tm_cache *tc)
+{
+    struct tm_bundle *tb;
+    FILE *file;
+    char path[MAXPATHLEN + 1];
+    char line[MAXPATHLEN + 128];
+    char *name;
+    long long int bandsize, bands, mtime, plist_mtime;
+    unsigned long long ino;
+    long nsec;
+    int len;
+
+    if (snprintf(path, sizeof(path), "%s%s", vol->v_dbpath, TMUSED_FILE) >= (int)sizeof(path))
+        return;
+
+    become_root();
+    file = fopen(path, "r");
+    unbecome_root();
+    if (file == NULL)
+        return;
+
+    if (fgets(line, sizeof(line), file) == NULL || strncmp(line, TMUSED_MAGIC, strlen(TMUSED_MAGIC)) != 0)
+        goto exit;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if ((len = strlen(line)) > 0 && line[len - 1] == '\n')
+            line[len - 1] = 0;
+        if (sscanf(line, "%lld %lld %llu %lld %ld %lld %n",
+                   &bandsize, &bands, &ino, &mtime, &nsec, &plist_mtime, &len) != 6)
+            break;
+        name = line + len;
+        if (*name == 0 || tm_lookup(tc, name) != NULL)
+            continue;
+        if ((tb = tm_add(tc, name)) == NULL)
+            break;
+        tb->tb_bandsize = bandsize;
+        tb->tb_bands = bands;
+        tb->tb_ino = ino;
+        tb->tb_mtime = mtime;
+        tb->tb_mtime_nsec = nsec;
+        tb->tb_plist_mtime = plist_mtime;
+    }
+
+    LOG(log_debug, logtype_afpd, "tm_load(\"%s\"): %d sparsebundles", vol->v_path, tc->tc_count);
+
+exit:
+    fclose(file);
+}
+
+static void tm_save(const struct vol *vol, struct tm_cache *tc)
+{
+    struct tm_bundle *tb;
+    FILE *file;
+    char path[MAXPATHLEN + 1];
+    char tmp[MAXPATHLEN + 1];
+    int i, err = 0;
+
+    if (snprintf(path, sizeof(path), "%s%s", vol->v_dbpath, TMUSED_FILE) >= (int)sizeof(path)
+        || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return;
+
+    become_root();
+    if ((file = fopen(tmp, "w")) == NULL) {
+        unbecome_root();
+        LOG(log_debug, logtype_afpd, "tm_save(\"%s\"): %s", tmp, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "%s\n", TMUSED_MAGIC);
+    for (i = 0; i < tc->tc_count; i++) {
+        tb = &tc->tc_bundles[i];
+        if (tb->tb_bands < 0 || tb->tb_bandsize < 0)
+            continue;
+        fprintf(file, "%lld %lld %llu %lld %ld %lld %s\n",
+                tb->tb_bandsize, tb->tb_bands, (unsigned long long)tb->tb_ino,
+                (long long)tb->tb_mtime, tb->tb_mtime_nsec, (long long)tb->tb_plist_mtime,
+                tb->tb_name);
+    }
+
+    if (fclose(file) != 0)
+        err = 1;
+    if (err || rename(tmp, path) != 0) {
+        LOG(log_error, logtype_afpd, "tm_save(\"%s\"): %s", path, strerror(errno));
+        unlink(tmp);
+    } else {
+        tc->tc_dirty = 0;
+    }
+    unbecome_root();
+}
+
+static struct tm_cache *tm_cache(struct vol *vol)
+{
+    struct tm_cache *tc;
+
+    if (vol->v_tm_cache)
+        return vol->v_tm_cache;
+
+    if ((tc = calloc(1, sizeof(struct tm_cache))) == NULL)
+        return NULL;
+    tm_load(vol, tc);
+    vol->v_tm_cache = tc;
+    return tc;
+}
+
+/*!
+ * Update the cache entry of a sparsebundle, counting its bands if they changed
+ *
+ * @return  used bytes of the sparsebundle, -1 if it isn't valid
+ */
+static long long int tm_bundle_used(const struct vol *vol, struct tm_cache *tc, const char *name)
+{
+    EC_INIT;
+    struct tm_bundle *tb;
+    struct stat st;
+    bstring infoplist = NULL;
+    bstring bandsdir = NULL;
+    long long int used = 0;
+
+    if ((tb = tm_lookup(tc, name)) == NULL && (tb = tm_add(tc, name)) == NULL)
+        return -1;
+    tb->tb_seen = 1;
+
+    EC_NULL_LOG( infoplist = bformat("%s/%s/%s", vol->v_path, name, "Info.plist") );
+    EC_NULL_LOG( bandsdir = bformat("%s/%s/%s/", vol->v_path, name, "bands") );
+
+    if (stat(cfrombstr(infoplist), &st) != 0)
+        EC_FAIL;
+    if (tb->tb_bandsize == -1 || tb->tb_plist_mtime != st.st_mtime) {
+        tb->tb_plist_mtime = st.st_mtime;
+        tb->tb_bandsize = get_tm_bandsize(cfrombstr(infoplist));
+        tc->tc_dirty = 1;
+    }
+    if (tb->tb_bandsize == -1)
+        EC_FAIL;
+
+    if (stat(cfrombstr(bandsdir), &st) != 0)
+        EC_FAIL;
+    if (tb->tb_bands == -1
+        || tb->tb_ino != st.st_ino
+        || tb->tb_mtime != st.st_mtime
+        || tb->tb_mtime_nsec != ST_MTIME_NSEC(&st)) {
+        LOG(log_debug, logtype_afpd, "tm_bundle_used(\"%s\"): counting bands", name);
+        tb->tb_ino = st.st_ino;
+        tb->tb_mtime = st.st_mtime;
+        tb->tb_mtime_nsec = ST_MTIME_NSEC(&st);
+        tb->tb_bands = get_tm_bands(cfrombstr(bandsdir));
+        tc->tc_dirty = 1;
+    }
+    if (tb->tb_bands == -1)
+        EC_FAIL;
+
+    used = (tb->tb_bands - 1) * tb->tb_bandsize;
+    LOG(log_debug, logtype_afpd, "getused(\"%s\"): bands: %lld bytes",
+        cfrombstr(bandsdir), used);
+
+EC_CLEANUP:
+    bdestroy(infoplist);
+    bdestroy(bandsdir);
+    if (ret != 0)
+        return -1;
+    return used;
+}
+
+/*!
+ * Calculate used size of a TimeMachine volume
+ *
+ * This assumes that the volume is used only for TimeMachine.
+ *
+ * 1) readdir(path of volume)
+ * 2) for every element that matches regex "\(.*\)\.sparsebundle$" :
+ * 3) parse "\1.sparsebundle/Info.plist" and read the band-size XML key integer value
+ * 4) readdir "\1.sparsebundle/bands/" counting files
+ * 5) calculate used size as: (file_count - 1) * band-size
+ *
+ * Steps 3) and 4) are skipped for sparsebundles whose cache entry is valid.
+ *
+ * The result of the calculation is returned in "volume->v_tm_used".
+ * "volume->v_appended" gets reset to 0.
+ * "volume->v_tm_cachetime" is updated with the current time from time(NULL).
+ *
+ * "volume->v_tm_used" is cached for TM_USED_CACHETIME seconds and updated by
+ * "volume->v_appended". The latter is increased by X every time the client
+ * appends X bytes to a file (in fork.c).
+ *
+ * @param vol     (rw) volume to calculate
+ * @return             0 on success, -1 on error
+ */
+int tmused_get(struct vol * restrict vol)
+{
+    EC_INIT;
+    struct tm_cache *tc;
+    long long int bundle;
+    VolSpace used = 0;
+    DIR *dir = NULL;
+    const struct dirent *entry;
+    const char *p;
+    time_t now = time(NULL);
+    int i;
+
+    if (vol->v_tm_cachetime
+        && ((vol->v_tm_cachetime + TM_USED_CACHETIME) >= now)) {
+        if (vol->v_tm_used == -1)
+            EC_FAIL;
+        vol->v_tm_used += vol->v_appended;
+        vol->v_appended = 0;
+        LOG(log_debug, logtype_afpd, "getused(\"%s\"): cached: %" PRIu64 " bytes",
+            vol->v_path, vol->v_tm_used);
+        return 0;
+    }
+
+    vol->v_tm_cachetime = now;
+
+    EC_NULL( tc = tm_cache(vol) );
+    EC_NULL( dir = opendir(vol->v_path) );
+
+    for (i = 0; i < tc->tc_count; i++)
+        tc->tc_bundles[i].tb_seen = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (((p = strstr(entry->d_name, "sparsebundle")) != NULL)
+            && (strlen(entry->d_name) == (p + strlen("sparsebundle") - entry->d_name))) {
+            if ((bundle = tm_bundle_used(vol, tc, entry->d_name)) != -1)
+                used += bundle;
+        }
+    }
+
+    /* forget sparsebundles that are gone */
+    for (i = 0; i < tc->tc_count; ) {
+        if (tc->tc_bundles[i].tb_seen) {
+            i++;
+            continue;
+        }
+        free(tc->tc_bundles[i].tb_name);
+        tc->tc_bundles[i] = tc->tc_bundles[--tc->tc_count];
+        tc->tc_dirty = 1;
+    }
+
+    if (tc->tc_dirty)
+        tm_save(vol, tc);
+
+    vol->v_tm_used = used;
+    vol->v_appended = 0;
+
+EC_CLEANUP:
+    if (dir)
+        closedir(dir);
+
+    LOG(log_debug, logtype_afpd, "getused(\"%s\"): %" PRIu64 " bytes", vol->v_path, vol->v_tm_used);
+
+    EC_EXIT;
+}
+
+/*
+ * The name of the sparsebundle if dir is the bands directory of one at the
+ * top level of the volume
+ */
+static const char *tm_bandsdir(const struct vol *vol, const struct dir *dir, char *name)
+{
+    const char *path, *end;
+    size_t len;
+
+    if (!vol->v_limitsize || vol->v_tm_cache == NULL || dir->d_fullpath == NULL)
+        return NULL;
+
+    /* dir must be "<volume>/<name>.sparsebundle/bands" */
+    path = cfrombstr(dir->d_fullpath);
+    len = strlen(vol->v_path);
+    if (strncmp(path, vol->v_path, len) != 0 || path[len] != '/')
+        return NULL;
+    path += len + 1;
+    if ((end = strchr(path, '/')) == NULL || strcmp(end, "/bands") != 0)
+        return NULL;
+    len = end - path;
+    if (len < strlen(".sparsebundle") || len > MAXPATHLEN
+        || strncmp(end - strlen(".sparsebundle"), ".sparsebundle", strlen(".sparsebundle")) != 0)
+        return NULL;
+    memcpy(name, path, len);
+    name[len] = 0;
+    return name;
+}
+
+/*!
+ * Get the mtime of a directory before afpd creates or deletes a file in it
+ *
+ * @param vol    (r) volume
+ * @param dir    (r) parent directory of the file
+ * @param mtime  (w) mtime for tmused_update(), tv_nsec is -1 if unknown
+ */
+void tmused_prepare(const struct vol *vol, const struct dir *dir, struct timespec *mtime)
+{
+    struct stat st;
+    char name[MAXPATHLEN + 1];
+
+    mtime->tv_sec = 0;
+    mtime->tv_nsec = -1;
+    if (tm_bandsdir(vol, dir, name) == NULL || stat(cfrombstr(dir->d_fullpath), &st) != 0)
+        return;
+    mtime->tv_sec = st.st_mtime;
+    mtime->tv_nsec = ST_MTIME_NSEC(&st);
+}
+
+/*!
+ * Account for a file created (delta 1) or deleted (delta -1) by afpd
+ *
+ * @param vol    (rw) volume
+ * @param dir    (r)  parent directory of the file
+ * @param delta  (r)  change of the number of files in dir
+ * @param mtime  (r)  mtime of dir before the change from tmused_prepare()
+ */
+void tmused_update(struct vol *vol, const struct dir *dir, int delta, const struct timespec *mtime)
+{
+    struct tm_cache *tc;
+    struct tm_bundle *tb;
+    struct stat st;
+    char name[MAXPATHLEN + 1];
+
+    if (tm_bandsdir(vol, dir, name) == NULL)
+        return;
+    tc = vol->v_tm_cache;
+
+    if ((tb = tm_lookup(tc, name)) == NULL || tb->tb_bands == -1)
+        return;
+    if (stat(cfrombstr(dir->d_fullpath), &st) != 0 || st.st_ino != tb->tb_ino)
+        return;
+
+    if (mtime->tv_nsec == -1 || mtime->tv_sec != tb->tb_mtime || mtime->tv_nsec != tb->tb_mtime_nsec) {
+        /* changed by someone else since the bands were counted */
+        LOG(log_debug, logtype_afpd, "tmused_update(\"%s\"): changed, recount", name);
+        tb->tb_bands = -1;
+        tc->tc_dirty = 1;
+        return;
+    }
+
+    tb->tb_bands += delta;
+    tb->tb_mtime = st.st_mtime;
+    tb->tb_mtime_nsec = ST_MTIME_NSEC(&st);
+    tc->tc_dirty = 1;
+
+    LOG(log_debug, logtype_afpd, "tmused_update(\"%s\"): %lld bands", name, tb->tb_bands);
+}
+
+void tmused_close(struct vol *vol)
+{
+    struct tm_cache *tc = vol->v_tm_cache;
+    int i;
+
+    if (tc == NULL)
+        return;
+
+    if (tc->tc_dirty)
+        tm_save(vol, tc);
+
+    for (i = 0; i < tc->tc_count; i++)
+        free(tc->tc_bundles[i].tb_name);
+    free(tc->tc_bundles);
+    free(tc);
+    vol->v_tm_cache = NULL;
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ */
+
+#ifndef AFPD_TMUSED_H
+#define AFPD_TMUSED_H 1
+
+#include <time.h>
+
+#include <atalk/volume.h>
+#include <atalk/directory.h>
+
+extern int  tmused_get      (struct vol * restrict vol);
+extern void tmused_prepare  (const struct vol *vol, const struct dir *dir, struct timespec *mtime);
+extern void tmused_update   (struct vol *vol, const struct dir *dir, int delta,
+                             const struct timespec *mtime);
+extern void tmused_close    (struct vol *vol);
+
+#endif /* AFPD_TMUSED_H */
@@ -57,164 +57,13 @@
 #include "fork.h"
 #include "hash.h"
 #include "acls.h"
+#include "catidx.h"
+#include "tmused.h"
 
 #define VOLPASSLEN  8
 
 extern int afprun(int root, char *cmd, int *outfd);
 
-/*!
- * Read band-size info from Info.plist XML file of an TM sparsebundle
- *
- * @param path   (r) path to Info.plist file
- * @return           band-size in bytes, -1 on error
- */
-static long long int get_tm_bandsize(const char *path)
-{
-    EC_INIT;
-    FILE *file = NULL;
-    char buf[512];
-    long long int bandsize = -1;
-
-    EC_NULL_LOGSTR( file = fopen(path, "r"),
-                    "get_tm_bandsize(\"%s\"): %s",
-                    path, strerror(errno) );
-
-    while (fgets(buf, sizeof(buf), file) != NULL) {
-        if (strstr(buf, "band-size") == NULL)
-            continue;
-
-        if (fscanf(file, " <integer>%lld</integer>", &bandsize) != 1) {
-            LOG(log_error, logtype_afpd, "get_tm_bandsize(\"%s\"): can't parse band-size", path);
-            EC_FAIL;
-        }
-        break;
-    }
-
-EC_CLEANUP:
-    if (file)
-        fclose(file);
-    LOG(log_debug, logtype_afpd, "get_tm_bandsize(\"%s\"): bandsize: %lld", path, bandsize);
-    return bandsize;
-}
-
-/*!
- * Return number on entries in a directory
- *
- * @param path   (r) path to dir
- * @return           number of entries, -1 on error
- */
-static long long int get_tm_bands(const char *path)
-{
-    EC_INIT;
-    long long int count = 0;
-    DIR *dir = NULL;
-    const struct dirent *entry;
-
-    EC_NULL( dir = opendir(path) );
-
-    while ((entry = readdir(dir)) != NULL)
-        count++;
-    count -= 2; /* All OSens I'm aware of return "." and "..", so just substract them, avoiding string comparison in loop */
-        
-EC_CLEANUP:
-    if (dir)
-        closedir(dir);
-    if (ret != 0)
-        return -1;
-    return count;
-}
-
-/*!
- * Calculate used size of a TimeMachine volume
- *
- * This assumes that the volume is used only for TimeMachine.
- *
- * 1) readdir(path of volume)
- * 2) for every element that matches regex "\(.*\)\.sparsebundle$" :
- * 3) parse "\1.sparsebundle/Info.plist" and read the band-size XML key integer value
- * 4) readdir "\1.sparsebundle/bands/" counting files
- * 5) calculate used size as: (file_count - 1) * band-size
- *
- * The result of the calculation is returned in "volume->v_tm_used".
- * "volume->v_appended" gets reset to 0.
- * "volume->v_tm_cachetime" is updated with the current time from time(NULL).
- *
- * "volume->v_tm_used" is cached for TM_USED_CACHETIME seconds and updated by
- * "volume->v_appended". The latter is increased by X every time the client
- * appends X bytes to a file (in fork.c).
- *
- * @param vol     (rw) volume to calculate
- * @return             0 on success, -1 on error
- */
-#define TM_USED_CACHETIME 60    /* cache for 60 seconds */
-static int get_tm_used(struct vol * restrict vol)
-{
-    EC_INIT;
-    long long int bandsize;
-    VolSpace used = 0;
-    bstring infoplist = NULL;
-    bstring bandsdir = NULL;
-    DIR *dir = NULL;
-    const struct dirent *entry;
-    const char *p;
-    long int links;
-    time_t now = time(NULL);
-
-    if (vol->v_tm_cachetime
-        && ((vol->v_tm_cachetime + TM_USED_CACHETIME) >= now)) {
-        if (vol->v_tm_used == -1)
-            EC_FAIL;
-        vol->v_tm_used += vol->v_appended;
-        vol->v_appended = 0;
-        LOG(log_debug, logtype_afpd, "getused(\"%s\"): cached: %" PRIu64 " bytes",
-            vol->v_path, vol->v_tm_used);
-        return 0;
-    }
-
-    vol->v_tm_cachetime = now;
-
-    EC_NULL( dir = opendir(vol->v_path) );
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (((p = strstr(entry->d_name, "sparsebundle")) != NULL)
-            && (strlen(entry->d_name) == (p + strlen("sparsebundle") - entry->d_name))) {
-
-            EC_NULL_LOG( infoplist = bformat("%s/%s/%s", vol->v_path, entry->d_name, "Info.plist") );
-            
-            if ((bandsize = get_tm_bandsize(cfrombstr(infoplist))) == -1) {
-                bdestroy(infoplist);
-                continue;
-            }
-
-            EC_NULL_LOG( bandsdir = bformat("%s/%s/%s/", vol->v_path, entry->d_name, "bands") );
-
-            if ((links = get_tm_bands(cfrombstr(bandsdir))) == -1) {
-                bdestroy(infoplist);
-                bdestroy(bandsdir);
-                continue;
-            }
-
-            used += (links - 1) * bandsize;
-            LOG(log_debug, logtype_afpd, "getused(\"%s\"): bands: %" PRIu64 " bytes",
-                cfrombstr(bandsdir), used);
-        }
-    }
-
-    vol->v_tm_used = used;
-
-EC_CLEANUP:
-    if (infoplist)
-        bdestroy(infoplist);
-    if (bandsdir)
-        bdestroy(bandsdir);
-    if (dir)
-        closedir(dir);
-
-    LOG(log_debug, logtype_afpd, "getused(\"%s\"): %" PRIu64 " bytes", vol->v_path, vol->v_tm_used);
-
-    EC_EXIT;
-}
-
 static int getvolspace(const AFPObj *obj, struct vol *vol,
                        uint32_t *bfree, uint32_t *btotal,
                        VolSpace *xbfree, VolSpace *xbtotal, uint32_t *bsize)
@@ -256,7 +105,7 @@ static int getvolspace(const AFPObj *obj, struct vol *vol,
 
 getvolspace_done:
     if (vol->v_limitsize) {
-        if (get_tm_used(vol) != 0)
+        if (tmused_get(vol) != 0)
             return AFPERR_MISC;
 
         *xbtotal = MIN(*xbtotal, (vol->v_limitsize * 1024 * 1024));
@@ -866,6 +715,10 @@ int afp_openvol(AFPObj *obj, char *ibuf, size_t ibuflen _U_, char *rbuf, size_t
                 ret = AFPERR_MISC;
                 goto openvol_err;
             }
+
+            if (catidx_open(volume) != 0)
+                LOG(log_error, logtype_afpd, "afp_openvol(%s): can't open catsearch index",
+                    volume->v_path);
         }
 
         const char *msg;
@@ -884,6 +737,8 @@ openvol_err:
     }
 
     volume->v_flags &= ~AFPVOL_OPEN;
+    catidx_close(volume);
+    tmused_close(volume);
     if (volume->v_cdb != NULL) {
         cnid_close(volume->v_cdb);
         volume->v_cdb = NULL;
@@ -904,6 +759,8 @@ void closevol(const AFPObj *obj, struct vol *vol)
 
     dir_free( vol->v_root );
     vol->v_root = NULL;
+    catidx_close(vol);
+    tmused_close(vol);
     if (vol->v_cdb != NULL) {
         cnid_close(vol->v_cdb);
         vol->v_cdb = NULL;
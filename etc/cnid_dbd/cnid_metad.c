@@ -495,6 +495,7 @@ int main(int argc, char *argv[])
 
     if (afp_config_parse(&obj, "cnid_metad") != 0)
         daemon_exit(1);
+    setuplog_async(obj.options.logbuffer);
 
     (void)setlimits();
 
@@ -532,6 +533,7 @@ int main(int argc, char *argv[])
     sigdelset(&set, SIGCHLD);
 
     while (1) {
+        log_flush();
         rqstfd = usockfd_check(srvfd, &set);
         /* Collect zombie processes and log what happened to them */
         if (sigchild) while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
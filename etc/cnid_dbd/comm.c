@@ -43,9 +43,12 @@
 struct connection {
     time_t tm;                    /* When respawned last */
     int    fd;
+    int    busy;                  /* request is processed by a worker thread */
 };
 
 static int   control_fd;
+static int   wakeup_fd = -1;
+static void  (*wakeup_fn)(void);
 static int   cur_fd;
 static struct connection *fd_table;
 static int  fd_table_size;
@@ -67,6 +70,7 @@ static void invalidate_fd(int fd)
     fds_in_use--;
     fd_table[i] = fd_table[fds_in_use];
     fd_table[fds_in_use].fd = -1;
+    fd_table[fds_in_use].busy = 0;
     close(fd);
     return;
 }
@@ -81,11 +85,10 @@ static void invalidate_fd(int fd)
  *  things and clean up fd_table. The same happens for any read/write errors.
  */
 
-static int check_fd(time_t timeout, const sigset_t *sigmask, time_t *now)
+static int check_fd(const struct timespec *timeout, const sigset_t *sigmask, time_t *now)
 {
     int fd;
     fd_set readfds;
-    struct timespec tv;
     int ret;
     int i;
     int maxfd = control_fd;
@@ -94,15 +97,21 @@ static int check_fd(time_t timeout, const sigset_t *sigmask, time_t *now)
     FD_ZERO(&readfds);
     FD_SET(control_fd, &readfds);
 
+    if (wakeup_fd != -1) {
+        FD_SET(wakeup_fd, &readfds);
+        if (maxfd < wakeup_fd)
+            maxfd = wakeup_fd;
+    }
+
     for (i = 0; i != fds_in_use; i++) {
+        if (fd_table[i].busy)
+            continue;
         FD_SET(fd_table[i].fd, &readfds);
         if (maxfd < fd_table[i].fd)
             maxfd = fd_table[i].fd;
     }
 
-    tv.tv_nsec = 0;
-    tv.tv_sec  = timeout;
-    if ((ret = pselect(maxfd + 1, &readfds, NULL, NULL, &tv, sigmask)) < 0) {
+    if ((ret = pselect(maxfd + 1, &readfds, NULL, NULL, timeout, sigmask)) < 0) {
         if (errno == EINTR)
             return 0;
         LOG(log_error, logtype_cnid, "error in select: %s",strerror(errno));
@@ -116,6 +125,11 @@ static int check_fd(time_t timeout, const sigset_t *sigmask, time_t *now)
     if (!ret)
         return 0;
 
+    if (wakeup_fd != -1 && FD_ISSET(wakeup_fd, &readfds)) {
+        wakeup_fn();
+        return 0;
+    }
+
 
     if (FD_ISSET(control_fd, &readfds)) {
         int    l = 0;
@@ -131,12 +145,20 @@ static int check_fd(time_t timeout, const sigset_t *sigmask, time_t *now)
         } else {
             time_t older = t;
 
+            l = -1;
             for (i = 0; i != fds_in_use; i++) {
-                if (older <= fd_table[i].tm) {
+                if (fd_table[i].busy)
+                    continue;
+                if (l == -1 || older <= fd_table[i].tm) {
                     older = fd_table[i].tm;
                     l = i;
                 }
             }
+            if (l == -1) {
+                /* all connections are busy, the client will retry */
+                close(fd);
+                return 0;
+            }
             close(fd_table[l].fd);
             fd_table[l].fd = fd;
             fd_table[l].tm = t;
@@ -145,7 +167,7 @@ static int check_fd(time_t timeout, const sigset_t *sigmask, time_t *now)
     }
 
     for (i = 0; i != fds_in_use; i++) {
-        if (FD_ISSET(fd_table[i].fd, &readfds)) {
+        if (!fd_table[i].busy && FD_ISSET(fd_table[i].fd, &readfds)) {
             fd_table[i].tm = t;
             return fd_table[i].fd;
         }
@@ -165,8 +187,10 @@ int comm_init(struct db_param *dbp, int ctrlfd, int clntfd)
         LOG(log_error, logtype_cnid, "Out of memory");
         return -1;
     }
-    for (i = 0; i != fd_table_size; i++)
+    for (i = 0; i != fd_table_size; i++) {
         fd_table[i].fd = -1;
+        fd_table[i].busy = 0;
+    }
     /* from dup2 */
     control_fd = ctrlfd;
 #if 0
@@ -193,7 +217,7 @@ int comm_nbe(void)
 }
 
 /* ------------ */
-int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout, const sigset_t *sigmask, time_t *now)
+int comm_rcv(struct cnid_dbd_rqst *rqst, const struct timespec *timeout, const sigset_t *sigmask, time_t *now)
 {
     char *nametmp;
     int b;
@@ -236,9 +260,48 @@ int comm_rcv(struct cnid_dbd_rqst *rqst, time_t timeout, const sigset_t *sigmask
     return 1;
 }
 
+/* ------------
+ * Hand over the connection of the current request to a worker thread,
+ * it isn't checked for requests until comm_release().
+ */
+int comm_hold(void)
+{
+    int i;
+
+    for (i = 0; i != fds_in_use; i++)
+        if (fd_table[i].fd == cur_fd)
+            fd_table[i].busy = 1;
+    return cur_fd;
+}
+
+/* ------------ */
+void comm_release(int fd, int ok)
+{
+    int i;
+
+    for (i = 0; i != fds_in_use; i++) {
+        if (fd_table[i].fd == fd) {
+            fd_table[i].busy = 0;
+            if (!ok)
+                invalidate_fd(fd);
+            return;
+        }
+    }
+}
+
+/* ------------
+ * Call fn from the main loop when fd becomes readable
+ */
+void comm_set_wakeup(int fd, void (*fn)(void))
+{
+    wakeup_fd = fd;
+    wakeup_fn = fn;
+}
+
 /* ------------ */
 #define USE_WRITEV
-int comm_snd(struct cnid_dbd_rply *rply)
+/* Send a reply on fd, returns 0 on error */
+int comm_snd_fd(int fd, struct cnid_dbd_rply *rply)
 {
 #ifdef USE_WRITEV
     struct iovec iov[2];
@@ -246,9 +309,8 @@ int comm_snd(struct cnid_dbd_rply *rply)
 #endif
 
     if (!rply->namelen) {
-        if (write(cur_fd, rply, sizeof(struct cnid_dbd_rply)) != sizeof(struct cnid_dbd_rply)) {
+        if (write(fd, rply, sizeof(struct cnid_dbd_rply)) != sizeof(struct cnid_dbd_rply)) {
             LOG(log_error, logtype_cnid, "error writing message header: %s", strerror(errno));
-            invalidate_fd(cur_fd);
             return 0;
         }
         return 1;
@@ -261,24 +323,29 @@ int comm_snd(struct cnid_dbd_rply *rply)
     iov[1].iov_len = rply->namelen;
     towrite = sizeof(struct cnid_dbd_rply) +rply->namelen;
 
-    if (writev(cur_fd, iov, 2) != towrite) {
+    if (writev(fd, iov, 2) != towrite) {
         LOG(log_error, logtype_cnid, "error writing message : %s", strerror(errno));
-        invalidate_fd(cur_fd);
         return 0;
     }
 #else
-    if (write(cur_fd, rply, sizeof(struct cnid_dbd_rply)) != sizeof(struct cnid_dbd_rply)) {
+    if (write(fd, rply, sizeof(struct cnid_dbd_rply)) != sizeof(struct cnid_dbd_rply)) {
         LOG(log_error, logtype_cnid, "error writing message header: %s", strerror(errno));
-        invalidate_fd(cur_fd);
         return 0;
     }
-    if (write(cur_fd, rply->name, rply->namelen) != rply->namelen) {
+    if (write(fd, rply->name, rply->namelen) != rply->namelen) {
         LOG(log_error, logtype_cnid, "error writing message name: %s", strerror(errno));
-        invalidate_fd(cur_fd);
         return 0;
     }
 #endif
     return 1;
 }
 
+/* ------------ */
+int comm_snd(struct cnid_dbd_rply *rply)
+{
+    int ret;
 
+    if ((ret = comm_snd_fd(cur_fd, rply)) == 0)
+        invalidate_fd(cur_fd);
+    return ret;
+}
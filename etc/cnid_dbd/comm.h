@@ -13,8 +13,12 @@
 
 
 extern int      comm_init  (struct db_param *, int, int);
-extern int      comm_rcv  (struct cnid_dbd_rqst *,  time_t, const sigset_t *, time_t *);
+extern int      comm_rcv  (struct cnid_dbd_rqst *, const struct timespec *, const sigset_t *, time_t *);
 extern int      comm_snd  (struct cnid_dbd_rply *);
+extern int      comm_snd_fd (int, struct cnid_dbd_rply *);
+extern int      comm_hold (void);
+extern void     comm_release (int, int);
+extern void     comm_set_wakeup (int, void (*)(void));
 extern int      comm_nbe  (void);
 
 #endif /* CNID_DBD_COMM_H */
@@ -69,6 +69,9 @@ static void default_params(struct db_param *dbp, char *dir)
     if ( dbp->fd_table_size > FD_SETSIZE -1)
         dbp->fd_table_size = FD_SETSIZE -1;
     dbp->idle_timeout        = DEFAULT_IDLE_TIMEOUT;
+    dbp->workers             = DEFAULT_WORKERS;
+    dbp->group_commit        = DEFAULT_GROUP_COMMIT;
+    dbp->group_commit_window = DEFAULT_GROUP_COMMIT_WINDOW;
 
     return;
 }
@@ -162,6 +165,15 @@ struct db_param *db_param_read(char *dir)
         } else if (! strcmp(key, "idle_timeout")) {
             params.idle_timeout = parse_int(val);
             LOG(log_info, logtype_cnid, "db_param: setting idle timeout to %d", params.idle_timeout);
+        } else if (! strcmp(key, "workers")) {
+            params.workers = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting worker threads to %d", params.workers);
+        } else if (! strcmp(key, "group_commit")) {
+            params.group_commit = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting group commit size to %d", params.group_commit);
+        } else if (! strcmp(key, "group_commit_window")) {
+            params.group_commit_window = parse_int(val);
+            LOG(log_info, logtype_cnid, "db_param: setting group commit window to %d ms", params.group_commit_window);
         }
 
         if (parse_err)
@@ -188,6 +200,17 @@ struct db_param *db_param_read(char *dir)
         if (params.idle_timeout <= 0)
             params.idle_timeout = 86400;
 
+        if (params.workers < 0)
+            params.workers = 0;
+
+        if (params.group_commit < 0)
+            params.group_commit = 0;
+        else if (params.group_commit > MAX_GROUP_COMMIT)
+            params.group_commit = MAX_GROUP_COMMIT;
+
+        if (params.group_commit_window < 0)
+            params.group_commit_window = 0;
+
         return &params;
     }
     else
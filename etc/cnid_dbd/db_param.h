@@ -18,6 +18,10 @@
 #define DEFAULT_USOCK_FILE         "usock"
 #define DEFAULT_FD_TABLE_SIZE      512
 #define DEFAULT_IDLE_TIMEOUT       (10 * 60)
+#define DEFAULT_WORKERS            0
+#define DEFAULT_GROUP_COMMIT       0
+#define DEFAULT_GROUP_COMMIT_WINDOW 2         /* ms */
+#define MAX_GROUP_COMMIT           256
 
 struct db_param {
     char *dir;
@@ -31,6 +35,9 @@ struct db_param {
     int fd_table_size;
     int idle_timeout;
     int max_vols;
+    int workers;                /* threads for read-only requests */
+    int group_commit;           /* max writes per log flush, 0: flush every write */
+    int group_commit_window;    /* ms to wait for more writes before flushing */
 };
 
 extern struct db_param *db_param_read  (char *);
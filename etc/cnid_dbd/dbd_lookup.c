@@ -314,3 +314,103 @@ int dbd_lookup(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
 
     return rc;
 }
+
+/*
+ * Like dbd_lookup() but read-only: *id is only set if the dev/ino and the
+ * did/name record exist and agree on the CNID and the type.
+ */
+static int lookup_clean(DBD *dbd, struct cnid_dbd_rqst *rqst, cnid_t *id)
+{
+    unsigned char *buf;
+    DBT key, devdata, diddata;
+    cnid_t id_devino, id_didname;
+    u_int32_t type_devino, type_didname;
+    int rc;
+
+    memset(&key, 0, sizeof(key));
+    memset(&diddata, 0, sizeof(diddata));
+    memset(&devdata, 0, sizeof(devdata));
+
+    *id = CNID_INVALID;
+    buf = pack_cnid_data(rqst);
+
+    key.data = buf + CNID_DEVINO_OFS;
+    key.size = CNID_DEVINO_LEN;
+    if ((rc = dbif_get(dbd, DBIF_IDX_DEVINO, &key, &devdata, 0)) <= 0)
+        return rc;
+    memcpy(&id_devino, devdata.data, sizeof(id_devino));
+    memcpy(&type_devino, (char *)devdata.data + CNID_TYPE_OFS, sizeof(type_devino));
+
+    key.data = buf + CNID_DID_OFS;
+    key.size = CNID_DID_LEN + rqst->namelen + 1;
+    if ((rc = dbif_get(dbd, DBIF_IDX_DIDNAME, &key, &diddata, 0)) <= 0)
+        return rc;
+    memcpy(&id_didname, diddata.data, sizeof(id_didname));
+    memcpy(&type_didname, (char *)diddata.data + CNID_TYPE_OFS, sizeof(type_didname));
+
+    if (id_devino == id_didname
+        && ntohl(type_devino) == rqst->type
+        && ntohl(type_didname) == rqst->type)
+        *id = id_didname;
+
+    return 0;
+}
+
+/*
+ * Look up a batch of CNIDs in one request, see CNID_DBD_OP_LOOKUP_BATCH.
+ *
+ * This never modifies the database: only entries whose dev/ino and did/name
+ * records agree get their CNID, everything else is CNID_INVALID and left to
+ * dbd_lookup() resp. dbd_add() which know how to salvage them.
+ */
+int dbd_lookup_batch(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
+{
+    static cnid_t ids[DBD_MAX_BATCH];
+    static char name[MAXPATHLEN + 1];
+    struct cnid_dbd_batch ent;
+    struct cnid_dbd_rqst lookup;
+    const char *p = rqst->name;
+    const char *end = rqst->name + rqst->namelen;
+    int count = 0, found = 0;
+
+    rply->name = (char *)ids;
+    rply->namelen = 0;
+
+    while (p + sizeof(ent) <= end && count < DBD_MAX_BATCH) {
+        memcpy(&ent, p, sizeof(ent));
+        p += sizeof(ent);
+        if (ent.namelen > MAXPATHLEN || p + ent.namelen > end) {
+            LOG(log_error, logtype_cnid, "dbd_lookup_batch: malformed request");
+            rply->result = CNID_DBD_RES_ERR_DB;
+            return 0;
+        }
+        memcpy(name, p, ent.namelen);
+        name[ent.namelen] = 0;
+        p += ent.namelen;
+
+        memset(&lookup, 0, sizeof(lookup));
+        lookup.op = CNID_DBD_OP_LOOKUP;
+        lookup.did = ent.did;
+        lookup.dev = ent.dev;
+        lookup.ino = ent.ino;
+        lookup.type = ent.type;
+        lookup.name = name;
+        lookup.namelen = ent.namelen;
+
+        if (lookup_clean(dbd, &lookup, &ids[count]) < 0) {
+            LOG(log_error, logtype_cnid, "dbd_lookup_batch: Unable to get CNID %u, name %s",
+                ntohl(ent.did), name);
+            rply->result = CNID_DBD_RES_ERR_DB;
+            return -1;
+        }
+        if (ids[count] != CNID_INVALID)
+            found++;
+        count++;
+    }
+
+    LOG(log_debug, logtype_cnid, "dbd_lookup_batch: %d of %d entries found", found, count);
+
+    rply->namelen = count * sizeof(cnid_t);
+    rply->result = CNID_DBD_RES_OK;
+    return 1;
+}
@@ -13,6 +13,7 @@
 
 #include <atalk/logger.h>
 #include <atalk/cnid_bdb_private.h>
+#include <atalk/cnid.h>
 
 #include "dbif.h"
 #include "dbd.h"
@@ -27,13 +28,15 @@ int dbd_search(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
     LOG(log_debug, logtype_cnid, "dbd_search(\"%s\"):", rqst->name);
 
     memset(&key, 0, sizeof(key));
-    rply->name = resbuf;
+    /* worker threads pass their own result buffer */
+    if (rply->name == NULL)
+        rply->name = resbuf;
     rply->namelen = 0;
 
     key.data = (char *)rqst->name;
     key.size = rqst->namelen;
 
-    if ((results = dbif_search(dbd, &key, resbuf)) < 0) {
+    if ((results = dbif_search(dbd, &key, rply->name)) < 0) {
         LOG(log_error, logtype_cnid, "dbd_search(\"%s\"): db error", rqst->name);
         rply->result = CNID_DBD_RES_ERR_DB;
         return -1;
@@ -49,3 +52,101 @@ int dbd_search(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
 
     return 1;
 }
+
+#define SRCH_CANDIDATES 256     /* candidates fetched from the index at once */
+#define SRCH_MAX_ROUNDS 16      /* at most SRCH_MAX_ROUNDS * SRCH_CANDIDATES per request */
+
+/*
+ * Find the names that contain rqst->name, rqst->cnid is the position to
+ * continue at. The number of candidates checked per request is limited, a
+ * reply with CNID_DBD_RES_SRCH_CNT may be empty.
+ */
+int dbd_search_name(DBD *dbd, struct cnid_dbd_rqst *rqst, struct cnid_dbd_rply *rply)
+{
+    static char resbuf[DBD_MAX_SRCH_LEN];
+    static cnid_t cnids[SRCH_CANDIDATES];
+    char name[MAXPATHLEN + 2];
+    char key[MAXPATHLEN + 2];
+    cnid_t pos = rqst->cnid;
+    DBT dbkey, data;
+    const char *dbname;
+    size_t len = 0, entlen, namelen, keylen;
+    int count, i, rc, rounds = 0, matches = 0;
+
+    LOG(log_debug, logtype_cnid, "dbd_search_name(\"%s\", pos: %u)", rqst->name, ntohl(pos));
+
+    if (rply->name == NULL)
+        rply->name = resbuf;
+    rply->namelen = 0;
+
+    if (rqst->namelen == 0 || rqst->namelen > MAXPATHLEN) {
+        rply->result = CNID_DBD_RES_ERR_DB;
+        return -1;
+    }
+    memcpy(name, rqst->name, rqst->namelen);
+    name[rqst->namelen] = 0;
+    /* names are indexed in lowercase */
+    if ((keylen = pack_name_tolower(name, key, sizeof(key))) == 0) {
+        rply->result = CNID_DBD_RES_ERR_DB;
+        return -1;
+    }
+
+    do {
+        if ((count = dbif_search_trigram(dbd, key, keylen, pos, cnids, SRCH_CANDIDATES)) < 0) {
+            LOG(log_error, logtype_cnid, "dbd_search_name(\"%s\"): db error", key);
+            rply->namelen = 0;
+            rply->result = CNID_DBD_RES_ERR_DB;
+            return -1;
+        }
+
+        for (i = 0; i < count; i++) {
+            memset(&dbkey, 0, sizeof(dbkey));
+            memset(&data, 0, sizeof(data));
+            dbkey.data = &cnids[i];
+            dbkey.size = sizeof(cnid_t);
+            if ((rc = dbif_get(dbd, DBIF_CNID, &dbkey, &data, 0)) < 0) {
+                rply->namelen = 0;
+                rply->result = CNID_DBD_RES_ERR_DB;
+                return -1;
+            }
+            if (rc == 0)
+                continue;
+
+            dbname = (const char *)data.data + CNID_NAME_OFS;
+            pack_name_tolower(dbname, name, sizeof(name));
+            if (strstr(name, key) == NULL)
+                continue;
+
+            namelen = strlen(dbname);
+            entlen = 2 * sizeof(cnid_t) + namelen + 1;
+            if (len + entlen > DBD_MAX_SRCH_LEN) {
+                /* continue with this one next time */
+                rply->cnid = i > 0 ? cnids[i - 1] : pos;
+                goto reply;
+            }
+            memcpy(rply->name + len, &cnids[i], sizeof(cnid_t));
+            memcpy(rply->name + len + sizeof(cnid_t), (char *)data.data + CNID_DID_OFS, sizeof(cnid_t));
+            memcpy(rply->name + len + 2 * sizeof(cnid_t), dbname, namelen + 1);
+            len += entlen;
+            matches++;
+        }
+
+        if (count < SRCH_CANDIDATES) {
+            LOG(log_debug, logtype_cnid, "dbd_search_name(\"%s\"): %d matches, done", key, matches);
+            rply->namelen = len;
+            rply->cnid = CNID_INVALID;
+            rply->result = CNID_DBD_RES_SRCH_DONE;
+            return 1;
+        }
+        pos = cnids[count - 1];
+    } while (++rounds < SRCH_MAX_ROUNDS);
+
+    rply->cnid = pos;
+
+reply:
+    LOG(log_debug, logtype_cnid, "dbd_search_name(\"%s\"): %d matches, next pos: %u",
+        key, matches, ntohl(rply->cnid));
+    rply->namelen = len;
+    rply->result = CNID_DBD_RES_SRCH_CNT;
+    return 1;
+}
@@ -362,18 +362,22 @@ DBD *dbif_init(const char *envhome, const char *filename)
     dbd->db_table[DBIF_IDX_DEVINO].name  = "devino.db";
     dbd->db_table[DBIF_IDX_DIDNAME].name = "didname.db";
     dbd->db_table[DBIF_IDX_NAME].name    = "name.db";
+    dbd->db_table[DBIF_IDX_TRIGRAM].name = "trigram.db";
 
     dbd->db_table[DBIF_CNID].type        = DB_BTREE;
     dbd->db_table[DBIF_IDX_DEVINO].type  = DB_BTREE;
     dbd->db_table[DBIF_IDX_DIDNAME].type = DB_BTREE;
     dbd->db_table[DBIF_IDX_NAME].type    = DB_BTREE;
+    dbd->db_table[DBIF_IDX_TRIGRAM].type = DB_BTREE;
 
     dbd->db_table[DBIF_CNID].openflags        = DB_CREATE;
     dbd->db_table[DBIF_IDX_DEVINO].openflags  = DB_CREATE;
     dbd->db_table[DBIF_IDX_DIDNAME].openflags = DB_CREATE;
     dbd->db_table[DBIF_IDX_NAME].openflags    = DB_CREATE;
+    dbd->db_table[DBIF_IDX_TRIGRAM].openflags = DB_CREATE;
 
     dbd->db_table[DBIF_IDX_NAME].flags = DB_DUPSORT;
+    dbd->db_table[DBIF_IDX_TRIGRAM].flags = DB_DUPSORT;
 
     return dbd;
 }
@@ -464,6 +468,15 @@ int dbif_env_open(DBD *dbd, struct db_param *dbp, uint32_t dbenv_oflags)
         return -1;
     }
 
+    /* Worker threads read concurrently with the writer, resolve deadlocks in favour of it */
+    if (dbp->workers > 0 && (ret = dbd->db_env->set_lk_detect(dbd->db_env, DB_LOCK_MINWRITE))) {
+        LOG(log_error, logtype_cnid, "error setting DB environment deadlock detection: %s",
+            db_strerror(ret));
+        dbd->db_env->close(dbd->db_env, 0);
+        dbd->db_env = NULL;
+        return -1;
+    }
+
     if ((ret = dbd->db_env->open(dbd->db_env, dbd->db_envhome, dbenv_oflags, 0))) {
         LOG(log_error, logtype_cnid, "error opening DB environment after recovery: %s",
             db_strerror(ret));
@@ -663,6 +676,23 @@ int dbif_open(DBD *dbd, struct db_param *dbp, int reindex)
     if (reindex)
         LOG(log_info, logtype_cnid, "... done.");
 
+    /*
+     * The trigram index was added without a version change, with DB_CREATE
+     * associate() builds it if it's empty
+     */
+    if (reindex)
+        LOG(log_info, logtype_cnid, "Reindexing trigram index...");
+    if ((ret = dbd->db_table[0].db->associate(dbd->db_table[0].db,
+                                              dbd->db_txn,
+                                              dbd->db_table[DBIF_IDX_TRIGRAM].db,
+                                              idxtrigram,
+                                              DB_CREATE)) != 0) {
+        LOG(log_error, logtype_cnid, "Failed to associate trigram index: %s", db_strerror(ret));
+        return -1;
+    }
+    if (reindex)
+        LOG(log_info, logtype_cnid, "... done.");
+
     if ((dbd->db_envhome) && ((ret = dbif_upgrade(dbd)) != 0)) {
         LOG(log_error, logtype_cnid, "Error upgrading CNID database to version %d", CNID_VERSION);
         return -1;
@@ -671,6 +701,88 @@ int dbif_open(DBD *dbd, struct db_param *dbp, int reindex)
     return 0;
 }
 
+/*!
+ * Open another set of handles of the databases of dbd for read-only access
+ * from a worker thread
+ *
+ * The handles share the environment of dbd which must have been opened with
+ * DB_THREAD. Reads through these handles are not part of a transaction.
+ */
+DBD *dbif_reader_open(DBD *dbd)
+{
+    DBD *rd;
+    int ret, i;
+
+    if ((rd = calloc(1, sizeof(DBD))) == NULL)
+        return NULL;
+
+    rd->db_env = dbd->db_env;
+    rd->db_param = dbd->db_param;
+    rd->db_envhome = dbd->db_envhome;
+    rd->db_filename = dbd->db_filename;
+    memcpy(rd->db_table, dbd->db_table, sizeof(rd->db_table));
+
+    for (i = 0; i != DBIF_DB_CNT; i++) {
+        rd->db_table[i].db = NULL;
+        if ((ret = db_create(&rd->db_table[i].db, rd->db_env, 0))) {
+            LOG(log_error, logtype_cnid, "error creating handle for database %s: %s",
+                rd->db_table[i].name, db_strerror(ret));
+            goto error;
+        }
+        if (rd->db_table[i].flags
+            && (ret = rd->db_table[i].db->set_flags(rd->db_table[i].db, rd->db_table[i].flags))) {
+            LOG(log_error, logtype_cnid, "error setting flags for database %s: %s",
+                rd->db_table[i].name, db_strerror(ret));
+            goto error;
+        }
+        if ((ret = rd->db_table[i].db->open(rd->db_table[i].db,
+                                            NULL,
+                                            rd->db_filename,
+                                            rd->db_table[i].name,
+                                            rd->db_table[i].type,
+                                            DB_RDONLY,
+                                            0664))) {
+            LOG(log_error, logtype_cnid, "error opening database %s read-only: %s",
+                rd->db_table[i].name, db_strerror(ret));
+            goto error;
+        }
+    }
+
+    if ((ret = rd->db_table[DBIF_CNID].db->associate(rd->db_table[DBIF_CNID].db, NULL,
+                                                     rd->db_table[DBIF_IDX_DIDNAME].db,
+                                                     didname, 0))
+        || (ret = rd->db_table[DBIF_CNID].db->associate(rd->db_table[DBIF_CNID].db, NULL,
+                                                        rd->db_table[DBIF_IDX_DEVINO].db,
+                                                        devino, 0))
+        || (ret = rd->db_table[DBIF_CNID].db->associate(rd->db_table[DBIF_CNID].db, NULL,
+                                                        rd->db_table[DBIF_IDX_NAME].db,
+                                                        idxname, 0))
+        || (ret = rd->db_table[DBIF_CNID].db->associate(rd->db_table[DBIF_CNID].db, NULL,
+                                                        rd->db_table[DBIF_IDX_TRIGRAM].db,
+                                                        idxtrigram, 0))) {
+        LOG(log_error, logtype_cnid, "Failed to associate indexes: %s", db_strerror(ret));
+        goto error;
+    }
+
+    return rd;
+
+error:
+    dbif_reader_close(rd);
+    return NULL;
+}
+
+/* ------------------------ */
+void dbif_reader_close(DBD *rd)
+{
+    int i;
+
+    for (i = DBIF_DB_CNT - 1; i >= 0; i--) {
+        if (rd->db_table[i].db != NULL)
+            rd->db_table[i].db->close(rd->db_table[i].db, 0);
+    }
+    free(rd);
+}
+
 /* ------------------------ */
 static int dbif_closedb(DBD *dbd)
 {
@@ -785,6 +897,38 @@ int dbif_env_remove(const char *path)
     return 0;
 }
 
+/*!
+ * Let DB return data in a buffer of dbd instead of memory of the DB handle
+ *
+ * With workers the environment is opened with DB_THREAD and all handles are
+ * free-threaded, then DB only returns data into DBTs with DB_DBT_MALLOC,
+ * DB_DBT_REALLOC or DB_DBT_USERMEM. The buffers of dbd are used in turn, so
+ * returned data stays valid for the next DBIF_RBUF_CNT - 1 calls on dbd. DBTs
+ * that already have one of our buffers keep it, e.g. in cursor loops.
+ *
+ * @param copy   (r) copy the data in dbt, for keys that are input and output
+ */
+static void dbif_usermem(DBD *dbd, DBT *dbt, int copy)
+{
+    char *buf;
+
+    if (dbt->flags & (DB_DBT_MALLOC | DB_DBT_REALLOC))
+        return;
+    if (dbt->flags & DB_DBT_USERMEM)
+        /* the caller's own buffer or one of ours from a previous call */
+        return;
+    if (copy && dbt->size > DBIF_RBUF_SIZE)
+        return;
+
+    buf = dbd->db_rbuf[dbd->db_rbuf_next];
+    dbd->db_rbuf_next = (dbd->db_rbuf_next + 1) % DBIF_RBUF_CNT;
+    if (copy && dbt->size)
+        memcpy(buf, dbt->data, dbt->size);
+    dbt->data = buf;
+    dbt->ulen = DBIF_RBUF_SIZE;
+    dbt->flags |= DB_DBT_USERMEM;
+}
+
 /*
  *  The following three functions are wrappers for DB->get(), DB->put() and DB->del().
  *  All three return -1 on error. dbif_get()/dbif_del return 1 if the key was found and 0
@@ -799,11 +943,15 @@ int dbif_get(DBD *dbd, const int dbi, DBT *key, DBT *val, u_int32_t flags)
 {
     int ret;
 
-    ret = dbd->db_table[dbi].db->get(dbd->db_table[dbi].db,
-                                     dbd->db_txn,
-                                     key,
-                                     val,
-                                     flags);
+    dbif_usermem(dbd, val, 0);
+    do {
+        ret = dbd->db_table[dbi].db->get(dbd->db_table[dbi].db,
+                                         dbd->db_txn,
+                                         key,
+                                         val,
+                                         flags);
+        /* a read outside of a transaction can simply be retried */
+    } while (ret == DB_LOCK_DEADLOCK && dbd->db_txn == NULL);
 
     if (ret == DB_NOTFOUND)
         return 0;
@@ -820,12 +968,16 @@ int dbif_pget(DBD *dbd, const int dbi, DBT *key, DBT *pkey, DBT *val, u_int32_t
 {
     int ret;
 
-    ret = dbd->db_table[dbi].db->pget(dbd->db_table[dbi].db,
-                                      dbd->db_txn,
-                                      key,
-                                      pkey,
-                                      val,
-                                      flags);
+    dbif_usermem(dbd, pkey, 0);
+    dbif_usermem(dbd, val, 0);
+    do {
+        ret = dbd->db_table[dbi].db->pget(dbd->db_table[dbi].db,
+                                          dbd->db_txn,
+                                          key,
+                                          pkey,
+                                          val,
+                                          flags);
+    } while (ret == DB_LOCK_DEADLOCK && dbd->db_txn == NULL);
 
     if (ret == DB_NOTFOUND || ret == DB_SECONDARY_BAD) {
         return 0;
@@ -932,6 +1084,9 @@ int dbif_search(DBD *dbd, DBT *key, char *resbuf)
         goto exit;
     }
 
+    dbif_usermem(dbd, key, 1);
+    dbif_usermem(dbd, &pkey, 0);
+    dbif_usermem(dbd, &data, 0);
     ret = cursorp->pget(cursorp, key, &pkey, &data, DB_SET_RANGE);
     while (count < DBD_MAX_SRCH_RSLTS && ret != DB_NOTFOUND) {
         if (!((namelenbkp <= key->size) && (strncmp(namebkp, key->data, namelenbkp) == 0)))
@@ -953,6 +1108,112 @@ exit:
     return ret;
 }
 
+/*!
+ * Get the CNIDs of the candidates of a substring name search
+ *
+ * The candidates are the CNIDs of all names that contain the least frequent
+ * trigram of key. Keys shorter than a trigram can't use the index, for them
+ * all CNIDs are candidates. The caller must check the names.
+ *
+ * @param key       (r) lowercased name fragment as used by the name indexes
+ * @param pos       (r) return CNIDs greater than pos
+ * @param cnids     (w) candidate CNIDs in ascending order
+ * @param count     (r) size of cnids
+ *
+ * @returns -1 on error, else the number of candidates, less than count if
+ *          there are no more
+ */
+int dbif_search_trigram(DBD *dbd, const char *key, size_t keylen, cnid_t pos,
+                        cnid_t *cnids, int count)
+{
+    int ret, n = 0;
+    size_t i;
+    db_recno_t dups, mindups = 0;
+    DB *db;
+    DBC *cursorp = NULL;
+    DBT skey, pkey, data;
+    const char *gram = NULL;
+    cnid_t start;
+
+    memset(&skey, 0, sizeof(DBT));
+    memset(&pkey, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+
+    start = htonl(ntohl(pos) + 1);
+
+    if (keylen < TRIGRAM_LEN) {
+        /* walk all CNIDs, CNID 0 is the rootinfo key */
+        if (start == 0)
+            start = htonl(1);
+        db = dbd->db_table[DBIF_CNID].db;
+        if ((ret = db->cursor(db, NULL, &cursorp, 0)) != 0)
+            goto error;
+
+        pkey.data = &start;
+        pkey.size = sizeof(cnid_t);
+        dbif_usermem(dbd, &pkey, 1);
+        dbif_usermem(dbd, &data, 0);
+        ret = cursorp->get(cursorp, &pkey, &data, DB_SET_RANGE);
+        while (n < count && ret == 0) {
+            memcpy(&cnids[n++], pkey.data, sizeof(cnid_t));
+            ret = cursorp->get(cursorp, &pkey, &data, DB_NEXT);
+        }
+        if (ret != 0 && ret != DB_NOTFOUND)
+            goto error;
+        cursorp->close(cursorp);
+        return n;
+    }
+
+    db = dbd->db_table[DBIF_IDX_TRIGRAM].db;
+    if ((ret = db->cursor(db, NULL, &cursorp, 0)) != 0)
+        goto error;
+
+    /* Find the least frequent trigram, if one is missing there are no matches */
+    dbif_usermem(dbd, &data, 0);
+    for (i = 0; i + TRIGRAM_LEN <= keylen; i++) {
+        skey.data = (char *)key + i;
+        skey.size = TRIGRAM_LEN;
+        if ((ret = cursorp->get(cursorp, &skey, &data, DB_SET)) == DB_NOTFOUND) {
+            cursorp->close(cursorp);
+            return 0;
+        }
+        if (ret != 0)
+            goto error;
+        if ((ret = cursorp->count(cursorp, &dups, 0)) != 0)
+            goto error;
+        if (gram == NULL || dups < mindups) {
+            gram = key + i;
+            mindups = dups;
+        }
+    }
+
+    LOG(log_debug, logtype_cnid, "dbif_search_trigram: \"%.3s\": %u candidates",
+        gram, (unsigned int)mindups);
+
+    skey.data = (char *)gram;
+    skey.size = TRIGRAM_LEN;
+    pkey.data = &start;
+    pkey.size = sizeof(cnid_t);
+    dbif_usermem(dbd, &skey, 1);
+    dbif_usermem(dbd, &pkey, 1);
+    ret = cursorp->pget(cursorp, &skey, &pkey, &data, DB_GET_BOTH_RANGE);
+    while (n < count && ret == 0) {
+        memcpy(&cnids[n++], pkey.data, sizeof(cnid_t));
+        ret = cursorp->pget(cursorp, &skey, &pkey, &data, DB_NEXT_DUP);
+    }
+    if (ret != 0 && ret != DB_NOTFOUND)
+        goto error;
+
+    cursorp->close(cursorp);
+    return n;
+
+error:
+    LOG(log_error, logtype_cnid, "dbif_search_trigram: %s", db_strerror(ret));
+    if (cursorp != NULL)
+        cursorp->close(cursorp);
+    return -1;
+}
+
 int dbif_txn_begin(DBD *dbd)
 {
     int ret;
@@ -985,7 +1246,7 @@ int dbif_txn_commit(DBD *dbd)
     if (dbd->db_env == NULL)
         return 0;
 
-    ret = dbd->db_txn->commit(dbd->db_txn, 0);
+    ret = dbd->db_txn->commit(dbd->db_txn, dbd->db_nosync ? DB_TXN_NOSYNC : 0);
     dbd->db_txn = NULL;
     
     if (ret) {
@@ -1016,6 +1277,25 @@ int dbif_txn_abort(DBD *dbd)
         return 0;
 }
 
+/*!
+ * Write the log of all transactions committed with db_nosync set to disk
+ *
+ * @returns 0 on success, -1 on error
+ */
+int dbif_txn_flush(DBD *dbd)
+{
+    int ret;
+
+    if (dbd->db_env == NULL)
+        return 0;
+
+    if ((ret = dbd->db_env->log_flush(dbd->db_env, NULL))) {
+        LOG(log_error, logtype_cnid, "error flushing log: %s", db_strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
 /* 
    ret = 1 -> commit txn if db_param.txn_frequency
    ret = 0 -> abort txn db_param.txn_frequency -> exit!
@@ -1121,7 +1401,9 @@ int dbif_dump(DBD *dbd, int dumpindexes)
         return -1;
     }
 
-    cur->c_get(cur, &key, &data, DB_FIRST);
+    dbif_usermem(dbd, &key, 0);
+    dbif_usermem(dbd, &data, 0);
+    rc = cur->c_get(cur, &key, &data, DB_FIRST);
     while (rc == 0) {
         /* Parse and print data */
         memcpy(&cnid, key.data, 4);
@@ -1189,7 +1471,7 @@ int dbif_dump(DBD *dbd, int dumpindexes)
             return -1;
         }
         
-        cur->c_get(cur, &key, &data, DB_FIRST);
+        rc = cur->c_get(cur, &key, &data, DB_FIRST);
         while (rc == 0) {
             /* Parse and print data */
 
@@ -1234,7 +1516,7 @@ int dbif_dump(DBD *dbd, int dumpindexes)
             return -1;
         }
         
-        cur->c_get(cur, &key, &data, DB_FIRST);
+        rc = cur->c_get(cur, &key, &data, DB_FIRST);
         while (rc == 0) {
             /* Parse and print data */
 
@@ -1300,8 +1582,11 @@ int dbif_idwalk(DBD *dbd, cnid_t *cnid, int close)
         }
         flag = DB_SET_RANGE;    /* This will seek to next cnid after the one just deleted */
         id = htonl(*cnid);
+        key.flags = data.flags = 0;
         key.data = &id;
         key.size = sizeof(cnid_t);
+        dbif_usermem(dbd, &key, 1);
+        dbif_usermem(dbd, &data, 0);
     } else
         flag = DB_NEXT;
 
@@ -55,14 +55,20 @@
 
 #include <db.h>
 #include <atalk/adouble.h>
+#include <atalk/cnid_private.h>
 #include "db_param.h"
 
-#define DBIF_DB_CNT 4
+#define DBIF_DB_CNT 5
  
 #define DBIF_CNID          0
 #define DBIF_IDX_DEVINO    1
 #define DBIF_IDX_DIDNAME   2
 #define DBIF_IDX_NAME      3
+#define DBIF_IDX_TRIGRAM   4
+
+/* buffers for data returned by DB, see dbif_usermem() */
+#define DBIF_RBUF_CNT      8
+#define DBIF_RBUF_SIZE     (CNID_HEADER_LEN + MAXPATHLEN + 1)
 
 #define LOCKFILENAME  "lock"
 #define LOCK_FREE          0
@@ -83,17 +89,22 @@ typedef struct {
     DB_ENV   *db_env;
     struct db_param db_param;
     DB_TXN   *db_txn;
+    int      db_nosync;            /* commit without flushing the log, see dbif_txn_flush() */
     DBC      *db_cur;              /* for dbif_walk */
     char     *db_envhome;
     char     *db_filename;
     FILE     *db_errlog;
     db_table db_table[DBIF_DB_CNT];
+    int      db_rbuf_next;
+    char     db_rbuf[DBIF_RBUF_CNT][DBIF_RBUF_SIZE];
 } DBD;
 
 extern DBD *dbif_init(const char *envhome, const char *dbname);
 extern int dbif_env_open(DBD *dbd, struct db_param *dbp, uint32_t dbenv_oflags);
 extern int dbif_open(DBD *dbd, struct db_param *dbp, int reindex);
 extern int dbif_close(DBD *dbd);
+extern DBD *dbif_reader_open(DBD *dbd);
+extern void dbif_reader_close(DBD *rd);
 extern int dbif_env_remove(const char *path);
 
 extern int dbif_get(DBD *, const int, DBT *, DBT *, u_int32_t);
@@ -102,10 +113,13 @@ extern int dbif_put(DBD *, const int, DBT *, DBT *, u_int32_t);
 extern int dbif_del(DBD *, const int, DBT *, u_int32_t);
 extern int dbif_count(DBD *, const int, u_int32_t *);
 extern int dbif_search(DBD *dbd, DBT *key, char *resbuf);
+extern int dbif_search_trigram(DBD *dbd, const char *key, size_t keylen, cnid_t pos,
+                               cnid_t *cnids, int count);
 extern int dbif_copy_rootinfokey(DBD *srcdbd, DBD *destdbd);
 extern int dbif_txn_begin(DBD *);
 extern int dbif_txn_commit(DBD *);
 extern int dbif_txn_abort(DBD *);
+extern int dbif_txn_flush(DBD *);
 extern int dbif_txn_close(DBD *dbd, int ret); /* Switch between commit+abort */
 extern int dbif_txn_checkpoint(DBD *, u_int32_t, u_int32_t, u_int32_t);
 
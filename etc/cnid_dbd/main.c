@@ -35,6 +35,7 @@
 #include "dbd.h"
 #include "comm.h"
 #include "pack.h"
+#include "worker.h"
 
 /* 
    Note: DB_INIT_LOCK is here so we can run the db_* utilities while netatalk is running.
@@ -49,6 +50,16 @@ static bstring dbpath;
 static struct db_param *dbp;
 static struct vol *vol;
 
+/* Group commit: replies to writes that wait for the next log flush */
+static struct {
+    int                  fd;
+    struct cnid_dbd_rply rply;
+} group[MAX_GROUP_COMMIT];
+static int group_count;
+static struct timespec group_deadline;
+static unsigned long group_flushes, group_writes;
+static int group_max;
+
 static void sig_exit(int signo)
 {
     exit_sig = signo;
@@ -188,8 +199,11 @@ static int open_db(void)
     if (NULL == (dbd = dbif_init(bdata(dbpath), "cnid2.db")))
         EC_FAIL;
 
-    /* Only recover if we got the lock */
-    if (dbif_env_open(dbd, dbp, DBOPTIONS | DB_RECOVER) < 0)
+    /* With group commit the log is flushed by group_flush() */
+    dbd->db_nosync = dbp->group_commit > 0;
+
+    /* Only recover if we got the lock, worker threads need a free-threaded environment */
+    if (dbif_env_open(dbd, dbp, DBOPTIONS | (dbp->workers > 0 ? DB_THREAD : 0) | DB_RECOVER) < 0)
         EC_FAIL;
 
     LOG(log_debug, logtype_cnid, "Finished initializing BerkeleyDB environment");
@@ -282,6 +296,80 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
+/* Hold the reply to a write until the log has been flushed */
+static void group_add(const struct cnid_dbd_rply *rply)
+{
+    if (group_count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &group_deadline);
+        group_deadline.tv_sec += dbp->group_commit_window / 1000;
+        group_deadline.tv_nsec += (dbp->group_commit_window % 1000) * 1000000L;
+        if (group_deadline.tv_nsec >= 1000000000L) {
+            group_deadline.tv_sec++;
+            group_deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    group[group_count].fd = comm_hold();
+    group[group_count].rply = *rply;
+    group_count++;
+}
+
+/*!
+ * Shorten the timeout tv to the end of the group commit window
+ *
+ * @returns 0 when the window has already passed, 1 otherwise
+ */
+static int group_window(struct timespec *tv)
+{
+    struct timespec now, left;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left.tv_sec = group_deadline.tv_sec - now.tv_sec;
+    left.tv_nsec = group_deadline.tv_nsec - now.tv_nsec;
+    if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000L;
+    }
+    if (left.tv_sec < 0)
+        return 0;
+
+    if (left.tv_sec < tv->tv_sec || (left.tv_sec == tv->tv_sec && left.tv_nsec < tv->tv_nsec))
+        *tv = left;
+    return 1;
+}
+
+/* Flush the log once for all held writes and send their replies */
+static int group_flush(void)
+{
+    int i;
+
+    if (group_count == 0)
+        return 0;
+
+    if (dbif_txn_flush(dbd) < 0)
+        return -1;
+
+    for (i = 0; i < group_count; i++)
+        comm_release(group[i].fd, comm_snd_fd(group[i].fd, &group[i].rply));
+
+    group_flushes++;
+    group_writes += group_count;
+    if (group_max < group_count)
+        group_max = group_count;
+    group_count = 0;
+
+    return 0;
+}
+
+static void group_stat_log(void)
+{
+    if (group_flushes == 0)
+        return;
+
+    LOG(log_info, logtype_cnid, "Group commit: %lu writes in %lu log flushes, %.1f on average, at most %d",
+        group_writes, group_flushes, (double)group_writes / group_flushes, group_max);
+}
+
 static int loop(struct db_param *dbp)
 {
     struct cnid_dbd_rqst rqst;
@@ -293,6 +381,8 @@ static int loop(struct db_param *dbp)
     char timebuf[64];
     static char namebuf[MAXPATHLEN + 1];
     sigset_t set;
+    struct timeval start;
+    struct timespec tv;
 
     sigemptyset(&set);
     sigprocmask(SIG_SETMASK, NULL, &set);
@@ -317,11 +407,21 @@ static int loop(struct db_param *dbp)
         else
             timeout = 1;
 
-        if ((cret = comm_rcv(&rqst, timeout, &set, &now)) < 0)
+        tv.tv_sec = timeout;
+        tv.tv_nsec = 0;
+        if (group_count && !group_window(&tv)) {
+            if (group_flush() != 0)
+                return -1;
+        }
+
+        log_flush();
+        if ((cret = comm_rcv(&rqst, &tv, &set, &now)) < 0)
             return -1;
 
         if (cret == 0) {
             /* comm_rcv returned from select without receiving anything. */
+            if (group_flush() != 0)
+                return -1;
             if (exit_sig) {
                 /* Received signal (TERM|INT) */
                 return 0;
@@ -332,10 +432,14 @@ static int loop(struct db_param *dbp)
             }
             /* still active connections, reset time_last_rqst */
             time_last_rqst = now;
+        } else if (worker_readonly(rqst.op) && worker_submit(&rqst) == 0) {
+            /* A worker thread processes the request and sends the reply */
+            time_last_rqst = now;
         } else {
             /* We got a request */
             time_last_rqst = now;
 
+            gettimeofday(&start, NULL);
             memset(&rply, 0, sizeof(rply));
             switch(rqst.op) {
                 /* ret gets set here */
@@ -357,6 +461,9 @@ static int loop(struct db_param *dbp)
             case CNID_DBD_OP_LOOKUP:
                 ret = dbd_lookup(dbd, &rqst, &rply);
                 break;
+            case CNID_DBD_OP_LOOKUP_BATCH:
+                ret = dbd_lookup_batch(dbd, &rqst, &rply);
+                break;
             case CNID_DBD_OP_UPDATE:
                 ret = dbd_update(dbd, &rqst, &rply);
                 break;
@@ -372,8 +479,18 @@ static int loop(struct db_param *dbp)
             case CNID_DBD_OP_SEARCH:
                 ret = dbd_search(dbd, &rqst, &rply);
                 break;
+            case CNID_DBD_OP_SEARCH_NAME:
+                ret = dbd_search_name(dbd, &rqst, &rply);
+                break;
             case CNID_DBD_OP_WIPE:
-                ret = reinit_db();
+                /* the workers hold handles of the databases that are about to be removed */
+                worker_stop();
+                if (group_flush() != 0)
+                    ret = -1;
+                else
+                    ret = reinit_db();
+                if (worker_start(dbd, dbp->workers) != 0)
+                    ret = -1;
                 break;
             default:
                 LOG(log_error, logtype_cnid, "loop: unknown op %d", rqst.op);
@@ -381,21 +498,33 @@ static int loop(struct db_param *dbp)
                 break;
             }
 
-            if ((cret = comm_snd(&rply)) < 0 || ret < 0) {
-                dbif_txn_abort(dbd);
-                return -1;
-            }
-            
-            if (ret == 0 || cret == 0) {
-                if (dbif_txn_abort(dbd) < 0)
+            if (ret > 0 && dbd->db_txn && dbp->group_commit > 0) {
+                /* Commit without waiting for the disk, reply after the next log flush */
+                if (dbif_txn_commit(dbd) < 0)
+                    return -1;
+                count++;
+                group_add(&rply);
+                op_stat_add(rqst.op, &start);
+                if (group_count >= dbp->group_commit && group_flush() != 0)
                     return -1;
             } else {
-                ret = dbif_txn_commit(dbd);
-                if (  ret < 0)
+                if ((cret = comm_snd(&rply)) < 0 || ret < 0) {
+                    dbif_txn_abort(dbd);
                     return -1;
-                else if ( ret > 0 )
-                    /* We had a designated txn because we wrote to the db */
-                    count++;
+                }
+                op_stat_add(rqst.op, &start);
+
+                if (ret == 0 || cret == 0) {
+                    if (dbif_txn_abort(dbd) < 0)
+                        return -1;
+                } else {
+                    ret = dbif_txn_commit(dbd);
+                    if (  ret < 0)
+                        return -1;
+                    else if ( ret > 0 )
+                        /* We had a designated txn because we wrote to the db */
+                        count++;
+                }
             }
         } /* got a request */
 
@@ -409,6 +538,8 @@ static int loop(struct db_param *dbp)
                 return -1;
             count = 0;
             time_next_flush = now + dbp->flush_interval;
+            op_stat_log();
+            group_stat_log();
 
             strftime(timebuf, 63, "%b %d %H:%M:%S.",localtime(&time_next_flush));
             LOG(log_debug, logtype_cnid, "Checkpoint interval: %d seconds. Next checkpoint: %s",
@@ -530,6 +661,7 @@ int main(int argc, char *argv[])
     }
 
     EC_ZERO( afp_config_parse(&obj, "cnid_dbd") );
+    setuplog_async(obj.options.logbuffer);
 
     if (username) {
         strlcpy(obj.username, username, MAXUSERLEN);
@@ -573,12 +705,21 @@ int main(int argc, char *argv[])
         goto close_db;
     }
 
+    if (worker_start(dbd, dbp->workers) < 0) {
+        ret = -1;
+        goto close_db;
+    }
+
     if (loop(dbp) < 0) {
         ret = -1;
         goto close_db;
     }
 
 close_db:
+    worker_stop();
+    op_stat_log();
+    group_stat_log();
+
     if (dbif_close(dbd) < 0)
         ret = -1;
 
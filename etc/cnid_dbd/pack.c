@@ -10,7 +10,9 @@
 
 #include <arpa/inet.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <sys/param.h>
 #include <db.h>
@@ -74,25 +76,81 @@ int devino(DB *dbp _U_, const DBT *pkey _U_,  const DBT *pdata, DBT *skey)
 }
 
 /* --------------- */
-int idxname(DB *dbp _U_, const DBT *pkey _U_,  const DBT *pdata, DBT *skey)
+/*
+ * Convert name to the lowercase form used as key by the name indexes,
+ * returns the length of the result
+ */
+size_t pack_name_tolower(const char *name, char *buf, size_t buflen)
 {
-    static char buffer[MAXPATHLEN +2];
     uint16_t flags = CONV_TOLOWER;
-    memset(skey, 0, sizeof(DBT));
 
     if (convert_charset(volume->v_volcharset,
                         volume->v_volcharset,
                         volume->v_maccharset,
-                        (char *)pdata->data + CNID_NAME_OFS,
-                        strlen((char *)pdata->data + CNID_NAME_OFS),
-                        buffer,
-                        MAXPATHLEN,
+                        name,
+                        strlen(name),
+                        buf,
+                        buflen - 2,
                         &flags) == (size_t)-1) {
-        LOG(log_error, logtype_cnid, "idxname: conversion error");
+        LOG(log_error, logtype_cnid, "pack_name_tolower: conversion error");
+        buf[0] = 0;
     }
 
+    return strlen(buf);
+}
+
+/* --------------- */
+int idxname(DB *dbp _U_, const DBT *pkey _U_,  const DBT *pdata, DBT *skey)
+{
+    static char buffer[MAXPATHLEN +2];
+    memset(skey, 0, sizeof(DBT));
+
     skey->data = buffer;
-    skey->size = strlen(skey->data);
+    skey->size = pack_name_tolower((char *)pdata->data + CNID_NAME_OFS, buffer, sizeof(buffer));
+    return (0);
+}
+
+/* --------------- */
+/*
+ * One key for every distinct trigram of the lowercased name, names shorter
+ * than a trigram are not indexed
+ */
+int idxtrigram(DB *dbp _U_, const DBT *pkey _U_,  const DBT *pdata, DBT *skey)
+{
+    char buffer[MAXPATHLEN + 2];
+    DBT *keys;
+    char *grams;
+    size_t len, i;
+    u_int32_t j, count = 0;
+
+    memset(skey, 0, sizeof(DBT));
+
+    len = pack_name_tolower((char *)pdata->data + CNID_NAME_OFS, buffer, sizeof(buffer));
+    if (len < TRIGRAM_LEN)
+        return DB_DONOTINDEX;
+
+    /* the keys and the trigrams they point to are freed by BerkeleyDB in one go */
+    if ((keys = malloc((len - TRIGRAM_LEN + 1) * (sizeof(DBT) + TRIGRAM_LEN))) == NULL)
+        return ENOMEM;
+    grams = (char *)(keys + len - TRIGRAM_LEN + 1);
+
+    for (i = 0; i + TRIGRAM_LEN <= len; i++) {
+        for (j = 0; j < count; j++) {
+            if (memcmp(grams + j * TRIGRAM_LEN, buffer + i, TRIGRAM_LEN) == 0)
+                break;
+        }
+        if (j < count)
+            continue;
+        memcpy(grams + count * TRIGRAM_LEN, buffer + i, TRIGRAM_LEN);
+        memset(&keys[count], 0, sizeof(DBT));
+        keys[count].data = grams + count * TRIGRAM_LEN;
+        keys[count].size = TRIGRAM_LEN;
+        count++;
+    }
+
+    skey->data = keys;
+    skey->size = count;
+    skey->flags = DB_DBT_MULTIPLE | DB_DBT_APPMALLOC;
     return (0);
 }
 
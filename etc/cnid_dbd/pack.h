@@ -10,9 +10,14 @@
 #include <db.h>
 #include <atalk/cnid_bdb_private.h>
 
+/* length of the keys of the trigram index */
+#define TRIGRAM_LEN 3
+
 extern unsigned char *pack_cnid_data(struct cnid_dbd_rqst *);
+extern size_t pack_name_tolower(const char *name, char *buf, size_t buflen);
 extern int didname(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 extern int devino(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 extern int idxname(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
+extern int idxtrigram(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey);
 extern void pack_setvol(const struct vol *vol);
 #endif /* CNID_DBD_PACK_H */
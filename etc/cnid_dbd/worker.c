@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ *
+ * Worker threads for read-only requests
+ * =====================================
+ *
+ * With "workers" set in db_param, GET, RESOLVE, SEARCH and GETSTAMP requests
+ * are handed to a pool of threads while the main loop keeps processing the
+ * requests of other clients. Every worker uses its own set of read-only
+ * database handles (dbif_reader_open), reads are not part of a transaction
+ * and thus only see committed data. All requests that write to the database
+ * are still processed by the main loop, which remains the only writer.
+ *
+ * The connection of a request a worker is processing is removed from the
+ * main loop's select set (comm_hold) until the worker has sent the reply.
+ * Finished requests are passed back to the main loop through a pipe, the
+ * main loop then puts the connection back into the select set (comm_release).
+ *
+ * Request latency
+ * ===============
+ *
+ * op_stat_add() counts the processing time of every request in a histogram
+ * of power of two microsecond buckets per op, op_stat_log() logs them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/cnid_bdb_private.h>
+
+#include "dbif.h"
+#include "dbd.h"
+#include "comm.h"
+#include "worker.h"
+
+struct job {
+    struct job           *next;
+    int                  fd;
+    int                  ok;
+    struct cnid_dbd_rqst rqst;
+    char                 name[MAXPATHLEN + 1];
+};
+
+struct worker {
+    pthread_t thread;
+    DBD       *dbd;
+    char      resbuf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t)];
+};
+
+static struct worker *workers;
+static int nworkers;
+static int started;
+static int stopping;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct job *pending, *pending_tail;
+static struct job *done;
+static int wakeup[2] = { -1, -1 };
+
+/* -------------------------------------------------------------------------- */
+
+#define OP_STAT_OPS     (CNID_DBD_OP_SEARCH_NAME + 1)
+#define OP_STAT_BUCKETS 24      /* up to 2^23 us, about 8 s */
+
+static const char *op_names[OP_STAT_OPS] = {
+    "NONE", "OPEN", "CLOSE", "ADD", "GET", "RESOLVE", "LOOKUP", "UPDATE",
+    "DELETE", "MANGLE_ADD", "MANGLE_GET", "GETSTAMP", "REBUILD_ADD", "SEARCH",
+    "WIPE", "LOOKUP_BATCH", "SEARCH_NAME"
+};
+
+static uint64_t op_stat[OP_STAT_OPS][OP_STAT_BUCKETS];
+
+void op_stat_add(int op, const struct timeval *start)
+{
+    struct timeval now;
+    uint64_t usec;
+    int bucket = 0;
+
+    if (op < 0 || op >= OP_STAT_OPS)
+        return;
+
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - start->tv_sec) * 1000000 + now.tv_usec - start->tv_usec;
+    while (usec > 1 && bucket < OP_STAT_BUCKETS - 1) {
+        usec >>= 1;
+        bucket++;
+    }
+    __sync_fetch_and_add(&op_stat[op][bucket], 1);
+}
+
+void op_stat_log(void)
+{
+    char buf[512];
+    uint64_t count;
+    int op, i, len;
+
+    for (op = 0; op < OP_STAT_OPS; op++) {
+        count = 0;
+        len = 0;
+        for (i = 0; i < OP_STAT_BUCKETS; i++) {
+            if (op_stat[op][i] == 0)
+                continue;
+            count += op_stat[op][i];
+            if ((size_t)len < sizeof(buf))
+                len += snprintf(buf + len, sizeof(buf) - len, " <%luus:%llu",
+                                1UL << i, (unsigned long long)op_stat[op][i]);
+        }
+        if (count)
+            LOG(log_info, logtype_cnid, "%s: %llu requests,%s",
+                op_names[op], (unsigned long long)count, buf);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+
+int worker_readonly(int op)
+{
+    switch (op) {
+    case CNID_DBD_OP_GET:
+    case CNID_DBD_OP_RESOLVE:
+    case CNID_DBD_OP_SEARCH:
+    case CNID_DBD_OP_GETSTAMP:
+        return started;
+    default:
+        return 0;
+    }
+}
+
+static void worker_process(struct worker *w, struct job *job)
+{
+    struct cnid_dbd_rply rply;
+    struct timeval start;
+    int ret;
+
+    gettimeofday(&start, NULL);
+
+    memset(&rply, 0, sizeof(rply));
+    rply.name = w->resbuf;
+
+    switch (job->rqst.op) {
+    case CNID_DBD_OP_GET:
+        ret = dbd_get(w->dbd, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_RESOLVE:
+        ret = dbd_resolve(w->dbd, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_SEARCH:
+        ret = dbd_search(w->dbd, &job->rqst, &rply);
+        break;
+    case CNID_DBD_OP_GETSTAMP:
+        ret = dbd_getstamp(w->dbd, &job->rqst, &rply);
+        break;
+    default:
+        rply.result = CNID_DBD_RES_ERR_DB;
+        ret = -1;
+        break;
+    }
+
+    /* a failed read leaves the database untouched, just report it */
+    if (ret < 0)
+        rply.namelen = 0;
+
+    job->ok = comm_snd_fd(job->fd, &rply);
+    op_stat_add(job->rqst.op, &start);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct job *job;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (pending == NULL && !stopping)
+            pthread_cond_wait(&cond, &lock);
+        if (pending == NULL) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        job = pending;
+        if ((pending = job->next) == NULL)
+            pending_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        worker_process(w, job);
+
+        pthread_mutex_lock(&lock);
+        job->next = done;
+        done = job;
+        pthread_mutex_unlock(&lock);
+
+        while (write(wakeup[1], "", 1) == -1 && errno == EINTR)
+            ;
+    }
+
+    return NULL;
+}
+
+/* Called from the main loop when workers have finished requests */
+static void worker_reap(void)
+{
+    struct job *job, *next;
+    char buf[64];
+
+    while (read(wakeup[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&lock);
+    job = done;
+    done = NULL;
+    pthread_mutex_unlock(&lock);
+
+    for (; job; job = next) {
+        next = job->next;
+        comm_release(job->fd, job->ok);
+        free(job);
+    }
+}
+
+/*!
+ * Hand the current read-only request to the workers
+ *
+ * @returns 0 on success, -1 if the request must be processed by the caller
+ */
+int worker_submit(const struct cnid_dbd_rqst *rqst)
+{
+    struct job *job;
+
+    if ((job = malloc(sizeof(struct job))) == NULL)
+        return -1;
+
+    job->next = NULL;
+    job->fd = comm_hold();
+    job->ok = 0;
+    job->rqst = *rqst;
+    memcpy(job->name, rqst->name, rqst->namelen);
+    job->name[rqst->namelen] = 0;
+    job->rqst.name = job->name;
+
+    pthread_mutex_lock(&lock);
+    if (pending_tail)
+        pending_tail->next = job;
+    else
+        pending = job;
+    pending_tail = job;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+/*!
+ * Start count worker threads for read-only requests on dbd
+ *
+ * The environment of dbd must have been opened with DB_THREAD.
+ */
+int worker_start(DBD *dbd, int count)
+{
+    if (count <= 0 || started)
+        return 0;
+
+    if (wakeup[0] == -1) {
+        if (pipe(wakeup) != 0) {
+            LOG(log_error, logtype_cnid, "worker_start: pipe: %s", strerror(errno));
+            return -1;
+        }
+        setnonblock(wakeup[0], 1);
+        fcntl(wakeup[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wakeup[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    if ((workers = calloc(count, sizeof(struct worker))) == NULL)
+        return -1;
+
+    stopping = 0;
+    for (nworkers = 0; nworkers < count; nworkers++) {
+        if ((workers[nworkers].dbd = dbif_reader_open(dbd)) == NULL)
+            break;
+        if (pthread_create(&workers[nworkers].thread, NULL, worker_main, &workers[nworkers]) != 0) {
+            LOG(log_error, logtype_cnid, "worker_start: pthread_create: %s", strerror(errno));
+            dbif_reader_close(workers[nworkers].dbd);
+            break;
+        }
+    }
+
+    if (nworkers == 0) {
+        free(workers);
+        workers = NULL;
+        return -1;
+    }
+
+    comm_set_wakeup(wakeup[0], worker_reap);
+    started = 1;
+
+    LOG(log_info, logtype_cnid, "Started %d of %d worker threads for read-only requests", nworkers, count);
+    return 0;
+}
+
+/*!
+ * Let the workers finish all pending requests and stop them
+ */
+void worker_stop(void)
+{
+    int i;
+
+    if (!started)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        dbif_reader_close(workers[i].dbd);
+    }
+
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    started = 0;
+
+    worker_reap();
+    comm_set_wakeup(-1, NULL);
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ */
+
+#ifndef CNID_DBD_WORKER_H
+#define CNID_DBD_WORKER_H 1
+
+#include <sys/time.h>
+#include <atalk/cnid_bdb_private.h>
+
+#include "dbif.h"
+
+extern int  worker_start    (DBD *dbd, int count);
+extern void worker_stop     (void);
+extern int  worker_readonly (int op);
+extern int  worker_submit   (const struct cnid_dbd_rqst *rqst);
+
+extern void op_stat_add     (int op, const struct timeval *start);
+extern void op_stat_log     (void);
+
+#endif /* CNID_DBD_WORKER_H */
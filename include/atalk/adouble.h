@@ -164,18 +164,27 @@ struct ad_entry {
     ssize_t   ade_len;
 };
 
+/* byte range locks of a fork are kept in an interval tree sorted by start */
 typedef struct adf_lock_t {
     struct flock lock;
     int user;
     int *refcount; /* handle read locks with multiple users */
+    off_t end;     /* end of the range, a l_len of 0 extends to the maximum offset */
+    off_t maxend;  /* largest end in this subtree */
+    struct adf_lock_t *left, *right;
+    int height;
+    uint32_t shmlock; /* shared lock table entry, 0 if none */
 } adf_lock_t;
 
 struct ad_fd {
     int          adf_fd;        /* -1: invalid, AD_SYMLINK: symlink */
     char         *adf_syml;
     int          adf_flags;
-    adf_lock_t   *adf_lock;
-    int          adf_refcount, adf_lockcount, adf_lockmax;
+    adf_lock_t   *adf_lock;     /* root of the lock tree */
+    int          adf_refcount, adf_lockcount;
+    uint32_t     adf_tmplock;   /* shared lock table entry of ad_tmplock() */
+    dev_t        adf_dev;       /* file id for the shared lock table, */
+    ino_t        adf_ino;       /* adf_ino 0: not yet known */
 };
 
 /* some header protection */
@@ -396,6 +405,11 @@ extern int ad_lock(struct adouble *, uint32_t eid, int type, off_t off, off_t le
 extern void ad_unlock(struct adouble *, int fork, int unlckbrl);
 extern int ad_tmplock(struct adouble *, uint32_t eid, int type, off_t off, off_t len, int fork);
 
+/* ad_shmlock.c */
+extern int ad_shmlock_init(unsigned int entries, int interop);
+extern void ad_shmlock_reap(pid_t pid);
+extern void ad_shmlock_log_stat(void);
+
 /* ad_open.c */
 extern off_t ad_getentryoff(const struct adouble *ad, int eid);
 extern const char *adflags2logstr(int adflags);
@@ -416,11 +430,16 @@ extern int ad_openat      (struct adouble *, int dirfd, const char *path, int ad
 extern int ad_refresh     (const char *path, struct adouble *);
 extern int ad_stat        (const char *, struct stat *);
 extern int ad_metadata    (const char *, int, struct adouble *);
+extern int ad_metadata_st (const char *, int, const struct stat *, struct adouble *);
 extern int ad_metadataat  (int, const char *, int, struct adouble *);
 extern mode_t ad_hf_mode(mode_t mode);
 extern int ad_valid_header_osx(const char *path);
 extern off_t ad_reso_size(const char *path, int adflags, struct adouble *ad);
 
+/* ad_cache.c */
+extern int  ad_cache_init(int size);
+extern void ad_cache_log_stat(void);
+
 /* ad_conv.c */
 extern int ad_convert(const char *path, const struct stat *sp, const struct vol *vol, const char **newpath);
 
@@ -461,5 +480,8 @@ extern int ad_readfile_init(const struct adouble *ad, int eid, off_t *off, int e
 #ifdef WITH_RECVFILE
 extern ssize_t ad_recvfile(struct adouble *ad, int eid,  int sock, off_t off, size_t len, int);
 #endif
+#ifdef WITH_IO_URING
+extern ssize_t ad_recvfile_uring(struct adouble *ad, int eid, int sock, off_t off, size_t len);
+#endif
 
 #endif /* _ATALK_ADOUBLE_H */
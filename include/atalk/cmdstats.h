@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ */
+
+#ifndef ATALK_CMDSTATS_H
+#define ATALK_CMDSTATS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * Latency histogram with HDR-style log-linear buckets: values below
+ * 2^CMDSTATS_SUBBITS microseconds get a bucket each, above that every power
+ * of two is divided into 2^CMDSTATS_SUBBITS buckets, so a bucket is never
+ * wider than 1/16 of its values.
+ */
+#define CMDSTATS_SUBBITS   4
+#define CMDSTATS_BUCKETS   ((32 - CMDSTATS_SUBBITS + 1) << CMDSTATS_SUBBITS)
+
+#define CMDSTATS_INTERVAL  10   /* seconds between IPC updates of a session */
+
+/* Counters of one AFP command */
+struct cmdstat {
+    uint64_t cs_calls;
+    uint64_t cs_errors;         /* result not AFP_OK */
+    uint64_t cs_bytes_in;       /* request and write data */
+    uint64_t cs_bytes_out;      /* reply and read data */
+    uint64_t cs_usec;           /* sum of latencies */
+    uint32_t cs_max;            /* max latency in us */
+    uint32_t cs_hist[CMDSTATS_BUCKETS];
+};
+
+/* Counters of all AFP commands, indexed by AFP function number */
+typedef struct cmdstats {
+    struct cmdstat *cs_cmd[256];
+} cmdstats_t;
+
+extern void     cmdstats_record(cmdstats_t *stats, uint8_t function, uint32_t usec, int error,
+                                uint64_t bytes_in, uint64_t bytes_out);
+extern int      cmdstats_send(cmdstats_t *stats, int ipc_fd);
+extern int      cmdstats_merge(cmdstats_t *stats, const char *msg, size_t len);
+extern uint32_t cmdstats_percentile(const struct cmdstat *cs, double q);
+extern int      cmdstats_format(const struct cmdstat *cs, const char *name, char *buf, size_t size);
+extern void     cmdstats_free(cmdstats_t *stats);
+
+#endif /* ATALK_CMDSTATS_H */
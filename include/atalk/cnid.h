@@ -46,6 +46,24 @@
 #define CNID_ERR_CLOSE 0x80000004   /* the db was not open */
 #define CNID_ERR_MAX   0x80000005
 
+/*
+ * cnid_search() fills a buffer of at least CNID_SEARCH_BUFLEN bytes with
+ * entries of CNID, parent DID (both in network byte order) and the NUL
+ * terminated name.
+ */
+#define CNID_SEARCH_BUFLEN 8192
+
+/*
+ * Entry for cnid_prefetch(): a file or directory whose CNID is about to be
+ * requested with cnid_add() or cnid_lookup().
+ */
+struct cnid_prefetch_ent {
+    const struct stat *st;
+    cnid_t      did;
+    const char  *name;
+    size_t      len;
+};
+
 /*
  * This is instance of CNID database object.
  */
@@ -71,6 +89,9 @@ typedef struct _cnid_db {
     int    (*cnid_find)        (struct _cnid_db *cdb, const char *name, size_t namelen,
                                 void *buffer, size_t buflen);
     int    (*cnid_wipe)        (struct _cnid_db *cdb);
+    int    (*cnid_prefetch)    (struct _cnid_db *cdb, const struct cnid_prefetch_ent *ents, int count);
+    int    (*cnid_search)      (struct _cnid_db *cdb, const char *name, size_t namelen,
+                                cnid_t *pos, void *buffer, size_t buflen);
 } cnid_db;
 
 /*
@@ -117,6 +138,13 @@ cnid_t cnid_rebuild_add(struct _cnid_db *cdb, const struct stat *st, const cnid_
 int    cnid_find       (struct _cnid_db *cdb, const char *name, size_t namelen,
                         void *buffer, size_t buflen);
 int    cnid_wipe       (struct _cnid_db *cdb);
+int    cnid_prefetch   (struct _cnid_db *cdb, const struct cnid_prefetch_ent *ents, int count);
+int    cnid_search     (struct _cnid_db *cdb, const char *name, size_t namelen,
+                        cnid_t *pos, void *buffer, size_t buflen);
 void   cnid_close      (struct _cnid_db *db);
 
+/* Shared directory cache */
+int    cnid_shm_init   (unsigned int entries);
+void   cnid_shm_log_stat(void);
+
 #endif
@@ -26,6 +26,8 @@
 #define CNID_DBD_OP_REBUILD_ADD 0x0c
 #define CNID_DBD_OP_SEARCH      0x0d
 #define CNID_DBD_OP_WIPE        0x0e
+#define CNID_DBD_OP_LOOKUP_BATCH 0x0f
+#define CNID_DBD_OP_SEARCH_NAME 0x10
 
 #define CNID_DBD_RES_OK            0x00
 #define CNID_DBD_RES_NOTFOUND      0x01
@@ -36,8 +38,34 @@
 #define CNID_DBD_RES_SRCH_DONE     0x06
 
 #define DBD_MAX_SRCH_RSLTS 100
+
+/*
+ * CNID_DBD_OP_SEARCH_NAME finds the names that contain the name of the
+ * request. The reply carries up to DBD_MAX_SRCH_LEN bytes of entries of CNID,
+ * parent DID and the NUL terminated name. The request's cnid is the position
+ * to continue at, the reply's cnid the position for the next request with
+ * result CNID_DBD_RES_SRCH_CNT, CNID_DBD_RES_SRCH_DONE ends the search.
+ */
+#define DBD_MAX_SRCH_LEN  8192
 #define DBD_NUM_OPEN_ARGS 3
 
+/*
+ * CNID_DBD_OP_LOOKUP_BATCH carries up to DBD_MAX_BATCH struct cnid_dbd_batch
+ * entries, each followed by its name, in the name buffer of the request.
+ * The reply carries one CNID per entry, CNID_INVALID for entries that must
+ * be looked up with CNID_DBD_OP_ADD or CNID_DBD_OP_LOOKUP.
+ */
+#define DBD_MAX_BATCH     128
+#define DBD_MAX_BATCH_LEN MAXPATHLEN
+
+struct cnid_dbd_batch {
+    cnid_t   did;
+    dev_t    dev;
+    ino_t    ino;
+    uint32_t type;
+    uint32_t namelen;
+};
+
 struct cnid_dbd_rqst {
     int     op;
     cnid_t  cnid;
@@ -65,6 +93,10 @@ typedef struct CNID_bdb_private {
     size_t    stamp_size;
     int       notfirst;   /* already open before */
     int       changed;  /* stamp differ */
+    int       nprefetched;  /* entries of the last CNID_DBD_OP_LOOKUP_BATCH */
+    size_t    prefetchlen;
+    char      prefetched[DBD_MAX_BATCH_LEN];     /* the request */
+    cnid_t    prefetched_id[DBD_MAX_BATCH];      /* the reply */
 } CNID_bdb_private;
 
 
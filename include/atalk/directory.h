@@ -55,6 +55,8 @@
 #define DIRF_ISFILE    (1<<3) /* it's cached file, not a directory */
 #define DIRF_OFFCNT    (1<<4) /* offsprings count is valid */
 #define DIRF_CNID	   (1<<5) /* renumerate id */
+#define DIRF_NOTIFY    (1<<6) /* dircache: validated by change notifications, not ctime */
+#define DIRF_WATCHED   (1<<7) /* dircache: directory has a change notification watch */
 
 struct dir {
     bstring     d_fullpath;          /* complete unix path to dir (or file) */
@@ -77,6 +79,8 @@ struct dir {
     /* Stuff used in the dircache */
     time_t      dcache_ctime;         /* inode ctime, used and modified by dircache */
     ino_t       dcache_ino;           /* inode number, used to detect changes in the dircache */
+    struct dir  *d_prev_sibling;      /* dircache: cached entries with the same parent DID */
+    struct dir  *d_next_sibling;
 };
 
 struct path {
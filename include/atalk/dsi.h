@@ -89,6 +89,11 @@ typedef struct DSI {
     char     *eof;              /* end of currently used buffer */
     char     *end;
 
+    /* DSI reply queue used for pipelined requests, see dsi_cmdreply_queue() */
+    uint8_t  *replyq;           /* NULL if pipelining is disabled */
+    size_t   replyqlen;         /* bytes currently queued */
+    size_t   replyqsize;        /* size of the reply queue */
+
 #ifdef USE_ZEROCONF
     char *bonjourname;      /* server name as UTF8 maxlen MAXINSTANCENAMELEN */
     int zeroconf_registered;
@@ -98,6 +103,8 @@ typedef struct DSI {
      * send/receive fill in the header and use dsi->commands.
      * write/read just write/read data */
     pid_t  (*proto_open)(struct DSI *);
+    int    (*proto_accept)(struct DSI *);  /* accept only, for pre-forked session workers */
+    void   (*proto_start)(struct DSI *);   /* read the first request in the session process */
     void   (*proto_close)(struct DSI *);
 } DSI;
 
@@ -155,6 +162,9 @@ typedef struct DSI {
 #define DSI_RECONINPROG      (1 << 8) /* used in the new session in reconnect */
 #define DSI_AFP_LOGGED_OUT   (1 << 9) /* client called afp_logout, quit on next EOF from socket */
 
+/* size of the reply queue for pipelined requests, fits two full replies */
+#define DSI_REPLYQ_SIZ       (2 * (DSI_BLOCKSIZ + DSI_DATASIZ))
+
 /* basic initialization: dsi_init.c */
 extern DSI *dsi_init(AFPObj *obj, const char *hostname, const char *address, const char *port);
 extern void dsi_setstatus (DSI *, char *, const size_t);
@@ -163,6 +173,7 @@ extern void dsi_free(DSI *dsi);
 
 /* in dsi_getsess.c */
 extern int dsi_getsession (DSI *, server_child_t *, const int, afp_child_t **);
+extern int dsi_worksession(DSI *, int, const int);
 extern void dsi_kill (int);
 
 
@@ -170,6 +181,7 @@ extern void dsi_kill (int);
 extern void dsi_opensession (DSI *);
 extern int  dsi_attention (DSI *, AFPUserBytes);
 extern int  dsi_cmdreply (DSI *, const int);
+extern int  dsi_cmdreply_queue (DSI *, const int);
 extern int dsi_tickle (DSI *);
 extern void dsi_getstatus (DSI *);
 extern void dsi_close (DSI *);
@@ -183,13 +195,19 @@ extern size_t dsi_stream_read (DSI *, void *, const size_t);
 extern int dsi_stream_send (DSI *, void *, size_t);
 extern int dsi_stream_receive (DSI *);
 extern int dsi_disconnect(DSI *dsi);
+extern int dsi_stream_pending(DSI *dsi);
+extern int dsi_replyq_flush(DSI *dsi);
 
 #ifdef WITH_SENDFILE
 extern ssize_t dsi_stream_read_file(DSI *, int, off_t off, const size_t len, const int err);
 #endif
+#ifdef WITH_IO_URING
+extern ssize_t dsi_uring_read_file(DSI *, int, off_t off, const size_t len, const int err);
+#endif
 
 /* client writes -- dsi_write.c */
 extern size_t dsi_writeinit (DSI *, void *, const size_t);
+extern size_t dsi_writeinit_buf(DSI *, char **);
 extern size_t dsi_write (DSI *, void *, const size_t);
 extern void   dsi_writeflush (DSI *);
 #define dsi_wrtreply(a,b)  dsi_cmdreply(a,b)
@@ -107,8 +107,59 @@
  * pid          = optional pid
  * username     = optional username
  * source path  = optional source path
+ *
+ *
+ * Network payload of an FCE packet, version 3
+ *
+ * Version 3 packets carry a batch of events. The pid and username are sent
+ * once per packet, followed by count event records.
+ *
+ *      1         2         3         4         5         6         7          8
+ * +---------+---------+---------+---------+---------+---------+----------+----------+
+ * |                                   FCE magic                                     |
+ * +---------+---------+---------+---------+---------+---------+----------+----------+
+ * | version |
+ * +---------+
+ * | options |
+ * +---------+---------+
+ * |       count       |
+ * +-------------------+
+ * ... optional:
+ * +---------+---------+---------+---------+---------+---------+----------+----------+
+ * |                                      pid                                        |
+ * +---------+---------+---------+---------+---------+---------+----------+----------+
+ * ...
+ * ... optional:
+ * +-------------------+----------  . . . .
+ * |  username length  | username
+ * +-------------------+----------  . . . .
+ * ...
+ * followed by count event records:
+ * +---------+
+ * |  event  |
+ * +---------+
+ * |  flags  |
+ * +---------+---------+---------+---------+
+ * |               event ID                |
+ * +-------------------+-------------------+ . . . .
+ * |     pathlen       | path
+ * +-------------------+------  . . . . . .
+ * ... optional:
+ * +-------------------+------------- . . .
+ * |     pathlen       | source path
+ * +-------------------+------------- . . .
+ *
+ * version      = 3
+ * options      = bitfield:
+ *                    0: pid present
+ *                    1: username present
+ * flags        = bitfield:
+ *                    2: source path present
  */
 
+#define FCE_BATCH_HDR_LEN   12  /* magic, version, options and count */
+#define FCE_BATCH_REC_LEN   8   /* event, flags, event ID and pathlen */
+
 struct fce_packet {
     char          fcep_magic[8];
     unsigned char fcep_version;
@@ -130,6 +181,7 @@ struct path;
 struct ofork;
 
 void fce_pending_events(const AFPObj *obj);
+void fce_cleanup(const AFPObj *obj);
 int fce_register(const AFPObj *obj, fce_ev_t event, const char *path, const char *oldpath);
 int fce_add_udp_socket(const char *target );  // IP or IP:Port
 int fce_set_coalesce(const char *coalesce_opt ); // all|delete|create
@@ -62,6 +62,11 @@
 #define OPTION_SPOTLIGHT_VOL (1 << 14) /* whether spotlight shall be enabled by default for volumes */
 #define OPTION_RECVFILE      (1 << 15)
 #define OPTION_SPOTLIGHT_EXPR (1 << 16) /* whether to allow Spotlight logic expressions */
+#define OPTION_DSI_PIPELINE  (1 << 17) /* whether to coalesce replies of pipelined DSI requests */
+#define OPTION_IO_URING      (1 << 18) /* use the io_uring engine for FPRead/FPWrite data */
+#define OPTION_DIRCACHE_NOTIFY (1 << 19) /* validate dircache entries with inotify instead of stat */
+#define OPTION_NOLOCKINTEROP (1 << 20) /* with the shared lock table, no fcntl byte locks */
+#define OPTION_SPOTLIGHT_NATIVE (1 << 21) /* Spotlight queries use the native backend, not Tracker */
 
 #define PASSWD_NONE     0
 #define PASSWD_SET     (1 << 0)
@@ -87,10 +92,16 @@ struct afp_volume_name {
 
 struct afp_options {
     int connections;            /* Maximum number of possible AFP connections */
+    int prefork;                /* idle pre-forked session workers to keep, 0 disables them */
+    int prefork_refill;         /* session workers forked per main loop pass */
     int tickleval;
     int timeout;
     int flags;
     int dircachesize;
+    int shdircachesize;     /* entries of the shared dircache, 0 disables it */
+    int shlocktablesize;    /* entries of the shared byte lock table, 0 disables it */
+    int dircache_watches;   /* maximum inotify watches with "dircache notify" */
+    int mdcachesize;        /* entries of the adouble:ea metadata cache, 0 disables it */
     int sleep;                  /* Maximum time allowed to sleep (in tickles) */
     int disconnected;           /* Maximum time in disconnected state (in tickles) */
     int fce_fmodwait;           /* number of seconds FCE file mod events are put on hold */
@@ -98,6 +109,7 @@ struct afp_options {
     unsigned char passwdbits, passwdminlen;
     uint32_t server_quantum;
     int dsireadbuf; /* scale factor for sizefof(dsi->buffer) = server_quantum * dsireadbuf */
+    int readahead;  /* number of FPRead requests to prefetch for sequential reads, 0 = off */
     char *hostname;
     char *listen, *interfaces, *port;
     char *Cnid_srv, *Cnid_port;
@@ -126,6 +138,7 @@ struct afp_options {
     char *ntdomain, *ntseparator, *addomain;
     char *logconfig;
     char *logfile;
+    int  logbuffer;           /* "log buffer", enabled by daemons that flush */
     char *mimicmodel;
     char *zeroconfname;
     char *adminauthuser;
@@ -198,5 +211,6 @@ extern const char *AfpErr2name(int err);
 extern struct dir rootParent;
 
 extern void afp_over_dsi (AFPObj *);
+extern int  afp_over_dsi_init(AFPObj *obj);
 extern void afp_over_dsi_sighandlers(AFPObj *obj);
 #endif /* globals.h */
@@ -161,6 +161,8 @@ extern UAM_MODULE_EXPORT logtype_conf_t type_configs[logtype_end_of_list_marker]
    ========================================================================= */
 
 void setuplog(const char *loglevel, const char *logfile);
+void setuplog_async(int entries);
+void log_flush(void);
 void set_processname(const char *processname);
 
 /* LOG macro func no.1: log the message to file */
@@ -10,6 +10,8 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 
+#include <atalk/cmdstats.h>
+
 /* useful stuff for child processes. most of this is hidden in 
  * server_child.c to ease changes in implementation */
 
@@ -38,6 +40,7 @@ typedef struct {
     int             servch_count;                   /* Current count of active AFP sessions */
     int             servch_nsessions;               /* Number of allowed AFP sessions */
     afp_child_t    *servch_table[CHILD_HASHSIZE];   /* Hashtable with data of AFP sesssions */
+    cmdstats_t      servch_stats;                   /* AFP command statistics of all sessions */
 } server_child_t;
 
 /* server_child.c */
@@ -100,12 +100,25 @@ typedef struct _slq_t {
     uint64_t         *slq_cnids;          /* Pointer to array with CNIDs      */
     size_t            slq_cnids_num;      /* Size of slq_cnids array          */
     void             *tracker_cursor;     /* Tracker SPARQL cursor            */
+    struct sl_native_query *slq_native;   /* native backend query state       */
     bool              slq_allow_expr;     /* Whether to allow expressions     */
     uint64_t          slq_result_limit;   /* Whether to LIMIT SPARQL results  */
     struct sl_rslts  *query_results;      /* query results                    */
 } slq_t;
 
+/* query backend */
+typedef enum {
+    SL_BACKEND_TRACKER,       /* SPARQL queries to Tracker            */
+    SL_BACKEND_NATIVE         /* built-in index, see spotlight_native.c */
+} sl_backend_t;
+
+/* sl_native_next() results */
+#define SL_NATIVE_DONE  0
+#define SL_NATIVE_MATCH 1
+#define SL_NATIVE_AGAIN 2
+
 struct sl_ctx {
+    sl_backend_t sl_backend;
 #ifdef HAVE_TRACKER
     TrackerSparqlConnection *tracker_con;
     GCancellable *cancellable;
@@ -124,5 +137,8 @@ extern int afp_spotlight_rpc(AFPObj *obj, char *ibuf, size_t ibuflen _U_,
 extern int sl_pack(DALLOC_CTX *query, char *buf);
 extern int sl_unpack(DALLOC_CTX *query, const char *buf);
 extern void configure_spotlight_attributes(const char *attributes);
+extern void sl_native_attributes(const char *attributes);
+extern int sl_native_open(slq_t *slq);
+extern int sl_native_next(slq_t *slq, TALLOC_CTX *mem_ctx, char **path);
 
 #endif /* SPOTLIGHT_H */
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ */
+
+#ifndef ATALK_URING_H
+#define ATALK_URING_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#ifdef WITH_IO_URING
+
+/*
+ * Callback for socket operations that returned EAGAIN, called with the
+ * private argument of the transfer. Must return 0 when the operation can be
+ * retried, anything else aborts the transfer.
+ */
+typedef int (*uring_sockwait_t)(void *private);
+
+extern int     uring_init(void);
+extern void    uring_close(void);
+extern int     uring_enabled(void);
+extern ssize_t uring_sendfile(int sock, int fd, off_t off, size_t count,
+                              uring_sockwait_t sockwait, void *private);
+extern ssize_t uring_recvfile(int sock, int fd, off_t off, size_t count,
+                              uring_sockwait_t sockwait, void *private);
+
+#else /* WITH_IO_URING */
+
+#define uring_enabled() 0
+
+#endif /* WITH_IO_URING */
+
+#endif /* ATALK_URING_H */
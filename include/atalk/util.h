@@ -17,6 +17,7 @@
 #include <poll.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <atalk/unicode.h>
 #include <atalk/bstrlib.h>
@@ -147,6 +148,12 @@ extern int lock_reg(int fd, int cmd, int type, off_t offest, int whence, off_t l
 #define unlock(fd, offset, whence, len) \
     lock_reg((fd), F_SETLK, F_UNLCK, (offset), (whence), (len))
 
+/* spin locks in shared memory, the lock word is the pid of the holder */
+extern int  pid_trylock(int32_t *word);
+extern int  pid_lock(int32_t *word);
+extern int  pid_lock_reap(int32_t *word, pid_t dead);
+extern void pid_unlock(int32_t *word);
+
 /******************************************************************
  * socket.c
  ******************************************************************/
@@ -73,6 +73,8 @@ struct vol {
     VolSpace        v_tm_used;  /* used bytes on a TM volume */
     time_t          v_tm_cachetime; /* time at which v_tm_used was calculated last */
     VolSpace        v_appended; /* amount of data appended to files */
+    void            *v_catidx;  /* FPCatSearch index, only used by afpd */
+    void            *v_tm_cache; /* sparsebundle band counts, only used by afpd */
     
     /* only when opening/closing volumes or in error */
     int             v_casefold;
@@ -140,6 +142,8 @@ typedef enum {
 #define AFPVOL_NONETIDS  (1 << 26)   /* signal the client it shall do privelege mapping */
 #define AFPVOL_FOLLOWSYM (1 << 27)   /* follow symlinks on the server, default is not to */
 #define AFPVOL_DELVETO   (1 << 28)   /* delete veto files and dirs */
+#define AFPVOL_CATIDX    (1 << 29)   /* Maintain an index for FPCatSearch */
+#define AFPVOL_CNID_NOSYNC (1 << 30) /* don't flush CNID changes to disk at commit (mmap) */
 
 /* Extended Attributes vfs indirection  */
 #define AFPVOL_EA_NONE           0   /* No EAs */
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ *
+ * Cache of adouble:ea metadata
+ * ============================
+ *
+ * Every ad_metadata() on an adouble:ea volume reads the metadata EA with
+ * getxattr(), enumerating a directory reads it for every file and the Finder
+ * enumerates the same directories again and again. This per process cache
+ * keeps the raw metadata EA of recently read files.
+ *
+ * Entries are keyed by dev/ino and validated with st_ctime, which every change
+ * of an EA updates, so changes by other processes are detected too. Entries
+ * are only stored if st_ctime lies in the past, otherwise a change within the
+ * same second could go unnoticed. ad_flush() removes the entry of the file it
+ * writes to.
+ *
+ * afpd has stat'ed the file already when it reads its metadata and passes
+ * that stat in with ad_metadata_st(), so a cache hit costs no syscall.
+ *
+ * The cache is a direct mapped table, an entry replaces whatever entry was
+ * stored in its slot before.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atalk/adouble.h>
+#include <atalk/logger.h>
+
+#include "ad_cache.h"
+
+#define AD_CACHE_MAXSIZE 131072
+
+struct ad_cache_entry {
+    dev_t  ace_dev;
+    ino_t  ace_ino;
+    time_t ace_ctime;
+    char   ace_data[AD_DATASZ_EA];
+};
+
+static struct ad_cache_entry *ad_cache;
+static unsigned int ad_cache_mask;
+static unsigned long ad_cache_hits, ad_cache_misses;
+
+static struct ad_cache_entry *ad_cache_slot(dev_t dev, ino_t ino)
+{
+    uint64_t hash = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev;
+
+    return &ad_cache[(hash >> 32) & ad_cache_mask];
+}
+
+/*!
+ * Allocate the cache for size entries, 0 disables it
+ *
+ * size is rounded up to the next power of 2.
+ */
+int ad_cache_init(int size)
+{
+    unsigned int entries = 1;
+
+    free(ad_cache);
+    ad_cache = NULL;
+    ad_cache_mask = 0;
+
+    if (size <= 0)
+        return 0;
+    if (size > AD_CACHE_MAXSIZE)
+        size = AD_CACHE_MAXSIZE;
+    while (entries < (unsigned int)size)
+        entries <<= 1;
+
+    if ((ad_cache = calloc(entries, sizeof(struct ad_cache_entry))) == NULL) {
+        LOG(log_error, logtype_ad, "ad_cache_init: out of memory");
+        return -1;
+    }
+    ad_cache_mask = entries - 1;
+
+    LOG(log_debug, logtype_ad, "ad_cache_init: %u entries", entries);
+    return 0;
+}
+
+int ad_cache_enabled(void)
+{
+    return ad_cache != NULL;
+}
+
+/*!
+ * Copy the cached metadata EA of the file st into buf
+ *
+ * @returns 1 if found, 0 otherwise
+ */
+int ad_cache_get(const struct stat *st, char *buf)
+{
+    struct ad_cache_entry *e;
+
+    if (ad_cache == NULL)
+        return 0;
+
+    e = ad_cache_slot(st->st_dev, st->st_ino);
+    if (e->ace_ino != st->st_ino || e->ace_dev != st->st_dev || e->ace_ctime != st->st_ctime
+        || e->ace_ctime == 0) {
+        ad_cache_misses++;
+        return 0;
+    }
+
+    memcpy(buf, e->ace_data, AD_DATASZ_EA);
+    ad_cache_hits++;
+    return 1;
+}
+
+void ad_cache_put(const struct stat *st, const char *buf)
+{
+    struct ad_cache_entry *e;
+
+    if (ad_cache == NULL)
+        return;
+
+    e = ad_cache_slot(st->st_dev, st->st_ino);
+
+    /* a change within this second wouldn't change st_ctime */
+    if (st->st_ctime >= time(NULL)) {
+        e->ace_ctime = 0;
+        return;
+    }
+
+    e->ace_dev = st->st_dev;
+    e->ace_ino = st->st_ino;
+    e->ace_ctime = st->st_ctime;
+    memcpy(e->ace_data, buf, AD_DATASZ_EA);
+}
+
+/* Remove the entry of the file fd after writing its metadata EA */
+void ad_cache_remove(int fd)
+{
+    struct ad_cache_entry *e;
+    struct stat st;
+
+    if (ad_cache == NULL || fstat(fd, &st) != 0)
+        return;
+
+    e = ad_cache_slot(st.st_dev, st.st_ino);
+    if (e->ace_ino == st.st_ino && e->ace_dev == st.st_dev)
+        e->ace_ctime = 0;
+}
+
+/*!
+ * Log metadata cache statistics
+ */
+void ad_cache_log_stat(void)
+{
+    if (ad_cache == NULL)
+        return;
+
+    LOG(log_info, logtype_ad, "metadata cache statistics: hits: %lu, misses: %lu",
+        ad_cache_hits, ad_cache_misses);
+}
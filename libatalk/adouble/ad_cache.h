@@ -0,0 +1,12 @@
+#ifndef LIBATALK_ADOUBLE_AD_CACHE_H
+#define LIBATALK_ADOUBLE_AD_CACHE_H 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+extern int  ad_cache_enabled(void);
+extern int  ad_cache_get(const struct stat *st, char *buf);
+extern void ad_cache_put(const struct stat *st, const char *buf);
+extern void ad_cache_remove(int fd);
+
+#endif /* libatalk/adouble/ad_cache.h */
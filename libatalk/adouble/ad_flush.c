@@ -41,6 +41,7 @@
 #include <atalk/util.h>
 
 #include "ad_lock.h"
+#include "ad_cache.h"
 
 static const uint32_t set_eid[] = {
     0,1,2,3,4,5,6,7,8,
@@ -319,6 +320,7 @@ static int ad_flush_hf(struct adouble *ad)
                 } else {
                     EC_ZERO_LOG( sys_fsetxattr(ad_data_fileno(ad), AD_EA_META, ad->ad_data, AD_DATASZ_EA, 0) );
                 }
+                ad_cache_remove(ad_data_fileno(ad));
             }
             break;
         default:
@@ -8,8 +8,7 @@
  *
  * TODO: fix the race when reading/writing.
  *       keep a pool of both locks and reference counters around so that
- *       we can save on mallocs. we should also use a tree to keep things
- *       sorted.
+ *       we can save on mallocs.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -97,136 +96,303 @@ static int XLATE_FCNTL_LOCK(int type)
     return -1;
 }
 
-/* ----------------------- */
-static int OVERLAP(off_t a, off_t alen, off_t b, off_t blen) 
+/* largest offset, the end of a lock with a l_len of 0 */
+#define ADF_OFF_MAX ((off_t)((UINT64_C(1) << (sizeof(off_t) * 8 - 1)) - 1))
+
+/* end of the range [start, start + len), len 0 extends to the maximum offset */
+static off_t lock_end(off_t start, off_t len)
 {
-    return (!alen && a <= b) || 
-        (!blen && b <= a) || 
-        ( (a + alen > b) && (b + blen > a) );
+    if (len == 0 || start > ADF_OFF_MAX - len)
+        return ADF_OFF_MAX;
+    return start + len;
 }
 
-/* allocation for lock regions. we allocate aggressively and shrink
- * only in large chunks. */
-#define ARRAY_BLOCK_SIZE 10 
-#define ARRAY_FREE_DELTA 100
+/*
+ * The locks of a fork are kept in an AVL tree ordered by start offset, where
+ * every node also stores the largest end offset of its subtree. That's an
+ * interval tree: a search for locks overlapping a range skips every subtree
+ * that ends before the range and stops at the first node starting after it.
+ */
 
-/* remove a lock and compact space if necessary */
-static void adf_freelock(struct ad_fd *ad, const int i)
+static int tree_height(const adf_lock_t *n)
 {
-    adf_lock_t *lock = ad->adf_lock + i;
+    return n ? n->height : 0;
+}
 
-    if (--(*lock->refcount) < 1) {
-	free(lock->refcount); 
-    lock->lock.l_type = F_UNLCK;
-    set_lock(ad->adf_fd, F_SETLK, &lock->lock); /* unlock */
+static void tree_update(adf_lock_t *n)
+{
+    n->height = MAX(tree_height(n->left), tree_height(n->right)) + 1;
+    n->maxend = n->end;
+    if (n->left && n->left->maxend > n->maxend)
+        n->maxend = n->left->maxend;
+    if (n->right && n->right->maxend > n->maxend)
+        n->maxend = n->right->maxend;
+}
+
+static adf_lock_t *tree_rotate_right(adf_lock_t *n)
+{
+    adf_lock_t *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    tree_update(n);
+    tree_update(l);
+    return l;
+}
+
+static adf_lock_t *tree_rotate_left(adf_lock_t *n)
+{
+    adf_lock_t *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    tree_update(n);
+    tree_update(r);
+    return r;
+}
+
+static adf_lock_t *tree_balance(adf_lock_t *n)
+{
+    int balance;
+
+    tree_update(n);
+    balance = tree_height(n->left) - tree_height(n->right);
+
+    if (balance > 1) {
+        if (tree_height(n->left->left) < tree_height(n->left->right))
+            n->left = tree_rotate_left(n->left);
+        return tree_rotate_right(n);
     }
+    if (balance < -1) {
+        if (tree_height(n->right->right) < tree_height(n->right->left))
+            n->right = tree_rotate_right(n->right);
+        return tree_rotate_left(n);
+    }
+    return n;
+}
+
+/* locks with the same start are told apart by their address */
+static int tree_cmp(const adf_lock_t *a, const adf_lock_t *b)
+{
+    if (a->lock.l_start != b->lock.l_start)
+        return a->lock.l_start < b->lock.l_start ? -1 : 1;
+    if (a != b)
+        return (uintptr_t)a < (uintptr_t)b ? -1 : 1;
+    return 0;
+}
+
+static adf_lock_t *tree_insert(adf_lock_t *root, adf_lock_t *n)
+{
+    if (root == NULL) {
+        n->left = n->right = NULL;
+        tree_update(n);
+        return n;
+    }
+    if (tree_cmp(n, root) < 0)
+        root->left = tree_insert(root->left, n);
+    else
+        root->right = tree_insert(root->right, n);
+    return tree_balance(root);
+}
+
+static adf_lock_t *tree_remove_min(adf_lock_t *root, adf_lock_t **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+    root->left = tree_remove_min(root->left, min);
+    return tree_balance(root);
+}
+
+static adf_lock_t *tree_remove(adf_lock_t *root, adf_lock_t *n)
+{
+    adf_lock_t *min;
+    int cmp;
+
+    if (root == NULL)
+        return NULL;
+
+    if ((cmp = tree_cmp(n, root)) < 0) {
+        root->left = tree_remove(root->left, n);
+    } else if (cmp > 0) {
+        root->right = tree_remove(root->right, n);
+    } else {
+        if (root->left == NULL)
+            return root->right;
+        if (root->right == NULL)
+            return root->left;
+        root->right = tree_remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = root->right;
+        root = min;
+    }
+    return tree_balance(root);
+}
+
+typedef int (*lock_match_t)(const adf_lock_t *lock, int fork, int type);
+
+/* find the first lock overlapping [start, end) accepted by match, any lock if match is NULL */
+static adf_lock_t *tree_find(adf_lock_t *n, off_t start, off_t end,
+                             lock_match_t match, int fork, int type)
+{
+    adf_lock_t *found;
+
+    while (n && n->maxend > start) {
+        if ((found = tree_find(n->left, start, end, match, fork, type)))
+            return found;
+        if (n->lock.l_start >= end)
+            return NULL;
+        if (n->end > start && (match == NULL || match(n, fork, type)))
+            return n;
+        n = n->right;
+    }
+    return NULL;
+}
+
+static int lock_type_match(const adf_lock_t *lock, int type)
+{
+    return ((type & ADLOCK_RD) && (lock->lock.l_type == F_RDLCK))
+        || ((type & ADLOCK_WR) && (lock->lock.l_type == F_WRLCK));
+}
+
+static int match_fork(const adf_lock_t *lock, int fork, int type)
+{
+    return lock->user == fork && lock_type_match(lock, type);
+}
+
+static int match_xfork(const adf_lock_t *lock, int fork, int type)
+{
+    return lock->user != fork && lock_type_match(lock, type);
+}
 
-    ad->adf_lockcount--;
+/*!
+ * Get the dev/ino the shared lock table knows the fork by
+ *
+ * @returns 0 if byte locks of the fork go to the shared lock table, -1 if not
+ */
+static int adf_shmkey(struct ad_fd *adf)
+{
+    struct stat st;
+
+    if (!shmlock_enabled() || adf->adf_fd < 0)
+        return -1;
 
-    /* move another lock into the empty space */
-    if (i < ad->adf_lockcount) {
-        memcpy(lock, lock + ad->adf_lockcount - i, sizeof(adf_lock_t));
+    if (adf->adf_ino == 0) {
+        if (fstat(adf->adf_fd, &st) != 0)
+            return -1;
+        adf->adf_dev = st.st_dev;
+        adf->adf_ino = st.st_ino;
     }
+    return 0;
+}
 
-    /* free extra cruft if we go past a boundary. we always want to
-     * keep at least some stuff around for allocations. this wastes
-     * a bit of space to save time on reallocations. */
-    if ((ad->adf_lockmax > ARRAY_FREE_DELTA) &&
-	(ad->adf_lockcount + ARRAY_FREE_DELTA < ad->adf_lockmax)) {
-	    struct adf_lock_t *tmp;
+/* remove a lock */
+static void adf_freelock(struct ad_fd *adf, adf_lock_t *lock)
+{
+    if (lock->shmlock)
+        shmlock_del(lock->shmlock);
 
-	    tmp = (struct adf_lock_t *) 
-		    realloc(ad->adf_lock, sizeof(adf_lock_t)*
-			    (ad->adf_lockcount + ARRAY_FREE_DELTA));
-	    if (tmp) {
-		ad->adf_lock = tmp;
-		ad->adf_lockmax = ad->adf_lockcount + ARRAY_FREE_DELTA;
-	    }
+    if (--(*lock->refcount) < 1) {
+        free(lock->refcount);
+        if (!lock->shmlock || shmlock_interop()) {
+            lock->lock.l_type = F_UNLCK;
+            set_lock(adf->adf_fd, F_SETLK, &lock->lock); /* unlock */
+        }
     }
+
+    adf->adf_lock = tree_remove(adf->adf_lock, lock);
+    adf->adf_lockcount--;
+    free(lock);
 }
 
+/* collect up to max locks to free in locks[] */
+static void adf_collect(adf_lock_t *n, adf_lock_t **locks, int *count, int max,
+                        const int fork, int unlckbrl)
+{
+    if (n == NULL || *count >= max)
+        return;
+    adf_collect(n->left, locks, count, max, fork, unlckbrl);
+    if (*count < max && ((unlckbrl && n->lock.l_start < AD_FILELOCK_BASE) || n->user == fork))
+        locks[(*count)++] = n;
+    adf_collect(n->right, locks, count, max, fork, unlckbrl);
+}
 
 /* this needs to deal with the following cases:
  * 1) free all UNIX byterange lock from any fork
  * 2) free all locks of the requested fork
- *
- * i converted to using arrays of locks. everytime a lock
- * gets removed, we shift all of the locks down.
+ * the tree changes when a lock is freed, so they're collected in batches.
  */
 static void adf_unlock(struct adouble *ad, struct ad_fd *adf, const int fork, int unlckbrl)
 {
-    adf_lock_t *lock = adf->adf_lock;
-    int i;
-
-    for (i = 0; i < adf->adf_lockcount; i++) {
-        if ((unlckbrl && lock[i].lock.l_start < AD_FILELOCK_BASE)
-            || lock[i].user == fork) {
-            /* we're really going to delete this lock. note: read locks
-               are the only ones that allow refcounts > 1 */
-            adf_freelock(adf, i);
-            /* we shifted things down, so we need to backtrack */
-            i--; 
-            /* unlikely but realloc may have change adf_lock */
-            lock = adf->adf_lock;       
-        }
-    }
+    adf_lock_t *locks[64];
+    const int max = sizeof(locks) / sizeof(locks[0]);
+    int i, count;
+
+    do {
+        count = 0;
+        adf_collect(adf->adf_lock, locks, &count, max, fork, unlckbrl);
+        /* we're really going to delete these locks. note: read locks
+           are the only ones that allow refcounts > 1 */
+        for (i = 0; i < count; i++)
+            adf_freelock(adf, locks[i]);
+    } while (count == max);
 }
 
-/* relock any byte lock that overlaps off/len. unlock everything
+/* relock any byte lock that overlaps [start, end). unlock everything
  * else. */
-static void adf_relockrange(struct ad_fd *ad, int fd, off_t off, off_t len)
+static void adf_relockrange(adf_lock_t *n, int fd, off_t start, off_t end)
 {
-    adf_lock_t *lock = ad->adf_lock;
-    int i;
-    
-    for (i = 0; i < ad->adf_lockcount; i++) {
-        if (OVERLAP(off, len, lock[i].lock.l_start, lock[i].lock.l_len)) 
-            set_lock(fd, F_SETLK, &lock[i].lock);
-    }
+    if (n == NULL || n->maxend <= start)
+        return;
+    adf_relockrange(n->left, fd, start, end);
+    if (n->lock.l_start >= end)
+        return;
+    if (n->end > start && (!n->shmlock || shmlock_interop()))
+        set_lock(fd, F_SETLK, &n->lock);
+    adf_relockrange(n->right, fd, start, end);
 }
 
+/* find a byte lock that overlaps [start, end) for a particular open fork */
+static adf_lock_t *adf_findlock(struct ad_fd *ad,
+                                const int fork, const int type,
+                                const off_t start,
+                                const off_t end)
+{
+    return tree_find(ad->adf_lock, start, end, match_fork, fork, type);
+}
 
-/* find a byte lock that overlaps off/len for a particular open fork */
-static int adf_findlock(struct ad_fd *ad,
-                        const int fork, const int type,
-                        const off_t off,
-                        const off_t len)
+/* search other fork lock lists */
+static adf_lock_t *adf_findxlock(struct ad_fd *ad,
+                                 const int fork, const int type,
+                                 const off_t start,
+                                 const off_t end)
 {
-  adf_lock_t *lock = ad->adf_lock;
-  int i;
-  
-  for (i = 0; i < ad->adf_lockcount; i++) {
-    if ((((type & ADLOCK_RD) && (lock[i].lock.l_type == F_RDLCK)) ||
-	((type & ADLOCK_WR) && (lock[i].lock.l_type == F_WRLCK))) &&
-	(lock[i].user == fork) && 
-	OVERLAP(off, len, lock[i].lock.l_start, lock[i].lock.l_len)) {
-      return i;
-    }
-  }
-  return -1;
+    return tree_find(ad->adf_lock, start, end, match_xfork, fork, type);
 }
 
+static void adf_freetree(struct ad_fd *adf, adf_lock_t *n)
+{
+    if (n == NULL)
+        return;
+    adf_freetree(adf, n->left);
+    adf_freetree(adf, n->right);
+    if (n->shmlock)
+        shmlock_del(n->shmlock);
+    if (--(*n->refcount) < 1)
+        free(n->refcount);
+    free(n);
+}
 
-/* search other fork lock lists */
-static int adf_findxlock(struct ad_fd *ad, 
-                         const int fork, const int type,
-                         const off_t off,
-                         const off_t len)
+/*!
+ * Forget all locks of a fork, the fcntl locks go away with the file descriptor
+ */
+void adf_lock_free(struct ad_fd *adf)
 {
-    adf_lock_t *lock = ad->adf_lock;
-    int i;
-  
-    for (i = 0; i < ad->adf_lockcount; i++) {
-        if ((((type & ADLOCK_RD) && (lock[i].lock.l_type == F_RDLCK))
-             ||
-             ((type & ADLOCK_WR) && (lock[i].lock.l_type == F_WRLCK)))
-            &&
-            (lock[i].user != fork)
-            && 
-            OVERLAP(off, len, lock[i].lock.l_start, lock[i].lock.l_len)) 
-            return i;
-    } 
-    return -1;
+    adf_freetree(adf, adf->adf_lock);
+    if (adf->adf_tmplock)
+        shmlock_del(adf->adf_tmplock);
+    adf_lock_init(adf);
 }
 
 /* okay, this needs to do the following:
@@ -264,7 +430,7 @@ static off_t rf2off(off_t off)
 /*!
  * Test a lock
  *
- * (1) Test against our own locks array
+ * (1) Test against our own locks
  * (2) Test fcntl lock, locks from other processes
  *
  * @param adf     (r) handle
@@ -277,20 +443,14 @@ static off_t rf2off(off_t off)
 static int testlock(const struct ad_fd *adf, off_t off, off_t len)
 {
     struct flock lock;
-    adf_lock_t *plock;
-    int i;
 
     lock.l_start = off;
-
-    plock = adf->adf_lock;
     lock.l_whence = SEEK_SET;
     lock.l_len = len;
 
     /* (1) Do we have a lock ? */
-    for (i = 0; i < adf->adf_lockcount; i++) {
-        if (OVERLAP(lock.l_start, 1, plock[i].lock.l_start, plock[i].lock.l_len)) 
-            return 1;
-    }
+    if (tree_find(adf->adf_lock, off, lock_end(off, 1), NULL, 0, 0))
+        return 1;
 
     /* (2) Does another process have a lock? */
     lock.l_type = (adf->adf_flags & O_RDWR) ? F_WRLCK : F_RDLCK;
@@ -355,9 +515,9 @@ int ad_lock(struct adouble *ad, uint32_t eid, int locktype, off_t off, off_t len
 {
     struct flock lock;
     struct ad_fd *adf;
-    adf_lock_t *adflock;
-    int oldlock;
-    int i;
+    adf_lock_t *adflock, *oldlock;
+    off_t end;
+    uint32_t shmlock = 0;
     int type;  
     int ret = 0, fcntl_lock_err = 0;
 
@@ -402,6 +562,7 @@ int ad_lock(struct adouble *ad, uint32_t eid, int locktype, off_t off, off_t len
     if (len == BYTELOCK_MAX) {
         lock.l_len -= lock.l_start; /* otherwise  EOVERFLOW error */
     }
+    end = lock_end(lock.l_start, lock.l_len);
 
     /* see if it's locked by another fork. 
      * NOTE: this guarantees that any existing locks must be at most
@@ -409,15 +570,14 @@ int ad_lock(struct adouble *ad, uint32_t eid, int locktype, off_t off, off_t len
      * guaranteed to be ORable. */
     if (adf_findxlock(adf, fork, ADLOCK_WR | 
                       ((type & ADLOCK_WR) ? ADLOCK_RD : 0), 
-                      lock.l_start, lock.l_len) > -1) {
+                      lock.l_start, end) != NULL) {
         errno = EACCES;
         ret = -1;
         goto exit;
     }
   
     /* look for any existing lock that we may have */
-    i = adf_findlock(adf, fork, ADLOCK_RD | ADLOCK_WR, lock.l_start, lock.l_len);
-    adflock = (i < 0) ? NULL : adf->adf_lock + i;
+    adflock = adf_findlock(adf, fork, ADLOCK_RD | ADLOCK_WR, lock.l_start, end);
 
     /* here's what we check for:
        1) we're trying to re-lock a lock, but we didn't specify an update.
@@ -440,60 +600,75 @@ int ad_lock(struct adouble *ad, uint32_t eid, int locktype, off_t off, off_t len
     /* now, update our list of locks */
     /* clear the lock */
     if (lock.l_type == F_UNLCK) { 
-        adf_freelock(adf, i);
+        adf_freelock(adf, adflock);
         goto exit;
     }
 
-    /* attempt to lock the file. */
-    if (set_lock(adf->adf_fd, F_SETLK, &lock) < 0) {
+    /* attempt to lock the file. byte locks are arbitrated between
+     * sessions by the shared lock table if there's one. */
+    if (!(type & ADLOCK_FILELOCK) && adf_shmkey(adf) == 0) {
+        shmlock = shmlock_add(adf->adf_dev, adf->adf_ino, lock.l_start, end,
+                              lock.l_type == F_WRLCK);
+        if (shmlock == 0) {
+            ret = -1;
+            goto exit;
+        }
+    }
+    if ((!shmlock || shmlock_interop()) && set_lock(adf->adf_fd, F_SETLK, &lock) < 0) {
+        if (shmlock)
+            shmlock_del(shmlock);
         ret = -1;
         goto exit;
     }
 
     /* we upgraded this lock. */
     if (adflock && (type & ADLOCK_UPGRADE)) {
+        if (adflock->shmlock)
+            shmlock_del(adflock->shmlock);
+        adf->adf_lock = tree_remove(adf->adf_lock, adflock);
         memcpy(&adflock->lock, &lock, sizeof(lock));
+        adflock->end = end;
+        adflock->shmlock = shmlock;
+        adf->adf_lock = tree_insert(adf->adf_lock, adflock);
         goto exit;
     } 
 
     /* it wasn't an upgrade */
-    oldlock = -1;
+    oldlock = NULL;
     if (lock.l_type == F_RDLCK) {
-        oldlock = adf_findxlock(adf, fork, ADLOCK_RD, lock.l_start, lock.l_len);
-    } 
-    
-    /* no more space. this will also happen if lockmax == lockcount == 0 */
-    if (adf->adf_lockmax == adf->adf_lockcount) { 
-        adf_lock_t *tmp = (adf_lock_t *) 
-            realloc(adf->adf_lock, sizeof(adf_lock_t)*
-                    (adf->adf_lockmax + ARRAY_BLOCK_SIZE));
-        if (!tmp) {
-            ret = fcntl_lock_err = -1;
-            goto exit;
-        }
-        adf->adf_lock = tmp;
-        adf->adf_lockmax += ARRAY_BLOCK_SIZE;
+        oldlock = adf_findxlock(adf, fork, ADLOCK_RD, lock.l_start, end);
     } 
-    adflock = adf->adf_lock + adf->adf_lockcount;
+
+    if ((adflock = calloc(1, sizeof(adf_lock_t))) == NULL) {
+        ret = fcntl_lock_err = -1;
+        goto exit;
+    }
 
     /* fill in fields */
     memcpy(&adflock->lock, &lock, sizeof(lock));
+    adflock->end = end;
     adflock->user = fork;
-    if (oldlock > -1) {
-        adflock->refcount = (adf->adf_lock + oldlock)->refcount;
+    adflock->shmlock = shmlock;
+    if (oldlock) {
+        adflock->refcount = oldlock->refcount;
     } else if ((adflock->refcount = calloc(1, sizeof(int))) == NULL) {
-        ret = fcntl_lock_err = 1;
+        free(adflock);
+        ret = fcntl_lock_err = -1;
         goto exit;
     }
   
     (*adflock->refcount)++;
+    adf->adf_lock = tree_insert(adf->adf_lock, adflock);
     adf->adf_lockcount++;
 
 exit:
     if (ret != 0) {
         if (fcntl_lock_err != 0) {
+            if (shmlock)
+                shmlock_del(shmlock);
             lock.l_type = F_UNLCK;
-            set_lock(adf->adf_fd, F_SETLK, &lock);
+            if (!shmlock || shmlock_interop())
+                set_lock(adf->adf_fd, F_SETLK, &lock);
         }
     }
     LOG(log_debug, logtype_ad, "ad_lock: END: %d", ret);
@@ -504,6 +679,7 @@ int ad_tmplock(struct adouble *ad, uint32_t eid, int locktype, off_t off, off_t
 {
     struct flock lock;
     struct ad_fd *adf;
+    off_t end;
     int err;
     int type;  
 
@@ -543,25 +719,48 @@ int ad_tmplock(struct adouble *ad, uint32_t eid, int locktype, off_t off, off_t
     lock.l_type = XLATE_FCNTL_LOCK(type & ADLOCK_MASK);
     lock.l_whence = SEEK_SET;
     lock.l_len = len;
+    end = lock_end(lock.l_start, lock.l_len);
 
     /* see if it's locked by another fork. */
     if (fork && adf_findxlock(adf, fork,
                               ADLOCK_WR | ((type & ADLOCK_WR) ? ADLOCK_RD : 0), 
-                              lock.l_start, lock.l_len) > -1) {
+                              lock.l_start, end) != NULL) {
         errno = EACCES;
         err = -1;
         goto exit;
     }
 
+    /* with a shared lock table the temporary lock of a fork is an entry
+     * there, fcntl is only needed for non AFP processes. */
+    if (fork && !(type & ADLOCK_FILELOCK) && adf_shmkey(adf) == 0) {
+        if (adf->adf_tmplock) {
+            shmlock_del(adf->adf_tmplock);
+            adf->adf_tmplock = 0;
+        }
+        if (lock.l_type != F_UNLCK) {
+            adf->adf_tmplock = shmlock_add(adf->adf_dev, adf->adf_ino, lock.l_start, end,
+                                           lock.l_type == F_WRLCK);
+            if (adf->adf_tmplock == 0) {
+                err = -1;
+                goto exit;
+            }
+        }
+        if (!shmlock_interop()) {
+            err = 0;
+            goto exit;
+        }
+    }
+
     /* okay, we might have ranges byte-locked. we need to make sure that
      * we restore the appropriate ranges once we're done. so, we check
-     * for overlap on an unlock and relock. 
-     * XXX: in the future, all the byte locks will be sorted and contiguous.
-     *      we just want to upgrade all the locks and then downgrade them
-     *      here. */
+     * for overlap on an unlock and relock. */
     err = set_lock(adf->adf_fd, F_SETLK, &lock);
     if (!err && (lock.l_type == F_UNLCK))
-        adf_relockrange(adf, adf->adf_fd, lock.l_start, len);
+        adf_relockrange(adf->adf_lock, adf->adf_fd, lock.l_start, end);
+    if (err && adf->adf_tmplock) {
+        shmlock_del(adf->adf_tmplock);
+        adf->adf_tmplock = 0;
+    }
 
 exit:
     LOG(log_debug, logtype_ad, "ad_tmplock: END: %d", err);
@@ -8,22 +8,19 @@
  * with the same file. */
 
 #define adf_lock_init(a) do {   \
-        (a)->adf_lockmax = 0;   \
         (a)->adf_lockcount = 0; \
         (a)->adf_lock = NULL;   \
+        (a)->adf_tmplock = 0;   \
+        (a)->adf_ino = 0;       \
     } while (0)
 
-#define adf_lock_free(a) do {                                 \
-        int i;                                                \
-        if (!(a)->adf_lock)                                   \
-            break;                                            \
-        for (i = 0; i < (a)->adf_lockcount; i++) {            \
-            adf_lock_t *lock = (a)->adf_lock + i;             \
-            if (--(*lock->refcount) < 1)                      \
-                free(lock->refcount);                         \
-        }                                                     \
-        free((a)->adf_lock);                                  \
-        adf_lock_init(a);                                     \
-    } while (0)
+/* ad_lock.c */
+extern void adf_lock_free(struct ad_fd *adf);
+
+/* ad_shmlock.c */
+extern int      shmlock_enabled(void);
+extern int      shmlock_interop(void);
+extern uint32_t shmlock_add(uint64_t dev, uint64_t ino, off_t start, off_t end, int wr);
+extern void     shmlock_del(uint32_t id);
 
 #endif /* libatalk/adouble/ad_private.h */
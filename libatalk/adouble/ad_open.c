@@ -54,6 +54,7 @@
 #include <atalk/volume.h>
 
 #include "ad_lock.h"
+#include "ad_cache.h"
 
 #define ADEDOFF_MAGIC        (0)
 #define ADEDOFF_VERSION      (ADEDOFF_MAGIC + ADEDLEN_MAGIC)
@@ -112,6 +113,8 @@ static int ad_header_upgrade(struct adouble *ad, const char *name);
 static int ad_mkrf_ea(const char *path);
 #endif
 static int ad_header_read_ea(const char *path, struct adouble *ad, const struct stat *hst);
+static int ad_open_st(struct adouble *ad, const char *path, int adflags, mode_t mode,
+                      const struct stat *st);
 static int ad_header_upgrade_ea(struct adouble *ad, const char *name);
 off_t ad_reso_size(const char *path, int adflags, struct adouble *ad);
 static int ad_mkrf_osx(const char *path);
@@ -738,15 +741,26 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
-static int ad_header_read_ea(const char *path, struct adouble *ad, const struct stat *hst _U_)
+static int ad_header_read_ea(const char *path, struct adouble *ad, const struct stat *hst)
 {
     EC_INIT;
     uint16_t nentries;
     int      len;
     ssize_t  header_len;
     char     *buf = ad->ad_data;
-
-    if (ad_meta_fileno(ad) != -1)
+    struct stat st;
+    int      cached = 0;
+
+    /* Try the metadata cache, keyed by dev/ino and validated by ctime */
+    if (hst == NULL && ad_cache_enabled()) {
+        if ((ad_meta_fileno(ad) != -1 ? fstat(ad_meta_fileno(ad), &st)
+             : path ? stat(path, &st) : -1) == 0)
+            hst = &st;
+    }
+    if (hst && ad_cache_get(hst, ad->ad_data)) {
+        header_len = AD_DATASZ_EA;
+        cached = 1;
+    } else if (ad_meta_fileno(ad) != -1)
         header_len = sys_fgetxattr(ad_meta_fileno(ad), AD_EA_META, ad->ad_data, AD_DATASZ_EA);
     else
         header_len = sys_getxattr(path, AD_EA_META, ad->ad_data, AD_DATASZ_EA);
@@ -811,6 +825,9 @@ static int ad_header_read_ea(const char *path, struct adouble *ad, const struct
         ad_setentryoff(ad, ADEID_RFORK, ADEDOFF_RFORK_OSX);
 #endif
 
+    if (hst && !cached)
+        ad_cache_put(hst, ad->ad_data);
+
 EC_CLEANUP:
     if (ret != 0 && errno == EINVAL) {
         become_root();
@@ -1191,7 +1208,8 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
-static int ad_open_hf_ea(const char *path, int adflags, int mode, struct adouble *ad)
+static int ad_open_hf_ea(const char *path, int adflags, int mode, struct adouble *ad,
+                         const struct stat *st)
 {
     EC_INIT;
     int oflags;
@@ -1235,7 +1253,7 @@ static int ad_open_hf_ea(const char *path, int adflags, int mode, struct adouble
     }
 
     /* Read the adouble header in and parse it.*/
-    if (ad->ad_ops->ad_header_read(path, ad, NULL) != 0) {
+    if (ad->ad_ops->ad_header_read(path, ad, st) != 0) {
         if (!(adflags & ADFLAGS_CREATE)) {
             LOG(log_debug, logtype_ad, "ad_open_hf_ea(\"%s\"): can't read metadata EA", path);
             errno = ENOENT;
@@ -1281,7 +1299,8 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
-static int ad_open_hf(const char *path, int adflags, int mode, struct adouble *ad)
+static int ad_open_hf(const char *path, int adflags, int mode, struct adouble *ad,
+                      const struct stat *st)
 {
     int ret = 0;
 
@@ -1292,7 +1311,7 @@ static int ad_open_hf(const char *path, int adflags, int mode, struct adouble *a
         ret = ad_open_hf_v2(path, adflags, mode, ad);
         break;
     case AD_VERSION_EA:
-        ret = ad_open_hf_ea(path, adflags, mode, ad);
+        ret = ad_open_hf_ea(path, adflags, mode, ad, st);
         break;
     default:
         ret = -1;
@@ -1835,10 +1854,28 @@ void ad_init(struct adouble *ad, const struct vol * restrict vol)
  */
 int ad_open(struct adouble *ad, const char *path, int adflags, ...)
 {
-    EC_INIT;
     va_list args;
     mode_t mode = 0;
 
+    va_start(args, adflags);
+    if (adflags & ADFLAGS_CREATE)
+        mode = (sizeof(mode_t) < sizeof(int) ? va_arg (args, int) : va_arg (args, mode_t));
+    va_end(args);
+
+    return ad_open_st(ad, path, adflags, mode, NULL);
+}
+
+/*!
+ * ad_open() with the caller's stat of path
+ *
+ * @param st        (r)  stat of path or NULL, adouble:ea uses it to look up the
+ *                       metadata cache without another stat()
+ */
+static int ad_open_st(struct adouble *ad, const char *path, int adflags, mode_t mode,
+                      const struct stat *st)
+{
+    EC_INIT;
+
     LOG(log_debug, logtype_ad,
         "ad_open(\"%s\", %s): BEGIN {d: %d, m: %d, r: %d}"
         "[dfd: %d (ref: %d), mfd: %d (ref: %d), rfd: %d (ref: %d)]",
@@ -1872,11 +1909,6 @@ int ad_open(struct adouble *ad, const char *path, int adflags, ...)
             ad->ad_open_forks |= ATTRBIT_ROPEN;
     }
 
-    va_start(args, adflags);
-    if (adflags & ADFLAGS_CREATE)
-        mode = (sizeof(mode_t) < sizeof(int) ? va_arg (args, int) : va_arg (args, mode_t));
-    va_end(args);
-
     if (adflags & ADFLAGS_DF) {
         ad->ad_data_refcount++;
         if (ad_open_df(path, adflags, mode, ad) != 0) {
@@ -1886,7 +1918,7 @@ int ad_open(struct adouble *ad, const char *path, int adflags, ...)
     }
 
     if (adflags & ADFLAGS_HF) {
-        if (ad_open_hf(path, adflags, mode, ad) != 0) {
+        if (ad_open_hf(path, adflags, mode, ad, st) != 0) {
             EC_FAIL;
         }
     }
@@ -1926,15 +1958,30 @@ EC_CLEANUP:
  * @param adp   pointer to struct adouble
  */
 int ad_metadata(const char *name, int flags, struct adouble *adp)
+{
+    return ad_metadata_st(name, flags, NULL, adp);
+}
+
+/*!
+ * @brief ad_metadata() with the caller's stat of name
+ *
+ * @param st    stat of name or NULL, saves the stat() of the adouble:ea
+ *              metadata cache lookup. Ignored for symlinks, as the EA is
+ *              read from the link target.
+ */
+int ad_metadata_st(const char *name, int flags, const struct stat *st, struct adouble *adp)
 {
     int   ret, err, oflags;
 
     /* Sanitize flags */
     oflags = (flags & (ADFLAGS_CHECK_OF | ADFLAGS_DIR)) | ADFLAGS_HF | ADFLAGS_RDONLY;    
 
-    if ((ret = ad_open(adp, name, oflags)) < 0 && errno == EACCES) {
+    if (st && S_ISLNK(st->st_mode))
+        st = NULL;
+
+    if ((ret = ad_open_st(adp, name, oflags, 0, st)) < 0 && errno == EACCES) {
         become_root();
-        ret = ad_open(adp, name, oflags);
+        ret = ad_open_st(adp, name, oflags, 0, st);
         unbecome_root();
         err = errno;
         errno = err;
@@ -29,10 +29,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/select.h>
+#include <fcntl.h>
+#include <string.h>
 
 #include <atalk/adouble.h>
 #include <atalk/logger.h>
 #include <atalk/util.h>
+#include <atalk/uring.h>
 
 static int ad_recvfile_init(const struct adouble *ad, int eid, off_t *off)
 {
@@ -48,6 +51,31 @@ static int ad_recvfile_init(const struct adouble *ad, int eid, off_t *off)
     return fd;
 }
 
+static int waitfordata(int socket)
+{
+    fd_set readfds;
+    int maxfd = socket + 1;
+    int ret;
+
+    FD_ZERO(&readfds);
+
+    while (1) {
+        FD_ZERO(&readfds);
+        FD_SET(socket, &readfds);
+        if ((ret = select(maxfd, &readfds, NULL, NULL, NULL)) <= 0) {
+            if (ret == -1 && errno == EINTR)
+                continue;
+            LOG(log_error, logtype_dsi, "waitfordata: unexpected select return: %d %s",
+                ret, ret < 0 ? strerror(errno) : "");
+            return -1;
+        }
+        if (FD_ISSET(socket, &readfds))
+            return 0;
+        return -1;
+    }
+
+}
+
 /*
  * If tofd is -1, drain the incoming socket of count bytes without writing to the outgoing fd,
  * if a write fails we do the same.
@@ -70,6 +98,7 @@ static ssize_t default_sys_recvfile(int fromfd,
     size_t total = 0;
     size_t bufsize = MIN(TRANSFER_BUF_SIZE, count);
     size_t total_written = 0;
+    int drain = (tofd == -1);
     char *buffer = NULL;
 
     if (count == 0) {
@@ -87,8 +116,14 @@ static ssize_t default_sys_recvfile(int fromfd,
         ssize_t read_ret;
         size_t toread = MIN(bufsize,count - total);
 
-        /* Read from socket - ignore EINTR. */
+        /* Read from socket - ignore EINTR, wait on the non-blocking socket */
         read_ret = read(fromfd, buffer, toread);
+        if (read_ret == -1 && errno == EINTR)
+            continue;
+        if (read_ret == -1 && errno == EAGAIN) {
+            if (waitfordata(fromfd) == 0)
+                continue;
+        }
         if (read_ret <= 0) {
             /* EOF or socket error. */
             free(buffer);
@@ -101,19 +136,24 @@ static ssize_t default_sys_recvfile(int fromfd,
             ssize_t write_ret;
 
             if (tofd == -1) {
-                write_ret = read_ret;
+                write_ret = read_ret - num_written;
+                if (drain)
+                    total_written += (size_t)write_ret;
             } else {
                 /* Write to file - ignore EINTR. */
                 write_ret = pwrite(tofd, buffer + num_written, read_ret - num_written, offset);
                 if (write_ret <= 0) {
+                    if (write_ret == -1 && errno == EINTR)
+                        continue;
                     /* write error - stop writing. */
                     tofd = -1;
-                    saved_errno = errno;
+                    saved_errno = write_ret == 0 ? EIO : errno;
                     continue;
                 }
+                total_written += (size_t)write_ret;
+                offset += write_ret;
             }
             num_written += (size_t)write_ret;
-            total_written += (size_t)write_ret;
         }
         total += read_ret;
     }
@@ -127,37 +167,16 @@ static ssize_t default_sys_recvfile(int fromfd,
 }
 
 #ifdef HAVE_SPLICE
-static int waitfordata(int socket)
-{
-    fd_set readfds;
-    int maxfd = socket + 1;
-    int ret;
-
-    FD_ZERO(&readfds);
-
-    while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(socket, &readfds);
-        if ((ret = select(maxfd, &readfds, NULL, NULL, NULL)) <= 0) {
-            if (ret == -1 && errno == EINTR)
-                continue;
-            LOG(log_error, logtype_dsi, "waitfordata: unexpected select return: %d %s",
-                ret, ret < 0 ? strerror(errno) : "");
-            return -1;
-        }
-        if (FD_ISSET(socket, &readfds))
-            return 0;
-        return -1;
-    }
-
-}
-
 /*
  * Try and use the Linux system call to do this.
  * Remember we only return -1 if the socket read
  * failed. Else we return the number of bytes
  * actually written. We always read count bytes
  * from the network in the case of return != -1.
+ *
+ * The pipe is created on first use and kept open for the lifetime of the
+ * session process, it's sized to hold splice_size bytes so that every splice
+ * from the socket can be moved to the file in one go.
  */
 static ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count, int splice_size)
 {
@@ -165,6 +184,7 @@ static ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count, in
     static bool try_splice_call = true;
     size_t total_written = 0;
     loff_t splice_offset = offset;
+    int saved_errno;
 
     LOG(log_debug, logtype_dsi, "sys_recvfile: from = %d, to = %d, offset = %.0f, count = %lu",
         fromfd, tofd, (double)offset, (unsigned long)count);
@@ -179,15 +199,20 @@ static ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count, in
      * implementation if recvfile splice fails. JRA.
      */
 
-    if (!try_splice_call) {
-        errno = ENOSYS;
-        return -1;
-    }
+    if (!try_splice_call)
+        return default_sys_recvfile(fromfd, tofd, offset, count);
 
-    if ((pipefd[0] == -1) && (pipe(pipefd) == -1)) {
-        try_splice_call = false;
-        errno = ENOSYS;
-        return -1;
+    if (pipefd[0] == -1) {
+        if (pipe(pipefd) == -1) {
+            LOG(log_warning, logtype_dsi, "sys_recvfile: pipe: %s", strerror(errno));
+            try_splice_call = false;
+            return default_sys_recvfile(fromfd, tofd, offset, count);
+        }
+#ifdef F_SETPIPE_SZ
+        if (fcntl(pipefd[1], F_SETPIPE_SZ, splice_size) == -1)
+            LOG(log_debug, logtype_dsi, "sys_recvfile: F_SETPIPE_SZ(%d): %s",
+                splice_size, strerror(errno));
+#endif
     }
 
     while (count > 0) {
@@ -206,18 +231,35 @@ static ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count, in
             if (total_written == 0 && (errno == EBADF || errno == EINVAL)) {
                 LOG(log_warning, logtype_dsi, "splice() doesn't work for recvfile");
                 try_splice_call = false;
-                errno = ENOSYS;
-                return -1;
+                return default_sys_recvfile(fromfd, tofd, offset, count);
             }
-            break;
+            return -1;
+        }
+        if (nread == 0) {
+            /* EOF */
+            errno = ECONNRESET;
+            return -1;
         }
 
         to_write = nread;
         while (to_write > 0) {
             int thistime;
             thistime = splice(pipefd[0], NULL, tofd, &splice_offset, to_write, SPLICE_F_MOVE);
-            if (thistime == -1)
-                return -1;
+            if (thistime == -1 && errno == EINTR)
+                continue;
+            if (thistime <= 0) {
+                /*
+                 * Write error: empty the pipe and drain the rest of the
+                 * request from the socket, so the DSI stream stays in sync.
+                 */
+                saved_errno = thistime == 0 ? EIO : errno;
+                LOG(log_error, logtype_dsi, "sys_recvfile: splice to file: %s", strerror(saved_errno));
+                if (default_sys_recvfile(pipefd[0], -1, 0, to_write) != to_write
+                    || default_sys_recvfile(fromfd, -1, 0, count - nread) != count - nread)
+                    return -1;
+                errno = saved_errno;
+                return total_written + (nread - to_write);
+            }
             to_write -= thistime;
         }
 
@@ -225,7 +267,6 @@ static ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count, in
         count -= nread;
     }
 
-done:
     LOG(log_maxdebug, logtype_dsi, "sys_recvfile: total_written: %zu", total_written);
 
     return total_written;
@@ -236,13 +277,19 @@ done:
  No recvfile system call - use the default 128 chunk implementation.
 *****************************************************************/
 
-ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count)
+static ssize_t sys_recvfile(int fromfd, int tofd, off_t offset, size_t count, int splice_size _U_)
 {
     return default_sys_recvfile(fromfd, tofd, offset, count);
 }
 #endif
 
-/* read from a socket and write to an adouble file */
+/*
+ * read from a socket and write to an adouble file
+ *
+ * Returns -1 if reading from the socket failed. Otherwise all len bytes have
+ * been read from the socket and the number of bytes written to the file is
+ * returned, if that's less then len errno is set.
+ */
 ssize_t ad_recvfile(struct adouble *ad, int eid, int sock, off_t off, size_t len, int splice_size)
 {
     ssize_t cc;
@@ -251,11 +298,41 @@ ssize_t ad_recvfile(struct adouble *ad, int eid, int sock, off_t off, size_t len
 
     fd = ad_recvfile_init(ad, eid, &off_fork);
     if ((cc = sys_recvfile(sock, fd, off_fork, len, splice_size)) != len)
-        return -1;
+        return cc;
+
+    if ((eid != ADEID_DFORK) && (off + cc > ad_getentrylen(ad, eid)))
+        ad_setentrylen(ad, eid, off + cc);
+
+    return cc;
+}
+
+#ifdef WITH_IO_URING
+static int uring_waitfordata(void *private)
+{
+    return waitfordata(*(int *)private);
+}
+
+/*
+ * read from a socket and write to an adouble file with the io_uring engine
+ *
+ * Returns -1 if reading from the socket failed. Otherwise all len bytes have
+ * been read from the socket and the number of bytes written to the file is
+ * returned, if that's less then len errno is set.
+ */
+ssize_t ad_recvfile_uring(struct adouble *ad, int eid, int sock, off_t off, size_t len)
+{
+    ssize_t cc;
+    int fd;
+    off_t off_fork = off;
+
+    fd = ad_recvfile_init(ad, eid, &off_fork);
+    if ((cc = uring_recvfile(sock, fd, off_fork, len, uring_waitfordata, &sock)) != len)
+        return cc;
 
-    if ((eid != ADEID_DFORK) && (off > ad_getentrylen(ad, eid)))
-        ad_setentrylen(ad, eid, off);
+    if ((eid != ADEID_DFORK) && (off + cc > ad_getentrylen(ad, eid)))
+        ad_setentrylen(ad, eid, off + cc);
 
     return cc;
 }
+#endif /* WITH_IO_URING */
 #endif
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Shared byte range lock table
+ * ============================
+ *
+ * fcntl locks are per process, so the byte range locks of all afpd sessions
+ * used to be arbitrated by the kernel, which costs a system call for every
+ * FPByteRangeLock and, with "afp read locks", two to three for every FPRead
+ * and FPWrite. With "shared lock table size" set, the byte range locks of all
+ * sessions are kept in a table in a shared memory segment that is set up by
+ * the afpd master process and inherited by all session processes, and
+ * sessions test and set locks there without entering the kernel.
+ *
+ * Unless "byte lock interop" is disabled, locks are additionally set with
+ * fcntl so that non AFP processes like Samba still see them. Every lock then
+ * still costs its fcntl calls on top of the table, the table only refuses
+ * conflicting locks of other AFP sessions before fcntl is called. System
+ * calls are only saved with "byte lock interop = no". Share mode locks
+ * (ADLOCK_FILELOCK) are always fcntl locks, they are tested with F_GETLK from
+ * other processes.
+ *
+ * Locks are keyed by the dev/ino of the fork and hashed to one of SHL_SHARDS
+ * shards, each with a hash table of lock chains. Test and set of a lock
+ * happen under a per shard lock, lock entries come from a common pool with
+ * its own lock that is only taken while the shard lock is held. Locks are
+ * pid_lock() spin locks, the lock word is the pid of the holder. If a
+ * session process dies while holding one, the next process takes over and
+ * rebuilds the chains of the shard, or the free list of the pool, from the
+ * entries. Entries are filled in under the pool lock, so the pid of an entry
+ * tells whether it's free.
+ *
+ * When the afpd master reaps a session process it drops the locks the process
+ * left behind with ad_shmlock_reap(), before the pid can be reused by another
+ * session which would otherwise inherit them. Locks of dead processes found
+ * in the way of another lock or when the pool runs dry are dropped too.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <atalk/adouble.h>
+#include <atalk/logger.h>
+#include <atalk/util.h>
+
+#include "ad_lock.h"
+
+#define SHL_SHARDS      64
+
+#define SHL_RD 1
+#define SHL_WR 2
+
+/* lock entry, index 0 is the list terminator */
+struct shl_lock {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t  start;
+    int64_t  end;               /* exclusive */
+    int32_t  pid;               /* 0: free */
+    uint32_t next;              /* next in chain or free list */
+    uint32_t type;
+    uint32_t pad;
+};
+
+struct shl_shard {
+    int32_t  lock;              /* pid of the holder */
+    uint32_t pad;
+    uint64_t grants;
+    uint64_t conflicts;
+    char     pad2[40];          /* one cache line per shard */
+};
+
+struct shl_pool {
+    int32_t  lock;              /* pid of the holder */
+    uint32_t free;              /* free entry list */
+    uint32_t used;
+    uint32_t pad;
+    uint64_t reclaimed;         /* entries of dead processes */
+    char     pad2[40];
+};
+
+struct shl_hdr {
+    uint32_t         nentries;
+    uint32_t         nbuckets;  /* hash chains per shard */
+    uint32_t         interop;
+    uint32_t         pad;
+    struct shl_pool  pool;
+    struct shl_shard shards[SHL_SHARDS];
+};
+
+static struct shl_hdr  *shl;
+static uint32_t        *heads;
+static struct shl_lock *locks;
+static size_t          shl_len;
+
+#define HEAD(shard, bucket) heads[(shard) * shl->nbuckets + (bucket)]
+
+static uint64_t hash_file(uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = ino * UINT64_C(0x9E3779B97F4A7C15) ^ dev;
+
+    hash ^= hash >> 29;
+    hash *= UINT64_C(0xBF58476D1CE4E5B9);
+    return hash ^ (hash >> 32);
+}
+
+#define SHARD(hash)  ((unsigned int)((hash) % SHL_SHARDS))
+#define BUCKET(hash) ((uint32_t)(((hash) / SHL_SHARDS) % shl->nbuckets))
+
+static int pid_dead(int32_t pid)
+{
+    return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/*********************************************************************************
+ * Locking
+ *********************************************************************************/
+
+static void pool_push(uint32_t idx)
+{
+    struct shl_lock *e = &locks[idx];
+
+    e->pid = 0;
+    e->next = shl->pool.free;
+    shl->pool.free = idx;
+}
+
+/* Rebuild the free list after its lock was taken over from a dead holder */
+static void pool_repair(void)
+{
+    uint32_t i;
+
+    LOG(log_warning, logtype_ad, "shmlock: pool lock holder died");
+
+    /* the dead holder may have left the free list half updated */
+    shl->pool.free = 0;
+    shl->pool.used = 0;
+    for (i = shl->nentries; i > 0; i--) {
+        if (locks[i].pid == 0)
+            pool_push(i);
+        else
+            shl->pool.used++;
+    }
+}
+
+static void pool_lock(void)
+{
+    if (pid_lock(&shl->pool.lock))
+        pool_repair();
+}
+
+static void pool_unlock(void)
+{
+    pid_unlock(&shl->pool.lock);
+}
+
+/*!
+ * Relink the chains of a shard, or all shards if shard is -1, from the entries
+ * dropping those of gone and other dead processes. Shards and pool must be locked.
+ */
+static void shard_relink(int shard, pid_t gone)
+{
+    struct shl_lock *e;
+    uint64_t hash;
+    uint32_t i;
+
+    if (shard < 0)
+        memset(heads, 0, SHL_SHARDS * shl->nbuckets * sizeof(uint32_t));
+    else
+        memset(&HEAD(shard, 0), 0, shl->nbuckets * sizeof(uint32_t));
+
+    for (i = shl->nentries; i > 0; i--) {
+        e = &locks[i];
+        if (e->pid == 0)
+            continue;
+        hash = hash_file(e->dev, e->ino);
+        if (shard >= 0 && SHARD(hash) != (unsigned int)shard)
+            continue;
+        if (e->pid == gone || pid_dead(e->pid)) {
+            pool_push(i);
+            shl->pool.used--;
+            shl->pool.reclaimed++;
+            continue;
+        }
+        e->next = HEAD(SHARD(hash), BUCKET(hash));
+        HEAD(SHARD(hash), BUCKET(hash)) = i;
+    }
+}
+
+/* Rebuild a shard after its lock was taken over from the dead process gone */
+static void shard_repair(unsigned int shard, pid_t gone)
+{
+    LOG(log_warning, logtype_ad, "shmlock: holder of shard %u died", shard);
+
+    /* the dead holder may have left chains half updated or entries unlinked */
+    pool_lock();
+    shard_relink(shard, gone);
+    pool_unlock();
+}
+
+static void shard_lock(unsigned int shard)
+{
+    if (pid_lock(&shl->shards[shard].lock))
+        shard_repair(shard, 0);
+}
+
+static void shard_unlock(unsigned int shard)
+{
+    pid_unlock(&shl->shards[shard].lock);
+}
+
+/* Unlink entry idx from its chain and return it to the pool, shard must be locked */
+static void shard_free(unsigned int shard, uint32_t bucket, uint32_t idx, int dead)
+{
+    uint32_t *link = &HEAD(shard, bucket);
+
+    while (*link != 0 && *link != idx)
+        link = &locks[*link].next;
+    if (*link == idx)
+        *link = locks[idx].next;
+
+    pool_lock();
+    pool_push(idx);
+    shl->pool.used--;
+    if (dead)
+        shl->pool.reclaimed++;
+    pool_unlock();
+}
+
+/* Drop the locks of all dead processes, called when the pool runs dry */
+static void table_reclaim(void)
+{
+    unsigned int shard;
+
+    for (shard = 0; shard < SHL_SHARDS; shard++)
+        shard_lock(shard);
+    pool_lock();
+    shard_relink(-1, 0);
+
+    pool_unlock();
+    for (shard = SHL_SHARDS; shard > 0; shard--)
+        shard_unlock(shard - 1);
+}
+
+/*********************************************************************************
+ * Interface
+ *********************************************************************************/
+
+int shmlock_enabled(void)
+{
+    return shl != NULL;
+}
+
+int shmlock_interop(void)
+{
+    return shl == NULL || shl->interop;
+}
+
+/*!
+ * Set a lock on [start, end) of a file if no other process holds a conflicting one
+ *
+ * @returns id of the lock, 0 with errno EACCES on conflict or ENOLCK if the table is full
+ */
+uint32_t shmlock_add(uint64_t dev, uint64_t ino, off_t start, off_t end, int wr)
+{
+    uint64_t hash = hash_file(dev, ino);
+    unsigned int shard = SHARD(hash);
+    uint32_t bucket = BUCKET(hash);
+    struct shl_shard *sh = &shl->shards[shard];
+    struct shl_lock *e;
+    int32_t me = getpid();
+    uint32_t idx, next;
+    int reclaimed = 0;
+
+again:
+    shard_lock(shard);
+
+    for (idx = HEAD(shard, bucket); idx != 0; idx = next) {
+        e = &locks[idx];
+        next = e->next;
+        if (e->ino != ino || e->dev != dev || e->pid == me
+            || e->start >= end || start >= e->end
+            || (!wr && e->type != SHL_WR))
+            continue;
+        if (pid_dead(e->pid)) {
+            shard_free(shard, bucket, idx, 1);
+            continue;
+        }
+        sh->conflicts++;
+        shard_unlock(shard);
+        errno = EACCES;
+        return 0;
+    }
+
+    pool_lock();
+    if ((idx = shl->pool.free) != 0) {
+        e = &locks[idx];
+        shl->pool.free = e->next;
+        shl->pool.used++;
+        e->dev = dev;
+        e->ino = ino;
+        e->start = start;
+        e->end = end;
+        e->type = wr ? SHL_WR : SHL_RD;
+        e->pid = me;
+    }
+    pool_unlock();
+
+    if (idx == 0) {
+        shard_unlock(shard);
+        if (!reclaimed) {
+            table_reclaim();
+            reclaimed = 1;
+            goto again;
+        }
+        LOG(log_warning, logtype_ad, "shmlock: table is full");
+        errno = ENOLCK;
+        return 0;
+    }
+
+    e->next = HEAD(shard, bucket);
+    HEAD(shard, bucket) = idx;
+    sh->grants++;
+
+    shard_unlock(shard);
+    return idx;
+}
+
+/*!
+ * Remove a lock set with shmlock_add()
+ */
+void shmlock_del(uint32_t id)
+{
+    struct shl_lock *e = &locks[id];
+    uint64_t hash = hash_file(e->dev, e->ino);
+
+    shard_lock(SHARD(hash));
+    /* a forked child must not drop the locks of its parent */
+    if (e->pid == getpid())
+        shard_free(SHARD(hash), BUCKET(hash), id, 0);
+    shard_unlock(SHARD(hash));
+}
+
+/*!
+ * Drop the locks of a session process that exited, called by the afpd master
+ * after it reaped the process and before it forks again
+ */
+void ad_shmlock_reap(pid_t pid)
+{
+    unsigned int shard;
+    uint32_t bucket, idx, *link;
+
+    if (shl == NULL)
+        return;
+
+    if (pid_lock_reap(&shl->pool.lock, pid)) {
+        pool_repair();
+        pool_unlock();
+    }
+
+    for (shard = 0; shard < SHL_SHARDS; shard++) {
+        if (pid_lock_reap(&shl->shards[shard].lock, pid)) {
+            shard_repair(shard, pid);
+            shard_unlock(shard);
+            continue;
+        }
+        shard_lock(shard);
+        for (bucket = 0; bucket < shl->nbuckets; bucket++) {
+            link = &HEAD(shard, bucket);
+            while ((idx = *link) != 0) {
+                if (locks[idx].pid != pid) {
+                    link = &locks[idx].next;
+                    continue;
+                }
+                *link = locks[idx].next;
+                pool_lock();
+                pool_push(idx);
+                shl->pool.used--;
+                shl->pool.reclaimed++;
+                pool_unlock();
+            }
+        }
+        shard_unlock(shard);
+    }
+}
+
+/*!
+ * Setup the shared lock table, called by the afpd master before forking sessions
+ *
+ * @param entries   (r) number of locks the table can hold
+ * @param interop   (r) whether byte range locks are also set with fcntl
+ *
+ * @returns 0 on success, -1 on error
+ */
+int ad_shmlock_init(unsigned int entries, int interop)
+{
+    uint32_t nbuckets, i;
+
+    if (shl != NULL || entries == 0)
+        return 0;
+
+    nbuckets = MAX(16, (entries + SHL_SHARDS - 1) / SHL_SHARDS);
+    shl_len = sizeof(struct shl_hdr)
+        + SHL_SHARDS * nbuckets * sizeof(uint32_t)
+        + (entries + 1) * sizeof(struct shl_lock);
+
+    shl = mmap(NULL, shl_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shl == MAP_FAILED) {
+        LOG(log_error, logtype_ad, "ad_shmlock_init: mmap(%zu): %s", shl_len, strerror(errno));
+        shl = NULL;
+        return -1;
+    }
+
+    shl->nentries = entries;
+    shl->nbuckets = nbuckets;
+    shl->interop = interop ? 1 : 0;
+    heads = (uint32_t *)(shl + 1);
+    locks = (struct shl_lock *)(heads + SHL_SHARDS * nbuckets);
+    for (i = entries; i > 0; i--)
+        pool_push(i);
+
+    LOG(log_info, logtype_ad, "ad_shmlock_init: shared lock table with %u entries (%zu KB)%s",
+        entries, shl_len / 1024, interop ? "" : ", no fcntl byte locks");
+
+    return 0;
+}
+
+/*!
+ * Log shared lock table statistics
+ */
+void ad_shmlock_log_stat(void)
+{
+    unsigned long long grants = 0, conflicts = 0;
+    unsigned int i;
+
+    if (shl == NULL)
+        return;
+
+    for (i = 0; i < SHL_SHARDS; i++) {
+        grants += shl->shards[i].grants;
+        conflicts += shl->shards[i].conflicts;
+    }
+
+    LOG(log_info, logtype_ad,
+        "shared lock table: %u locks held, %llu granted, %llu conflicts, %llu reclaimed",
+        shl->pool.used, grants, conflicts, (unsigned long long)shl->pool.reclaimed);
+}
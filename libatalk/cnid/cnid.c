@@ -32,6 +32,8 @@
 #include <atalk/compat.h>
 #include <atalk/volume.h>
 
+#include "cnid_shm.h"
+
 /* List of all registered modules. */
 static struct list_head modules = ATALK_LIST_HEAD_INIT(modules);
 
@@ -225,9 +227,16 @@ cnid_t cnid_add(struct _cnid_db *cdb, const struct stat *st, const cnid_t did,
     if (len == 0)
         return CNID_INVALID;
 
+    if (cnid_shm_enabled(cdb)
+        && (ret = cnid_shm_lookup(cdb, st, did, name, len)) != CNID_INVALID)
+        return ret;
+
     block_signal(cdb->cnid_db_flags);
     ret = valide(cdb->cnid_add(cdb, st, did, name, len, hint));
     unblock_signal(cdb->cnid_db_flags);
+
+    if (ret != CNID_INVALID && cnid_shm_enabled(cdb))
+        cnid_shm_set(cdb, ret, st, did, name, len);
     return ret;
 }
 
@@ -239,6 +248,9 @@ int ret;
     block_signal(cdb->cnid_db_flags);
     ret = cdb->cnid_delete(cdb, id);
     unblock_signal(cdb->cnid_db_flags);
+
+    if (cnid_shm_enabled(cdb))
+        cnid_shm_delete(cdb, id);
     return ret;
 }
 
@@ -248,9 +260,16 @@ cnid_t cnid_get(struct _cnid_db *cdb, const cnid_t did, char *name,const size_t
 {
 cnid_t ret;
 
+    if (cnid_shm_enabled(cdb)
+        && (ret = cnid_shm_get(cdb, did, name, len)) != CNID_INVALID)
+        return ret;
+
     block_signal(cdb->cnid_db_flags);
     ret = valide(cdb->cnid_get(cdb, did, name, len));
     unblock_signal(cdb->cnid_db_flags);
+
+    if (ret != CNID_INVALID && cnid_shm_enabled(cdb))
+        cnid_shm_set(cdb, ret, NULL, did, name, len);
     return ret;
 }
 
@@ -284,6 +303,14 @@ cnid_t cnid_lookup(struct _cnid_db *cdb, const struct stat *st, const cnid_t did
     block_signal(cdb->cnid_db_flags);
     ret = valide(cdb->cnid_lookup(cdb, st, did, name, len));
     unblock_signal(cdb->cnid_db_flags);
+
+    if (cnid_shm_enabled(cdb)) {
+        if (ret != CNID_INVALID)
+            cnid_shm_set(cdb, ret, st, did, name, len);
+        else
+            /* the backend may just have deleted a stale record of it */
+            cnid_shm_delete_name(cdb, did, name, len);
+    }
     return ret;
 }
 
@@ -303,10 +330,55 @@ int cnid_find(struct _cnid_db *cdb, const char *name, size_t namelen, void *buff
     return ret;
 }
 
+/* --------------- 
+ * Tell the backend which CNIDs are going to be requested next, so that it
+ * can fetch them in one go. Returns the number of entries the backend
+ * fetched, 0 if it doesn't support prefetching. A count of 0 drops the
+ * results of the previous prefetch.
+ */
+int cnid_prefetch(struct _cnid_db *cdb, const struct cnid_prefetch_ent *ents, int count)
+{
+    int ret;
+
+    if (cdb->cnid_prefetch == NULL)
+        return 0;
+
+    block_signal(cdb->cnid_db_flags);
+    ret = cdb->cnid_prefetch(cdb, ents, count);
+    unblock_signal(cdb->cnid_db_flags);
+    return ret;
+}
+
+/* --------------- 
+ * Find the names that contain name, a substring search. *pos is the position
+ * to continue at, 0 to start, and is set to 0 when there are no more matches.
+ * Returns the number of entries in buffer, which may be 0 even if there are
+ * more, or -1 on error.
+ */
+int cnid_search(struct _cnid_db *cdb, const char *name, size_t namelen,
+                cnid_t *pos, void *buffer, size_t buflen)
+{
+    int ret;
+
+    if (cdb->cnid_search == NULL) {
+        LOG(log_error, logtype_cnid, "cnid_search not supported by CNID backend");
+        return -1;
+    }
+
+    block_signal(cdb->cnid_db_flags);
+    ret = cdb->cnid_search(cdb, name, namelen, pos, buffer, buflen);
+    unblock_signal(cdb->cnid_db_flags);
+    return ret;
+}
+
 /* --------------- */
 char *cnid_resolve(struct _cnid_db *cdb, cnid_t *id, void *buffer, size_t len)
 {
 char *ret;
+cnid_t cnid = *id;
+
+    if (cnid_shm_enabled(cdb) && (ret = cnid_shm_resolve(cdb, id, buffer, len)) != NULL)
+        return ret;
 
     block_signal(cdb->cnid_db_flags);
     ret = cdb->cnid_resolve(cdb, id, buffer, len);
@@ -315,6 +387,13 @@ char *ret;
         LOG(log_error, logtype_afpd, "cnid_resolve: name is '..', corrupted db? ");
         ret = NULL;
     }
+
+    if (cnid_shm_enabled(cdb)) {
+        if (ret)
+            cnid_shm_set(cdb, cnid, NULL, *id, ret, strlen(ret));
+        else
+            cnid_shm_delete(cdb, cnid);
+    }
     return ret;
 }
 
@@ -327,6 +406,13 @@ int ret;
     block_signal(cdb->cnid_db_flags);
     ret = cdb->cnid_update(cdb, id, st, did, name, len);
     unblock_signal(cdb->cnid_db_flags);
+
+    if (cnid_shm_enabled(cdb)) {
+        if (ret == 0)
+            cnid_shm_set(cdb, id, st, did, name, len);
+        else
+            cnid_shm_delete(cdb, id);
+    }
     return ret;
 }
 			
@@ -339,6 +425,9 @@ cnid_t ret;
     block_signal(cdb->cnid_db_flags);
     ret = cdb->cnid_rebuild_add(cdb, st, did, name, len, hint);
     unblock_signal(cdb->cnid_db_flags);
+
+    if (ret != CNID_INVALID && cnid_shm_enabled(cdb))
+        cnid_shm_set(cdb, ret, st, did, name, len);
     return ret;
 }
 
@@ -351,5 +440,8 @@ int cnid_wipe(struct _cnid_db *cdb)
     if (cdb->cnid_wipe)
         ret = cdb->cnid_wipe(cdb);
     unblock_signal(cdb->cnid_db_flags);
+
+    if (cnid_shm_enabled(cdb))
+        cnid_shm_wipe();
     return ret;
 }
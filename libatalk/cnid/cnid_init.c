@@ -56,6 +56,10 @@ extern struct _cnid_module cnid_dbd_module;
 extern struct _cnid_module cnid_tdb_module;
 #endif
 
+#ifdef CNID_BACKEND_MMAP
+extern struct _cnid_module cnid_mmap_module;
+#endif
+
 #ifdef CNID_BACKEND_MYSQL
 extern struct _cnid_module cnid_mysql_module;
 #endif
@@ -90,6 +94,10 @@ void cnid_init(void)
     cnid_register(&cnid_tdb_module);
 #endif
 
+#ifdef CNID_BACKEND_MMAP
+    cnid_register(&cnid_mmap_module);
+#endif
+
 #ifdef CNID_BACKEND_MYSQL
     cnid_register(&cnid_mysql_module);
 #endif
@@ -0,0 +1,630 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Shared directory cache
+ * ======================
+ *
+ * A cache of CNID database mappings in a shared memory segment that is set
+ * up by the afpd master process and inherited by all session processes, so
+ * that a mapping learned by one session saves a cnid_dbd round trip in all
+ * the others. The per process dircache in afpd still sits in front of it.
+ *
+ * There are two tables:
+ * - the CNID table maps (volume, CNID) to (parent DID, name, dev, ino)
+ * - the name table maps (volume, parent DID, name) to a CNID
+ *
+ * A mapping is only used if both tables agree: a name table hit needs the CNID
+ * table entry of the found CNID to still have the same parent and name, a CNID
+ * table hit needs the name table entry of its parent and name to still point
+ * back to it. So deleting or updating a CNID entry invalidates the name entries
+ * pointing to it, and storing a new CNID for a name, eg when the backend
+ * replaced a stale record in cnid_add(), invalidates the old CNID. Backend
+ * results that show a cached mapping is gone (a failed lookup or resolve)
+ * drop it. cnid_add() hits additionally require a matching dev/ino.
+ *
+ * Volumes are identified by a hash of the volume path and the database stamp,
+ * as volume ids are assigned per session process. Only persistent backends are
+ * cached, "tdb" CNIDs are process local.
+ *
+ * Each table is split into SHM_SHARDS shards. Readers are lock-free, they use
+ * a per shard seqlock and retry if a writer modified the shard meanwhile.
+ * Writers take a per shard pid_lock() spin lock, holding it only while
+ * copying an entry. Writers wait for the lock instead of skipping the write,
+ * a dropped delete or update would leave a stale mapping behind. If a session
+ * process dies while holding the lock, the next writer takes over and clears
+ * the shard.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <atalk/cnid.h>
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/volume.h>
+
+#include "cnid_shm.h"
+
+#define SHM_SHARDS      64
+#define SHM_WAYS        4       /* slots probed per lookup */
+#define SHM_READ_TRIES  64      /* seqlock read retries before giving up */
+#define SHM_NAMELEN     94      /* longer names aren't cached */
+
+#define SHM_CNIDTAB     0
+#define SHM_NAMETAB     1
+
+/* CNID table entry, 128 bytes */
+struct shm_cnid {
+    uint64_t volkey;
+    uint64_t dev;               /* 0 if learned from cnid_resolve() */
+    uint64_t ino;
+    uint32_t id;                /* CNID_INVALID marks a free slot */
+    uint32_t pdid;
+    uint16_t namelen;
+    char     name[SHM_NAMELEN];
+};
+
+/* name table entry */
+struct shm_name {
+    uint64_t volkey;
+    uint64_t namehash;
+    uint32_t pdid;
+    uint32_t id;
+};
+
+struct shm_shard {
+    int32_t  lock;              /* pid of the writer */
+    uint32_t seq;               /* odd while a writer is active */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    char     pad[32];           /* one cache line per shard */
+};
+
+struct shm_hdr {
+    uint32_t         nslots;    /* slots per shard and table */
+    struct shm_shard shards[2][SHM_SHARDS];
+};
+
+static struct shm_hdr  *shm;
+static struct shm_cnid *cnidtab;
+static struct shm_name *nametab;
+static size_t          shm_len;
+
+/* FNV 1a */
+static uint64_t fnv(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+#define FNV_INIT UINT64_C(14695981039346656037)
+
+static uint64_t shm_volkey(const struct _cnid_db *cdb)
+{
+    const struct vol *vol = cdb->cnid_db_vol;
+    uint64_t hash = FNV_INIT;
+
+    hash = fnv(hash, vol->v_path, strlen(vol->v_path));
+    hash = fnv(hash, vol->v_stamp, sizeof(vol->v_stamp));
+    return hash;
+}
+
+static uint64_t hash_cnid(uint64_t volkey, cnid_t id)
+{
+    return fnv(volkey, &id, sizeof(id));
+}
+
+static uint64_t hash_name(uint64_t volkey, cnid_t pdid, uint64_t namehash)
+{
+    uint64_t hash = fnv(volkey, &pdid, sizeof(pdid));
+    return fnv(hash, &namehash, sizeof(namehash));
+}
+
+/*********************************************************************************
+ * Shard locking
+ *********************************************************************************/
+
+/*!
+ * Take the writer lock of a shard, clear the shard if its last owner died
+ */
+static void shard_lock(int tab, unsigned int shard)
+{
+    struct shm_shard *sh = &shm->shards[tab][shard];
+    uint32_t seq;
+
+    if (pid_lock(&sh->lock) == 0)
+        return;
+
+    LOG(log_warning, logtype_cnid, "cnid_shm: clearing shard %u of table %d, owner died",
+        shard, tab);
+
+    /* The dead writer may have left a half written entry behind */
+    seq = __atomic_load_n(&sh->seq, __ATOMIC_RELAXED);
+    if (!(seq & 1))
+        __atomic_store_n(&sh->seq, ++seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (tab == SHM_CNIDTAB)
+        memset(&cnidtab[shard * shm->nslots], 0, shm->nslots * sizeof(struct shm_cnid));
+    else
+        memset(&nametab[shard * shm->nslots], 0, shm->nslots * sizeof(struct shm_name));
+    __atomic_store_n(&sh->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static void shard_unlock(int tab, unsigned int shard)
+{
+    pid_unlock(&shm->shards[tab][shard].lock);
+}
+
+static void shard_write_begin(int tab, unsigned int shard)
+{
+    struct shm_shard *sh = &shm->shards[tab][shard];
+
+    __atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void shard_write_end(int tab, unsigned int shard)
+{
+    struct shm_shard *sh = &shm->shards[tab][shard];
+
+    __atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&sh->inserts, 1, __ATOMIC_RELAXED);
+}
+
+static void shard_count(int tab, unsigned int shard, int hit)
+{
+    struct shm_shard *sh = &shm->shards[tab][shard];
+
+    if (hit)
+        __atomic_fetch_add(&sh->hits, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&sh->misses, 1, __ATOMIC_RELAXED);
+}
+
+/*********************************************************************************
+ * CNID table
+ *********************************************************************************/
+
+/*!
+ * Lookup a CNID, copy its entry to *e
+ *
+ * @returns 1 if found, 0 if not
+ */
+static int cnidtab_get(uint64_t volkey, cnid_t id, struct shm_cnid *e)
+{
+    uint64_t hash = hash_cnid(volkey, id);
+    unsigned int shard = hash % SHM_SHARDS;
+    unsigned int slot = (hash / SHM_SHARDS) % shm->nslots;
+    struct shm_shard *sh = &shm->shards[SHM_CNIDTAB][shard];
+    struct shm_cnid *base = &cnidtab[shard * shm->nslots];
+    uint32_t seq;
+    int i, tries, found;
+
+    for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+        seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        found = 0;
+        for (i = 0; i < SHM_WAYS; i++) {
+            memcpy(e, &base[(slot + i) % shm->nslots], sizeof(*e));
+            if (e->id == id && e->volkey == volkey) {
+                found = 1;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (found && e->namelen >= SHM_NAMELEN)
+            /* can't happen with a consistent read, don't trust it */
+            found = 0;
+        shard_count(SHM_CNIDTAB, shard, found);
+        return found;
+    }
+
+    shard_count(SHM_CNIDTAB, shard, 0);
+    return 0;
+}
+
+/*!
+ * Insert or replace the entry of a CNID, or remove it if e->namelen is 0
+ */
+static void cnidtab_put(const struct shm_cnid *e)
+{
+    uint64_t hash = hash_cnid(e->volkey, e->id);
+    unsigned int shard = hash % SHM_SHARDS;
+    unsigned int slot = (hash / SHM_SHARDS) % shm->nslots;
+    struct shm_cnid *base = &cnidtab[shard * shm->nslots];
+    struct shm_cnid *s, *victim = NULL;
+    int i;
+
+    shard_lock(SHM_CNIDTAB, shard);
+
+    for (i = 0; i < SHM_WAYS; i++) {
+        s = &base[(slot + i) % shm->nslots];
+        if (s->id == e->id && s->volkey == e->volkey) {
+            victim = s;
+            break;
+        }
+        if (victim == NULL && s->id == CNID_INVALID)
+            victim = s;
+    }
+
+    if (e->namelen == 0) {
+        /* remove */
+        if (victim && victim->id == e->id && victim->volkey == e->volkey) {
+            shard_write_begin(SHM_CNIDTAB, shard);
+            memset(victim, 0, sizeof(*victim));
+            shard_write_end(SHM_CNIDTAB, shard);
+        }
+        shard_unlock(SHM_CNIDTAB, shard);
+        return;
+    }
+
+    if (victim == NULL)
+        /* all ways taken, replace a pseudo random one */
+        victim = &base[(slot + (hash >> 32) % SHM_WAYS) % shm->nslots];
+
+    shard_write_begin(SHM_CNIDTAB, shard);
+    if (e->dev == 0 && e->ino == 0
+        && victim->id == e->id && victim->volkey == e->volkey && victim->pdid == e->pdid
+        && victim->namelen == e->namelen && memcmp(victim->name, e->name, e->namelen) == 0) {
+        /* same mapping, keep the known dev/ino */
+    } else {
+        memcpy(victim, e, sizeof(*e));
+    }
+    shard_write_end(SHM_CNIDTAB, shard);
+    shard_unlock(SHM_CNIDTAB, shard);
+}
+
+/*********************************************************************************
+ * Name table
+ *********************************************************************************/
+
+static int nametab_get(uint64_t volkey, cnid_t pdid, uint64_t namehash, cnid_t *id)
+{
+    uint64_t hash = hash_name(volkey, pdid, namehash);
+    unsigned int shard = hash % SHM_SHARDS;
+    unsigned int slot = (hash / SHM_SHARDS) % shm->nslots;
+    struct shm_shard *sh = &shm->shards[SHM_NAMETAB][shard];
+    struct shm_name *base = &nametab[shard * shm->nslots];
+    struct shm_name e;
+    uint32_t seq;
+    int i, tries, found;
+
+    for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+        seq = __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        found = 0;
+        for (i = 0; i < SHM_WAYS; i++) {
+            memcpy(&e, &base[(slot + i) % shm->nslots], sizeof(e));
+            if (e.id != CNID_INVALID && e.volkey == volkey && e.pdid == pdid && e.namehash == namehash) {
+                found = 1;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        shard_count(SHM_NAMETAB, shard, found);
+        if (found)
+            *id = e.id;
+        return found;
+    }
+
+    shard_count(SHM_NAMETAB, shard, 0);
+    return 0;
+}
+
+/*!
+ * Insert or replace the CNID of a name, or remove it if id is CNID_INVALID
+ */
+static void nametab_put(uint64_t volkey, cnid_t pdid, uint64_t namehash, cnid_t id)
+{
+    uint64_t hash = hash_name(volkey, pdid, namehash);
+    unsigned int shard = hash % SHM_SHARDS;
+    unsigned int slot = (hash / SHM_SHARDS) % shm->nslots;
+    struct shm_name *base = &nametab[shard * shm->nslots];
+    struct shm_name *s, *victim = NULL;
+    int i;
+
+    shard_lock(SHM_NAMETAB, shard);
+
+    for (i = 0; i < SHM_WAYS; i++) {
+        s = &base[(slot + i) % shm->nslots];
+        if (s->volkey == volkey && s->pdid == pdid && s->namehash == namehash) {
+            victim = s;
+            break;
+        }
+        if (victim == NULL && s->id == CNID_INVALID)
+            victim = s;
+    }
+
+    if (id == CNID_INVALID) {
+        /* remove */
+        if (victim && victim->id != CNID_INVALID && victim->volkey == volkey
+            && victim->pdid == pdid && victim->namehash == namehash) {
+            shard_write_begin(SHM_NAMETAB, shard);
+            memset(victim, 0, sizeof(*victim));
+            shard_write_end(SHM_NAMETAB, shard);
+        }
+        shard_unlock(SHM_NAMETAB, shard);
+        return;
+    }
+
+    if (victim == NULL)
+        victim = &base[(slot + (hash >> 32) % SHM_WAYS) % shm->nslots];
+
+    if (victim->id != id || victim->volkey != volkey || victim->pdid != pdid || victim->namehash != namehash) {
+        shard_write_begin(SHM_NAMETAB, shard);
+        victim->volkey = volkey;
+        victim->namehash = namehash;
+        victim->pdid = pdid;
+        victim->id = id;
+        shard_write_end(SHM_NAMETAB, shard);
+    }
+    shard_unlock(SHM_NAMETAB, shard);
+}
+
+/*********************************************************************************
+ * Hooks for cnid.c
+ *********************************************************************************/
+
+/*!
+ * Whether lookups for this database go through the shared cache
+ */
+int cnid_shm_enabled(const struct _cnid_db *cdb)
+{
+    return shm != NULL
+        && (cdb->cnid_db_flags & CNID_FLAG_PERSISTENT)
+        && !(cdb->cnid_db_flags & CNID_FLAG_MEMORY)
+        && cdb->cnid_db_vol != NULL;
+}
+
+/*!
+ * Resolve a CNID from the cache, same semantics as cnid_resolve()
+ *
+ * @returns name stored in buffer and parent DID in *id, NULL if not cached
+ */
+char *cnid_shm_resolve(struct _cnid_db *cdb, cnid_t *id, void *buffer, size_t len)
+{
+    uint64_t volkey = shm_volkey(cdb);
+    struct shm_cnid e;
+    cnid_t nameid;
+
+    if (!cnidtab_get(volkey, *id, &e) || e.namelen + 1 > len)
+        return NULL;
+
+    /* the name entry must still point back to it */
+    if (!nametab_get(volkey, e.pdid, fnv(FNV_INIT, e.name, e.namelen), &nameid)
+        || nameid != *id)
+        return NULL;
+
+    memcpy(buffer, e.name, e.namelen);
+    ((char *)buffer)[e.namelen] = 0;
+    *id = e.pdid;
+    return buffer;
+}
+
+/*!
+ * Find the CNID of did/name in the cache
+ *
+ * @returns CNID or CNID_INVALID if not cached
+ */
+cnid_t cnid_shm_get(struct _cnid_db *cdb, cnid_t did, const char *name, size_t len)
+{
+    uint64_t volkey;
+    struct shm_cnid e;
+    cnid_t id;
+
+    if (len >= SHM_NAMELEN)
+        return CNID_INVALID;
+
+    volkey = shm_volkey(cdb);
+    if (!nametab_get(volkey, did, fnv(FNV_INIT, name, len), &id))
+        return CNID_INVALID;
+
+    /* the CNID entry must still agree */
+    if (!cnidtab_get(volkey, id, &e)
+        || e.pdid != did || e.namelen != len || memcmp(e.name, name, len) != 0)
+        return CNID_INVALID;
+
+    return id;
+}
+
+/*!
+ * Find the CNID of did/name in the cache for cnid_add(), dev/ino must match
+ *
+ * @returns CNID or CNID_INVALID if not cached
+ */
+cnid_t cnid_shm_lookup(struct _cnid_db *cdb, const struct stat *st, cnid_t did,
+                       const char *name, size_t len)
+{
+    uint64_t volkey;
+    struct shm_cnid e;
+    cnid_t id;
+
+    if (len >= SHM_NAMELEN)
+        return CNID_INVALID;
+
+    volkey = shm_volkey(cdb);
+    if (!nametab_get(volkey, did, fnv(FNV_INIT, name, len), &id))
+        return CNID_INVALID;
+
+    if (!cnidtab_get(volkey, id, &e)
+        || e.pdid != did || e.namelen != len || memcmp(e.name, name, len) != 0)
+        return CNID_INVALID;
+
+    if (e.ino != (uint64_t)st->st_ino
+        || (!(cdb->cnid_db_flags & CNID_FLAG_NODEV) && e.dev != (uint64_t)st->st_dev))
+        return CNID_INVALID;
+
+    return id;
+}
+
+/*!
+ * Store a mapping learned from or written to the database
+ *
+ * @param st   (r) stat of the object, NULL if unknown
+ */
+void cnid_shm_set(struct _cnid_db *cdb, cnid_t id, const struct stat *st, cnid_t did,
+                  const char *name, size_t len)
+{
+    struct shm_cnid e;
+
+    if (id == CNID_INVALID || len == 0 || len >= SHM_NAMELEN) {
+        /* at least drop a stale entry */
+        cnid_shm_delete(cdb, id);
+        return;
+    }
+
+    memset(&e, 0, sizeof(e));
+    e.volkey = shm_volkey(cdb);
+    e.id = id;
+    e.pdid = did;
+    e.namelen = len;
+    memcpy(e.name, name, len);
+    if (st) {
+        e.dev = (cdb->cnid_db_flags & CNID_FLAG_NODEV) ? 0 : st->st_dev;
+        e.ino = st->st_ino;
+    }
+
+    cnidtab_put(&e);
+    nametab_put(e.volkey, did, fnv(FNV_INIT, name, len), id);
+}
+
+/*!
+ * Remove a CNID, name table entries pointing to it become invalid
+ */
+void cnid_shm_delete(struct _cnid_db *cdb, cnid_t id)
+{
+    struct shm_cnid e;
+
+    if (id == CNID_INVALID)
+        return;
+
+    memset(&e, 0, sizeof(e));
+    e.volkey = shm_volkey(cdb);
+    e.id = id;
+    cnidtab_put(&e);
+}
+
+/*!
+ * Remove the name did/name, eg after the backend didn't find it
+ */
+void cnid_shm_delete_name(struct _cnid_db *cdb, cnid_t did, const char *name, size_t len)
+{
+    if (len >= SHM_NAMELEN)
+        return;
+
+    nametab_put(shm_volkey(cdb), did, fnv(FNV_INIT, name, len), CNID_INVALID);
+}
+
+/*!
+ * Clear the whole cache, eg after a database has been wiped
+ *
+ * Clearing the CNID table invalidates all name entries too.
+ */
+void cnid_shm_wipe(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < SHM_SHARDS; i++) {
+        shard_lock(SHM_CNIDTAB, i);
+        shard_write_begin(SHM_CNIDTAB, i);
+        memset(&cnidtab[i * shm->nslots], 0, shm->nslots * sizeof(struct shm_cnid));
+        shard_write_end(SHM_CNIDTAB, i);
+        shard_unlock(SHM_CNIDTAB, i);
+    }
+}
+
+/*********************************************************************************
+ * Interface
+ *********************************************************************************/
+
+/*!
+ * Setup the shared directory cache
+ *
+ * Must be called in the afpd master process before forking session processes.
+ *
+ * @param entries   (r) number of cached CNIDs, 0 disables the cache
+ *
+ * @returns 0 on success, -1 on error
+ */
+int cnid_shm_init(unsigned int entries)
+{
+    uint32_t nslots;
+
+    if (shm != NULL || entries == 0)
+        return 0;
+
+    nslots = MAX(SHM_WAYS, (entries + SHM_SHARDS - 1) / SHM_SHARDS);
+    shm_len = sizeof(struct shm_hdr)
+        + SHM_SHARDS * nslots * (sizeof(struct shm_cnid) + sizeof(struct shm_name));
+
+    shm = mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        LOG(log_error, logtype_cnid, "cnid_shm_init: mmap(%zu): %s", shm_len, strerror(errno));
+        shm = NULL;
+        return -1;
+    }
+
+    shm->nslots = nslots;
+    cnidtab = (struct shm_cnid *)(shm + 1);
+    nametab = (struct shm_name *)(cnidtab + SHM_SHARDS * nslots);
+
+    LOG(log_info, logtype_cnid, "cnid_shm_init: shared dircache with %u entries (%zu KB)",
+        SHM_SHARDS * nslots, shm_len / 1024);
+
+    return 0;
+}
+
+/*!
+ * Log shared dircache statistics, totals at level info, per shard at level debug
+ */
+void cnid_shm_log_stat(void)
+{
+    unsigned long long hits[2] = {0, 0}, misses[2] = {0, 0}, inserts[2] = {0, 0};
+    const struct shm_shard *sh;
+    int tab;
+    unsigned int i;
+
+    if (shm == NULL)
+        return;
+
+    for (tab = SHM_CNIDTAB; tab <= SHM_NAMETAB; tab++) {
+        for (i = 0; i < SHM_SHARDS; i++) {
+            sh = &shm->shards[tab][i];
+            hits[tab] += sh->hits;
+            misses[tab] += sh->misses;
+            inserts[tab] += sh->inserts;
+            LOG(log_debug, logtype_cnid, "shared dircache %s shard %u: hits: %llu, misses: %llu, inserts: %llu",
+                tab == SHM_CNIDTAB ? "cnid" : "name", i,
+                (unsigned long long)sh->hits, (unsigned long long)sh->misses,
+                (unsigned long long)sh->inserts);
+        }
+    }
+
+    LOG(log_info, logtype_cnid, "shared dircache statistics: "
+        "cnid hits: %llu, cnid misses: %llu, name hits: %llu, name misses: %llu, inserts: %llu",
+        hits[SHM_CNIDTAB], misses[SHM_CNIDTAB], hits[SHM_NAMETAB], misses[SHM_NAMETAB],
+        inserts[SHM_CNIDTAB] + inserts[SHM_NAMETAB]);
+}
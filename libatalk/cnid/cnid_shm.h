@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Shared directory cache, hooks for the CNID wrappers in cnid.c
+ */
+
+#ifndef _CNID_SHM_H
+#define _CNID_SHM_H 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <atalk/cnid.h>
+
+extern int    cnid_shm_enabled(const struct _cnid_db *cdb);
+extern char   *cnid_shm_resolve(struct _cnid_db *cdb, cnid_t *id, void *buffer, size_t len);
+extern cnid_t cnid_shm_get(struct _cnid_db *cdb, cnid_t did, const char *name, size_t len);
+extern cnid_t cnid_shm_lookup(struct _cnid_db *cdb, const struct stat *st, cnid_t did,
+                              const char *name, size_t len);
+extern void   cnid_shm_set(struct _cnid_db *cdb, cnid_t id, const struct stat *st, cnid_t did,
+                           const char *name, size_t len);
+extern void   cnid_shm_delete(struct _cnid_db *cdb, cnid_t id);
+extern void   cnid_shm_delete_name(struct _cnid_db *cdb, cnid_t did, const char *name, size_t len);
+extern void   cnid_shm_wipe(void);
+
+#endif /* _CNID_SHM_H */
@@ -424,6 +424,36 @@ static int transmit(CNID_bdb_private *db, struct cnid_dbd_rqst *rqst, struct cni
     return -1;
 }
 
+/* ---------------------
+ * CNID of an entry of the last CNID_DBD_OP_LOOKUP_BATCH, every result is
+ * used only once.
+ */
+static cnid_t dbd_prefetched(CNID_bdb_private *db, const struct cnid_dbd_rqst *rqst)
+{
+    struct cnid_dbd_batch ent;
+    const char *p = db->prefetched;
+    cnid_t id;
+    int i;
+
+    for (i = 0; i < db->nprefetched; i++) {
+        memcpy(&ent, p, sizeof(ent));
+        p += sizeof(ent);
+        if (db->prefetched_id[i] != CNID_INVALID
+            && ent.did == rqst->did
+            && ent.ino == rqst->ino
+            && ent.dev == rqst->dev
+            && ent.type == rqst->type
+            && ent.namelen == rqst->namelen
+            && memcmp(p, rqst->name, ent.namelen) == 0) {
+            id = db->prefetched_id[i];
+            db->prefetched_id[i] = CNID_INVALID;
+            return id;
+        }
+        p += ent.namelen;
+    }
+    return CNID_INVALID;
+}
+
 /* ---------------------- */
 static struct _cnid_db *cnid_dbd_new(struct vol *vol)
 {
@@ -446,6 +476,8 @@ static struct _cnid_db *cnid_dbd_new(struct vol *vol)
     cdb->cnid_rebuild_add = cnid_dbd_rebuild_add;
     cdb->cnid_close = cnid_dbd_close;
     cdb->cnid_wipe = cnid_dbd_wipe;
+    cdb->cnid_prefetch = cnid_dbd_prefetch;
+    cdb->cnid_search = cnid_dbd_search;
     return cdb;
 }
 
@@ -571,6 +603,11 @@ cnid_t cnid_dbd_add(struct _cnid_db *cdb, const struct stat *st,
     LOG(log_debug, logtype_cnid, "cnid_dbd_add: CNID: %u, name: '%s', dev: 0x%llx, inode: 0x%llx, type: %s",
         ntohl(did), name, (long long)rqst.dev, (long long)st->st_ino, rqst.type ? "dir" : "file");
 
+    if ((id = dbd_prefetched(db, &rqst)) != CNID_INVALID) {
+        LOG(log_debug, logtype_cnid, "cnid_dbd_add: prefetched CNID: %u", ntohl(id));
+        return id;
+    }
+
     rply.namelen = 0;
     if (transmit(db, &rqst, &rply) < 0) {
         errno = CNID_ERR_DB;
@@ -763,6 +800,11 @@ cnid_t cnid_dbd_lookup(struct _cnid_db *cdb, const struct stat *st, cnid_t did,
     LOG(log_debug, logtype_cnid, "cnid_dbd_lookup: CNID: %u, name: '%s', inode: 0x%llx, type: %d (0=file, 1=dir)",
         ntohl(did), name, (long long)st->st_ino, rqst.type);
 
+    if ((id = dbd_prefetched(db, &rqst)) != CNID_INVALID) {
+        LOG(log_debug, logtype_cnid, "cnid_dbd_lookup: prefetched CNID: %u", ntohl(id));
+        return id;
+    }
+
     rply.namelen = 0;
     if (transmit(db, &rqst, &rply) < 0) {
         errno = CNID_ERR_DB;
@@ -843,6 +885,134 @@ int cnid_dbd_find(struct _cnid_db *cdb, const char *name, size_t namelen, void *
     return count;
 }
 
+/* ---------------------- */
+int cnid_dbd_search(struct _cnid_db *cdb, const char *name, size_t namelen,
+                    cnid_t *pos, void *buffer, size_t buflen)
+{
+    CNID_bdb_private *db;
+    struct cnid_dbd_rqst rqst;
+    struct cnid_dbd_rply rply;
+    char *p, *end;
+    int count = 0;
+
+    if (!cdb || !(db = cdb->cnid_db_private) || !name || buflen < DBD_MAX_SRCH_LEN) {
+        LOG(log_error, logtype_cnid, "cnid_search: Parameter error");
+        errno = CNID_ERR_PARAM;
+        return -1;
+    }
+
+    if (namelen > MAXPATHLEN) {
+        LOG(log_error, logtype_cnid, "cnid_search: Path name is too long");
+        errno = CNID_ERR_PATH;
+        return -1;
+    }
+
+    LOG(log_debug, logtype_cnid, "cnid_search(\"%s\", pos: %u)", name, ntohl(*pos));
+
+    RQST_RESET(&rqst);
+    rqst.op = CNID_DBD_OP_SEARCH_NAME;
+    rqst.cnid = *pos;
+    rqst.name = name;
+    rqst.namelen = namelen;
+
+    rply.name = buffer;
+    rply.namelen = DBD_MAX_SRCH_LEN;
+
+    if (transmit(db, &rqst, &rply) < 0) {
+        errno = CNID_ERR_DB;
+        return -1;
+    }
+
+    switch (rply.result) {
+    case CNID_DBD_RES_SRCH_CNT:
+        *pos = rply.cnid;
+        break;
+    case CNID_DBD_RES_SRCH_DONE:
+        *pos = CNID_INVALID;
+        break;
+    case CNID_DBD_RES_ERR_DB:
+        errno = CNID_ERR_DB;
+        return -1;
+    default:
+        abort();
+    }
+
+    /* count the entries */
+    p = buffer;
+    end = p + rply.namelen;
+    while (p + 2 * sizeof(cnid_t) < end) {
+        p += 2 * sizeof(cnid_t);
+        p += strnlen(p, end - p) + 1;
+        count++;
+    }
+
+    LOG(log_debug, logtype_cnid, "cnid_search: got %d matches, next pos: %u", count, ntohl(*pos));
+    return count;
+}
+
+/* ----------------------
+ * Look up the CNIDs of count entries with one CNID_DBD_OP_LOOKUP_BATCH
+ * request, later cnid_dbd_add() and cnid_dbd_lookup() calls for them are
+ * answered from the reply. Only as many entries as fit into one request
+ * are sent. Returns the number of entries sent, -1 on error.
+ */
+int cnid_dbd_prefetch(struct _cnid_db *cdb, const struct cnid_prefetch_ent *ents, int count)
+{
+    CNID_bdb_private *db;
+    struct cnid_dbd_rqst rqst;
+    struct cnid_dbd_rply rply;
+    struct cnid_dbd_batch ent;
+    size_t len = 0;
+    int i;
+
+    if (!cdb || !(db = cdb->cnid_db_private) || (count && !ents)) {
+        LOG(log_error, logtype_cnid, "cnid_prefetch: Parameter error");
+        errno = CNID_ERR_PARAM;
+        return -1;
+    }
+
+    db->nprefetched = 0;
+
+    for (i = 0; i < count && i < DBD_MAX_BATCH; i++) {
+        if (len + sizeof(ent) + ents[i].len > DBD_MAX_BATCH_LEN)
+            break;
+        memset(&ent, 0, sizeof(ent));
+        if (!(cdb->cnid_db_flags & CNID_FLAG_NODEV))
+            ent.dev = ents[i].st->st_dev;
+        ent.ino = ents[i].st->st_ino;
+        ent.type = S_ISDIR(ents[i].st->st_mode) ? 1 : 0;
+        ent.did = ents[i].did;
+        ent.namelen = ents[i].len;
+        memcpy(db->prefetched + len, &ent, sizeof(ent));
+        len += sizeof(ent);
+        memcpy(db->prefetched + len, ents[i].name, ents[i].len);
+        len += ents[i].len;
+    }
+    if (i == 0)
+        return 0;
+
+    RQST_RESET(&rqst);
+    rqst.op = CNID_DBD_OP_LOOKUP_BATCH;
+    rqst.name = db->prefetched;
+    rqst.namelen = len;
+
+    rply.name = (char *)db->prefetched_id;
+    rply.namelen = sizeof(db->prefetched_id);
+
+    if (transmit(db, &rqst, &rply) < 0) {
+        errno = CNID_ERR_DB;
+        return -1;
+    }
+    if (rply.result != CNID_DBD_RES_OK || rply.namelen != i * sizeof(cnid_t)) {
+        LOG(log_debug, logtype_cnid, "cnid_dbd_prefetch: no results (%d)", rply.result);
+        return 0;
+    }
+
+    LOG(log_debug, logtype_cnid, "cnid_dbd_prefetch: %d entries", i);
+    db->nprefetched = i;
+    return i;
+}
+
 /* ---------------------- */
 int cnid_dbd_update(struct _cnid_db *cdb, cnid_t id, const struct stat *st,
                     cnid_t did, const char *name, size_t len)
@@ -865,6 +1035,7 @@ int cnid_dbd_update(struct _cnid_db *cdb, cnid_t id, const struct stat *st,
 
     RQST_RESET(&rqst);
     rqst.op = CNID_DBD_OP_UPDATE;
+    db->nprefetched = 0;   /* results may be stale now */
     rqst.cnid = id;
     if (!(cdb->cnid_db_flags & CNID_FLAG_NODEV)) {
         rqst.dev = st->st_dev;
@@ -920,6 +1091,7 @@ cnid_t cnid_dbd_rebuild_add(struct _cnid_db *cdb, const struct stat *st,
 
     RQST_RESET(&rqst);
     rqst.op = CNID_DBD_OP_REBUILD_ADD;
+    db->nprefetched = 0;   /* results may be stale now */
 
     if (!(cdb->cnid_db_flags & CNID_FLAG_NODEV)) {
         rqst.dev = st->st_dev;
@@ -977,6 +1149,7 @@ int cnid_dbd_delete(struct _cnid_db *cdb, const cnid_t id)
 
     RQST_RESET(&rqst);
     rqst.op = CNID_DBD_OP_DELETE;
+    db->nprefetched = 0;   /* results may be stale now */
     rqst.cnid = id;
 
     rply.namelen = 0;
@@ -1014,6 +1187,7 @@ int cnid_dbd_wipe(struct _cnid_db *cdb)
 
     RQST_RESET(&rqst);
     rqst.op = CNID_DBD_OP_WIPE;
+    db->nprefetched = 0;   /* results may be stale now */
     rqst.cnid = 0;
 
     rply.namelen = 0;
@@ -33,6 +33,10 @@ extern int    cnid_dbd_delete     (struct _cnid_db *, const cnid_t);
 extern cnid_t cnid_dbd_rebuild_add(struct _cnid_db *, const struct stat *,
                                    cnid_t, const char *, size_t, cnid_t);
 extern int    cnid_dbd_wipe       (struct _cnid_db *cdb);
+extern int    cnid_dbd_prefetch   (struct _cnid_db *cdb, const struct cnid_prefetch_ent *ents,
+                                   int count);
+extern int    cnid_dbd_search     (struct _cnid_db *cdb, const char *name, size_t namelen,
+                                   cnid_t *pos, void *buffer, size_t buflen);
 /* FIXME: These functions could be static in cnid_dbd.c */
 
 #endif /* include/atalk/cnid_dbd.h */
@@ -0,0 +1,884 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Embedded memory mapped CNID backend
+ * ===================================
+ *
+ * Keeps the CNID database of a volume in .AppleDB/cnid2.mmap, a file of
+ * copy-on-write B+trees every afpd process maps (cnid_mmap_btree.c).
+ * Lookups are served straight from the mapping without a lock or a trip to
+ * cnid_dbd. Only when an entry is missing or the indexes disagree a write
+ * transaction is started, which locks out other writers but not readers.
+ *
+ * The records and the repair logic are those of cnid_dbd: the CNID index
+ * holds the full record, dev/ino and did/name map to the CNID.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef CNID_BACKEND_MMAP
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/volume.h>
+#include <atalk/unicode.h>
+
+#include "cnid_mmap.h"
+
+#define DBHOME       ".AppleDB"
+#define DBCNID       "cnid2.mmap"
+
+/* CNID records scanned per cnid_search() call */
+#define SRCH_MAX_SCAN 10000
+/* index entries counted per trigram when picking the one to search with */
+#define SRCH_GRAM_COUNT 1000
+
+#define RECBUF_LEN   (CNID_HEADER_LEN + MAXPATHLEN + 1)
+
+/* Result of the index lookups of a record */
+struct lookup {
+    int      devino, didname;       /* found in the index */
+    cnid_t   id_devino, id_didname;
+    uint32_t type_devino, type_didname;
+    int      dangling;              /* index entry without CNID record */
+};
+
+static void make_devino_data(unsigned char *buf, dev_t dev, ino_t ino)
+{
+    int i;
+
+    for (i = CNID_DEV_LEN - 1; i >= 0; i--) {
+        buf[i] = dev;
+        dev >>= 8;
+    }
+    for (i = CNID_DEV_LEN + CNID_INO_LEN - 1; i >= CNID_DEV_LEN; i--) {
+        buf[i] = ino;
+        ino >>= 8;
+    }
+}
+
+/* Build the CNID record, returns its length or 0 if the name is too long */
+static size_t make_record(unsigned char *buf, uint32_t flags, const struct stat *st,
+                          cnid_t did, const char *name, size_t len)
+{
+    uint32_t type;
+
+    if (len > MAXPATHLEN || CNID_HEADER_LEN + len + 1 > MM_MAXENTRY - CNID_LEN)
+        return 0;
+
+    memset(buf, 0, CNID_LEN);
+    make_devino_data(buf + CNID_DEVINO_OFS, !(flags & CNID_FLAG_NODEV) ? st->st_dev : 0, st->st_ino);
+    type = htonl(S_ISDIR(st->st_mode) ? 1 : 0);
+    memcpy(buf + CNID_TYPE_OFS, &type, sizeof(type));
+    /* did is already in network byte order */
+    memcpy(buf + CNID_DID_OFS, &did, sizeof(did));
+    memcpy(buf + CNID_NAME_OFS, name, len);
+    buf[CNID_NAME_OFS + len] = 0;
+
+    return CNID_HEADER_LEN + len + 1;
+}
+
+/* Get the CNID record of id, returns 1 if found, 0 if not, -1 on error */
+static int get_record(MM_ENV *env, cnid_t id, struct mm_val *rec)
+{
+    int rc;
+
+    if ((rc = mm_get(env, MM_CNID, &id, sizeof(id), rec)) <= 0)
+        return rc;
+    if (rec->size <= CNID_HEADER_LEN) {
+        LOG(log_error, logtype_cnid, "cnid_mmap: bad record for CNID %u", ntohl(id));
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Look up an index, *id and *type are those of the record found. A
+ * dangling index entry is removed in a write transaction.
+ */
+static int get_index(MM_ENV *env, int tree, const void *key, size_t klen, int write,
+                     cnid_t *id, uint32_t *type, int *dangling)
+{
+    struct mm_val val, rec;
+    int rc;
+
+    if ((rc = mm_get(env, tree, key, klen, &val)) <= 0)
+        return rc;
+    if (val.size != sizeof(cnid_t))
+        return -1;
+    memcpy(id, val.data, sizeof(cnid_t));
+
+    if ((rc = get_record(env, *id, &rec)) < 0)
+        return -1;
+    if (rc == 0) {
+        *dangling = 1;
+        if (write && mm_del(env, tree, key, klen) < 0)
+            return -1;
+        return 0;
+    }
+    memcpy(type, (const char *)rec.data + CNID_TYPE_OFS, sizeof(*type));
+    return 1;
+}
+
+static int lookup(MM_ENV *env, const unsigned char *rec, size_t reclen, int write, struct lookup *lk)
+{
+    memset(lk, 0, sizeof(*lk));
+
+    if ((lk->devino = get_index(env, MM_DEVINO, rec + CNID_DEVINO_OFS, CNID_DEVINO_LEN, write,
+                                &lk->id_devino, &lk->type_devino, &lk->dangling)) < 0)
+        return -1;
+    if ((lk->didname = get_index(env, MM_DIDNAME, rec + CNID_DID_OFS, reclen - CNID_DID_OFS, write,
+                                 &lk->id_didname, &lk->type_didname, &lk->dangling)) < 0)
+        return -1;
+    return 0;
+}
+
+/* Both indexes agree on the CNID and the type */
+static int lookup_clean(const struct lookup *lk, const unsigned char *rec)
+{
+    uint32_t type;
+
+    memcpy(&type, rec + CNID_TYPE_OFS, sizeof(type));
+    return lk->devino && lk->didname && lk->id_devino == lk->id_didname
+        && lk->type_devino == type && lk->type_didname == type;
+}
+
+/* Lowercase a name the way cnid_dbd indexes names */
+static size_t name_tolower(const struct vol *vol, const char *name, size_t len, char *buf, size_t buflen)
+{
+    uint16_t flags = CONV_TOLOWER;
+
+    if (convert_charset(vol->v_volcharset, vol->v_volcharset, vol->v_maccharset,
+                        name, len, buf, buflen - 2, &flags) == (size_t)-1) {
+        buf[0] = 0;
+    }
+    return strlen(buf);
+}
+
+/*
+ * Add (put != 0) or delete the name index entries of a record: the
+ * lowercased name for prefix searches and its trigrams for substring
+ * searches, both followed by the CNID. Names too long for a key aren't
+ * indexed.
+ */
+static int index_name(MM_ENV *env, const struct vol *vol, const unsigned char *rec, size_t reclen, int put)
+{
+    char key[MAXPATHLEN + 2 + CNID_LEN];
+    unsigned char gram[TRIGRAM_LEN + CNID_LEN];
+    size_t len, i;
+    int rc;
+
+    len = name_tolower(vol, (const char *)rec + CNID_NAME_OFS, reclen - CNID_NAME_OFS - 1,
+                       key, MAXPATHLEN + 2);
+    if (len == 0 || len + 1 + CNID_LEN > MM_MAXENTRY)
+        return 0;
+
+    for (i = 0; i + TRIGRAM_LEN <= len; i++) {
+        memcpy(gram, key + i, TRIGRAM_LEN);
+        memcpy(gram + TRIGRAM_LEN, rec + CNID_OFS, CNID_LEN);
+        /* a trigram occurring twice is simply put or deleted twice */
+        rc = put ? mm_put(env, MM_TRIGRAM, gram, sizeof(gram), "", 0)
+            : mm_del(env, MM_TRIGRAM, gram, sizeof(gram));
+        if (rc < 0)
+            return -1;
+    }
+
+    key[len] = 0;
+    memcpy(key + len + 1, rec + CNID_OFS, CNID_LEN);
+    rc = put ? mm_put(env, MM_NAME, key, len + 1 + CNID_LEN, "", 0)
+        : mm_del(env, MM_NAME, key, len + 1 + CNID_LEN);
+    return rc < 0 ? -1 : 0;
+}
+
+/* Delete a CNID record and the index entries pointing to it */
+static int delete_id(MM_ENV *env, const struct vol *vol, cnid_t id)
+{
+    unsigned char rec[MM_MAXENTRY];
+    struct mm_val val;
+    cnid_t other;
+    size_t reclen;
+    int rc;
+
+    if ((rc = get_record(env, id, &val)) <= 0)
+        return rc;
+    reclen = val.size;
+    memcpy(rec, val.data, reclen);
+
+    if ((rc = mm_get(env, MM_DEVINO, rec + CNID_DEVINO_OFS, CNID_DEVINO_LEN, &val)) < 0)
+        return -1;
+    if (rc == 1 && val.size == sizeof(other) && (memcpy(&other, val.data, sizeof(other)), other == id)
+        && mm_del(env, MM_DEVINO, rec + CNID_DEVINO_OFS, CNID_DEVINO_LEN) < 0)
+        return -1;
+
+    if ((rc = mm_get(env, MM_DIDNAME, rec + CNID_DID_OFS, reclen - CNID_DID_OFS, &val)) < 0)
+        return -1;
+    if (rc == 1 && val.size == sizeof(other) && (memcpy(&other, val.data, sizeof(other)), other == id)
+        && mm_del(env, MM_DIDNAME, rec + CNID_DID_OFS, reclen - CNID_DID_OFS) < 0)
+        return -1;
+
+    if (index_name(env, vol, rec, reclen, 0) != 0)
+        return -1;
+
+    return mm_del(env, MM_CNID, &id, sizeof(id));
+}
+
+/* Insert a record under id, rec is modified */
+static int put_record(MM_ENV *env, const struct vol *vol, unsigned char *rec, size_t reclen, cnid_t id)
+{
+    memcpy(rec, &id, sizeof(id));
+    if (mm_put(env, MM_CNID, &id, sizeof(id), rec, reclen) < 0
+        || mm_put(env, MM_DEVINO, rec + CNID_DEVINO_OFS, CNID_DEVINO_LEN, &id, sizeof(id)) < 0
+        || mm_put(env, MM_DIDNAME, rec + CNID_DID_OFS, reclen - CNID_DID_OFS, &id, sizeof(id)) < 0
+        || index_name(env, vol, rec, reclen, 1) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Look up a record in a write transaction and fix the database like
+ * dbd_lookup() does. Returns 1 and the CNID in *id if found, 0 if not
+ * and -1 on error. *hint is invalidated if it must not be reused.
+ */
+static int lookup_fix(MM_ENV *env, const struct vol *vol, unsigned char *rec, size_t reclen,
+                      cnid_t *hint, cnid_t *id)
+{
+    struct lookup lk;
+    uint32_t type;
+
+    if (lookup(env, rec, reclen, 1, &lk) != 0)
+        return -1;
+    if (!lk.devino && !lk.didname)
+        return 0;
+
+    if (lookup_clean(&lk, rec)) {
+        *id = lk.id_didname;
+        return 1;
+    }
+
+    /* one is a dir one is a file, remove from db */
+    memcpy(&type, rec + CNID_TYPE_OFS, sizeof(type));
+    if ((lk.devino && lk.type_devino != type) || (lk.didname && lk.type_didname != type)) {
+        if (lk.devino && lk.type_devino != type && delete_id(env, vol, lk.id_devino) < 0)
+            return -1;
+        if (lk.didname && lk.type_didname != type && delete_id(env, vol, lk.id_didname) < 0)
+            return -1;
+        return 0;
+    }
+
+    /* CNIDs don't match, e.g. emacs and its backup files swapped inodes */
+    if (lk.devino && lk.didname) {
+        if (delete_id(env, vol, lk.id_devino) < 0 || delete_id(env, vol, lk.id_didname) < 0)
+            return -1;
+        return 0;
+    }
+
+    /* renamed or moved, keep the CNID if the hint from the AppleDouble file agrees */
+    if (!lk.didname) {
+        if (delete_id(env, vol, lk.id_devino) < 0)
+            return -1;
+        if (*hint != lk.id_devino) {
+            *hint = CNID_INVALID;
+            return 0;
+        }
+        if (put_record(env, vol, rec, reclen, lk.id_devino) < 0)
+            return -1;
+        *id = lk.id_devino;
+        return 1;
+    }
+
+    /* inode changed */
+    if (delete_id(env, vol, lk.id_didname) < 0)
+        return -1;
+    *hint = CNID_INVALID;
+    return 0;
+}
+
+/* Allocate a CNID like get_cnid() of cnid_dbd, the hint is used if it's free */
+static int next_id(MM_ENV *env, cnid_t hint, cnid_t *id)
+{
+    struct mm_val val;
+    cnid_t last, try, key;
+    int rc;
+
+    if ((last = mm_get_lastid(env)) < CNID_START - 1)
+        last = CNID_START - 1;
+
+    if (hint != CNID_INVALID && ntohl(hint) < CNID_START)
+        hint = CNID_INVALID;
+
+    while (1) {
+        if (hint != CNID_INVALID) {
+            try = ntohl(hint);
+            hint = CNID_INVALID;
+        } else {
+            if (++last == CNID_INVALID)
+                last = CNID_START;
+            try = last;
+        }
+        key = htonl(try);
+        if ((rc = mm_get(env, MM_CNID, &key, sizeof(key), &val)) < 0)
+            return -1;
+        if (rc == 0)
+            break;
+    }
+
+    if (try == last)
+        mm_set_lastid(env, last);
+    *id = htonl(try);
+    return 0;
+}
+
+static MM_ENV *get_env(struct _cnid_db *cdb)
+{
+    struct _cnid_mmap_private *db;
+
+    if (!cdb || !(db = cdb->cnid_db_private))
+        return NULL;
+    return db->env;
+}
+
+/*
+ * Lock-free lookup, returns 1 and the CNID if the database is consistent,
+ * 0 if nothing was found, 2 if a write transaction must fix it up
+ */
+static int lookup_fast(MM_ENV *env, const unsigned char *rec, size_t reclen, cnid_t *id)
+{
+    struct lookup lk;
+    int rc;
+
+    if (mm_read_begin(env) != 0)
+        return -1;
+    if (lookup(env, rec, reclen, 0, &lk) != 0) {
+        rc = -1;
+    } else if (lookup_clean(&lk, rec)) {
+        *id = lk.id_didname;
+        rc = 1;
+    } else if (!lk.devino && !lk.didname && !lk.dangling) {
+        rc = 0;
+    } else {
+        rc = 2;
+    }
+    mm_read_end(env);
+    return rc;
+}
+
+/* ------------------------ */
+static cnid_t cnid_mmap_add(struct _cnid_db *cdb, const struct stat *st,
+                            cnid_t did, const char *name, size_t len, cnid_t hint)
+{
+    unsigned char rec[RECBUF_LEN];
+    MM_ENV *env;
+    size_t reclen;
+    cnid_t id = CNID_INVALID;
+    int rc;
+
+    if ((env = get_env(cdb)) == NULL || !st || !name) {
+        errno = CNID_ERR_PARAM;
+        return CNID_INVALID;
+    }
+    if ((reclen = make_record(rec, cdb->cnid_db_flags, st, did, name, len)) == 0) {
+        LOG(log_error, logtype_cnid, "cnid_mmap_add: Path name is too long");
+        errno = CNID_ERR_PATH;
+        return CNID_INVALID;
+    }
+
+    if ((rc = lookup_fast(env, rec, reclen, &id)) == 1)
+        return id;
+    if (rc < 0 || mm_rdonly(env))
+        goto error;
+
+    if (mm_write_begin(env) != 0)
+        goto error;
+    if ((rc = lookup_fix(env, cdb->cnid_db_vol, rec, reclen, &hint, &id)) < 0)
+        goto abort;
+    if (rc == 0) {
+        if (next_id(env, hint, &id) != 0 || put_record(env, cdb->cnid_db_vol, rec, reclen, id) != 0)
+            goto abort;
+    }
+    if (mm_write_commit(env) != 0)
+        goto error;
+
+    LOG(log_debug, logtype_cnid, "cnid_mmap_add(did: %u, name: \"%s\"): CNID %u",
+        ntohl(did), name, ntohl(id));
+    return id;
+
+abort:
+    mm_write_abort(env);
+error:
+    errno = CNID_ERR_DB;
+    return CNID_INVALID;
+}
+
+/* ------------------------ */
+static cnid_t cnid_mmap_lookup(struct _cnid_db *cdb, const struct stat *st,
+                               cnid_t did, const char *name, size_t len)
+{
+    unsigned char rec[RECBUF_LEN];
+    MM_ENV *env;
+    size_t reclen;
+    cnid_t id = CNID_INVALID, hint = CNID_INVALID;
+    int rc;
+
+    if ((env = get_env(cdb)) == NULL || !st || !name) {
+        errno = CNID_ERR_PARAM;
+        return CNID_INVALID;
+    }
+    if ((reclen = make_record(rec, cdb->cnid_db_flags, st, did, name, len)) == 0) {
+        errno = CNID_ERR_PATH;
+        return CNID_INVALID;
+    }
+
+    if ((rc = lookup_fast(env, rec, reclen, &id)) != 2)
+        return rc == 1 ? id : CNID_INVALID;
+    if (mm_rdonly(env))
+        return CNID_INVALID;
+
+    if (mm_write_begin(env) != 0)
+        return CNID_INVALID;
+    if ((rc = lookup_fix(env, cdb->cnid_db_vol, rec, reclen, &hint, &id)) < 0) {
+        mm_write_abort(env);
+        return CNID_INVALID;
+    }
+    if (mm_write_commit(env) != 0)
+        return CNID_INVALID;
+    return rc == 1 ? id : CNID_INVALID;
+}
+
+/* ------------------------ */
+static cnid_t cnid_mmap_get(struct _cnid_db *cdb, cnid_t did, const char *name, size_t len)
+{
+    char key[CNID_DID_LEN + MAXPATHLEN + 1];
+    struct mm_val val;
+    MM_ENV *env;
+    cnid_t id = CNID_INVALID;
+
+    if ((env = get_env(cdb)) == NULL || !name || len > MAXPATHLEN)
+        return CNID_INVALID;
+
+    memcpy(key, &did, sizeof(did));
+    memcpy(key + CNID_DID_LEN, name, len);
+    key[CNID_DID_LEN + len] = 0;
+
+    if (mm_read_begin(env) != 0)
+        return CNID_INVALID;
+    if (mm_get(env, MM_DIDNAME, key, CNID_DID_LEN + len + 1, &val) == 1 && val.size == sizeof(id))
+        memcpy(&id, val.data, sizeof(id));
+    mm_read_end(env);
+
+    return id;
+}
+
+/* ------------------------ */
+static char *cnid_mmap_resolve(struct _cnid_db *cdb, cnid_t *id, void *buffer, size_t len)
+{
+    struct mm_val rec;
+    MM_ENV *env;
+    char *ret = NULL;
+
+    if ((env = get_env(cdb)) == NULL || !id || !(*id))
+        return NULL;
+
+    if (mm_read_begin(env) != 0)
+        return NULL;
+    if (get_record(env, *id, &rec) == 1 && rec.size - CNID_NAME_OFS <= len) {
+        memcpy(id, (const char *)rec.data + CNID_DID_OFS, sizeof(cnid_t));
+        memcpy(buffer, (const char *)rec.data + CNID_NAME_OFS, rec.size - CNID_NAME_OFS);
+        ((char *)buffer)[rec.size - CNID_NAME_OFS - 1] = 0;
+        ret = buffer;
+    }
+    mm_read_end(env);
+
+    return ret;
+}
+
+/* ------------------------ */
+static int cnid_mmap_delete(struct _cnid_db *cdb, cnid_t id)
+{
+    MM_ENV *env;
+    int rc;
+
+    if ((env = get_env(cdb)) == NULL || !id)
+        return -1;
+    if (mm_rdonly(env))
+        return -1;
+
+    if (mm_write_begin(env) != 0)
+        return -1;
+    if ((rc = delete_id(env, cdb->cnid_db_vol, id)) < 0) {
+        mm_write_abort(env);
+        return -1;
+    }
+    if (mm_write_commit(env) != 0)
+        return -1;
+
+    LOG(log_debug, logtype_cnid, "cnid_mmap_delete(CNID: %u): %s",
+        ntohl(id), rc ? "deleted" : "not in database");
+    return 0;
+}
+
+/* ------------------------ */
+static int cnid_mmap_update(struct _cnid_db *cdb, cnid_t id, const struct stat *st,
+                            cnid_t did, const char *name, size_t len)
+{
+    unsigned char rec[RECBUF_LEN];
+    struct mm_val val;
+    MM_ENV *env;
+    cnid_t other;
+    size_t reclen;
+
+    if ((env = get_env(cdb)) == NULL || !id || !st || !name || mm_rdonly(env)) {
+        errno = CNID_ERR_PARAM;
+        return -1;
+    }
+    if ((reclen = make_record(rec, cdb->cnid_db_flags, st, did, name, len)) == 0) {
+        errno = CNID_ERR_PATH;
+        return -1;
+    }
+
+    if (mm_write_begin(env) != 0)
+        goto error;
+
+    /* delete the old record and whatever the new keys point to, then insert */
+    if (delete_id(env, cdb->cnid_db_vol, id) < 0)
+        goto abort;
+    if (mm_get(env, MM_DEVINO, rec + CNID_DEVINO_OFS, CNID_DEVINO_LEN, &val) == 1
+        && val.size == sizeof(other)) {
+        memcpy(&other, val.data, sizeof(other));
+        if (delete_id(env, cdb->cnid_db_vol, other) < 0)
+            goto abort;
+    }
+    if (mm_get(env, MM_DIDNAME, rec + CNID_DID_OFS, reclen - CNID_DID_OFS, &val) == 1
+        && val.size == sizeof(other)) {
+        memcpy(&other, val.data, sizeof(other));
+        if (delete_id(env, cdb->cnid_db_vol, other) < 0)
+            goto abort;
+    }
+    if (put_record(env, cdb->cnid_db_vol, rec, reclen, id) < 0)
+        goto abort;
+
+    if (mm_write_commit(env) != 0)
+        goto error;
+    return 0;
+
+abort:
+    mm_write_abort(env);
+error:
+    errno = CNID_ERR_DB;
+    return -1;
+}
+
+/* ------------------------ */
+static cnid_t cnid_mmap_rebuild_add(struct _cnid_db *cdb, const struct stat *st,
+                                    cnid_t did, const char *name, size_t len, cnid_t hint)
+{
+    unsigned char rec[RECBUF_LEN];
+    MM_ENV *env;
+    size_t reclen;
+
+    if ((env = get_env(cdb)) == NULL || !st || !name || hint == CNID_INVALID || mm_rdonly(env)) {
+        errno = CNID_ERR_PARAM;
+        return CNID_INVALID;
+    }
+    if ((reclen = make_record(rec, cdb->cnid_db_flags, st, did, name, len)) == 0) {
+        errno = CNID_ERR_PATH;
+        return CNID_INVALID;
+    }
+
+    if (mm_write_begin(env) != 0)
+        goto error;
+    if (delete_id(env, cdb->cnid_db_vol, hint) < 0
+        || put_record(env, cdb->cnid_db_vol, rec, reclen, hint) < 0)
+        goto abort;
+    if (ntohl(hint) > mm_get_lastid(env))
+        mm_set_lastid(env, ntohl(hint));
+    if (mm_write_commit(env) != 0)
+        goto error;
+    return hint;
+
+abort:
+    mm_write_abort(env);
+error:
+    errno = CNID_ERR_DB;
+    return CNID_INVALID;
+}
+
+/* ------------------------ */
+static int cnid_mmap_getstamp(struct _cnid_db *cdb, void *buffer, const size_t len)
+{
+    MM_ENV *env;
+    uint64_t stamp;
+
+    if ((env = get_env(cdb)) == NULL || len < sizeof(stamp))
+        return -1;
+
+    stamp = mm_stamp(env);
+    memset(buffer, 0, len);
+    memcpy(buffer, &stamp, sizeof(stamp));
+    return 0;
+}
+
+/* ------------------------ */
+static int cnid_mmap_wipe(struct _cnid_db *cdb)
+{
+    MM_ENV *env;
+
+    if ((env = get_env(cdb)) == NULL || mm_rdonly(env))
+        return -1;
+
+    if (mm_write_begin(env) != 0)
+        return -1;
+    if (mm_wipe(env) != 0) {
+        mm_write_abort(env);
+        return -1;
+    }
+    return mm_write_commit(env);
+}
+
+/* ------------------------ */
+static int cnid_mmap_find(struct _cnid_db *cdb, const char *name, size_t namelen,
+                          void *buffer, size_t buflen)
+{
+    char key[MAXPATHLEN + 2];
+    struct mm_val k, v;
+    MM_ENV *env;
+    size_t keylen;
+    int rc = 0, count = 0;
+
+    if ((env = get_env(cdb)) == NULL || !name || namelen > MAXPATHLEN) {
+        errno = CNID_ERR_PARAM;
+        return -1;
+    }
+    if ((keylen = name_tolower(cdb->cnid_db_vol, name, namelen, key, sizeof(key))) == 0)
+        return 0;
+
+    if (mm_read_begin(env) != 0)
+        return -1;
+
+    /* names starting with name, like the name index of cnid_dbd */
+    k.data = key;
+    k.size = keylen;
+    while ((count + 1) * sizeof(cnid_t) <= buflen
+           && (rc = mm_seek(env, MM_NAME, k.data, k.size, &k, &v)) == 1) {
+        if (k.size < keylen + 1 + CNID_LEN || memcmp(k.data, key, keylen) != 0)
+            break;
+        memcpy((char *)buffer + count * sizeof(cnid_t),
+               (const char *)k.data + k.size - CNID_LEN, sizeof(cnid_t));
+        count++;
+    }
+    mm_read_end(env);
+
+    LOG(log_debug, logtype_cnid, "cnid_mmap_find(\"%s\"): %d matches", key, count);
+    return rc < 0 ? -1 : count;
+}
+
+/*
+ * The next candidate after id for a substring search: with a trigram the
+ * next CNID of its index entries, else simply the next CNID. Returns 1 and
+ * the CNID in *next, 0 at the end, -1 on error.
+ */
+static int next_candidate(MM_ENV *env, const char *gram, cnid_t id, cnid_t *next)
+{
+    unsigned char key[TRIGRAM_LEN + CNID_LEN];
+    struct mm_val k, v;
+    int rc;
+
+    if (gram == NULL) {
+        if ((rc = mm_seek(env, MM_CNID, &id, id ? sizeof(id) : 0, &k, &v)) != 1)
+            return rc;
+        memcpy(next, k.data, sizeof(cnid_t));
+        return 1;
+    }
+
+    memcpy(key, gram, TRIGRAM_LEN);
+    memcpy(key + TRIGRAM_LEN, &id, CNID_LEN);
+    if ((rc = mm_seek(env, MM_TRIGRAM, key, sizeof(key), &k, &v)) != 1)
+        return rc;
+    if (k.size != sizeof(key) || memcmp(k.data, gram, TRIGRAM_LEN) != 0)
+        return 0;
+    memcpy(next, (const char *)k.data + TRIGRAM_LEN, sizeof(cnid_t));
+    return 1;
+}
+
+/* Number of names with the trigram, counting stops at max */
+static int count_trigram(MM_ENV *env, const char *gram, int max)
+{
+    cnid_t id = 0;
+    int rc, n = 0;
+
+    while (n < max && (rc = next_candidate(env, gram, id, &id)) == 1)
+        n++;
+    return rc < 0 ? -1 : n;
+}
+
+/* ------------------------ */
+static int cnid_mmap_search(struct _cnid_db *cdb, const char *name, size_t namelen,
+                            cnid_t *pos, void *buffer, size_t buflen)
+{
+    char key[MAXPATHLEN + 2], lname[MAXPATHLEN + 2];
+    struct mm_val rec;
+    MM_ENV *env;
+    cnid_t id = *pos, next;
+    const char *dbname, *gram = NULL;
+    size_t keylen, len = 0, entlen, dbnamelen, i;
+    int rc, n, min = 0, scanned = 0, count = 0;
+
+    if ((env = get_env(cdb)) == NULL || !name || namelen > MAXPATHLEN) {
+        errno = CNID_ERR_PARAM;
+        return -1;
+    }
+    if ((keylen = name_tolower(cdb->cnid_db_vol, name, namelen, key, sizeof(key))) == 0) {
+        *pos = CNID_INVALID;
+        return 0;
+    }
+
+    if (mm_read_begin(env) != 0)
+        return -1;
+
+    /*
+     * Only names with the least frequent trigram of key can match, keys
+     * shorter than a trigram check all names
+     */
+    for (i = 0; i + TRIGRAM_LEN <= keylen; i++) {
+        if ((n = count_trigram(env, key + i, SRCH_GRAM_COUNT)) < 0) {
+            rc = -1;
+            goto exit;
+        }
+        if (gram == NULL || n < min) {
+            gram = key + i;
+            min = n;
+        }
+    }
+
+    while ((rc = next_candidate(env, gram, id, &next)) == 1) {
+        if (++scanned > SRCH_MAX_SCAN)
+            break;
+        if (get_record(env, next, &rec) != 1) {
+            id = next;
+            continue;
+        }
+        dbname = (const char *)rec.data + CNID_NAME_OFS;
+        dbnamelen = rec.size - CNID_NAME_OFS - 1;
+        name_tolower(cdb->cnid_db_vol, dbname, dbnamelen, lname, sizeof(lname));
+        if (strstr(lname, key) == NULL) {
+            id = next;
+            continue;
+        }
+
+        entlen = 2 * sizeof(cnid_t) + dbnamelen + 1;
+        if (len + entlen > buflen)
+            break;                  /* continue with this one next time */
+        id = next;
+        memcpy((char *)buffer + len, &id, sizeof(cnid_t));
+        memcpy((char *)buffer + len + sizeof(cnid_t), (const char *)rec.data + CNID_DID_OFS, sizeof(cnid_t));
+        memcpy((char *)buffer + len + 2 * sizeof(cnid_t), dbname, dbnamelen);
+        ((char *)buffer)[len + entlen - 1] = 0;
+        len += entlen;
+        count++;
+    }
+
+exit:
+    mm_read_end(env);
+
+    if (rc < 0)
+        return -1;
+    *pos = rc == 0 ? CNID_INVALID : id;
+
+    LOG(log_debug, logtype_cnid, "cnid_mmap_search(\"%s\"): %d matches, next pos: %u",
+        key, count, ntohl(*pos));
+    return count;
+}
+
+/* ------------------------ */
+static void cnid_mmap_close(struct _cnid_db *cdb)
+{
+    struct _cnid_mmap_private *db;
+
+    if (!cdb)
+        return;
+    if ((db = cdb->cnid_db_private) != NULL) {
+        mm_close(db->env);
+        free(db);
+    }
+    free(cdb);
+}
+
+/* ------------------------ */
+static struct _cnid_db *cnid_mmap_open(struct cnid_open_args *args)
+{
+    struct _cnid_db *cdb = NULL;
+    struct _cnid_mmap_private *db = NULL;
+    struct vol *vol = args->cnid_args_vol;
+    struct stat st;
+    char path[MAXPATHLEN + 1];
+
+    if (args->cnid_args_flags & CNID_FLAG_MEMORY) {
+        LOG(log_error, logtype_cnid, "cnid_mmap_open: no in-memory databases");
+        return NULL;
+    }
+
+    if (strlen(vol->v_path) + strlen("/" DBHOME "/" DBCNID) > MAXPATHLEN) {
+        LOG(log_error, logtype_cnid, "cnid_mmap_open: Pathname too large: %s", vol->v_path);
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/" DBHOME, vol->v_path);
+    if ((stat(path, &st) < 0) && (ad_mkdir(path, 0777 & ~vol->v_umask) < 0)) {
+        LOG(log_error, logtype_cnid, "cnid_mmap_open: DBHOME mkdir failed for %s", path);
+        return NULL;
+    }
+    strlcat(path, "/" DBCNID, sizeof(path));
+
+    if ((cdb = calloc(1, sizeof(struct _cnid_db))) == NULL
+        || (db = calloc(1, sizeof(struct _cnid_mmap_private))) == NULL) {
+        LOG(log_error, logtype_cnid, "cnid_mmap_open: out of memory");
+        goto fail;
+    }
+    if (mm_open(&db->env, path, 0666 & ~vol->v_umask,
+                (vol->v_flags & AFPVOL_CNID_NOSYNC) ? MM_NOSYNC : 0) != 0)
+        goto fail;
+
+    cdb->cnid_db_vol = vol;
+    cdb->cnid_db_private = db;
+    cdb->cnid_db_flags = CNID_FLAG_PERSISTENT;
+
+    cdb->cnid_add = cnid_mmap_add;
+    cdb->cnid_delete = cnid_mmap_delete;
+    cdb->cnid_get = cnid_mmap_get;
+    cdb->cnid_lookup = cnid_mmap_lookup;
+    cdb->cnid_nextid = NULL;
+    cdb->cnid_resolve = cnid_mmap_resolve;
+    cdb->cnid_update = cnid_mmap_update;
+    cdb->cnid_close = cnid_mmap_close;
+    cdb->cnid_getstamp = cnid_mmap_getstamp;
+    cdb->cnid_rebuild_add = cnid_mmap_rebuild_add;
+    cdb->cnid_find = cnid_mmap_find;
+    cdb->cnid_wipe = cnid_mmap_wipe;
+    cdb->cnid_search = cnid_mmap_search;
+
+    LOG(log_debug, logtype_cnid, "cnid_mmap_open: opened \"%s\"", path);
+    return cdb;
+
+fail:
+    free(db);
+    free(cdb);
+    return NULL;
+}
+
+struct _cnid_module cnid_mmap_module = {
+    "mmap",
+    {NULL, NULL},
+    cnid_mmap_open,
+    CNID_FLAG_SETUID | CNID_FLAG_BLOCK
+};
+
+#endif /* CNID_BACKEND_MMAP */
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ */
+
+#ifndef _ATALK_CNID_MMAP__H
+#define _ATALK_CNID_MMAP__H 1
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include <atalk/cnid.h>
+#include <atalk/cnid_private.h>
+
+/* the indexes of cnid_dbd */
+#define MM_CNID      0          /* CNID -> full record */
+#define MM_DEVINO    1          /* dev/ino -> CNID */
+#define MM_DIDNAME   2          /* did/name -> CNID */
+#define MM_NAME      3          /* lowercased name, 0, CNID -> nothing */
+#define MM_TRIGRAM   4          /* trigram of the lowercased name, CNID -> nothing */
+#define MM_NTREES    5
+
+/* length of the trigrams in MM_TRIGRAM */
+#define TRIGRAM_LEN  3
+
+/* mm_open() flags */
+#define MM_NOSYNC    0x01
+
+/* largest key + value that can be stored */
+#define MM_MAXENTRY  1000
+
+typedef struct mm_env MM_ENV;
+
+struct mm_val {
+    const void *data;
+    size_t     size;
+};
+
+struct _cnid_mmap_private {
+    MM_ENV *env;
+};
+
+/* cnid_mmap_btree.c */
+extern int      mm_open(MM_ENV **envp, const char *path, mode_t mode, int flags);
+extern void     mm_close(MM_ENV *env);
+extern int      mm_rdonly(const MM_ENV *env);
+extern int      mm_read_begin(MM_ENV *env);
+extern void     mm_read_end(MM_ENV *env);
+extern int      mm_write_begin(MM_ENV *env);
+extern int      mm_write_commit(MM_ENV *env);
+extern void     mm_write_abort(MM_ENV *env);
+extern int      mm_get(MM_ENV *env, int tree, const void *key, size_t klen, struct mm_val *val);
+extern int      mm_seek(MM_ENV *env, int tree, const void *key, size_t klen,
+                        struct mm_val *rkey, struct mm_val *rval);
+extern int      mm_put(MM_ENV *env, int tree, const void *key, size_t klen,
+                       const void *val, size_t vlen);
+extern int      mm_del(MM_ENV *env, int tree, const void *key, size_t klen);
+extern uint32_t mm_get_lastid(MM_ENV *env);
+extern void     mm_set_lastid(MM_ENV *env, uint32_t id);
+extern uint64_t mm_stamp(MM_ENV *env);
+extern int      mm_wipe(MM_ENV *env);
+
+/* cnid_mmap.c */
+extern struct _cnid_module cnid_mmap_module;
+
+#endif /* _ATALK_CNID_MMAP__H */
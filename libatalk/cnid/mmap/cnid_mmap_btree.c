@@ -0,0 +1,1340 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Memory mapped copy-on-write B+trees
+ * ===================================
+ *
+ * The database is one file of MM_PAGESIZE pages mapped shared into every
+ * process that has the volume open. It holds the three indexes of the
+ * CNID database as B+trees. Pages are never modified while they're
+ * reachable from a committed tree: a write transaction copies every page
+ * it changes and its parents up to the root, then publishes the new roots
+ * by writing the meta page. Readers therefore need no lock, they take a
+ * snapshot by reading the meta and only follow pages of that snapshot.
+ *
+ * File layout:
+ *
+ *   page 0              header and the two metas
+ *   pages 1 to 3        reader table
+ *   pages 4 ...         tree and freelist pages
+ *
+ * The two metas are written alternately, a meta whose mm_txnid is 0 is
+ * being written. A reader copies the meta with the highest txnid and
+ * checks the txnid afterwards, much like a seqlock.
+ *
+ * Writers are serialized by an fcntl() write lock on the first byte of the
+ * file. A page a transaction replaces can't be reused before no reader
+ * uses a snapshot older than that transaction. Readers announce their
+ * snapshot in a slot of the reader table, the writer takes the oldest
+ * txnid found there and puts the pages freed by later transactions on the
+ * pending list of the meta. Pages that are safe to reuse are chained on
+ * the free list through mp_next, which a reused page keeps, so the free
+ * list of the previous meta stays intact if a writer dies halfway. Slots
+ * of dead processes are reclaimed with kill(pid, 0). A process without a
+ * slot, and read-only volumes, read under a shared fcntl() lock instead.
+ *
+ * A commit first flushes the pages the transaction wrote with msync(), then
+ * writes and flushes the meta, so a meta on disk never refers to pages that
+ * aren't. Without MM_NOSYNC a committed transaction survives a crash of the
+ * host. The header gets its magic only after the rest of it is on disk, a
+ * file without it is initialized again on the next mm_open().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef CNID_BACKEND_MMAP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+
+#include "cnid_mmap.h"
+
+#define MM_MAGIC       0x4e41434d   /* "NACM" */
+#define MM_VERSION     2
+#define MM_PAGESIZE    4096
+#define MM_HEADPAGES   4            /* header and reader table */
+#define MM_MAXDEPTH    16
+#define MM_MAPMIN      (64 * 1024 * 1024)
+#define MM_RESERVE     (4 * 1024 * 1024)  /* room a write transaction may use */
+#define MM_GROW        (1024 * 1024)
+
+#define MP_LEAF        0x01
+#define MP_BRANCH      0x02
+#define MP_PENDING     0x04
+
+#define barrier()      __sync_synchronize()
+
+struct mm_meta {
+    uint64_t mm_txnid;              /* 0 while the meta is written */
+    uint64_t mm_stamp;              /* database stamp, changed by mm_wipe() */
+    uint32_t mm_root[MM_NTREES];
+    uint32_t mm_npages;             /* pages in use including the header */
+    uint32_t mm_freehead;           /* free list */
+    uint32_t mm_pending;            /* first pending list page */
+    uint32_t mm_lastid;
+    uint32_t mm_pad;
+};
+
+struct mm_head {
+    uint32_t mh_magic;
+    uint32_t mh_version;
+    uint32_t mh_pagesize;
+    uint32_t mh_pad;
+    struct mm_meta mh_meta[2];
+};
+
+struct mm_reader {
+    volatile pid_t    mr_pid;
+    uint32_t          mr_pad;
+    volatile uint64_t mr_txnid;     /* snapshot in use, 0 if none */
+};
+
+#define MM_NREADERS  ((MM_HEADPAGES - 1) * MM_PAGESIZE / sizeof(struct mm_reader))
+
+struct mm_page {
+    uint32_t mp_next;               /* free list link, kept when reused */
+    uint16_t mp_flags;
+    uint16_t mp_nkeys;
+    uint64_t mp_txnid;              /* transaction that wrote the page */
+    uint16_t mp_upper;              /* start of the entry data */
+    uint16_t mp_pad[3];
+    uint16_t mp_ptrs[];             /* entry offsets in key order */
+};
+
+#define PAGEHDR        offsetof(struct mm_page, mp_ptrs)
+#define FREESPACE(p)   ((p)->mp_upper - PAGEHDR - (p)->mp_nkeys * sizeof(uint16_t))
+
+/*
+ * Entries: leaf pages hold (uint16 klen, uint16 vlen, key, value), branch
+ * pages (uint16 klen, uint16 pad, uint32 child, key). The key of the first
+ * entry of a branch page is not used, it's smaller than all keys below.
+ */
+#define LEAFHDR        4
+#define BRANCHHDR      8
+#define MAXKEYS        ((MM_PAGESIZE - PAGEHDR) / (LEAFHDR + 4 + sizeof(uint16_t)) + 1)
+
+/* entries of a pending list page */
+struct mm_pgent {
+    uint64_t txnid;                 /* transaction that freed the page */
+    uint32_t pgno;
+    uint32_t pad;
+};
+
+#define PENDING_PER_PAGE ((MM_PAGESIZE - PAGEHDR - 8) / sizeof(struct mm_pgent))
+
+struct mm_env {
+    int             fd;
+    int             rdonly;
+    int             nosync;         /* MM_NOSYNC */
+    size_t          syspagesize;
+    pid_t           pid;
+    char            *map;
+    size_t          mapsize;
+    off_t           filesize;
+    struct mm_head  *head;
+    struct mm_reader *slot;         /* our reader slot, NULL if none */
+    int             locked;         /* fcntl lock held */
+    /* transaction */
+    int             txn;            /* 0, 'r' or 'w' */
+    struct mm_meta  meta;           /* snapshot or meta being written */
+    uint64_t        txnid;          /* id of the write transaction */
+    uint32_t        dirty_lo;       /* pages written by the transaction */
+    uint32_t        dirty_hi;
+    uint32_t        *freed;         /* pages freed by this transaction */
+    size_t          nfreed, maxfreed;
+    struct mm_pgent *pending;       /* pending pages carried over */
+    size_t          npending, maxpending;
+};
+
+static struct mm_page *getpage(MM_ENV *env, uint32_t pgno)
+{
+    return (struct mm_page *)(env->map + (size_t)pgno * MM_PAGESIZE);
+}
+
+/* a page number read from the file that can be followed */
+static int valid_pgno(MM_ENV *env, uint32_t pgno)
+{
+    return pgno >= MM_HEADPAGES && pgno < env->meta.mm_npages
+        && (size_t)env->meta.mm_npages * MM_PAGESIZE <= env->mapsize;
+}
+
+/* Remember that the transaction wrote pgno */
+static void mark_dirty(MM_ENV *env, uint32_t pgno)
+{
+    if (env->dirty_hi == 0 || pgno < env->dirty_lo)
+        env->dirty_lo = pgno;
+    if (pgno >= env->dirty_hi)
+        env->dirty_hi = pgno + 1;
+}
+
+/***************************************************************************
+ * Locking, mapping and metas
+ ***************************************************************************/
+
+static int filelock(MM_ENV *env, short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 1;
+
+    while (fcntl(env->fd, F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            LOG(log_error, logtype_cnid, "cnid_mmap: fcntl: %s", strerror(errno));
+            return -1;
+        }
+    }
+    env->locked = (type != F_UNLCK);
+    return 0;
+}
+
+/* Map at least size bytes, mappings are reserved generously so that they rarely move */
+static int remap(MM_ENV *env, size_t size)
+{
+    size_t mapsize = env->mapsize ? env->mapsize : MM_MAPMIN;
+    void *map;
+
+    while (mapsize < size + MM_RESERVE)
+        mapsize *= 2;
+    if (env->map && mapsize == env->mapsize)
+        return 0;
+
+    if (env->map)
+        munmap(env->map, env->mapsize);
+    env->head = NULL;
+
+    map = mmap(NULL, mapsize, env->rdonly ? PROT_READ : PROT_READ | PROT_WRITE,
+               MAP_SHARED, env->fd, 0);
+    if (map == MAP_FAILED) {
+        LOG(log_error, logtype_cnid, "cnid_mmap: mmap: %s", strerror(errno));
+        env->map = NULL;
+        env->mapsize = 0;
+        return -1;
+    }
+    env->map = map;
+    env->mapsize = mapsize;
+    env->head = map;
+    return 0;
+}
+
+/* Copy the current meta */
+static int read_meta(MM_ENV *env, struct mm_meta *meta)
+{
+    struct mm_meta *m;
+    uint64_t t0, t1;
+    int i;
+
+    for (i = 0; i < 1000000; i++) {
+        t0 = *(volatile uint64_t *)&env->head->mh_meta[0].mm_txnid;
+        t1 = *(volatile uint64_t *)&env->head->mh_meta[1].mm_txnid;
+        if (t0 == 0 && t1 == 0)
+            continue;
+        m = &env->head->mh_meta[t1 > t0 ? 1 : 0];
+        barrier();
+        memcpy(meta, m, sizeof(*meta));
+        barrier();
+        if (meta->mm_txnid != 0 && *(volatile uint64_t *)&m->mm_txnid == meta->mm_txnid)
+            return 0;
+    }
+    LOG(log_error, logtype_cnid, "cnid_mmap: no valid meta");
+    return -1;
+}
+
+/* Write pages from to to of the mapping to disk */
+static int sync_pages(MM_ENV *env, uint32_t from, uint32_t to)
+{
+    size_t start = (size_t)from * MM_PAGESIZE, end = (size_t)to * MM_PAGESIZE;
+
+    /* msync() wants addresses aligned to the system page size */
+    start &= ~(env->syspagesize - 1);
+    if (msync(env->map + start, end - start, MS_SYNC) != 0) {
+        LOG(log_error, logtype_cnid, "cnid_mmap: msync: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void write_meta(MM_ENV *env)
+{
+    struct mm_meta *m = &env->head->mh_meta[env->txnid & 1];
+
+    m->mm_txnid = 0;
+    barrier();
+    memcpy((char *)m + sizeof(m->mm_txnid), (char *)&env->meta + sizeof(m->mm_txnid),
+           sizeof(*m) - sizeof(m->mm_txnid));
+    barrier();
+    m->mm_txnid = env->txnid;
+    barrier();
+}
+
+/***************************************************************************
+ * Reader table
+ ***************************************************************************/
+
+static struct mm_reader *readers(MM_ENV *env)
+{
+    return (struct mm_reader *)(env->map + MM_PAGESIZE);
+}
+
+static int pid_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void claim_slot(MM_ENV *env)
+{
+    struct mm_reader *r = readers(env);
+    pid_t pid;
+    size_t i;
+
+    for (i = 0; i < MM_NREADERS; i++) {
+        if (r[i].mr_pid == 0 && __sync_bool_compare_and_swap(&r[i].mr_pid, 0, env->pid))
+            goto done;
+    }
+    for (i = 0; i < MM_NREADERS; i++) {
+        pid = r[i].mr_pid;
+        if (pid != 0 && !pid_alive(pid)
+            && __sync_bool_compare_and_swap(&r[i].mr_pid, pid, env->pid))
+            goto done;
+    }
+    LOG(log_note, logtype_cnid, "cnid_mmap: reader table full, reading with locks");
+    return;
+
+done:
+    r[i].mr_txnid = 0;
+    env->slot = &r[i];
+}
+
+static void release_slot(MM_ENV *env)
+{
+    if (env->slot == NULL)
+        return;
+    env->slot->mr_txnid = 0;
+    barrier();
+    __sync_bool_compare_and_swap(&env->slot->mr_pid, env->pid, 0);
+    env->slot = NULL;
+}
+
+/* Oldest snapshot in use by any reader */
+static uint64_t oldest_reader(MM_ENV *env, uint64_t current)
+{
+    struct mm_reader *r = readers(env);
+    uint64_t oldest = current, txnid;
+    pid_t pid;
+    size_t i;
+
+    for (i = 0; i < MM_NREADERS; i++) {
+        if ((pid = r[i].mr_pid) == 0)
+            continue;
+        txnid = r[i].mr_txnid;
+        if (txnid == 0 || txnid >= oldest)
+            continue;
+        if (!pid_alive(pid)) {
+            if (__sync_bool_compare_and_swap(&r[i].mr_pid, pid, 0))
+                LOG(log_debug, logtype_cnid, "cnid_mmap: freed slot of dead reader %d", pid);
+            continue;
+        }
+        oldest = txnid;
+    }
+    return oldest;
+}
+
+/***************************************************************************
+ * Open and close
+ ***************************************************************************/
+
+/*
+ * Extend the file to size with its blocks allocated. Pages are written through
+ * the shared mapping, where a full filesystem raises SIGBUS instead of an error,
+ * so a sparse file isn't good enough. On failure the file keeps its old size.
+ */
+static int grow_file(MM_ENV *env, off_t size)
+{
+    static const char zeros[MM_PAGESIZE];
+    off_t off = env->filesize;
+    ssize_t n;
+    int ret;
+
+    if ((ret = posix_fallocate(env->fd, off, size - off)) == 0) {
+        env->filesize = size;
+        return 0;
+    }
+    if (ret != EINVAL && ret != EOPNOTSUPP)
+        goto error;
+
+    /* no fallocate() on this filesystem, write zeros */
+    while (off < size) {
+        n = pwrite(env->fd, zeros, MIN((off_t)sizeof(zeros), size - off), off);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = n == 0 ? ENOSPC : errno;
+            goto error;
+        }
+        off += n;
+    }
+    env->filesize = size;
+    return 0;
+
+error:
+    LOG(log_error, logtype_cnid, "cnid_mmap: growing the file to %jd bytes: %s",
+        (intmax_t)size, strerror(ret));
+    if (ftruncate(env->fd, env->filesize) != 0)
+        LOG(log_error, logtype_cnid, "cnid_mmap: ftruncate: %s", strerror(errno));
+    errno = ret;
+    return -1;
+}
+
+static int init_file(MM_ENV *env)
+{
+    struct mm_head *h;
+    struct mm_meta *m;
+
+    /* start over, the file may hold the remains of an incomplete header */
+    if (ftruncate(env->fd, 0) != 0) {
+        LOG(log_error, logtype_cnid, "cnid_mmap: ftruncate: %s", strerror(errno));
+        return -1;
+    }
+    env->filesize = 0;
+    if (grow_file(env, (off_t)MM_HEADPAGES * MM_PAGESIZE + MM_GROW) != 0)
+        return -1;
+    if (remap(env, MM_HEADPAGES * MM_PAGESIZE) != 0)
+        return -1;
+
+    h = env->head;
+    memset(h, 0, MM_HEADPAGES * MM_PAGESIZE);
+    h->mh_version = MM_VERSION;
+    h->mh_pagesize = MM_PAGESIZE;
+    m = &h->mh_meta[1];
+    m->mm_stamp = (uint64_t)time(NULL);
+    m->mm_npages = MM_HEADPAGES;
+    barrier();
+    m->mm_txnid = 1;
+
+    /* the magic goes last, a file without it is initialized again */
+    if (sync_pages(env, 0, MM_HEADPAGES) != 0)
+        return -1;
+    h->mh_magic = MM_MAGIC;
+    return sync_pages(env, 0, 1);
+}
+
+/*!
+ * Open or create the database in path
+ *
+ * @param flags    (r) MM_NOSYNC: don't wait for commits to reach the disk
+ */
+int mm_open(MM_ENV **envp, const char *path, mode_t mode, int flags)
+{
+    MM_ENV *env;
+    struct stat st;
+
+    if ((env = calloc(1, sizeof(MM_ENV))) == NULL)
+        return -1;
+    env->pid = getpid();
+    env->nosync = (flags & MM_NOSYNC) != 0;
+    env->syspagesize = sysconf(_SC_PAGESIZE);
+
+    if ((env->fd = open(path, O_RDWR | O_CREAT, mode)) == -1) {
+        if ((errno != EROFS && errno != EACCES)
+            || (env->fd = open(path, O_RDONLY)) == -1) {
+            LOG(log_error, logtype_cnid, "cnid_mmap: open(\"%s\"): %s", path, strerror(errno));
+            free(env);
+            return -1;
+        }
+        env->rdonly = 1;
+        LOG(log_note, logtype_cnid, "cnid_mmap: \"%s\" is read-only", path);
+    }
+    fcntl(env->fd, F_SETFD, FD_CLOEXEC);
+
+    if (filelock(env, env->rdonly ? F_RDLCK : F_WRLCK) != 0)
+        goto error;
+    if (fstat(env->fd, &st) != 0)
+        goto error;
+    env->filesize = st.st_size;
+
+    if (st.st_size >= MM_HEADPAGES * MM_PAGESIZE && remap(env, st.st_size) != 0)
+        goto error;
+
+    if (!env->rdonly && (st.st_size == 0 || (env->head && env->head->mh_magic == 0))) {
+        /* new, or its creator died before the header was complete */
+        if (init_file(env) != 0)
+            goto error;
+    } else {
+        if (env->head == NULL)
+            goto corrupt;
+        if (env->head->mh_magic != MM_MAGIC
+            || env->head->mh_version != MM_VERSION
+            || env->head->mh_pagesize != MM_PAGESIZE)
+            goto corrupt;
+    }
+    filelock(env, F_UNLCK);
+
+    if (!env->rdonly)
+        claim_slot(env);
+    *envp = env;
+    return 0;
+
+corrupt:
+    LOG(log_error, logtype_cnid, "cnid_mmap: \"%s\" is not a CNID database of this version", path);
+error:
+    if (env->locked)
+        filelock(env, F_UNLCK);
+    if (env->map)
+        munmap(env->map, env->mapsize);
+    close(env->fd);
+    free(env);
+    return -1;
+}
+
+void mm_close(MM_ENV *env)
+{
+    if (env == NULL)
+        return;
+    if (env->txn == 'w')
+        mm_write_abort(env);
+    else if (env->txn == 'r')
+        mm_read_end(env);
+    if (env->pid == getpid())
+        release_slot(env);
+    if (env->map)
+        munmap(env->map, env->mapsize);
+    close(env->fd);
+    free(env->freed);
+    free(env->pending);
+    free(env);
+}
+
+int mm_rdonly(const MM_ENV *env)
+{
+    return env->rdonly;
+}
+
+uint64_t mm_stamp(MM_ENV *env)
+{
+    struct mm_meta meta;
+
+    if (env->txn)
+        return env->meta.mm_stamp;
+    if (env->head == NULL || read_meta(env, &meta) != 0)
+        return 0;
+    return meta.mm_stamp;
+}
+
+/***************************************************************************
+ * Transactions
+ ***************************************************************************/
+
+/*!
+ * Take a snapshot for reading, the values returned by mm_get() and
+ * mm_seek() are valid until mm_read_end()
+ */
+int mm_read_begin(MM_ENV *env)
+{
+    uint64_t txnid;
+
+    if (env->map == NULL && remap(env, 0) != 0)
+        return -1;
+
+    if (env->slot == NULL || env->pid != getpid()) {
+        if (filelock(env, F_RDLCK) != 0)
+            return -1;
+        if (read_meta(env, &env->meta) != 0)
+            goto error;
+    } else {
+        do {
+            if (read_meta(env, &env->meta) != 0)
+                return -1;
+            txnid = env->meta.mm_txnid;
+            env->slot->mr_txnid = txnid;
+            barrier();
+            /* a writer may have missed the slot, so check the snapshot is still current */
+            if (read_meta(env, &env->meta) != 0)
+                goto error;
+        } while (env->meta.mm_txnid != txnid);
+    }
+
+    if ((size_t)env->meta.mm_npages * MM_PAGESIZE > env->mapsize
+        && remap(env, (size_t)env->meta.mm_npages * MM_PAGESIZE) != 0)
+        goto error;
+
+    env->txn = 'r';
+    return 0;
+
+error:
+    if (env->locked)
+        filelock(env, F_UNLCK);
+    else if (env->slot)
+        env->slot->mr_txnid = 0;
+    return -1;
+}
+
+void mm_read_end(MM_ENV *env)
+{
+    if (env->txn != 'r')
+        return;
+    if (env->locked) {
+        filelock(env, F_UNLCK);
+    } else if (env->slot) {
+        barrier();
+        env->slot->mr_txnid = 0;
+    }
+    env->txn = 0;
+}
+
+static int add_pending(MM_ENV *env, uint64_t txnid, uint32_t pgno)
+{
+    struct mm_pgent *p;
+    size_t max;
+
+    if (env->npending == env->maxpending) {
+        max = env->maxpending ? 2 * env->maxpending : 64;
+        if ((p = realloc(env->pending, max * sizeof(*p))) == NULL)
+            return -1;
+        env->pending = p;
+        env->maxpending = max;
+    }
+    env->pending[env->npending].txnid = txnid;
+    env->pending[env->npending].pgno = pgno;
+    env->pending[env->npending].pad = 0;
+    env->npending++;
+    return 0;
+}
+
+static int free_page(MM_ENV *env, uint32_t pgno)
+{
+    uint32_t *p;
+    size_t max;
+
+    if (env->nfreed == env->maxfreed) {
+        max = env->maxfreed ? 2 * env->maxfreed : 64;
+        if ((p = realloc(env->freed, max * sizeof(*p))) == NULL)
+            return -1;
+        env->freed = p;
+        env->maxfreed = max;
+    }
+    env->freed[env->nfreed++] = pgno;
+    return 0;
+}
+
+/*
+ * Move the pending pages no reader can see anymore to the free list, keep
+ * the others for the next pending list
+ */
+static int load_pending(MM_ENV *env)
+{
+    struct mm_page *p;
+    struct mm_pgent ent;
+    uint64_t oldest;
+    uint32_t pgno, next;
+    int i, pages = 0;
+
+    oldest = oldest_reader(env, env->meta.mm_txnid);
+
+    for (pgno = env->meta.mm_pending; pgno != 0; pgno = next) {
+        if (!valid_pgno(env, pgno) || ++pages > (int)env->meta.mm_npages)
+            return -1;
+        p = getpage(env, pgno);
+        if (!(p->mp_flags & MP_PENDING))
+            return -1;
+        memcpy(&next, (char *)p + PAGEHDR, sizeof(next));
+
+        for (i = 0; i < p->mp_nkeys && i < (int)PENDING_PER_PAGE; i++) {
+            memcpy(&ent, (char *)p + PAGEHDR + 8 + i * sizeof(ent), sizeof(ent));
+            if (!valid_pgno(env, ent.pgno))
+                continue;
+            if (ent.txnid <= oldest) {
+                getpage(env, ent.pgno)->mp_next = env->meta.mm_freehead;
+                mark_dirty(env, ent.pgno);
+                env->meta.mm_freehead = ent.pgno;
+            } else if (add_pending(env, ent.txnid, ent.pgno) != 0) {
+                return -1;
+            }
+        }
+        /* only writers read the list, its pages are freed with the next meta */
+        if (free_page(env, pgno) != 0)
+            return -1;
+    }
+    env->meta.mm_pending = 0;
+    return 0;
+}
+
+/*!
+ * Start a write transaction, changes are visible to other processes after
+ * mm_write_commit()
+ */
+int mm_write_begin(MM_ENV *env)
+{
+    struct stat st;
+
+    if (env->rdonly) {
+        errno = EROFS;
+        return -1;
+    }
+    if (env->map == NULL && remap(env, 0) != 0)
+        return -1;
+    if (filelock(env, F_WRLCK) != 0)
+        return -1;
+    if (fstat(env->fd, &st) != 0)
+        goto error;
+    env->filesize = st.st_size;
+
+    if (read_meta(env, &env->meta) != 0)
+        goto error;
+    if ((size_t)env->meta.mm_npages * MM_PAGESIZE > (size_t)env->filesize)
+        goto corrupt;
+    if ((size_t)env->meta.mm_npages * MM_PAGESIZE + MM_RESERVE > env->mapsize
+        && remap(env, (size_t)env->meta.mm_npages * MM_PAGESIZE) != 0)
+        goto error;
+
+    env->txnid = env->meta.mm_txnid + 1;
+    env->dirty_lo = env->dirty_hi = 0;
+    env->nfreed = 0;
+    env->npending = 0;
+    env->txn = 'w';
+
+    if (load_pending(env) != 0)
+        goto corrupt;
+    return 0;
+
+corrupt:
+    LOG(log_error, logtype_cnid, "cnid_mmap: database corrupted");
+    errno = EIO;
+error:
+    env->txn = 0;
+    filelock(env, F_UNLCK);
+    return -1;
+}
+
+void mm_write_abort(MM_ENV *env)
+{
+    if (env->txn != 'w')
+        return;
+    env->txn = 0;
+    filelock(env, F_UNLCK);
+}
+
+static uint32_t alloc_page(MM_ENV *env, uint16_t flags)
+{
+    struct mm_page *p;
+    uint32_t pgno;
+    off_t size;
+
+    if ((pgno = env->meta.mm_freehead) != 0) {
+        if (!valid_pgno(env, pgno)) {
+            LOG(log_error, logtype_cnid, "cnid_mmap: free list corrupted");
+            return 0;
+        }
+        env->meta.mm_freehead = getpage(env, pgno)->mp_next;
+    } else {
+        pgno = env->meta.mm_npages;
+        if ((size_t)(pgno + 1) * MM_PAGESIZE > env->mapsize) {
+            LOG(log_error, logtype_cnid, "cnid_mmap: transaction too large");
+            return 0;
+        }
+        if ((off_t)(pgno + 1) * MM_PAGESIZE > env->filesize) {
+            size = env->filesize + (env->filesize / 8 > MM_GROW ? env->filesize / 8 : MM_GROW);
+            if (grow_file(env, size) != 0)
+                return 0;
+        }
+        env->meta.mm_npages++;
+    }
+
+    /* leave mp_next alone, see above */
+    mark_dirty(env, pgno);
+    p = getpage(env, pgno);
+    memset((char *)p + sizeof(p->mp_next), 0, PAGEHDR - sizeof(p->mp_next));
+    p->mp_flags = flags;
+    p->mp_txnid = env->txnid;
+    p->mp_upper = MM_PAGESIZE;
+    return pgno;
+}
+
+/* Write the pending list, every page freed by this transaction goes to it */
+static int write_pending(MM_ENV *env)
+{
+    struct mm_page *p;
+    uint32_t pgno, next = 0;
+    size_t i, n, npages, start;
+
+    for (i = 0; i < env->nfreed; i++)
+        if (add_pending(env, env->txnid, env->freed[i]) != 0)
+            return -1;
+    env->nfreed = 0;
+
+    if ((n = env->npending) == 0)
+        return 0;
+
+    /* fill from the end so the list is linked front to back */
+    npages = (n + PENDING_PER_PAGE - 1) / PENDING_PER_PAGE;
+    while (npages-- > 0) {
+        start = npages * PENDING_PER_PAGE;
+        if ((pgno = alloc_page(env, MP_PENDING)) == 0)
+            return -1;
+        p = getpage(env, pgno);
+        p->mp_nkeys = n - start;
+        memcpy((char *)p + PAGEHDR, &next, sizeof(next));
+        memcpy((char *)p + PAGEHDR + 8, env->pending + start, (n - start) * sizeof(struct mm_pgent));
+        n = start;
+        next = pgno;
+    }
+    env->meta.mm_pending = next;
+    return 0;
+}
+
+/*!
+ * Publish the changes of the write transaction
+ *
+ * If the meta can't be written to disk, the transaction is visible to
+ * other processes but -1 is returned.
+ */
+int mm_write_commit(MM_ENV *env)
+{
+    int ret = 0;
+
+    if (env->txn != 'w')
+        return -1;
+
+    if (write_pending(env) != 0) {
+        mm_write_abort(env);
+        return -1;
+    }
+    /* the new pages must be on disk before a meta that refers to them */
+    if (!env->nosync && env->dirty_hi && sync_pages(env, env->dirty_lo, env->dirty_hi) != 0) {
+        mm_write_abort(env);
+        return -1;
+    }
+    env->meta.mm_txnid = env->txnid;
+    write_meta(env);
+    if (!env->nosync && sync_pages(env, 0, 1) != 0)
+        ret = -1;
+
+    env->txn = 0;
+    if (filelock(env, F_UNLCK) != 0)
+        ret = -1;
+    return ret;
+}
+
+/***************************************************************************
+ * Pages and entries
+ ***************************************************************************/
+
+static const uint8_t *entry(struct mm_page *p, int i)
+{
+    return (const uint8_t *)p + p->mp_ptrs[i];
+}
+
+static void entry_key(struct mm_page *p, int i, const uint8_t **key, size_t *klen)
+{
+    const uint8_t *e = entry(p, i);
+    uint16_t l;
+
+    memcpy(&l, e, sizeof(l));
+    *klen = l;
+    *key = e + ((p->mp_flags & MP_LEAF) ? LEAFHDR : BRANCHHDR);
+}
+
+static void entry_val(struct mm_page *p, int i, struct mm_val *val)
+{
+    const uint8_t *e = entry(p, i);
+    uint16_t klen, vlen;
+
+    memcpy(&klen, e, sizeof(klen));
+    memcpy(&vlen, e + 2, sizeof(vlen));
+    val->data = e + LEAFHDR + klen;
+    val->size = vlen;
+}
+
+static uint32_t entry_child(struct mm_page *p, int i)
+{
+    uint32_t child;
+
+    memcpy(&child, entry(p, i) + 4, sizeof(child));
+    return child;
+}
+
+static void set_child(struct mm_page *p, int i, uint32_t child)
+{
+    memcpy((uint8_t *)entry(p, i) + 4, &child, sizeof(child));
+}
+
+static size_t entry_size(struct mm_page *p, int i)
+{
+    const uint8_t *e = entry(p, i);
+    uint16_t klen, vlen;
+
+    memcpy(&klen, e, sizeof(klen));
+    if (!(p->mp_flags & MP_LEAF))
+        return BRANCHHDR + klen;
+    memcpy(&vlen, e + 2, sizeof(vlen));
+    return LEAFHDR + klen + vlen;
+}
+
+static int keycmp(const void *k1, size_t l1, const void *k2, size_t l2)
+{
+    int r = memcmp(k1, k2, l1 < l2 ? l1 : l2);
+
+    if (r != 0)
+        return r;
+    return l1 < l2 ? -1 : l1 > l2;
+}
+
+/*
+ * Leaf: index of the first entry >= key, *exact if it's equal.
+ * Branch: index of the last entry <= key, entry 0 counts as smallest.
+ */
+static int page_search(struct mm_page *p, const void *key, size_t klen, int *exact)
+{
+    const uint8_t *k;
+    size_t l;
+    int lo, hi, mid;
+
+    *exact = 0;
+    if (p->mp_flags & MP_LEAF) {
+        lo = 0;
+        hi = p->mp_nkeys;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            entry_key(p, mid, &k, &l);
+            if (keycmp(k, l, key, klen) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < p->mp_nkeys) {
+            entry_key(p, lo, &k, &l);
+            *exact = keycmp(k, l, key, klen) == 0;
+        }
+        return lo;
+    }
+
+    lo = 1;
+    hi = p->mp_nkeys;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        entry_key(p, mid, &k, &l);
+        if (keycmp(k, l, key, klen) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+static void page_insert(struct mm_page *p, int pos, const uint8_t *ent, size_t len)
+{
+    p->mp_upper -= len;
+    memcpy((char *)p + p->mp_upper, ent, len);
+    memmove(&p->mp_ptrs[pos + 1], &p->mp_ptrs[pos], (p->mp_nkeys - pos) * sizeof(uint16_t));
+    p->mp_ptrs[pos] = p->mp_upper;
+    p->mp_nkeys++;
+}
+
+/* Rewrite the entries of a page, ents point into a copy of the page */
+static void page_fill(struct mm_page *p, const uint8_t **ents, const size_t *lens, int n)
+{
+    int i;
+
+    p->mp_nkeys = 0;
+    p->mp_upper = MM_PAGESIZE;
+    for (i = 0; i < n; i++)
+        page_insert(p, i, ents[i], lens[i]);
+}
+
+static void page_remove(struct mm_page *p, int pos)
+{
+    uint8_t copy[MM_PAGESIZE];
+    const uint8_t *ents[MAXKEYS];
+    size_t lens[MAXKEYS];
+    struct mm_page *c = (struct mm_page *)copy;
+    int i, n = 0;
+
+    memcpy(copy, p, MM_PAGESIZE);
+    for (i = 0; i < c->mp_nkeys; i++) {
+        if (i == pos)
+            continue;
+        ents[n] = entry(c, i);
+        lens[n++] = entry_size(c, i);
+    }
+    page_fill(p, ents, lens, n);
+}
+
+/* Make a page writable by this transaction, returns its new number */
+static uint32_t touch(MM_ENV *env, uint32_t pgno)
+{
+    struct mm_page *p = getpage(env, pgno), *np;
+    uint32_t newno;
+
+    if (p->mp_txnid == env->txnid)
+        return pgno;
+    if ((newno = alloc_page(env, p->mp_flags)) == 0)
+        return 0;
+    np = getpage(env, newno);
+    memcpy((char *)np + sizeof(np->mp_next), (char *)p + sizeof(p->mp_next),
+           MM_PAGESIZE - sizeof(p->mp_next));
+    np->mp_txnid = env->txnid;
+    if (free_page(env, pgno) != 0)
+        return 0;
+    return newno;
+}
+
+/***************************************************************************
+ * Trees
+ ***************************************************************************/
+
+struct path {
+    int      depth;                 /* index of the leaf */
+    uint32_t pgno[MM_MAXDEPTH];
+    int      idx[MM_MAXDEPTH];      /* child taken in branches, position in the leaf */
+    int      exact;
+};
+
+/* Find the leaf for key, returns -1 on a corrupted tree, 0 on an empty tree, 1 otherwise */
+static int descend(MM_ENV *env, int tree, const void *key, size_t klen, struct path *path)
+{
+    struct mm_page *p;
+    uint32_t pgno = env->meta.mm_root[tree];
+    int d;
+
+    if (pgno == 0)
+        return 0;
+
+    for (d = 0; d < MM_MAXDEPTH; d++) {
+        if (!valid_pgno(env, pgno))
+            break;
+        p = getpage(env, pgno);
+        if (p->mp_nkeys == 0 && !(p->mp_flags & MP_LEAF))
+            break;
+        path->pgno[d] = pgno;
+        path->idx[d] = page_search(p, key, klen, &path->exact);
+        if (p->mp_flags & MP_LEAF) {
+            path->depth = d;
+            return 1;
+        }
+        if (!(p->mp_flags & MP_BRANCH))
+            break;
+        pgno = entry_child(p, path->idx[d]);
+    }
+
+    LOG(log_error, logtype_cnid, "cnid_mmap: tree %d corrupted", tree);
+    errno = EIO;
+    return -1;
+}
+
+/* Copy the pages of path, they're writable afterwards */
+static int touch_path(MM_ENV *env, int tree, struct path *path)
+{
+    uint32_t pgno;
+    int d;
+
+    for (d = 0; d <= path->depth; d++) {
+        if ((pgno = touch(env, path->pgno[d])) == 0)
+            return -1;
+        if (pgno == path->pgno[d])
+            continue;
+        path->pgno[d] = pgno;
+        if (d == 0)
+            env->meta.mm_root[tree] = pgno;
+        else
+            set_child(getpage(env, path->pgno[d - 1]), path->idx[d - 1], pgno);
+    }
+    return 0;
+}
+
+/* Insert an entry at level d of path, splitting pages as needed */
+static int insert(MM_ENV *env, int tree, struct path *path, int d, int pos,
+                  const uint8_t *ent, size_t len)
+{
+    uint8_t copy[MM_PAGESIZE], sep[BRANCHHDR + MM_MAXENTRY];
+    const uint8_t *ents[MAXKEYS];
+    size_t lens[MAXKEYS];
+    struct mm_page *p = getpage(env, path->pgno[d]), *c, *r, *root;
+    uint32_t rno, rootno;
+    size_t total = 0, half = 0, seplen;
+    const uint8_t *k;
+    size_t kl;
+    uint16_t l16;
+    int i, n = 0, s;
+
+    if (FREESPACE(p) >= len + sizeof(uint16_t)) {
+        page_insert(p, pos, ent, len);
+        return 0;
+    }
+
+    /* split: the lower half stays, the upper half moves to a new right sibling */
+    c = (struct mm_page *)copy;
+    memcpy(copy, p, MM_PAGESIZE);
+    for (i = 0; i <= c->mp_nkeys; i++) {
+        if (i == pos) {
+            ents[n] = ent;
+            lens[n++] = len;
+        }
+        if (i < c->mp_nkeys) {
+            ents[n] = entry(c, i);
+            lens[n++] = entry_size(c, i);
+        }
+    }
+    for (i = 0; i < n; i++)
+        total += lens[i] + sizeof(uint16_t);
+    for (s = 0; s < n - 1 && half + lens[s] + sizeof(uint16_t) <= total / 2; s++)
+        half += lens[s] + sizeof(uint16_t);
+    if (s == 0)
+        s = 1;
+
+    if ((rno = alloc_page(env, c->mp_flags)) == 0)
+        return -1;
+    r = getpage(env, rno);
+    page_fill(p, ents, lens, s);
+    page_fill(r, ents + s, lens + s, n - s);
+
+    /* separator: first key of the right page */
+    entry_key(r, 0, &k, &kl);
+    l16 = kl;
+    memcpy(sep, &l16, sizeof(l16));
+    memset(sep + 2, 0, 2);
+    memcpy(sep + 4, &rno, sizeof(rno));
+    memcpy(sep + BRANCHHDR, k, kl);
+    seplen = BRANCHHDR + kl;
+
+    if (d > 0)
+        return insert(env, tree, path, d - 1, path->idx[d - 1] + 1, sep, seplen);
+
+    /* new root */
+    if ((rootno = alloc_page(env, MP_BRANCH)) == 0)
+        return -1;
+    root = getpage(env, rootno);
+    l16 = 0;
+    memcpy(copy, &l16, sizeof(l16));
+    memset(copy + 2, 0, 2);
+    memcpy(copy + 4, &path->pgno[0], sizeof(uint32_t));
+    page_insert(root, 0, copy, BRANCHHDR);
+    page_insert(root, 1, sep, seplen);
+    env->meta.mm_root[tree] = rootno;
+    return 0;
+}
+
+/*!
+ * Look up key, returns 1 if found, 0 if not and -1 on error
+ */
+int mm_get(MM_ENV *env, int tree, const void *key, size_t klen, struct mm_val *val)
+{
+    struct path path;
+    int rc;
+
+    if ((rc = descend(env, tree, key, klen, &path)) <= 0)
+        return rc;
+    if (!path.exact)
+        return 0;
+    entry_val(getpage(env, path.pgno[path.depth]), path.idx[path.depth], val);
+    return 1;
+}
+
+/*!
+ * Find the first entry with a key greater than key, returns 1 if there's
+ * one, 0 at the end and -1 on error
+ */
+int mm_seek(MM_ENV *env, int tree, const void *key, size_t klen,
+            struct mm_val *rkey, struct mm_val *rval)
+{
+    struct path path;
+    struct mm_page *p;
+    const uint8_t *k;
+    size_t kl;
+    int rc, d;
+
+    if ((rc = descend(env, tree, key, klen, &path)) <= 0)
+        return rc;
+
+    d = path.depth;
+    if (path.exact)
+        path.idx[d]++;
+
+    /* climb up until there's a right sibling, then down its leftmost path */
+    p = getpage(env, path.pgno[d]);
+    while (path.idx[d] >= p->mp_nkeys) {
+        if (--d < 0)
+            return 0;
+        p = getpage(env, path.pgno[d]);
+        path.idx[d]++;
+    }
+    while (!(p->mp_flags & MP_LEAF)) {
+        path.pgno[d + 1] = entry_child(p, path.idx[d]);
+        d++;
+        if (d >= MM_MAXDEPTH || !valid_pgno(env, path.pgno[d])) {
+            errno = EIO;
+            return -1;
+        }
+        p = getpage(env, path.pgno[d]);
+        path.idx[d] = 0;
+        if (p->mp_nkeys == 0) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    entry_key(p, path.idx[d], &k, &kl);
+    rkey->data = k;
+    rkey->size = kl;
+    entry_val(p, path.idx[d], rval);
+    return 1;
+}
+
+/*!
+ * Insert or replace an entry, only in a write transaction
+ */
+int mm_put(MM_ENV *env, int tree, const void *key, size_t klen, const void *val, size_t vlen)
+{
+    uint8_t ent[LEAFHDR + MM_MAXENTRY];
+    struct path path;
+    struct mm_page *p;
+    uint32_t pgno;
+    uint16_t l16;
+    int rc;
+
+    if (env->txn != 'w' || klen == 0 || klen + vlen > MM_MAXENTRY) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    l16 = klen;
+    memcpy(ent, &l16, sizeof(l16));
+    l16 = vlen;
+    memcpy(ent + 2, &l16, sizeof(l16));
+    memcpy(ent + LEAFHDR, key, klen);
+    memcpy(ent + LEAFHDR + klen, val, vlen);
+
+    if ((rc = descend(env, tree, key, klen, &path)) < 0)
+        return -1;
+    if (rc == 0) {
+        if ((pgno = alloc_page(env, MP_LEAF)) == 0)
+            return -1;
+        page_insert(getpage(env, pgno), 0, ent, LEAFHDR + klen + vlen);
+        env->meta.mm_root[tree] = pgno;
+        return 0;
+    }
+
+    if (touch_path(env, tree, &path) != 0)
+        return -1;
+    if (path.exact) {
+        p = getpage(env, path.pgno[path.depth]);
+        page_remove(p, path.idx[path.depth]);
+    }
+    return insert(env, tree, &path, path.depth, path.idx[path.depth], ent, LEAFHDR + klen + vlen);
+}
+
+/*!
+ * Delete an entry, only in a write transaction, returns 1 if it was
+ * deleted, 0 if it didn't exist and -1 on error
+ */
+int mm_del(MM_ENV *env, int tree, const void *key, size_t klen)
+{
+    struct path path;
+    struct mm_page *p;
+    uint32_t pgno;
+    int rc, d;
+
+    if (env->txn != 'w') {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((rc = descend(env, tree, key, klen, &path)) <= 0 || !path.exact)
+        return rc < 0 ? -1 : 0;
+    if (touch_path(env, tree, &path) != 0)
+        return -1;
+
+    /* pages aren't merged, but empty ones are removed */
+    for (d = path.depth; d >= 0; d--) {
+        p = getpage(env, path.pgno[d]);
+        page_remove(p, path.idx[d]);
+        if (p->mp_nkeys > 0)
+            break;
+        if (free_page(env, path.pgno[d]) != 0)
+            return -1;
+        if (d == 0)
+            env->meta.mm_root[tree] = 0;
+    }
+
+    /* a branch with one child is replaced by the child */
+    while ((pgno = env->meta.mm_root[tree]) != 0) {
+        p = getpage(env, pgno);
+        if ((p->mp_flags & MP_LEAF) || p->mp_nkeys != 1)
+            break;
+        env->meta.mm_root[tree] = entry_child(p, 0);
+        if (free_page(env, pgno) != 0)
+            return -1;
+    }
+    return 1;
+}
+
+uint32_t mm_get_lastid(MM_ENV *env)
+{
+    return env->meta.mm_lastid;
+}
+
+void mm_set_lastid(MM_ENV *env, uint32_t id)
+{
+    if (env->txn == 'w')
+        env->meta.mm_lastid = id;
+}
+
+static int free_tree(MM_ENV *env, uint32_t pgno, int depth)
+{
+    struct mm_page *p;
+    int i;
+
+    if (depth >= MM_MAXDEPTH || !valid_pgno(env, pgno))
+        return -1;
+    p = getpage(env, pgno);
+    if (p->mp_flags & MP_BRANCH) {
+        for (i = 0; i < p->mp_nkeys; i++)
+            if (free_tree(env, entry_child(p, i), depth + 1) != 0)
+                return -1;
+    }
+    return free_page(env, pgno);
+}
+
+/*!
+ * Delete all entries and give the database a new stamp, only in a write
+ * transaction
+ */
+int mm_wipe(MM_ENV *env)
+{
+    uint64_t stamp;
+    int tree;
+
+    if (env->txn != 'w') {
+        errno = EINVAL;
+        return -1;
+    }
+    for (tree = 0; tree < MM_NTREES; tree++) {
+        if (env->meta.mm_root[tree] && free_tree(env, env->meta.mm_root[tree], 0) != 0)
+            return -1;
+        env->meta.mm_root[tree] = 0;
+    }
+    env->meta.mm_lastid = 0;
+    /* clients compare the stamp to notice the wipe, so it must change */
+    stamp = (uint64_t)time(NULL);
+    env->meta.mm_stamp = stamp > env->meta.mm_stamp ? stamp : env->meta.mm_stamp + 1;
+    return 0;
+}
+
+#endif /* CNID_BACKEND_MMAP */
@@ -8,6 +8,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <stdio.h>
+#include <string.h>
 #include <arpa/inet.h>
 
 #include <atalk/dsi.h>
@@ -34,3 +35,46 @@ int dsi_cmdreply(DSI *dsi, const int err)
 
     return ret;
 }
+
+/*!
+ * Queue a reply in the DSI reply queue instead of sending it
+ *
+ * Used for pipelined requests, ie when the next request from the client is already
+ * in the readahead buffer. The queued replies are sent with a single write from
+ * dsi_replyq_flush(). Falls back to dsi_cmdreply() if pipelining is disabled.
+ *
+ * @returns 0 on failure, 1 on success
+ */
+int dsi_cmdreply_queue(DSI *dsi, const int err)
+{
+    uint8_t *p;
+
+    if (dsi->replyq == NULL)
+        return dsi_cmdreply(dsi, err);
+
+    if (dsi->replyqlen + DSI_BLOCKSIZ + dsi->datalen > dsi->replyqsize) {
+        if (dsi_replyq_flush(dsi) != 0)
+            return 0;
+        if (DSI_BLOCKSIZ + dsi->datalen > dsi->replyqsize)
+            return dsi_cmdreply(dsi, err);
+    }
+
+    LOG(log_debug, logtype_dsi, "dsi_cmdreply_queue(DSI ID: %u, len: %zd, queued: %zd)",
+        dsi->clientID, dsi->datalen, dsi->replyqlen);
+
+    dsi->header.dsi_flags = DSIFL_REPLY;
+    dsi->header.dsi_len = htonl(dsi->datalen);
+    dsi->header.dsi_data.dsi_code = htonl(err);
+
+    p = dsi->replyq + dsi->replyqlen;
+    p[0] = dsi->header.dsi_flags;
+    p[1] = dsi->header.dsi_command;
+    memcpy(p + 2, &dsi->header.dsi_requestID, sizeof(dsi->header.dsi_requestID));
+    memcpy(p + 4, &dsi->header.dsi_data.dsi_code, sizeof(dsi->header.dsi_data.dsi_code));
+    memcpy(p + 8, &dsi->header.dsi_len, sizeof(dsi->header.dsi_len));
+    memcpy(p + 12, &dsi->header.dsi_reserved, sizeof(dsi->header.dsi_reserved));
+    memcpy(p + DSI_BLOCKSIZ, dsi->data, dsi->datalen);
+    dsi->replyqlen += DSI_BLOCKSIZ + dsi->datalen;
+
+    return 1;
+}
@@ -26,6 +26,8 @@
 #include <atalk/dsi.h>
 #include <atalk/server_child.h>
 
+static int dsi_startsession(DSI *dsi, int tickleval);
+
 /*!
  * Start a DSI session, fork an afpd process
  *
@@ -86,6 +88,36 @@ int dsi_getsession(DSI *dsi, server_child_t *serv_children, int tickleval, afp_c
   dsi->serversock = -1;
   server_child_free(serv_children); 
 
+  *childp = NULL;
+  return dsi_startsession(dsi, tickleval);
+}
+
+/*!
+ * Start a DSI session in a pre-forked afpd session worker
+ *
+ * The afpd master accepted the connection and passed the socket to the worker.
+ *
+ * @param sock      (r) socket of the connection
+ * @returns             0 on sucess, any other value denotes failure
+ */
+int dsi_worksession(DSI *dsi, int sock, int tickleval)
+{
+  socklen_t len = sizeof(dsi->client);
+
+  dsi->socket = sock;
+  if (getpeername(sock, (struct sockaddr *)&dsi->client, &len) != 0) {
+      LOG(log_error, logtype_dsi, "dsi_worksession: getpeername: %s", strerror(errno));
+      return -1;
+  }
+
+  dsi->proto_start(dsi); /* in libatalk/dsi/dsi_tcp.c */
+
+  return dsi_startsession(dsi, tickleval);
+}
+
+/* Handle the first request of a new connection in the session process */
+static int dsi_startsession(DSI *dsi, int tickleval)
+{
   switch (dsi->header.dsi_command) {
   case DSIFUNC_STAT: /* send off status and return */
     {
@@ -114,7 +146,6 @@ int dsi_getsession(DSI *dsi, server_child_t *serv_children, int tickleval, afp_c
     dsi->timer.it_interval.tv_sec = dsi->timer.it_value.tv_sec = tickleval;
     dsi->timer.it_interval.tv_usec = dsi->timer.it_value.tv_usec = 0;
     dsi_opensession(dsi);
-    *childp = NULL;
     return 0;
 
   default: /* just close */
@@ -8,6 +8,8 @@
  * dsi_stream_read:     just read a bunch of bytes.
  * dsi_stream_send:     send a DSI header + data.
  * dsi_stream_receive:  read a DSI header + data.
+ * dsi_stream_pending:  check for a complete buffered DSI request.
+ * dsi_replyq_flush:    send all queued replies.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -30,6 +32,7 @@
 #include <atalk/logger.h>
 #include <atalk/dsi.h>
 #include <atalk/util.h>
+#include <atalk/uring.h>
 
 #ifndef MSG_MORE
 #define MSG_MORE 0x8000
@@ -471,6 +474,49 @@ exit:
 }
 #endif
 
+#ifdef WITH_IO_URING
+static int dsi_uring_sockwait(void *private)
+{
+    return dsi_peek((DSI *)private);
+}
+
+/*
+ * Like dsi_stream_read_file(), but the file data is moved through the
+ * io_uring engine instead of sendfile()
+ */
+ssize_t dsi_uring_read_file(DSI *dsi, const int fromfd, off_t offset, const size_t length, const int err)
+{
+    ssize_t written;
+    char block[DSI_BLOCKSIZ];
+
+    LOG(log_maxdebug, logtype_dsi, "dsi_uring_read_file(off: %jd, len: %zu)", (intmax_t)offset, length);
+
+    if (dsi->flags & DSI_DISCONNECTED)
+        return -1;
+
+    dsi->in_write++;
+
+    dsi->flags |= DSI_NOREPLY;
+    dsi->header.dsi_flags = DSIFL_REPLY;
+    dsi->header.dsi_len = htonl(length);
+    dsi->header.dsi_data.dsi_code = htonl(err);
+    dsi_header_pack_reply(dsi, block);
+
+    if (dsi_stream_write(dsi, block, sizeof(block), DSI_MSG_MORE) != sizeof(block)) {
+        dsi->in_write--;
+        return -1;
+    }
+
+    written = uring_sendfile(dsi->socket, fromfd, offset, length, dsi_uring_sockwait, dsi);
+    if (written > 0)
+        dsi->write_count += written;
+
+    dsi->in_write--;
+    LOG(log_maxdebug, logtype_dsi, "dsi_uring_read_file: written: %zd", written);
+    return written;
+}
+#endif /* WITH_IO_URING */
+
 
 /*
  * Essentially a loop around buf_read() to ensure "length" bytes are read
@@ -588,6 +634,67 @@ int dsi_stream_send(DSI *dsi, void *buf, size_t length)
 }
 
 
+/*!
+ * Check whether the next DSI request is already in the readahead buffer
+ *
+ * Tries to fill the readahead buffer with whatever is waiting on the socket
+ * without blocking, then checks whether a complete DSI command (header plus
+ * command data) is buffered. Used for pipelining: while this returns true the
+ * reply to the current request can be queued instead of being sent immediately.
+ *
+ * @returns 1 if a complete DSICommand is buffered, 0 otherwise
+ */
+int dsi_stream_pending(DSI *dsi)
+{
+    ssize_t len;
+    uint32_t dsilen;
+
+    if (dsi->replyq == NULL || dsi->buffer == NULL || (dsi->flags & DSI_DISCONNECTED))
+        return 0;
+
+    if (dsi->eof < dsi->end) {
+        len = recv(dsi->socket, dsi->eof, dsi->end - dsi->eof, MSG_DONTWAIT);
+        if (len > 0)
+            dsi->eof += len;
+    }
+
+    if (dsi->eof - dsi->start < DSI_BLOCKSIZ)
+        return 0;
+
+    /* only plain DSICommands can be pipelined, DSIWrite carries data */
+    if (dsi->start[1] != DSIFUNC_CMD)
+        return 0;
+
+    memcpy(&dsilen, dsi->start + 8, sizeof(dsilen));
+    dsilen = MIN(ntohl(dsilen), dsi->server_quantum);
+
+    return (size_t)(dsi->eof - dsi->start) >= DSI_BLOCKSIZ + dsilen;
+}
+
+/*!
+ * Send all replies queued by dsi_cmdreply_queue()
+ *
+ * @returns 0 on success (or nothing to do), -1 on error
+ */
+int dsi_replyq_flush(DSI *dsi)
+{
+    ssize_t len;
+
+    if (dsi->replyq == NULL || dsi->replyqlen == 0)
+        return 0;
+
+    LOG(log_debug, logtype_dsi, "dsi_replyq_flush: %zd bytes", dsi->replyqlen);
+
+    len = dsi_stream_write(dsi, dsi->replyq, dsi->replyqlen, 0);
+    if (len < 0 || (size_t)len != dsi->replyqlen) {
+        dsi->replyqlen = 0;
+        return -1;
+    }
+
+    dsi->replyqlen = 0;
+    return 0;
+}
+
 /*!
  * Read DSI command and data
  *
@@ -43,6 +43,35 @@ size_t dsi_writeinit(DSI *dsi, void *buf, const size_t buflen _U_)
     return bytes;
 }
 
+/*
+ * Like dsi_writeinit(), but instead of copying the data already read into the
+ * DSI readahead buffer, return a pointer to it in *buf. The data is only valid
+ * until the next read from the DSI stream, so the caller must write it out
+ * before receiving the rest of the request with dsi_write() or a recvfile
+ * method.
+ */
+size_t dsi_writeinit_buf(DSI *dsi, char **buf)
+{
+    size_t bytes = 0;
+    dsi->datasize = ntohl(dsi->header.dsi_len) - dsi->header.dsi_data.dsi_doff;
+    *buf = NULL;
+
+    if (dsi->eof > dsi->start) {
+        /* We have data in the buffer */
+        bytes = MIN(dsi->eof - dsi->start, dsi->datasize);
+        *buf = dsi->start;
+        dsi->start += bytes;
+        dsi->datasize -= bytes;
+        if (dsi->start >= dsi->eof)
+            dsi->start = dsi->eof = dsi->buffer;
+    }
+
+    LOG(log_maxdebug, logtype_dsi, "dsi_writeinit_buf: buffered: %zu, remaining DSI datasize: %jd",
+        bytes, (intmax_t)dsi->datasize);
+
+    return bytes;
+}
+
 
 /* fill up buf and then return. this should be called repeatedly
  * until all the data has been read. i block alarm processing 
@@ -37,6 +37,9 @@
 #include <iconv.h>
 #endif
 #include <arpa/inet.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include <atalk/logger.h>
 #include <atalk/unicode.h>
@@ -68,6 +71,7 @@
 static atalk_iconv_t conv_handles[MAX_CHARSETS][MAX_CHARSETS];
 static char* charset_names[MAX_CHARSETS];
 static struct charset_functions* charsets[MAX_CHARSETS];
+static signed char ascii_compat[MAX_CHARSETS]; /* 0: unknown, 1: yes, -1: no */
 static char hexdig[] = "0123456789abcdef";
 #define hextoint( c )   ( isdigit( c ) ? c - '0' : c + 10 - 'a' )
 
@@ -206,6 +210,8 @@ void init_iconv(void)
 
         charsets[c1] = get_charset_functions (c1);
     }
+
+    memset(ascii_compat, 0, sizeof(ascii_compat));
 }
 
 /**
@@ -982,6 +988,136 @@ end:
     return (i_len + j == 0 || (option & CONV_FORCE)) ? destlen - o_len : (size_t)-1;
 }
 
+/*
+ * ASCII fast path
+ *
+ * Almost all names are plain 7-bit ASCII. If both charsets encode ASCII
+ * as itself, such names are converted by copying them, only applying the case
+ * conversion, without going through UCS2, iconv and pre/decomposition.
+ * Names with ':' or '/', which may have to be escaped or swapped, and names
+ * with a leading dot to escape are left to the full conversion.
+ */
+
+/* Whether ch encodes the characters 0x01-0x7f as themselves */
+static int charset_is_ascii(charset_t ch)
+{
+    char ascii[127], back[127];
+    ucs2_t ucs2[127];
+    const char *inbuf;
+    char *outbuf;
+    size_t i_len, o_len;
+    int i;
+
+    if (ch == CH_UCS2 || ch >= MAX_CHARSETS)
+        return 0;
+    if (ascii_compat[ch] != 0)
+        return ascii_compat[ch] > 0;
+
+    ascii_compat[ch] = -1;
+    if (conv_handles[ch][CH_UCS2] == NULL || conv_handles[ch][CH_UCS2] == (atalk_iconv_t)-1
+        || conv_handles[CH_UCS2][ch] == NULL || conv_handles[CH_UCS2][ch] == (atalk_iconv_t)-1)
+        return 0;
+
+    for (i = 0; i < 127; i++)
+        ascii[i] = i + 1;
+
+    inbuf = ascii;
+    i_len = sizeof(ascii);
+    outbuf = (char *)ucs2;
+    o_len = sizeof(ucs2);
+    if (atalk_iconv(conv_handles[ch][CH_UCS2], &inbuf, &i_len, &outbuf, &o_len) == (size_t)-1
+        || o_len != 0)
+        return 0;
+    for (i = 0; i < 127; i++)
+        if (ucs2[i] != i + 1)
+            return 0;
+
+    inbuf = (char *)ucs2;
+    i_len = sizeof(ucs2);
+    outbuf = back;
+    o_len = sizeof(back);
+    if (atalk_iconv(conv_handles[CH_UCS2][ch], &inbuf, &i_len, &outbuf, &o_len) == (size_t)-1
+        || o_len != 0 || memcmp(ascii, back, sizeof(ascii)) != 0)
+        return 0;
+
+    ascii_compat[ch] = 1;
+    return 1;
+}
+
+/*
+ * Copy src to dest with case conversion if it's all ASCII without ':' and '/'.
+ * Returns the length or (size_t)-1 if the name needs the full conversion.
+ */
+static size_t ascii_convert(const char *src, size_t srclen, char *dest, uint16_t option)
+{
+    const int upper = option & CONV_TOUPPER;
+    const int lower = !upper && (option & CONV_TOLOWER);
+    const char first = upper ? 'a' : 'A';
+    const char last = upper ? 'z' : 'Z';
+    size_t i = 0;
+    unsigned char c;
+
+#ifdef __AVX2__
+    {
+        const __m256i colon = _mm256_set1_epi8(':');
+        const __m256i slash = _mm256_set1_epi8('/');
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i lo = _mm256_set1_epi8(first - 1);
+        const __m256i hi = _mm256_set1_epi8(last + 1);
+        const __m256i bit = _mm256_set1_epi8((upper || lower) ? 0x20 : 0);
+        __m256i v, special, alpha;
+
+        for (; i + 32 <= srclen; i += 32) {
+            v = _mm256_loadu_si256((const __m256i *)(src + i));
+            special = _mm256_or_si256(_mm256_cmpeq_epi8(v, colon),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, slash),
+                                                      _mm256_cmpeq_epi8(v, zero)));
+            /* sign bit set: non-ASCII byte or special character */
+            if (_mm256_movemask_epi8(_mm256_or_si256(v, special)))
+                return (size_t)-1;
+            alpha = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+            v = _mm256_xor_si256(v, _mm256_and_si256(alpha, bit));
+            _mm256_storeu_si256((__m256i *)(dest + i), v);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    {
+        const __m128i colon = _mm_set1_epi8(':');
+        const __m128i slash = _mm_set1_epi8('/');
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lo = _mm_set1_epi8(first - 1);
+        const __m128i hi = _mm_set1_epi8(last + 1);
+        const __m128i bit = _mm_set1_epi8((upper || lower) ? 0x20 : 0);
+        __m128i v, special, alpha;
+
+        for (; i + 16 <= srclen; i += 16) {
+            v = _mm_loadu_si128((const __m128i *)(src + i));
+            special = _mm_or_si128(_mm_cmpeq_epi8(v, colon),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, slash),
+                                                _mm_cmpeq_epi8(v, zero)));
+            /* sign bit set: non-ASCII byte or special character */
+            if (_mm_movemask_epi8(_mm_or_si128(v, special)))
+                return (size_t)-1;
+            alpha = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmpgt_epi8(hi, v));
+            v = _mm_xor_si128(v, _mm_and_si128(alpha, bit));
+            _mm_storeu_si128((__m128i *)(dest + i), v);
+        }
+    }
+#endif
+
+    for (; i < srclen; i++) {
+        c = src[i];
+        if (c >= 0x80 || c == ':' || c == '/' || c == 0)
+            return (size_t)-1;
+        if ((upper || lower) && c >= first && c <= last)
+            c ^= 0x20;
+        dest[i] = c;
+    }
+
+    return srclen;
+}
+
 /*
  * FIXME the size is a mess we really need a malloc/free logic
  *`dest size must be dest_len +2
@@ -995,6 +1131,15 @@ size_t convert_charset ( charset_t from_set, charset_t to_set, charset_t cap_cha
 
     lazy_initialize_conv();
 
+    if (src_len > 0 && src_len <= dest_len && src_len <= MAXPATHLEN
+        && !(CHECK_FLAGS(flags, CONV_ESCAPEDOTS) && src[0] == '.')
+        && charset_is_ascii(from_set) && charset_is_ascii(to_set)
+        && (o_len = ascii_convert(src, src_len, dest, flags ? *flags : 0)) != (size_t)-1) {
+        dest[o_len] = 0;
+        dest[o_len +1] = 0;
+        return o_len;
+    }
+
     /* convert from_set to UCS2 */
     if ((size_t)(-1) == ( o_len = pull_charset_flags( from_set, to_set, cap_charset, src, src_len,
                                                       (char *) buffer, sizeof(buffer) -2, flags)) ) {
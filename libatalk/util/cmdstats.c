@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Per AFP command statistics
+ * ==========================
+ *
+ * Session processes count calls, errors, bytes and latencies of every AFP
+ * command they execute. Every CMDSTATS_INTERVAL seconds and when the session
+ * ends they send the counters accumulated since the last update to the
+ * master with IPC_STATS messages and reset them. The master adds them up in
+ * server_child_t, from where they're available to the afpstats D-Bus service
+ * and the text dump.
+ *
+ * An IPC_STATS message carries one command, its latency histogram is sent
+ * sparse as (bucket, count) pairs, a histogram with more used buckets than
+ * fit in one message is split over several messages.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <atalk/cmdstats.h>
+#include <atalk/server_ipc.h>
+#include <atalk/logger.h>
+
+/* IPC_STATS message, followed by cm_nbuckets (uint16_t bucket, uint32_t count) pairs */
+struct cmdstats_msg {
+    uint8_t  cm_function;
+    uint8_t  cm_pad;
+    uint16_t cm_nbuckets;
+    uint32_t cm_max;
+    uint64_t cm_calls;
+    uint64_t cm_errors;
+    uint64_t cm_bytes_in;
+    uint64_t cm_bytes_out;
+    uint64_t cm_usec;
+};
+
+#define BUCKET_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
+#define MAX_BUCKETS ((IPC_MAXMSGSIZE - IPC_HEADERLEN - sizeof(struct cmdstats_msg)) / BUCKET_SIZE)
+
+static unsigned int bucket_index(uint32_t usec)
+{
+    unsigned int e = CMDSTATS_SUBBITS;
+
+    if (usec < (1U << CMDSTATS_SUBBITS))
+        return usec;
+
+    while (e < 31 && (usec >> (e + 1)))
+        e++;
+
+    return ((e - CMDSTATS_SUBBITS + 1) << CMDSTATS_SUBBITS)
+        + (usec >> (e - CMDSTATS_SUBBITS)) - (1U << CMDSTATS_SUBBITS);
+}
+
+/* Highest value of a bucket */
+static uint32_t bucket_value(unsigned int idx)
+{
+    unsigned int e, sub;
+
+    if (idx < (1U << CMDSTATS_SUBBITS))
+        return idx;
+
+    e = (idx >> CMDSTATS_SUBBITS) + CMDSTATS_SUBBITS - 1;
+    sub = (idx & ((1U << CMDSTATS_SUBBITS) - 1)) + (1U << CMDSTATS_SUBBITS);
+
+    return (uint32_t)((((uint64_t)sub + 1) << (e - CMDSTATS_SUBBITS)) - 1);
+}
+
+static struct cmdstat *cmdstat_get(cmdstats_t *stats, uint8_t function)
+{
+    if (stats->cs_cmd[function] == NULL)
+        stats->cs_cmd[function] = calloc(1, sizeof(struct cmdstat));
+    return stats->cs_cmd[function];
+}
+
+/*!
+ * Count one execution of an AFP command
+ */
+void cmdstats_record(cmdstats_t *stats, uint8_t function, uint32_t usec, int error,
+                     uint64_t bytes_in, uint64_t bytes_out)
+{
+    struct cmdstat *cs;
+
+    if ((cs = cmdstat_get(stats, function)) == NULL)
+        return;
+
+    cs->cs_calls++;
+    if (error)
+        cs->cs_errors++;
+    cs->cs_bytes_in += bytes_in;
+    cs->cs_bytes_out += bytes_out;
+    cs->cs_usec += usec;
+    if (usec > cs->cs_max)
+        cs->cs_max = usec;
+    cs->cs_hist[bucket_index(usec)]++;
+}
+
+/*!
+ * Send the counters to the master and reset them
+ *
+ * @returns 0 on success, -1 if a message couldn't be sent
+ */
+int cmdstats_send(cmdstats_t *stats, int ipc_fd)
+{
+    char buf[IPC_MAXMSGSIZE];
+    struct cmdstats_msg msg;
+    struct cmdstat *cs;
+    unsigned int f, i;
+    uint16_t idx;
+    char *p;
+    int ret = 0;
+
+    if (ipc_fd == -1)
+        return -1;
+
+    for (f = 0; f < 256; f++) {
+        if ((cs = stats->cs_cmd[f]) == NULL || cs->cs_calls == 0)
+            continue;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.cm_function = f;
+        msg.cm_max = cs->cs_max;
+        msg.cm_calls = cs->cs_calls;
+        msg.cm_errors = cs->cs_errors;
+        msg.cm_bytes_in = cs->cs_bytes_in;
+        msg.cm_bytes_out = cs->cs_bytes_out;
+        msg.cm_usec = cs->cs_usec;
+
+        i = 0;
+        do {
+            p = buf + sizeof(msg);
+            for (; i < CMDSTATS_BUCKETS && msg.cm_nbuckets < MAX_BUCKETS; i++) {
+                if (cs->cs_hist[i] == 0)
+                    continue;
+                idx = i;
+                memcpy(p, &idx, sizeof(idx));
+                memcpy(p + sizeof(idx), &cs->cs_hist[i], sizeof(uint32_t));
+                p += BUCKET_SIZE;
+                msg.cm_nbuckets++;
+            }
+            memcpy(buf, &msg, sizeof(msg));
+
+            if (ipc_child_write(ipc_fd, IPC_STATS, p - buf, buf) != 0) {
+                LOG(log_debug, logtype_afpd, "cmdstats_send: %s", strerror(errno));
+                ret = -1;
+                break;
+            }
+
+            /* further messages of this command only carry buckets */
+            memset(&msg, 0, sizeof(msg));
+            msg.cm_function = f;
+        } while (i < CMDSTATS_BUCKETS);
+
+        memset(cs, 0, sizeof(*cs));
+    }
+
+    return ret;
+}
+
+/*!
+ * Add the counters of an IPC_STATS message
+ *
+ * @returns 0 on success, -1 on a malformed message or ENOMEM
+ */
+int cmdstats_merge(cmdstats_t *stats, const char *buf, size_t len)
+{
+    struct cmdstats_msg msg;
+    struct cmdstat *cs;
+    const char *p;
+    uint16_t idx;
+    uint32_t count;
+    int i;
+
+    if (len < sizeof(msg))
+        return -1;
+    memcpy(&msg, buf, sizeof(msg));
+    if (len != sizeof(msg) + msg.cm_nbuckets * BUCKET_SIZE)
+        return -1;
+
+    if ((cs = cmdstat_get(stats, msg.cm_function)) == NULL)
+        return -1;
+
+    cs->cs_calls += msg.cm_calls;
+    cs->cs_errors += msg.cm_errors;
+    cs->cs_bytes_in += msg.cm_bytes_in;
+    cs->cs_bytes_out += msg.cm_bytes_out;
+    cs->cs_usec += msg.cm_usec;
+    if (msg.cm_max > cs->cs_max)
+        cs->cs_max = msg.cm_max;
+
+    for (i = 0, p = buf + sizeof(msg); i < msg.cm_nbuckets; i++, p += BUCKET_SIZE) {
+        memcpy(&idx, p, sizeof(idx));
+        memcpy(&count, p + sizeof(idx), sizeof(count));
+        if (idx >= CMDSTATS_BUCKETS)
+            return -1;
+        cs->cs_hist[idx] += count;
+    }
+
+    return 0;
+}
+
+/*!
+ * Latency in us below which the fraction q of all calls completed
+ */
+uint32_t cmdstats_percentile(const struct cmdstat *cs, double q)
+{
+    uint64_t total = 0, wanted, seen = 0;
+    uint32_t value;
+    int i;
+
+    for (i = 0; i < CMDSTATS_BUCKETS; i++)
+        total += cs->cs_hist[i];
+    if (total == 0)
+        return 0;
+
+    wanted = (uint64_t)(q * total + 0.5);
+    if (wanted == 0)
+        wanted = 1;
+
+    for (i = 0; i < CMDSTATS_BUCKETS; i++) {
+        seen += cs->cs_hist[i];
+        if (seen >= wanted)
+            break;
+    }
+    if (i == CMDSTATS_BUCKETS)
+        i--;
+
+    value = bucket_value(i);
+    return value < cs->cs_max ? value : cs->cs_max;
+}
+
+/*!
+ * Print the counters of a command as one line of text
+ *
+ * @returns length of the text like snprintf()
+ */
+int cmdstats_format(const struct cmdstat *cs, const char *name, char *buf, size_t size)
+{
+    return snprintf(buf, size,
+                    "%s: calls: %llu, errors: %llu, bytes in: %llu, bytes out: %llu, "
+                    "avg: %lluus, p50: %uus, p90: %uus, p99: %uus, p99.9: %uus, max: %uus",
+                    name,
+                    (unsigned long long)cs->cs_calls,
+                    (unsigned long long)cs->cs_errors,
+                    (unsigned long long)cs->cs_bytes_in,
+                    (unsigned long long)cs->cs_bytes_out,
+                    (unsigned long long)(cs->cs_calls ? cs->cs_usec / cs->cs_calls : 0),
+                    cmdstats_percentile(cs, 0.5),
+                    cmdstats_percentile(cs, 0.9),
+                    cmdstats_percentile(cs, 0.99),
+                    cmdstats_percentile(cs, 0.999),
+                    cs->cs_max);
+}
+
+void cmdstats_free(cmdstats_t *stats)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        free(stats->cs_cmd[i]);
+        stats->cs_cmd[i] = NULL;
+    }
+}
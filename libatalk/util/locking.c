@@ -23,8 +23,15 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
 #include <atalk/util.h>
 
+#define PID_SPINS      64       /* spins before yielding the CPU */
+#define PID_OWNERCHECK 1024     /* spins before checking if the holder is alive */
+
 /*!
  * @def read_lock(fd, offset, whence, len)
  * @brief place read lock on file
@@ -93,3 +100,83 @@ int lock_reg(int fd, int cmd, int type, off_t offset, int whence, off_t len)
 
     return (fcntl(fd, cmd, &lock));
 }
+
+/*!
+ * @brief take over a lock word from a dead holder
+ *
+ * @returns 1 if the lock is now ours, 0 otherwise
+ */
+static int pid_takeover(int32_t *word, int32_t owner, int32_t me)
+{
+    if (owner == 0 || owner == me || kill(owner, 0) == 0 || errno != ESRCH)
+        return 0;
+    return __atomic_compare_exchange_n(word, &owner, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief try to take a spin lock in shared memory
+ *
+ * The lock word holds the pid of the holder, a lock held by a process that
+ * died is taken over. The caller must then repair whatever the lock protects.
+ *
+ * @param   word       (rw) lock word, 0 if free
+ *
+ * @returns 0 if the lock was taken, 1 if it was taken over from a dead
+ *          process, -1 if it is held by another process
+ */
+int pid_trylock(int32_t *word)
+{
+    int32_t me = getpid();
+    int32_t owner = 0;
+
+    if (__atomic_compare_exchange_n(word, &owner, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    return pid_takeover(word, owner, me) ? 1 : -1;
+}
+
+/*!
+ * @brief spin until a lock word is ours
+ *
+ * @returns 0 if the lock was taken, 1 if it was taken over from a dead process
+ *
+ * @sa pid_trylock
+ */
+int pid_lock(int32_t *word)
+{
+    int32_t me = getpid();
+    int32_t owner;
+    unsigned int spins = 0;
+
+    for (;;) {
+        owner = 0;
+        if (__atomic_compare_exchange_n(word, &owner, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+        if (++spins % PID_OWNERCHECK == 0 && pid_takeover(word, owner, me))
+            return 1;
+        if (spins % PID_SPINS == 0)
+            sched_yield();
+    }
+}
+
+/*!
+ * @brief take a lock word held by a process that is known to be dead
+ *
+ * For the parent that reaped the process, before its pid can be reused.
+ *
+ * @returns 1 if the lock is now ours, 0 if dead didn't hold it
+ */
+int pid_lock_reap(int32_t *word, pid_t dead)
+{
+    int32_t owner = dead;
+
+    return __atomic_compare_exchange_n(word, &owner, (int32_t)getpid(), 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief release a lock taken with pid_lock() or pid_trylock()
+ */
+void pid_unlock(int32_t *word)
+{
+    __atomic_store_n(word, 0, __ATOMIC_RELEASE);
+}
@@ -29,6 +29,8 @@ Netatalk 2001 (c)
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <atalk/util.h>
 #include <atalk/logger.h>
@@ -36,6 +38,7 @@ Netatalk 2001 (c)
 
 #define COUNT_ARRAY(array) (sizeof((array))/sizeof((array)[0]))
 
+/* size of a ring buffer slot, longer buffered messages are truncated */
 #define MAXLOGSIZE 512
 
 #define LOGLEVEL_STRING_IDENTIFIERS { \
@@ -94,10 +97,6 @@ UAM_MODULE_EXPORT logtype_conf_t type_configs[logtype_end_of_list_marker] = {
 
 static void syslog_setup(int loglevel, enum logtypes logtype, int display_options, int facility);
 
-/* These are used by the LOG macro to store __FILE__ and __LINE__ */
-static const char *log_src_filename;
-static int  log_src_linenumber;
-
 /* Array to store text to list given a log type */
 static const char *arr_logtype_strings[] =  LOGTYPE_STRING_IDENTIFIERS;
 static const unsigned int num_logtype_strings = COUNT_ARRAY(arr_logtype_strings);
@@ -117,7 +116,9 @@ static int generate_message(char **message_details_buffer,
                             char *user_message,
                             int display_options,
                             enum loglevels loglevel,
-                            enum logtypes logtype)
+                            enum logtypes logtype,
+                            const char *file,
+                            int line)
 {
     char *details;
     int    len;
@@ -128,11 +129,11 @@ static int generate_message(char **message_details_buffer,
     gettimeofday(&tv, NULL);
     strftime(buf, sizeof(buf), "%b %d %H:%M:%S.", localtime(&tv.tv_sec));
     pid = getpid();
-    const char *basename = strrchr(log_src_filename, '/');
+    const char *basename = strrchr(file, '/');
     if (basename) {
         basename++;
     } else {
-        basename = log_src_filename;
+        basename = file;
     }
 
 
@@ -143,7 +144,7 @@ static int generate_message(char **message_details_buffer,
                    log_config.processname,
                    pid,
                    basename,
-                   log_src_linenumber,
+                   line,
                    arr_loglevel_strings[loglevel],
                    arr_logtype_strings[logtype],
                    user_message);
@@ -155,6 +156,247 @@ static int generate_message(char **message_details_buffer,
     return len;
 }
 
+/* =========================================================================
+   Asynchronous logging
+
+   With "log buffer" set, messages for log files are formatted into a ring
+   buffer on the caller's thread without any allocation, while the message
+   header with the timestamp is only generated when the ring is flushed by
+   log_flush() with one writev() per batch. Only the daemons that flush
+   before they wait for the next request enable the ring: afpd sessions,
+   cnid_dbd and cnid_metad. Messages at level error and worse, a ring that
+   is half full and the first message of a new second flush immediately. When
+   the ring is full, messages are counted and dropped instead of blocking.
+   A message is truncated to MAXLOGSIZE - 2 bytes plus the newline, the
+   header isn't part of that.
+
+   Any thread can add messages, slots are reserved with a CAS on log_head and
+   published by storing their sequence number. One thread at a time flushes.
+   Adding doesn't take the recursion guard of make_log_entry(), so it works
+   from signal handlers and from the log functions themselves.
+   The ring is flushed before fork(), so children don't repeat messages.
+   ========================================================================= */
+
+#define LOG_RING_MAX   65536
+#define LOG_BATCH      64       /* messages per writev() */
+#define LOG_HDRSIZE    128
+
+struct log_slot {
+    uint32_t        ls_seq;     /* ring position + 1 once the slot is filled */
+    int             ls_fd;
+    struct timeval  ls_tv;
+    const char     *ls_file;
+    int             ls_line;
+    enum loglevels  ls_level;
+    enum logtypes   ls_type;
+    int             ls_len;
+    char            ls_msg[MAXLOGSIZE];
+};
+
+static struct log_slot *log_ring;
+static uint32_t log_ring_size;
+static uint32_t log_head;       /* next slot to fill */
+static uint32_t log_tail;       /* next slot to write */
+static int      log_flushing;
+static unsigned long log_dropped;
+static pid_t    log_ring_pid;
+static time_t   log_ring_flushed;
+
+static int format_header(char *buf, size_t size, const struct timeval *tv, const char *file,
+                         int line, enum loglevels loglevel, enum logtypes logtype)
+{
+    static __thread time_t last_sec = -1;
+    static __thread char datebuf[64];
+    const char *basename;
+    int len;
+
+    /* most messages are from the same second as their predecessor */
+    if (tv->tv_sec != last_sec) {
+        strftime(datebuf, sizeof(datebuf), "%b %d %H:%M:%S.", localtime(&tv->tv_sec));
+        last_sec = tv->tv_sec;
+    }
+    if ((basename = strrchr(file, '/')) != NULL)
+        basename++;
+    else
+        basename = file;
+
+    len = snprintf(buf, size, "%s%06u %s[%d] {%s:%d} (%s:%s): ",
+                   datebuf,
+                   (int)tv->tv_usec,
+                   log_config.processname,
+                   (int)(log_ring_pid ? log_ring_pid : getpid()),
+                   basename,
+                   line,
+                   arr_loglevel_strings[loglevel],
+                   arr_logtype_strings[logtype]);
+    if (len >= (int)size)
+        len = size - 1;
+    return len;
+}
+
+/*!
+ * Add a message to the ring
+ *
+ * @returns 1 if the ring should be flushed now
+ */
+static int log_ring_add(enum loglevels loglevel, enum logtypes logtype, int fd,
+                        const char *file, int line, const char *message, va_list args)
+{
+    struct log_slot *slot;
+    uint32_t head, tail;
+    int len;
+
+    head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    do {
+        tail = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= log_ring_size) {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    } while (!__atomic_compare_exchange_n(&log_head, &head, head + 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    slot = &log_ring[head & (log_ring_size - 1)];
+    gettimeofday(&slot->ls_tv, NULL);
+    slot->ls_fd = fd;
+    slot->ls_file = file;
+    slot->ls_line = line;
+    slot->ls_level = loglevel;
+    slot->ls_type = logtype;
+
+    len = vsnprintf(slot->ls_msg, MAXLOGSIZE - 1, message, args);
+    if (len < 0)
+        len = 0;
+    else if (len > MAXLOGSIZE - 2)
+        len = MAXLOGSIZE - 2;
+    slot->ls_msg[len++] = '\n';
+    slot->ls_len = len;
+
+    __atomic_store_n(&slot->ls_seq, head + 1, __ATOMIC_RELEASE);
+
+    return loglevel <= log_error
+        || head + 1 - tail >= log_ring_size / 2
+        || slot->ls_tv.tv_sec != log_ring_flushed;
+}
+
+/* Log the number of messages dropped since the last report */
+static void log_report_dropped(const struct timeval *tv)
+{
+    unsigned long dropped;
+    int fd, len;
+    char buf[MAXLOGSIZE];
+
+    if (__atomic_load_n(&log_dropped, __ATOMIC_RELAXED) == 0)
+        return;
+    if ((fd = type_configs[logtype_logger].set ?
+         type_configs[logtype_logger].fd : type_configs[logtype_default].fd) < 0)
+        return;
+    if ((dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED)) == 0)
+        return;
+
+    len = format_header(buf, LOG_HDRSIZE, tv, __FILE__, __LINE__, log_warning, logtype_logger);
+    len += snprintf(buf + len, sizeof(buf) - len, "%lu log messages dropped\n", dropped);
+    write(fd, buf, len);
+}
+
+/*!
+ * Write all messages in the ring to their log files
+ *
+ * Does nothing if another thread is already flushing.
+ */
+void log_flush(void)
+{
+    static char hdrbuf[LOG_BATCH][LOG_HDRSIZE];
+    struct iovec iov[2 * LOG_BATCH];
+    struct log_slot *slot;
+    struct timeval tv;
+    uint32_t pos;
+    int fd, n;
+
+    if (log_ring == NULL)
+        return;
+    if (__atomic_exchange_n(&log_flushing, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    while (1) {
+        /* collect a batch of consecutive messages for the same file */
+        fd = -1;
+        for (n = 0; n < LOG_BATCH; n++) {
+            slot = &log_ring[(pos + n) & (log_ring_size - 1)];
+            if (__atomic_load_n(&slot->ls_seq, __ATOMIC_ACQUIRE) != pos + n + 1)
+                break;
+            if (n > 0 && slot->ls_fd != fd)
+                break;
+            fd = slot->ls_fd;
+            iov[2 * n].iov_base = hdrbuf[n];
+            iov[2 * n].iov_len = format_header(hdrbuf[n], LOG_HDRSIZE, &slot->ls_tv, slot->ls_file,
+                                               slot->ls_line, slot->ls_level, slot->ls_type);
+            iov[2 * n + 1].iov_base = slot->ls_msg;
+            iov[2 * n + 1].iov_len = slot->ls_len;
+        }
+        if (n == 0)
+            break;
+        writev(fd, iov, 2 * n);
+        pos += n;
+        __atomic_store_n(&log_tail, pos, __ATOMIC_RELEASE);
+    }
+
+    gettimeofday(&tv, NULL);
+    log_ring_flushed = tv.tv_sec;
+    log_report_dropped(&tv);
+
+    __atomic_store_n(&log_flushing, 0, __ATOMIC_RELEASE);
+}
+
+/* fork() handler, the parent has flushed the ring and writes anything left */
+static void log_ring_forked(void)
+{
+    log_tail = log_head;
+    log_dropped = 0;
+    log_flushing = 0;
+    log_ring_pid = getpid();
+}
+
+/*!
+ * Log to files via a ring buffer of entries messages, 0 logs synchronously
+ *
+ * Must not be called while other threads may log.
+ */
+void setuplog_async(int entries)
+{
+    static int registered;
+    uint32_t size = 1;
+
+    if (entries > LOG_RING_MAX)
+        entries = LOG_RING_MAX;
+    while (entries > 0 && size < (uint32_t)entries)
+        size <<= 1;
+    if (log_ring && entries > 0 && size == log_ring_size)
+        return;
+
+    log_flush();
+    free(log_ring);
+    log_ring = NULL;
+    log_ring_size = 0;
+    log_head = log_tail = 0;
+
+    if (entries <= 0)
+        return;
+
+    if ((log_ring = calloc(size, sizeof(struct log_slot))) == NULL)
+        return;
+    log_ring_size = size;
+    log_ring_pid = getpid();
+    if (!registered) {
+        pthread_atfork(log_flush, NULL, log_ring_forked);
+        atexit(log_flush);
+        registered = 1;
+    }
+
+    LOG(log_debug, logtype_logger, "Asynchronous logging with a buffer of %u messages", size);
+}
+
 static int get_syslog_equivalent(enum loglevels loglevel)
 {
     switch (loglevel)
@@ -199,6 +441,9 @@ static void log_init(void)
 
 static void log_setup(const char *filename, enum loglevels loglevel, enum logtypes logtype)
 {
+    /* pending messages must go to the file they were logged to */
+    log_flush();
+
     if (loglevel == 0) {
         /* Disable */
         if (type_configs[logtype].set) {
@@ -395,6 +640,16 @@ void set_processname(const char *processname)
     log_config.processname[15] = 0;
 }
 
+/* The log file of logtype, -1 if there's none */
+static int log_fd(enum logtypes logtype)
+{
+    /* Check if requested logtype is setup */
+    if (type_configs[logtype].set)
+        return type_configs[logtype].fd;
+    /* No: use default */
+    return type_configs[logtype_default].fd;
+}
+
 /* -------------------------------------------------------------------------
    make_log_entry has 1 main flaws:
    The message in its entirity, must fit into the tempbuffer.
@@ -403,22 +658,37 @@ void set_processname(const char *processname)
 void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
                     const char *file, int line, char *message, ...)
 {
-    /* fn is not reentrant but is used in signal handler
-     * with LOGGER it's a little late source name and line number
-     * are already changed. */
-    static int inlog = 0;
+    /* fn is not reentrant but is used in signal handler, the guard is per
+     * thread as cnid_dbd logs from its worker threads */
+    static __thread int inlog = 0;
     int fd, len;
     char *user_message, *log_message;
+    unsigned long dropped;
+    struct timeval tv;
     va_list args;
 
-    if (inlog)
-        return;
-
-    inlog = 1;
-
     if (!log_config.inited) {
       log_init();
     }
+
+    /* buffered file logging is reentrant and needs no guard */
+    if (log_ring && !type_configs[logtype].syslog) {
+        if ((fd = log_fd(logtype)) < 0)
+            return;
+        va_start(args, message);
+        len = log_ring_add(loglevel, logtype, fd, file, line, message, args);
+        va_end(args);
+        if (len)
+            log_flush();
+        return;
+    }
+
+    if (inlog) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    inlog = 1;
     
     if (type_configs[logtype].syslog) {
         if (type_configs[logtype].level >= loglevel) {
@@ -427,10 +697,18 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
             len = vasprintf(&user_message, message, args);
             va_end(args);
             if (len == -1) {
+                __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+                inlog = 0;
                 return;
             }
             make_syslog_entry(loglevel, logtype, user_message);
             free(user_message);
+            if ((dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED)) != 0) {
+                if (asprintf(&user_message, "%lu log messages dropped", dropped) != -1) {
+                    make_syslog_entry(log_warning, logtype_logger, user_message);
+                    free(user_message);
+                }
+            }
         }
         inlog = 0;
         return;
@@ -438,19 +716,7 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
 
     /* logging to a file */
 
-    log_src_filename = file;
-    log_src_linenumber = line;
-
-    /* Check if requested logtype is setup */
-    if (type_configs[logtype].set) {
-        /* Yes */
-        fd = type_configs[logtype].fd;
-    } else {
-        /* No: use default */
-        fd = type_configs[logtype_default].fd;
-    }
-
-    if (fd < 0) {
+    if ((fd = log_fd(logtype)) < 0) {
         /* no where to send the output, give up */
         goto exit;
     }
@@ -458,24 +724,33 @@ void make_log_entry(enum loglevels loglevel, enum logtypes logtype,
     /* Initialise the Messages */
     va_start(args, message);
     len = vasprintf(&user_message, message, args);
+    va_end(args);
     if (len == -1) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
         goto exit;
     }
-    va_end(args);
 
     len = generate_message(&log_message,
                            user_message,
                            type_configs[logtype].set ?
                            type_configs[logtype].display_options :
                            type_configs[logtype_default].display_options,
-                           loglevel, logtype);
+                           loglevel, logtype, file, line);
     if (len == -1) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+        free(user_message);
         goto exit;
     }
     write(fd, log_message, len);
     free(log_message);
     free(user_message);
 
+    /* messages dropped by the guard, e.g. logged by a signal handler */
+    if (__atomic_load_n(&log_dropped, __ATOMIC_RELAXED)) {
+        gettimeofday(&tv, NULL);
+        log_report_dropped(&tv);
+    }
+
 exit:
     inlog = 0;
 }
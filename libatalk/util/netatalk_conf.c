@@ -820,12 +820,16 @@ static struct vol *creatvol(AFPObj *obj,
         volume->v_flags |= AFPVOL_UNIX_PRIV;
     if (!getoption_bool(obj->iniconfig, section, "cnid dev", preset, 1))
         volume->v_flags |= AFPVOL_NODEV;
+    if (!getoption_bool(obj->iniconfig, section, "cnid sync", preset, 1))
+        volume->v_flags |= AFPVOL_CNID_NOSYNC;
     if (getoption_bool(obj->iniconfig, section, "illegal seq", preset, 0))
         volume->v_flags |= AFPVOL_EILSEQ;
     if (getoption_bool(obj->iniconfig, section, "time machine", preset, 0))
         volume->v_flags |= AFPVOL_TM;
     if (getoption_bool(obj->iniconfig, section, "search db", preset, 0))
         volume->v_flags |= AFPVOL_SEARCHDB;
+    if (getoption_bool(obj->iniconfig, section, "catsearch index", preset, 0))
+        volume->v_flags |= AFPVOL_CATIDX;
     if (!getoption_bool(obj->iniconfig, section, "network ids", preset, 1))
         volume->v_flags |= AFPVOL_NONETIDS;
 #ifdef HAVE_ACLS
@@ -839,6 +843,9 @@ static struct vol *creatvol(AFPObj *obj,
     if (getoption_bool(obj->iniconfig, section, "spotlight", preset, obj->options.flags & OPTION_SPOTLIGHT_VOL)) {
         volume->v_flags |= AFPVOL_SPOTLIGHT;
         obj->options.flags |= OPTION_SPOTLIGHT;
+        /* the native backend answers queries from the catalog index */
+        if (obj->options.flags & OPTION_SPOTLIGHT_NATIVE)
+            volume->v_flags |= AFPVOL_CATIDX;
     }
     if (getoption_bool(obj->iniconfig, section, "delete veto files", preset, 0))
         volume->v_flags |= AFPVOL_DELVETO;
@@ -1914,6 +1921,8 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
     options->logconfig = atalk_iniparser_getstrdup(config, INISEC_GLOBAL, "log level", "default:note");
     options->logfile   = atalk_iniparser_getstrdup(config, INISEC_GLOBAL, "log file",  NULL);
 
+    options->logbuffer = atalk_iniparser_getint(config, INISEC_GLOBAL, "log buffer", 0);
+
     setuplog(options->logconfig, options->logfile);
 
     /* "server options" boolean options */
@@ -1935,6 +1944,8 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
         options->flags |= OPTION_DBUS_AFPSTATS;
     if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "afp read locks", 0))
         options->flags |= OPTION_AFP_READ_LOCK;
+    if (!atalk_iniparser_getboolean(config, INISEC_GLOBAL, "byte lock interop", 1))
+        options->flags |= OPTION_NOLOCKINTEROP;
     if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "spotlight", 0))
         options->flags |= OPTION_SPOTLIGHT_VOL;
     if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "veto message", 0))
@@ -1945,6 +1956,12 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
         options->passwdbits |= PASSWD_SET;
     if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "spotlight expr", 1))
         options->flags |= OPTION_SPOTLIGHT_EXPR;
+    if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "dsi pipelining", 0))
+        options->flags |= OPTION_DSI_PIPELINE;
+    if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "io uring", 0))
+        options->flags |= OPTION_IO_URING;
+    if (atalk_iniparser_getboolean(config, INISEC_GLOBAL, "dircache notify", 0))
+        options->flags |= OPTION_DIRCACHE_NOTIFY;
 
     /* figure out options w values */
     options->loginmesg      = atalk_iniparser_getstrdup(config, INISEC_GLOBAL, "login message",  NULL);
@@ -1971,13 +1988,20 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
     options->cnid_mysql_pw  = atalk_iniparser_getstrdup(config, INISEC_GLOBAL, "cnid mysql pw", NULL);
     options->cnid_mysql_db  = atalk_iniparser_getstrdup(config, INISEC_GLOBAL, "cnid mysql db", NULL);
     options->connections    = atalk_iniparser_getint   (config, INISEC_GLOBAL, "max connections",200);
+    options->prefork        = atalk_iniparser_getint   (config, INISEC_GLOBAL, "prefork sessions", 0);
+    options->prefork_refill = atalk_iniparser_getint   (config, INISEC_GLOBAL, "prefork refill", 2);
     options->passwdminlen   = atalk_iniparser_getint   (config, INISEC_GLOBAL, "passwd minlen",  0);
     options->tickleval      = atalk_iniparser_getint   (config, INISEC_GLOBAL, "tickleval",      30);
     options->timeout        = atalk_iniparser_getint   (config, INISEC_GLOBAL, "timeout",        4);
     options->dsireadbuf     = atalk_iniparser_getint   (config, INISEC_GLOBAL, "dsireadbuf",     12);
     options->server_quantum = atalk_iniparser_getint   (config, INISEC_GLOBAL, "server quantum", DSI_SERVQUANT_DEF);
+    options->readahead      = atalk_iniparser_getint   (config, INISEC_GLOBAL, "read ahead",     0);
     options->volnamelen     = atalk_iniparser_getint   (config, INISEC_GLOBAL, "volnamelen",     80);
     options->dircachesize   = atalk_iniparser_getint   (config, INISEC_GLOBAL, "dircachesize",   DEFAULT_MAX_DIRCACHE_SIZE);
+    options->shdircachesize = atalk_iniparser_getint   (config, INISEC_GLOBAL, "shared dircache size", 0);
+    options->shlocktablesize = atalk_iniparser_getint  (config, INISEC_GLOBAL, "shared lock table size", 0);
+    options->dircache_watches = atalk_iniparser_getint (config, INISEC_GLOBAL, "dircache watches", 4096);
+    options->mdcachesize    = atalk_iniparser_getint   (config, INISEC_GLOBAL, "metadata cache size", 8192);
     options->tcp_sndbuf     = atalk_iniparser_getint   (config, INISEC_GLOBAL, "tcpsndbuf",      0);
     options->tcp_rcvbuf     = atalk_iniparser_getint   (config, INISEC_GLOBAL, "tcprcvbuf",      0);
     options->fce_fmodwait   = atalk_iniparser_getint   (config, INISEC_GLOBAL, "fce holdfmod",   60);
@@ -1986,6 +2010,23 @@ int afp_config_parse(AFPObj *AFPObj, char *processname)
     options->splice_size    = atalk_iniparser_getint   (config, INISEC_GLOBAL, "splice size",    64*1024);
     options->sparql_limit   = atalk_iniparser_getint   (config, INISEC_GLOBAL, "sparql results limit", 0);
 
+#ifdef HAVE_TRACKER
+    p = atalk_iniparser_getstring(config, INISEC_GLOBAL, "spotlight backend", "tracker");
+#else
+    p = atalk_iniparser_getstring(config, INISEC_GLOBAL, "spotlight backend", "native");
+#endif
+    if (STRCMP(p, ==, "native"))
+        options->flags |= OPTION_SPOTLIGHT_NATIVE;
+    else if (STRCMP(p, ==, "tracker")) {
+#ifndef HAVE_TRACKER
+        LOG(log_error, logtype_afpd, "Spotlight backend \"tracker\" not available, using \"native\"");
+        options->flags |= OPTION_SPOTLIGHT_NATIVE;
+#endif
+    } else {
+        LOG(log_error, logtype_afpd, "bad Spotlight backend: %s, defaulting to 'native'", p);
+        options->flags |= OPTION_SPOTLIGHT_NATIVE;
+    }
+
     p = atalk_iniparser_getstring(config, INISEC_GLOBAL, "map acls", "rights");
     if (STRCMP(p, ==, "rights"))
         options->flags |= OPTION_ACL2MACCESS;
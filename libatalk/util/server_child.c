@@ -182,6 +182,7 @@ void server_child_free(server_child_t *children)
         }
     }
 
+    cmdstats_free(&children->servch_stats);
     free(children);
 }
 
@@ -339,12 +340,14 @@ void server_reset_signal(void)
     sigaction(SIGHUP,  &sv, NULL );
     sigaction(SIGTERM, &sv, NULL );
     sigaction(SIGUSR1, &sv, NULL );
+    sigaction(SIGUSR2, &sv, NULL );
     sigaction(SIGCHLD, &sv, NULL );
 
     sigemptyset(&sigs);
     sigaddset(&sigs, SIGALRM);
     sigaddset(&sigs, SIGHUP);
     sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
     sigaddset(&sigs, SIGCHLD);
     pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
 
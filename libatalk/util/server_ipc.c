@@ -28,9 +28,7 @@
 #include <atalk/paths.h>
 #include <atalk/globals.h>
 #include <atalk/dsi.h>
-
-#define IPC_HEADERLEN 14
-#define IPC_MAXMSGSIZE 90
+#include <atalk/cmdstats.h>
 
 typedef struct ipc_header {
 	uint16_t command;
@@ -45,7 +43,8 @@ typedef struct ipc_header {
 static char *ipc_cmd_str[] = { "IPC_DISCOLDSESSION",
                                "IPC_GETSESSION",
                                "IPC_STATE",
-                               "IPC_VOLUMES"};
+                               "IPC_VOLUMES",
+                               "IPC_STATS"};
 
 /*
  * Pass afp_socket to old disconnected session if one has a matching token (token = pid)
@@ -146,6 +145,17 @@ EC_CLEANUP:
     EC_EXIT;
 }
 
+static int ipc_add_stats(struct ipc_header *ipc, server_child_t *children)
+{
+    int ret;
+
+    pthread_mutex_lock(&children->servch_lock);
+    ret = cmdstats_merge(&children->servch_stats, ipc->msg, ipc->len);
+    pthread_mutex_unlock(&children->servch_lock);
+
+    return ret;
+}
+
 /***********************************************************************************
  * Public functions
  ***********************************************************************************/
@@ -205,7 +215,7 @@ int ipc_server_read(server_child_t *children, int fd)
 
     memset (buf, 0, IPC_MAXMSGSIZE);
     if ( ipc.len != 0) {
-	    if ((ret = read(fd, buf, ipc.len)) != (int) ipc.len) {
+	    if ((ret = readt(fd, buf, ipc.len, 0, 2)) != (int) ipc.len) {
             LOG(log_info, logtype_afpd, "Reading IPC message failed (%u of %u  bytes read): %s",
                 ret, ipc.len, strerror(errno));
             return -1;
@@ -253,6 +263,14 @@ int ipc_server_read(server_child_t *children, int fd)
             return -1;
         break;
 
+    case IPC_STATS:
+        if (ipc_add_stats(&ipc, children) != 0) {
+            LOG(log_info, logtype_afpd, "ipc_read(%s:child[%u]): bad message",
+                ipc_cmd_str[ipc.command], ipc.child_pid);
+            return -1;
+        }
+        break;
+
 	default:
 		LOG (log_info, logtype_afpd, "ipc_read: unknown command: %d", ipc.command);
 		return -1;
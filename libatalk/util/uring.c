@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All rights reserved. See COPYRIGHT.
+ *
+ * Optional io_uring I/O engine for moving data between the AFP session
+ * socket and files (FPRead and FPWrite).
+ *
+ * Every afpd session process sets up its own small ring with two registered
+ * buffers. Data is moved in a pipeline: while one buffer is being sent to (or
+ * received from) the socket, the other one is read from (or written to) the
+ * file, each step being a single io_uring_enter() that both submits the next
+ * operations and reaps completions.
+ *
+ * The ring is driven with raw syscalls, there's no dependency on liburing.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef WITH_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/param.h>
+#include <linux/io_uring.h>
+
+#include <atalk/logger.h>
+#include <atalk/util.h>
+#include <atalk/uring.h>
+
+#define URING_ENTRIES  8
+#define URING_NBUFS    2
+#define URING_BUFSIZ   (128 * 1024)
+
+/* operations, encoded in the lowest bit of the user_data together with the buffer index */
+#define URING_FILL     0        /* read into buffer */
+#define URING_DRAIN    1        /* write from buffer */
+
+/* buffer states */
+#define URB_FREE       0
+#define URB_FILLING    1
+#define URB_FULL       2
+#define URB_DRAINING   3
+
+struct uring_buf {
+    int    state;
+    size_t off;                 /* offset of the buffer in the transfer */
+    size_t len;                 /* number of bytes the buffer is filled with */
+    size_t done;                /* bytes already filled or drained */
+};
+
+static struct {
+    int                 fd;
+    int                 fixed;  /* buffers are registered with the ring */
+    unsigned int        sq_entries;
+    unsigned int        *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t              sq_ring_len, cq_ring_len, sqes_len;
+    unsigned int        pending;  /* SQEs not yet submitted */
+    unsigned int        inflight; /* submitted, not yet completed */
+    struct iovec        bufs[URING_NBUFS];
+} ring = { .fd = -1 };
+
+static struct {
+    unsigned long long enters;  /* io_uring_enter() calls */
+    unsigned long long ops;     /* submitted operations */
+    unsigned long long bytes;   /* bytes transferred */
+} uring_stat;
+
+/*********************************************************************************
+ * Ring handling
+ *********************************************************************************/
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*!
+ * Queue an operation on buffer "buf", the SQE is submitted with the next uring_wait()
+ *
+ * @param op      (r) URING_FILL or URING_DRAIN
+ * @param buf     (r) buffer index
+ * @param fd      (r) file or socket
+ * @param sock    (r) whether fd is a socket
+ * @param off     (r) file offset, unused for sockets
+ * @param start   (r) offset into the buffer
+ * @param len     (r) number of bytes
+ */
+static void uring_prep(int op, int buf, int fd, int sock, off_t off, size_t start, size_t len)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, idx;
+
+    tail = *ring.sq_tail;
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)((char *)ring.bufs[buf].iov_base + start);
+    sqe->len = len;
+    sqe->user_data = (buf << 1) | op;
+
+    if (sock) {
+        if (op == URING_FILL) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->msg_flags = MSG_WAITALL;
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+        }
+    } else {
+        sqe->off = off;
+        if (ring.fixed) {
+            sqe->opcode = (op == URING_FILL) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = buf;
+        } else {
+            sqe->opcode = (op == URING_FILL) ? IORING_OP_READ : IORING_OP_WRITE;
+        }
+    }
+
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    ring.inflight++;
+    uring_stat.ops++;
+}
+
+/*!
+ * Submit queued operations and wait for at least one completion
+ *
+ * @returns 0 on success, -1 on error
+ */
+static int uring_wait(void)
+{
+    int ret;
+
+    while (1) {
+        if (ring.pending == 0
+            && *ring.cq_head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+            return 0;
+
+        uring_stat.enters++;
+        ret = sys_io_uring_enter(ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(log_error, logtype_default, "uring_wait: io_uring_enter: %s", strerror(errno));
+            return -1;
+        }
+        ring.pending -= ret;
+    }
+}
+
+/*!
+ * Fetch the next completion
+ *
+ * @returns 1 if a completion was fetched, 0 if the completion queue is empty
+ */
+static int uring_reap(uint64_t *user_data, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+
+    head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    cqe = &ring.cqes[head & *ring.cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    ring.inflight--;
+
+    return 1;
+}
+
+/*!
+ * Wait for all submitted operations after an error, so that no stale
+ * completion is left behind for the next transfer
+ */
+static void uring_drain_inflight(void)
+{
+    uint64_t ud;
+    int res;
+
+    while (ring.inflight > 0) {
+        if (uring_wait() != 0)
+            return;
+        while (uring_reap(&ud, &res))
+            ;
+    }
+}
+
+/*!
+ * Move "count" bytes from infd to outfd through the ring buffers
+ *
+ * Exactly one side is a socket. Socket operations are serialized and issued
+ * in stream order, file operations may run concurrently with them.
+ *
+ * If writing to the output file fails, the remaining data is still read from
+ * the input socket and discarded, so the DSI stream stays in sync, and the
+ * number of bytes written so far is returned with errno set.
+ *
+ * @returns number of bytes written to outfd, -1 on error reading the input
+ *          or writing the socket
+ */
+static ssize_t uring_transfer(int infd, off_t inoff, int outfd, off_t outoff, size_t count,
+                              uring_sockwait_t sockwait, void *private)
+{
+    struct uring_buf bufs[URING_NBUFS];
+    struct uring_buf *b;
+    int insock = (inoff == -1);
+    int outsock = (outoff == -1);
+    size_t filled = 0;          /* bytes scheduled for filling */
+    size_t drained = 0;         /* bytes drained or discarded */
+    size_t written = 0;         /* bytes written to outfd */
+    int sockbusy = 0;           /* socket operation in flight */
+    int werr = 0;               /* error writing the output file */
+    uint64_t ud;
+    int i, op, res, sockop;
+
+    if (ring.fd == -1) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    for (i = 0; i < URING_NBUFS; i++)
+        bufs[i].state = URB_FREE;
+
+    while (drained < count) {
+        /* start filling free buffers */
+        for (i = 0; i < URING_NBUFS && filled < count; i++) {
+            b = &bufs[i];
+            if (b->state != URB_FREE || (insock && sockbusy))
+                continue;
+            b->off = filled;
+            b->len = MIN(URING_BUFSIZ, count - filled);
+            b->done = 0;
+            b->state = URB_FILLING;
+            filled += b->len;
+            uring_prep(URING_FILL, i, infd, insock, inoff + b->off, 0, b->len);
+            if (insock)
+                sockbusy = 1;
+        }
+
+        /* start draining full buffers, sockets in stream order */
+        for (i = 0; i < URING_NBUFS; i++) {
+            b = &bufs[i];
+            if (b->state != URB_FULL)
+                continue;
+            if (werr) {
+                /* output file failed, discard */
+                drained += b->len;
+                b->state = URB_FREE;
+                continue;
+            }
+            if (outsock && (sockbusy || b->off != drained))
+                continue;
+            b->done = 0;
+            b->state = URB_DRAINING;
+            uring_prep(URING_DRAIN, i, outfd, outsock, outoff + b->off, 0, b->len);
+            if (outsock)
+                sockbusy = 1;
+        }
+
+        if (drained >= count)
+            break;
+        if (ring.pending == 0 && ring.inflight == 0)
+            /* discarded the last buffers, loop to refill */
+            continue;
+
+        if (uring_wait() != 0)
+            goto error;
+
+        while (uring_reap(&ud, &res)) {
+            i = ud >> 1;
+            op = ud & 1;
+            b = &bufs[i];
+            sockop = (op == URING_FILL) ? insock : outsock;
+
+            if (res == -EINTR
+                || (res == -EAGAIN && sockop && sockwait && sockwait(private) == 0)) {
+                /* retry remaining part */
+                if (op == URING_FILL)
+                    uring_prep(op, i, infd, insock, inoff + b->off + b->done, b->done, b->len - b->done);
+                else
+                    uring_prep(op, i, outfd, outsock, outoff + b->off + b->done, b->done, b->len - b->done);
+                continue;
+            }
+
+            if (res < 0) {
+                if (op == URING_DRAIN && !outsock) {
+                    /* file write error, keep reading the socket */
+                    LOG(log_error, logtype_default, "uring_transfer: write: %s", strerror(-res));
+                    werr = -res;
+                    drained += b->len;
+                    b->state = URB_FREE;
+                    continue;
+                }
+                LOG(log_error, logtype_default, "uring_transfer: %s: %s",
+                    op == URING_FILL ? "read" : "write", strerror(-res));
+                errno = -res;
+                goto error;
+            }
+
+            if (op == URING_FILL) {
+                if (res == 0) {
+                    /* unexpected EOF */
+                    LOG(log_error, logtype_default, "uring_transfer: unexpected EOF");
+                    errno = insock ? ECONNRESET : EIO;
+                    goto error;
+                }
+                b->done += res;
+                if (b->done < b->len) {
+                    uring_prep(op, i, infd, insock, inoff + b->off + b->done, b->done, b->len - b->done);
+                    continue;
+                }
+                if (insock)
+                    sockbusy = 0;
+                b->state = URB_FULL;
+            } else {
+                b->done += res;
+                written += res;
+                if (b->done < b->len) {
+                    uring_prep(op, i, outfd, outsock, outoff + b->off + b->done, b->done, b->len - b->done);
+                    continue;
+                }
+                if (outsock)
+                    sockbusy = 0;
+                drained += b->len;
+                b->state = URB_FREE;
+            }
+        }
+    }
+
+    uring_stat.bytes += written;
+
+    if (werr) {
+        errno = werr;
+        return written;
+    }
+    return count;
+
+error:
+    uring_drain_inflight();
+    return -1;
+}
+
+/*********************************************************************************
+ * Public functions
+ *********************************************************************************/
+
+/*!
+ * Setup the io_uring of this process
+ *
+ * @returns 0 on success, -1 if io_uring is not available
+ */
+int uring_init(void)
+{
+    struct io_uring_params p;
+    int i;
+
+    if (ring.fd != -1)
+        return 0;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring.fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0) {
+        LOG(log_error, logtype_default, "uring_init: io_uring_setup: %s", strerror(errno));
+        ring.fd = -1;
+        return -1;
+    }
+
+    ring.sq_entries = p.sq_entries;
+    ring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sq_ring_len = ring.cq_ring_len = MAX(ring.sq_ring_len, ring.cq_ring_len);
+#endif
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED)
+        goto error;
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cq_ring = ring.sq_ring;
+    else
+#endif
+        ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED)
+        goto error;
+
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto error;
+
+    ring.sq_head  = (unsigned int *)((char *)ring.sq_ring + p.sq_off.head);
+    ring.sq_tail  = (unsigned int *)((char *)ring.sq_ring + p.sq_off.tail);
+    ring.sq_mask  = (unsigned int *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)((char *)ring.sq_ring + p.sq_off.array);
+    ring.cq_head  = (unsigned int *)((char *)ring.cq_ring + p.cq_off.head);
+    ring.cq_tail  = (unsigned int *)((char *)ring.cq_ring + p.cq_off.tail);
+    ring.cq_mask  = (unsigned int *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+
+    for (i = 0; i < URING_NBUFS; i++) {
+        if ((ring.bufs[i].iov_base = malloc(URING_BUFSIZ)) == NULL)
+            goto error;
+        ring.bufs[i].iov_len = URING_BUFSIZ;
+    }
+
+    /* Registering the buffers may fail eg because of RLIMIT_MEMLOCK, not fatal */
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, ring.bufs, URING_NBUFS) == 0)
+        ring.fixed = 1;
+    else
+        LOG(log_note, logtype_default, "uring_init: can't register buffers: %s", strerror(errno));
+
+    LOG(log_debug, logtype_default, "uring_init: io_uring ready, %u entries, registered buffers: %s",
+        ring.sq_entries, ring.fixed ? "yes" : "no");
+
+    return 0;
+
+error:
+    LOG(log_error, logtype_default, "uring_init: %s", strerror(errno));
+    uring_close();
+    return -1;
+}
+
+/*!
+ * Tear down the io_uring of this process and log statistics
+ */
+void uring_close(void)
+{
+    int i;
+
+    if (ring.fd == -1)
+        return;
+
+    if (uring_stat.ops)
+        LOG(log_info, logtype_default, "io_uring statistics: "
+            "io_uring_enter: %llu, operations: %llu, transferred: %.2f KB",
+            uring_stat.enters, uring_stat.ops, uring_stat.bytes / 1024.0);
+
+    if (ring.sqes && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sqes_len);
+    if (ring.cq_ring && ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_len);
+    if (ring.sq_ring && ring.sq_ring != MAP_FAILED)
+        munmap(ring.sq_ring, ring.sq_ring_len);
+    close(ring.fd);
+
+    for (i = 0; i < URING_NBUFS; i++)
+        free(ring.bufs[i].iov_base);
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/*!
+ * Whether the io_uring engine has been set up in this process
+ */
+int uring_enabled(void)
+{
+    return ring.fd != -1;
+}
+
+/*!
+ * Send "count" bytes at offset "off" of file "fd" to socket "sock"
+ *
+ * @returns count on success, -1 on error
+ */
+ssize_t uring_sendfile(int sock, int fd, off_t off, size_t count,
+                       uring_sockwait_t sockwait, void *private)
+{
+    LOG(log_maxdebug, logtype_default, "uring_sendfile(fd: %d, off: %jd, count: %zu)",
+        fd, (intmax_t)off, count);
+
+    if (count == 0)
+        return 0;
+
+    return uring_transfer(fd, off, sock, -1, count, sockwait, private);
+}
+
+/*!
+ * Receive "count" bytes from socket "sock" and write them to file "fd" at offset "off"
+ *
+ * Unless reading from the socket fails, all "count" bytes are read from the
+ * socket, even if writing to the file fails.
+ *
+ * @returns number of bytes written to the file, on short writes errno is set,
+ *          -1 on socket errors
+ */
+ssize_t uring_recvfile(int sock, int fd, off_t off, size_t count,
+                       uring_sockwait_t sockwait, void *private)
+{
+    LOG(log_maxdebug, logtype_default, "uring_recvfile(fd: %d, off: %jd, count: %zu)",
+        fd, (intmax_t)off, count);
+
+    if (count == 0)
+        return 0;
+
+    return uring_transfer(sock, -1, fd, off, count, sockwait, private);
+}
+
+#endif /* WITH_IO_URING */
@@ -14,6 +14,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#if HAVE_DECL_FICLONE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <atalk/afp.h>
 #include <atalk/util.h>
@@ -131,38 +135,129 @@ int netatalk_unlink(const char *name)
  * *at semnatics support functions (like openat, renameat standard funcs)
  **************************************************************************/
 
-/* Copy all file data from one file fd to another */
-int copy_file_fd(int sfd, int dfd)
+#define COPY_BUFSIZE    (1024 * 1024)
+#define COPY_RANGE_MAX  (1024 * 1024 * 1024)
+
+/* Whether errno says that an offload method isn't supported for these files */
+static int copy_unsupported(int err)
+{
+    switch (err) {
+    case ENOSYS:
+    case EINVAL:
+    case EXDEV:
+    case EOPNOTSUPP:
+#if defined(ENOTSUP) && ENOTSUP != EOPNOTSUPP
+    case ENOTSUP:
+#endif
+    case ENOTTY:
+    case EBADF:
+    case EPERM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*!
+ * Copy the data of sfd from its file offset to the file offset of dfd
+ *
+ * The copy is offloaded to the filesystem if possible:
+ * 1) if both offsets are 0 and dfd is empty, clone the file (FICLONE reflink)
+ * 2) copy_file_range(), which can copy server side on NFS and SMB too
+ * 3) read/write with buf, or a buffer of COPY_BUFSIZE if buf is smaller
+ *
+ * Both offsets are at the end of the copied data afterwards.
+ *
+ * @param sfd    (r) source file
+ * @param dfd    (r) destination file
+ * @param buf    (r) buffer for 3), may be NULL
+ * @param buflen (r) size of buf
+ * @returns 0 on success, -1 on error with errno set
+ */
+int copy_file_data(int sfd, int dfd, char *buf, size_t buflen)
 {
     EC_INIT;
     ssize_t cc;
-    size_t  buflen;
-    char   filebuf[NETATALK_DIOSZ_STACK];
+    size_t  len;
+    char   *filebuf = NULL;
+    char    stackbuf[NETATALK_DIOSZ_STACK];
+
+#if HAVE_DECL_FICLONE
+    struct stat st;
+
+    if (lseek(sfd, 0, SEEK_CUR) == 0 && lseek(dfd, 0, SEEK_CUR) == 0
+        && fstat(dfd, &st) == 0 && st.st_size == 0) {
+        if (ioctl(dfd, FICLONE, sfd) == 0) {
+            if (fstat(sfd, &st) != 0
+                || lseek(sfd, st.st_size, SEEK_SET) == (off_t)-1
+                || lseek(dfd, st.st_size, SEEK_SET) == (off_t)-1)
+                EC_FAIL;
+            LOG(log_debug, logtype_afpd, "copy_file_data: cloned %jd bytes", (intmax_t)st.st_size);
+            goto EC_CLEANUP;
+        }
+        if (!copy_unsupported(errno)) {
+            LOG(log_error, logtype_afpd, "copy_file_data: FICLONE: %s", strerror(errno));
+            EC_FAIL;
+        }
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while ((cc = copy_file_range(sfd, NULL, dfd, NULL, COPY_RANGE_MAX, 0)) != 0) {
+        if (cc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (copy_unsupported(errno))
+                break;
+            LOG(log_error, logtype_afpd, "copy_file_data: copy_file_range: %s", strerror(errno));
+            EC_FAIL;
+        }
+    }
+    if (cc == 0)
+        goto EC_CLEANUP;
+#endif
 
-    while ((cc = read(sfd, filebuf, sizeof(filebuf)))) {
+    if (buf == NULL || buflen < COPY_BUFSIZE) {
+        if ((filebuf = malloc(COPY_BUFSIZE)) != NULL) {
+            buf = filebuf;
+            buflen = COPY_BUFSIZE;
+        } else if (buf == NULL || buflen < sizeof(stackbuf)) {
+            buf = stackbuf;
+            buflen = sizeof(stackbuf);
+        }
+    }
+
+    while ((cc = read(sfd, buf, buflen))) {
         if (cc < 0) {
             if (errno == EINTR)
                 continue;
-            LOG(log_error, logtype_afpd, "copy_file_fd: %s", strerror(errno));
+            LOG(log_error, logtype_afpd, "copy_file_data: %s", strerror(errno));
             EC_FAIL;
         }
 
-        buflen = cc;
-        while (buflen > 0) {
-            if ((cc = write(dfd, filebuf, buflen)) < 0) {
+        for (len = 0; len < (size_t)cc; ) {
+            ssize_t wc;
+            if ((wc = write(dfd, buf + len, cc - len)) < 0) {
                 if (errno == EINTR)
                     continue;
-                LOG(log_error, logtype_afpd, "copy_file_fd: %s", strerror(errno));
+                LOG(log_error, logtype_afpd, "copy_file_data: %s", strerror(errno));
                 EC_FAIL;
             }
-            buflen -= cc;
+            len += wc;
         }
     }
 
 EC_CLEANUP:
+    free(filebuf);
     EC_EXIT;
 }
 
+/* Copy all file data from one file fd to another */
+int copy_file_fd(int sfd, int dfd)
+{
+    return copy_file_data(sfd, dfd, NULL, 0);
+}
+
 /* 
  * Supports *at semantics if HAVE_ATFUNCS, pass dirfd=-1 to ignore this
  */
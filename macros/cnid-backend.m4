@@ -108,6 +108,29 @@ AC_DEFUN([AC_NETATALK_CNID], [
     fi
     AM_CONDITIONAL(USE_TDB_BACKEND, test x"$use_tdb_backend" = x"yes")
 
+    dnl Determine whether or not to use the memory mapped DID scheme
+    AC_MSG_CHECKING([whether or not to use mmap DID scheme])
+    AC_ARG_WITH(cnid-mmap-backend,
+	[  --with-cnid-mmap-backend	build memory mapped CNID scheme            [[yes]]],
+    [
+        if test x"$withval" = x"no"; then
+            use_mmap_backend=no
+        else
+            use_mmap_backend=yes
+        fi
+    ],[
+        use_mmap_backend=yes
+    ])
+
+    if test $use_mmap_backend = yes; then
+        AC_MSG_RESULT([yes])
+        AC_DEFINE(CNID_BACKEND_MMAP, 1, [Define if CNID mmap scheme backend should be compiled.])
+        compiled_backends="$compiled_backends mmap"
+    else
+        AC_MSG_RESULT([no])
+    fi
+    AM_CONDITIONAL(USE_MMAP_BACKEND, test x"$use_mmap_backend" = x"yes")
+
     dnl Check for mysql CNID backend
     AC_ARG_VAR(MYSQL_CFLAGS, [C compiler flags for MySQL, overriding checks])
     AC_ARG_VAR(MYSQL_LIBS, [linker flags for MySQL, overriding checks])
@@ -1219,6 +1219,33 @@ if test x"$atalk_cv_use_recvfile" = x"yes"; then
 fi
 ])
 
+dnl --------------------- Check for io_uring
+AC_DEFUN([AC_NETATALK_IO_URING], [
+    AC_ARG_ENABLE(
+        io-uring,
+        AS_HELP_STRING([--disable-io-uring], [disable the io_uring engine for FPRead/FPWrite (default: enabled if supported)]),
+        enable_io_uring=$enableval,
+        enable_io_uring=yes
+    )
+
+    atalk_cv_use_io_uring=no
+    if test x"$enable_io_uring" = x"yes" -a x"$netatalk_cv_HAVE_SENDFILE" = x"yes" -a x"$atalk_cv_use_recvfile" = x"yes"; then
+        AC_CHECK_HEADER([linux/io_uring.h], [
+            AC_CHECK_DECLS([__NR_io_uring_setup], [], [], [#include <sys/syscall.h>])
+            AC_CHECK_DECLS([IORING_OP_SEND], [atalk_cv_use_io_uring=yes], [], [#include <linux/io_uring.h>])
+        ])
+        if test x"$ac_cv_have_decl___NR_io_uring_setup" != x"yes"; then
+            atalk_cv_use_io_uring=no
+        fi
+    fi
+
+    AC_MSG_CHECKING([whether to enable the io_uring engine])
+    AC_MSG_RESULT([$atalk_cv_use_io_uring])
+    if test x"$atalk_cv_use_io_uring" = x"yes"; then
+        AC_DEFINE(WITH_IO_URING, 1, [Whether io_uring should be used])
+    fi
+])
+
 dnl --------------------- Check if realpath() takes NULL
 AC_DEFUN([AC_NETATALK_REALPATH], [
 AC_CACHE_CHECK([if the realpath function allows a NULL argument],
@@ -12,7 +12,7 @@ AC_DEFUN([AC_NETATALK_CONFIG_SUMMARY], [
 	AC_MSG_RESULT([    AFP:])
 	AC_MSG_RESULT([         Extended Attributes: $neta_cv_eas])
 	AC_MSG_RESULT([         ACL support: $ac_cv_have_acls])
-	AC_MSG_RESULT([         Spotlight: $ac_cv_have_tracker])
+	AC_MSG_RESULT([         Spotlight Tracker backend: $ac_cv_have_tracker])
 	AC_MSG_RESULT([    CNID:])
 	AC_MSG_RESULT([         backends: $compiled_backends])
 	AC_MSG_RESULT([    UAMS:])
@@ -55,6 +55,7 @@ dnl	AC_MSG_RESULT([         Samba sharemode interop: $neta_cv_have_smbshmd])
 	AC_MSG_RESULT([         LDAP support:            $netatalk_cv_ldap])
 	AC_MSG_RESULT([         AFP stats via dbus:      $atalk_cv_with_dbus])
 	AC_MSG_RESULT([         dtrace probes:           $WDTRACE])
+	AC_MSG_RESULT([         io_uring:                $atalk_cv_use_io_uring])
 	AC_MSG_RESULT([    Paths:])
 	AC_MSG_RESULT([         Netatalk lockfile:       $ac_cv_netatalk_lock])
 	if test "x$init_style" != x"none"; then
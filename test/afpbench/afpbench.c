@@ -0,0 +1,1124 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYING.
+ *
+ * afpbench: AFP load generator and latency benchmark
+ * ==================================================
+ *
+ * Connects N sessions via DSI to an afpd, each session works in its own
+ * directory on the volume and runs the selected workloads one after another:
+ *
+ *   enum      enumerate a directory tree with FPEnumerateExt2
+ *   stat      FPGetFileDirParms on files in a directory
+ *   read      sequential FPReadExt of a file
+ *   write     sequential FPWriteExt to a file
+ *   create    create, write 4 KB to and delete small files
+ *   catsearch FPCatSearchExt for a partial file name
+ *
+ * The setup and cleanup of a workload isn't measured. For every AFP command
+ * sent while a workload runs the latency is recorded, afpbench reports the
+ * request rate and latency percentiles per command.
+ *
+ * afpbench.sh starts an afpd from the build tree on the loopback interface
+ * and runs afpbench against it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <atalk/afp.h>
+
+/* DSI, see include/atalk/dsi.h */
+#define DSI_BLOCKSIZ    16
+#define DSIFL_REQUEST   0x00
+#define DSIFL_REPLY     0x01
+#define DSIFUNC_CLOSE   1
+#define DSIFUNC_CMD     2
+#define DSIFUNC_OPEN    4
+#define DSIFUNC_TICKLE  5
+#define DSIFUNC_WRITE   6
+#define DSIOPT_SERVQUANT 0x00
+#define DSIOPT_ATTNQUANT 0x01
+
+/* file and directory parameter bits, see etc/afpd/file.h and directory.h */
+#define PBIT_ATTR       (1 << 0)
+#define PBIT_PDID       (1 << 1)
+#define PBIT_CDATE      (1 << 2)
+#define PBIT_MDATE      (1 << 3)
+#define PBIT_FINFO      (1 << 5)
+#define PBIT_FNUM       (1 << 8)    /* DIRPBIT_DID for directories */
+#define PBIT_DFLEN      (1 << 9)    /* DIRPBIT_OFFCNT for directories */
+#define PBIT_RFLEN      (1 << 10)   /* DIRPBIT_UID for directories */
+#define PBIT_GID        (1 << 11)
+#define PBIT_ACCESS     (1 << 12)
+#define PBIT_UTF8NAME   (1 << 13)
+#define FILDIRBIT_ISDIR (1 << 7)
+
+/* what the Finder asks for */
+#define FILE_BITMAP (PBIT_ATTR | PBIT_PDID | PBIT_CDATE | PBIT_MDATE | PBIT_FINFO \
+                     | PBIT_FNUM | PBIT_DFLEN | PBIT_RFLEN | PBIT_UTF8NAME)
+#define DIR_BITMAP  (PBIT_ATTR | PBIT_PDID | PBIT_CDATE | PBIT_MDATE | PBIT_FINFO \
+                     | PBIT_FNUM | PBIT_DFLEN | PBIT_RFLEN | PBIT_GID | PBIT_ACCESS | PBIT_UTF8NAME)
+/* offset of the directory ID in an enumerated directory, after attr, pdid, cdate, mdate, finfo */
+#define DIR_DID_OFF (2 + 4 + 4 + 4 + 32)
+
+#define DIRID_ROOT      2
+#define UTF8_HINT       0x08000103
+#define OPENACC_RD      (1 << 0)
+#define OPENACC_WR      (1 << 1)
+#define SMALLFILE_SIZE  4096
+
+#define BENCH_IOERR     1           /* not an AFP error code */
+#define NCMDS           256
+
+/* latencies of one AFP command in nanoseconds */
+struct lat {
+    uint64_t *ns;
+    size_t    n;
+    size_t    size;
+};
+
+struct obj {
+    uint32_t did;
+    char     name[48];
+};
+
+struct session {
+    int         id;
+    int         sock;
+    int         failed;
+    int         measure;
+    uint16_t    reqid;
+    uint16_t    vid;
+    uint32_t    wdid;               /* work directory */
+    char        wname[48];
+    char       *buf;                /* reply buffer */
+    size_t      bufsize;
+    char       *data;               /* data for FPWriteExt */
+    uint64_t    ops;                /* workload iterations */
+    uint64_t    counter;
+    uint64_t    pos;
+    uint16_t    fork;
+    struct obj *objs;               /* created objects, deleted in reverse order */
+    size_t      nobjs, objsize;
+    uint32_t   *stack;
+    size_t      stacksize;
+    struct lat  lat[NCMDS];
+    pthread_t   tid;
+};
+
+struct workload {
+    const char *name;
+    int (*setup)(struct session *);
+    int (*run)(struct session *);
+};
+
+static const char *host = "127.0.0.1";
+static const char *port = "548";
+static const char *user;
+static const char *passwd = "";
+static const char *volname;
+static int nsessions = 4;
+static int duration = 10;
+static long count;                  /* iterations per session instead of duration */
+static size_t blocksize = 128 * 1024;
+static uint64_t filesize = 64 * 1024 * 1024;
+static int depth = 2, fanout = 4, nfiles = 32;
+static const char *workloads = "enum,stat,read,write,create,catsearch";
+
+static volatile int stop;
+static pthread_barrier_t barrier;
+static const struct workload *wltab;
+static int nwl;
+
+/****************************************************************************
+ * Helpers
+ ****************************************************************************/
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *cmdname(int cmd)
+{
+    switch (cmd) {
+    case AFP_CLOSEFORK:      return "FPCloseFork";
+    case AFP_CREATEDIR:      return "FPCreateDir";
+    case AFP_CREATEFILE:     return "FPCreateFile";
+    case AFP_DELETE:         return "FPDelete";
+    case AFP_LOGIN:          return "FPLogin";
+    case AFP_LOGOUT:         return "FPLogout";
+    case AFP_OPENVOL:        return "FPOpenVol";
+    case AFP_OPENFORK:       return "FPOpenFork";
+    case AFP_GETFLDRPARAM:   return "FPGetFileDirParms";
+    case AFP_READ_EXT:       return "FPReadExt";
+    case AFP_WRITE_EXT:      return "FPWriteExt";
+    case AFP_CATSEARCH_EXT:  return "FPCatSearchExt";
+    case AFP_ENUMERATE_EXT2: return "FPEnumerateExt2";
+    default:                 return "?";
+    }
+}
+
+static void lat_add(struct lat *l, uint64_t ns)
+{
+    uint64_t *tmp;
+
+    if (l->n == l->size) {
+        size_t size = l->size ? l->size * 2 : 4096;
+        if ((tmp = realloc(l->ns, size * sizeof(uint64_t))) == NULL)
+            return;
+        l->ns = tmp;
+        l->size = size;
+    }
+    l->ns[l->n++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Parameter block of an AFP request */
+struct pbuf {
+    char   b[1024];
+    size_t len;
+};
+
+static void put8(struct pbuf *p, uint8_t v)
+{
+    p->b[p->len++] = v;
+}
+
+static void put16(struct pbuf *p, uint16_t v)
+{
+    v = htons(v);
+    memcpy(p->b + p->len, &v, 2);
+    p->len += 2;
+}
+
+static void put32(struct pbuf *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p->b + p->len, &v, 4);
+    p->len += 4;
+}
+
+static void put64(struct pbuf *p, uint64_t v)
+{
+    put32(p, v >> 32);
+    put32(p, v & 0xffffffff);
+}
+
+static void putpstr(struct pbuf *p, const char *s)
+{
+    size_t len = strlen(s);
+    put8(p, len);
+    memcpy(p->b + p->len, s, len);
+    p->len += len;
+}
+
+/* UTF8 pathname */
+static void putpath(struct pbuf *p, const char *name)
+{
+    size_t len = strlen(name);
+    put8(p, 3);
+    put32(p, UTF8_HINT);
+    put16(p, len);
+    memcpy(p->b + p->len, name, len);
+    p->len += len;
+}
+
+static uint16_t get16(const char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static uint32_t get32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+/****************************************************************************
+ * DSI
+ ****************************************************************************/
+
+static int writeallv(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t len;
+
+    while (iovcnt > 0) {
+        if ((len = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    return 0;
+}
+
+static int readall(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    size_t stored = 0;
+
+    while (stored < len) {
+        if ((n = read(fd, (char *)buf + stored, len - stored)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        stored += n;
+    }
+    return 0;
+}
+
+/* Read and drop len bytes */
+static int skip(struct session *s, size_t len)
+{
+    while (len > 0) {
+        size_t n = len > s->bufsize ? s->bufsize : len;
+        if (readall(s->sock, s->buf, n) != 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/*!
+ * Send a DSI request and wait for the reply
+ *
+ * The reply data is stored in s->buf, truncated to s->bufsize. Requests from
+ * the server (tickles, attentions) are ignored.
+ *
+ * @returns 0 and the DSI error code in *code, -1 on I/O errors
+ */
+static int dsi_request(struct session *s, uint8_t cmd,
+                       const void *params, size_t plen, const void *data, size_t dlen,
+                       int32_t *code, size_t *rlen)
+{
+    unsigned char hdr[DSI_BLOCKSIZ];
+    struct iovec iov[3];
+    uint16_t reqid = ++s->reqid;
+    uint32_t len;
+
+    hdr[0] = DSIFL_REQUEST;
+    hdr[1] = cmd;
+    *(uint16_t *)(hdr + 2) = htons(reqid);
+    *(uint32_t *)(hdr + 4) = htonl(cmd == DSIFUNC_WRITE ? plen : 0);
+    *(uint32_t *)(hdr + 8) = htonl(plen + dlen);
+    *(uint32_t *)(hdr + 12) = 0;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)params;
+    iov[1].iov_len = plen;
+    iov[2].iov_base = (void *)data;
+    iov[2].iov_len = dlen;
+    if (writeallv(s->sock, iov, dlen ? 3 : 2) != 0)
+        return -1;
+
+    while (1) {
+        if (readall(s->sock, hdr, sizeof(hdr)) != 0)
+            return -1;
+        len = ntohl(*(uint32_t *)(hdr + 8));
+
+        if (hdr[0] != DSIFL_REPLY || ntohs(*(uint16_t *)(hdr + 2)) != reqid) {
+            if (skip(s, len) != 0)
+                return -1;
+            continue;
+        }
+
+        *code = (int32_t)ntohl(*(uint32_t *)(hdr + 4));
+        *rlen = len > s->bufsize ? s->bufsize : len;
+        if (readall(s->sock, s->buf, *rlen) != 0 || skip(s, len - *rlen) != 0)
+            return -1;
+        return 0;
+    }
+}
+
+/*!
+ * Send an AFP command and record its latency
+ *
+ * @returns AFP result code, BENCH_IOERR on I/O errors
+ */
+static int afp_call(struct session *s, const struct pbuf *p, const void *data, size_t dlen,
+                    size_t *rlen)
+{
+    uint64_t start;
+    int32_t code;
+    size_t len;
+
+    start = now_ns();
+    if (dsi_request(s, dlen ? DSIFUNC_WRITE : DSIFUNC_CMD, p->b, p->len, data, dlen,
+                    &code, rlen ? rlen : &len) != 0) {
+        fprintf(stderr, "session %d: %s: %s\n", s->id, cmdname((uint8_t)p->b[0]),
+                errno ? strerror(errno) : "connection closed");
+        return BENCH_IOERR;
+    }
+    if (s->measure)
+        lat_add(&s->lat[(uint8_t)p->b[0]], now_ns() - start);
+
+    return code;
+}
+
+static int check(struct session *s, const struct pbuf *p, int ret, const char *what)
+{
+    if (ret == AFP_OK)
+        return 0;
+    if (ret != BENCH_IOERR)
+        fprintf(stderr, "session %d: %s %s: error %d\n", s->id, cmdname((uint8_t)p->b[0]),
+                what ? what : "", ret);
+    s->failed = 1;
+    return -1;
+}
+
+static int dsi_connect(struct session *s)
+{
+    struct addrinfo hints, *res, *ai;
+    unsigned char opt[6] = {DSIOPT_ATTNQUANT, 4, 0, 0, 0x40, 0};
+    size_t rlen, i;
+    int32_t code;
+    int flag = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve %s:%s\n", host, port);
+        return -1;
+    }
+    s->sock = -1;
+    for (ai = res; ai && s->sock == -1; ai = ai->ai_next) {
+        if ((s->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+            continue;
+        if (connect(s->sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(s->sock);
+            s->sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (s->sock == -1) {
+        fprintf(stderr, "session %d: can't connect to %s:%s: %s\n", s->id, host, port, strerror(errno));
+        return -1;
+    }
+    setsockopt(s->sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if (dsi_request(s, DSIFUNC_OPEN, opt, sizeof(opt), NULL, 0, &code, &rlen) != 0 || code != 0) {
+        fprintf(stderr, "session %d: DSIOpenSession failed\n", s->id);
+        return -1;
+    }
+
+    /* don't send more than the server quantum with FPWriteExt */
+    for (i = 0; i + 2 <= rlen; i += 2 + (uint8_t)s->buf[i + 1]) {
+        if (s->buf[i] == DSIOPT_SERVQUANT && (uint8_t)s->buf[i + 1] == 4
+            && i + 6 <= rlen && get32(s->buf + i + 2) < blocksize + 64) {
+            blocksize = get32(s->buf + i + 2) - 64;
+            fprintf(stderr, "block size limited to %zu by server quantum\n", blocksize);
+        }
+    }
+
+    return 0;
+}
+
+/* Send DSICloseSession, there's no reply */
+static void dsi_disconnect(struct session *s)
+{
+    unsigned char hdr[DSI_BLOCKSIZ];
+    struct iovec iov[1];
+
+    if (s->sock == -1)
+        return;
+
+    memset(hdr, 0, sizeof(hdr));
+    hdr[1] = DSIFUNC_CLOSE;
+    *(uint16_t *)(hdr + 2) = htons(++s->reqid);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    (void)writeallv(s->sock, iov, 1);
+    close(s->sock);
+    s->sock = -1;
+}
+
+/****************************************************************************
+ * AFP commands
+ ****************************************************************************/
+
+static int fp_login(struct session *s)
+{
+    struct pbuf p = {.len = 0};
+    char pw[8];
+
+    put8(&p, AFP_LOGIN);
+    putpstr(&p, "AFP3.4");
+    if (user == NULL) {
+        putpstr(&p, "No User Authent");
+    } else {
+        putpstr(&p, "Cleartxt Passwrd");
+        putpstr(&p, user);
+        if (p.len & 1)
+            put8(&p, 0);
+        memset(pw, 0, sizeof(pw));
+        memcpy(pw, passwd, strnlen(passwd, sizeof(pw)));
+        memcpy(p.b + p.len, pw, sizeof(pw));
+        p.len += sizeof(pw);
+    }
+    return check(s, &p, afp_call(s, &p, NULL, 0, NULL), user);
+}
+
+static int fp_openvol(struct session *s)
+{
+    struct pbuf p = {.len = 0};
+    size_t rlen;
+    int ret;
+
+    put8(&p, AFP_OPENVOL);
+    put8(&p, 0);
+    put16(&p, 1 << 5);          /* VOLPBIT_VID */
+    putpstr(&p, volname);
+    if ((ret = check(s, &p, afp_call(s, &p, NULL, 0, &rlen), volname)) != 0)
+        return ret;
+    if (rlen < 4) {
+        s->failed = 1;
+        return -1;
+    }
+    memcpy(&s->vid, s->buf + 2, 2); /* network order */
+    return 0;
+}
+
+static void fp_logout(struct session *s)
+{
+    struct pbuf p = {.len = 0};
+
+    put8(&p, AFP_LOGOUT);
+    put8(&p, 0);
+    (void)afp_call(s, &p, NULL, 0, NULL);
+}
+
+/* Prepare a request with a volume, directory and path */
+static void put_vdp(struct pbuf *p, uint8_t cmd, uint8_t flag, struct session *s, uint32_t did)
+{
+    put8(p, cmd);
+    put8(p, flag);
+    memcpy(p->b + p->len, &s->vid, 2);
+    p->len += 2;
+    put32(p, did);
+}
+
+static void remember(struct session *s, uint32_t did, const char *name)
+{
+    struct obj *tmp;
+
+    if (s->nobjs == s->objsize) {
+        size_t size = s->objsize ? s->objsize * 2 : 64;
+        if ((tmp = realloc(s->objs, size * sizeof(struct obj))) == NULL)
+            return;
+        s->objs = tmp;
+        s->objsize = size;
+    }
+    s->objs[s->nobjs].did = did;
+    strncpy(s->objs[s->nobjs].name, name, sizeof(s->objs[0].name) - 1);
+    s->objs[s->nobjs].name[sizeof(s->objs[0].name) - 1] = 0;
+    s->nobjs++;
+}
+
+static int fp_createdir(struct session *s, uint32_t did, const char *name, uint32_t *newdid)
+{
+    struct pbuf p = {.len = 0};
+    size_t rlen;
+
+    put_vdp(&p, AFP_CREATEDIR, 0, s, did);
+    putpath(&p, name);
+    if (check(s, &p, afp_call(s, &p, NULL, 0, &rlen), name) != 0 || rlen < 4)
+        return -1;
+    *newdid = get32(s->buf);
+    return 0;
+}
+
+static int fp_createfile(struct session *s, uint32_t did, const char *name)
+{
+    struct pbuf p = {.len = 0};
+
+    put_vdp(&p, AFP_CREATEFILE, 0x80, s, did); /* hard create */
+    putpath(&p, name);
+    return check(s, &p, afp_call(s, &p, NULL, 0, NULL), name);
+}
+
+static int fp_delete(struct session *s, uint32_t did, const char *name)
+{
+    struct pbuf p = {.len = 0};
+
+    put_vdp(&p, AFP_DELETE, 0, s, did);
+    putpath(&p, name);
+    return check(s, &p, afp_call(s, &p, NULL, 0, NULL), name);
+}
+
+static int fp_openfork(struct session *s, uint32_t did, const char *name, uint16_t access,
+                       uint16_t *fork)
+{
+    struct pbuf p = {.len = 0};
+    size_t rlen;
+
+    put_vdp(&p, AFP_OPENFORK, 0, s, did); /* data fork */
+    put16(&p, 0);
+    put16(&p, access);
+    putpath(&p, name);
+    if (check(s, &p, afp_call(s, &p, NULL, 0, &rlen), name) != 0 || rlen < 4)
+        return -1;
+    memcpy(fork, s->buf + 2, 2); /* network order */
+    return 0;
+}
+
+static int fp_closefork(struct session *s, uint16_t fork)
+{
+    struct pbuf p = {.len = 0};
+
+    put8(&p, AFP_CLOSEFORK);
+    put8(&p, 0);
+    memcpy(p.b + p.len, &fork, 2);
+    p.len += 2;
+    return check(s, &p, afp_call(s, &p, NULL, 0, NULL), NULL);
+}
+
+static int fp_readext(struct session *s, uint16_t fork, uint64_t off, uint64_t len)
+{
+    struct pbuf p = {.len = 0};
+    int ret;
+
+    put8(&p, AFP_READ_EXT);
+    put8(&p, 0);
+    memcpy(p.b + p.len, &fork, 2);
+    p.len += 2;
+    put64(&p, off);
+    put64(&p, len);
+    ret = afp_call(s, &p, NULL, 0, NULL);
+    if (ret == AFPERR_EOF)
+        ret = AFP_OK;
+    return check(s, &p, ret, NULL);
+}
+
+static int fp_writeext(struct session *s, uint16_t fork, uint64_t off, const char *data, size_t len)
+{
+    struct pbuf p = {.len = 0};
+
+    put8(&p, AFP_WRITE_EXT);
+    put8(&p, 0);
+    memcpy(p.b + p.len, &fork, 2);
+    p.len += 2;
+    put64(&p, off);
+    put64(&p, len);
+    return check(s, &p, afp_call(s, &p, data, len, NULL), NULL);
+}
+
+static int fp_getfiledirparms(struct session *s, uint32_t did, const char *name)
+{
+    struct pbuf p = {.len = 0};
+
+    put_vdp(&p, AFP_GETFLDRPARAM, 0, s, did);
+    put16(&p, FILE_BITMAP);
+    put16(&p, DIR_BITMAP);
+    putpath(&p, name);
+    return check(s, &p, afp_call(s, &p, NULL, 0, NULL), name);
+}
+
+static int push(struct session *s, size_t *n, uint32_t did)
+{
+    uint32_t *tmp;
+
+    if (*n == s->stacksize) {
+        size_t size = s->stacksize ? s->stacksize * 2 : 64;
+        if ((tmp = realloc(s->stack, size * sizeof(uint32_t))) == NULL)
+            return -1;
+        s->stack = tmp;
+        s->stacksize = size;
+    }
+    s->stack[(*n)++] = did;
+    return 0;
+}
+
+/* Enumerate the tree below did, depth first */
+static int enumerate_tree(struct session *s, uint32_t did)
+{
+    struct pbuf p;
+    size_t n = 0, rlen, off;
+    uint32_t sindex;
+    uint16_t cnt, elen;
+    int ret;
+
+    if (push(s, &n, did) != 0)
+        return -1;
+
+    while (n > 0) {
+        did = s->stack[--n];
+        for (sindex = 1; ; sindex += cnt) {
+            p.len = 0;
+            put_vdp(&p, AFP_ENUMERATE_EXT2, 0, s, did);
+            put16(&p, FILE_BITMAP);
+            put16(&p, DIR_BITMAP);
+            put16(&p, 1024);
+            put32(&p, sindex);
+            put32(&p, 65536);
+            putpath(&p, "");
+            ret = afp_call(s, &p, NULL, 0, &rlen);
+            if (ret == AFPERR_NOOBJ)
+                break;
+            if (check(s, &p, ret, NULL) != 0 || rlen < 6)
+                return -1;
+            if ((cnt = get16(s->buf + 4)) == 0)
+                break;
+            for (off = 6; off + 4 <= rlen; off += elen) {
+                if ((elen = get16(s->buf + off)) < 4)
+                    break;
+                if ((s->buf[off + 2] & FILDIRBIT_ISDIR) && off + 4 + DIR_DID_OFF + 4 <= rlen)
+                    if (push(s, &n, get32(s->buf + off + 4 + DIR_DID_OFF)) != 0)
+                        return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Search the volume for names containing name */
+static int fp_catsearch(struct session *s, const char *name)
+{
+    struct pbuf p;
+    char catpos[16];
+    size_t rlen, len = strlen(name);
+    int ret;
+
+    memset(catpos, 0, sizeof(catpos));
+    while (1) {
+        p.len = 0;
+        put8(&p, AFP_CATSEARCH_EXT);
+        put8(&p, 0);
+        memcpy(p.b + p.len, &s->vid, 2);
+        p.len += 2;
+        put32(&p, 256);                         /* requested matches */
+        put32(&p, 0);
+        memcpy(p.b + p.len, catpos, sizeof(catpos));
+        p.len += sizeof(catpos);
+        put16(&p, PBIT_PDID | PBIT_UTF8NAME);   /* file bitmap */
+        put16(&p, PBIT_PDID | PBIT_UTF8NAME);   /* directory bitmap */
+        put32(&p, 0x80000000 | PBIT_UTF8NAME);  /* partial name match */
+        /* specification 1: name offset, hint, length, name */
+        put16(&p, 8 + len);
+        put16(&p, 2);
+        put32(&p, UTF8_HINT);
+        put16(&p, len);
+        memcpy(p.b + p.len, name, len);
+        p.len += len;
+        /* specification 2 */
+        put16(&p, 8 + len);
+        memset(p.b + p.len, 0, 8 + len);
+        p.len += 8 + len;
+
+        ret = afp_call(s, &p, NULL, 0, &rlen);
+        if (ret == AFPERR_EOF)
+            return 0;
+        if (check(s, &p, ret, name) != 0 || rlen < 16)
+            return -1;
+        memcpy(catpos, s->buf, sizeof(catpos));
+    }
+}
+
+/****************************************************************************
+ * Workloads
+ ****************************************************************************/
+
+static int make_tree(struct session *s, uint32_t did, int level)
+{
+    char name[48];
+    uint32_t sub;
+    int i;
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof(name), "file-%d", i);
+        if (fp_createfile(s, did, name) != 0)
+            return -1;
+        remember(s, did, name);
+    }
+    if (level >= depth)
+        return 0;
+    for (i = 0; i < fanout; i++) {
+        snprintf(name, sizeof(name), "dir-%d", i);
+        if (fp_createdir(s, did, name, &sub) != 0)
+            return -1;
+        remember(s, did, name);
+        if (make_tree(s, sub, level + 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int enum_setup(struct session *s)
+{
+    return make_tree(s, s->wdid, 0);
+}
+
+static int enum_run(struct session *s)
+{
+    return enumerate_tree(s, s->wdid);
+}
+
+static int stat_setup(struct session *s)
+{
+    return make_tree(s, s->wdid, depth);
+}
+
+static int stat_run(struct session *s)
+{
+    char name[48];
+
+    snprintf(name, sizeof(name), "file-%d", (int)(s->counter++ % nfiles));
+    return fp_getfiledirparms(s, s->wdid, name);
+}
+
+/* Create and open the read/write file, fill it for reading */
+static int rw_setup(struct session *s, int fill)
+{
+    uint64_t off;
+
+    if (fp_createfile(s, s->wdid, "bench.dat") != 0)
+        return -1;
+    remember(s, s->wdid, "bench.dat");
+    if (fp_openfork(s, s->wdid, "bench.dat", OPENACC_RD | OPENACC_WR, &s->fork) != 0)
+        return -1;
+    if (fill) {
+        for (off = 0; off < filesize; off += blocksize)
+            if (fp_writeext(s, s->fork, off, s->data, blocksize) != 0)
+                return -1;
+    }
+    s->pos = 0;
+    return 0;
+}
+
+static int read_setup(struct session *s)
+{
+    return rw_setup(s, 1);
+}
+
+static int write_setup(struct session *s)
+{
+    return rw_setup(s, 0);
+}
+
+static int read_run(struct session *s)
+{
+    if (s->pos + blocksize > filesize)
+        s->pos = 0;
+    if (fp_readext(s, s->fork, s->pos, blocksize) != 0)
+        return -1;
+    s->pos += blocksize;
+    return 0;
+}
+
+static int write_run(struct session *s)
+{
+    if (s->pos + blocksize > filesize)
+        s->pos = 0;
+    if (fp_writeext(s, s->fork, s->pos, s->data, blocksize) != 0)
+        return -1;
+    s->pos += blocksize;
+    return 0;
+}
+
+static int create_setup(struct session *s _U_)
+{
+    return 0;
+}
+
+static int create_run(struct session *s)
+{
+    char name[48];
+    uint16_t fork;
+
+    snprintf(name, sizeof(name), "small-%llu", (unsigned long long)s->counter++);
+    if (fp_createfile(s, s->wdid, name) != 0
+        || fp_openfork(s, s->wdid, name, OPENACC_WR, &fork) != 0
+        || fp_writeext(s, fork, 0, s->data, SMALLFILE_SIZE) != 0
+        || fp_closefork(s, fork) != 0
+        || fp_delete(s, s->wdid, name) != 0)
+        return -1;
+    return 0;
+}
+
+static int catsearch_setup(struct session *s)
+{
+    char name[48];
+    int i;
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof(name), "needle-%d-%d", s->id, i);
+        if (fp_createfile(s, s->wdid, name) != 0)
+            return -1;
+        remember(s, s->wdid, name);
+    }
+    return 0;
+}
+
+static int catsearch_run(struct session *s)
+{
+    return fp_catsearch(s, "needle");
+}
+
+static const struct workload workload_tab[] = {
+    {"enum",      enum_setup,      enum_run},
+    {"stat",      stat_setup,      stat_run},
+    {"read",      read_setup,      read_run},
+    {"write",     write_setup,     write_run},
+    {"create",    create_setup,    create_run},
+    {"catsearch", catsearch_setup, catsearch_run},
+};
+
+static void cleanup(struct session *s)
+{
+    int measure = s->measure;
+
+    s->measure = 0;
+    if (s->fork) {
+        (void)fp_closefork(s, s->fork);
+        s->fork = 0;
+    }
+    while (s->nobjs > 0) {
+        s->nobjs--;
+        (void)fp_delete(s, s->objs[s->nobjs].did, s->objs[s->nobjs].name);
+    }
+    s->measure = measure;
+}
+
+/****************************************************************************
+ * Sessions and reporting
+ ****************************************************************************/
+
+static void *session_thread(void *arg)
+{
+    struct session *s = arg;
+    long i;
+    int w;
+
+    if (dsi_connect(s) != 0 || fp_login(s) != 0 || fp_openvol(s) != 0) {
+        s->failed = 1;
+    } else {
+        snprintf(s->wname, sizeof(s->wname), "afpbench-%d-%d", (int)getpid(), s->id);
+        if (fp_createdir(s, DIRID_ROOT, s->wname, &s->wdid) != 0)
+            s->failed = 1;
+    }
+
+    for (w = 0; w < nwl; w++) {
+        s->counter = 0;
+        s->ops = 0;
+        if (!s->failed && wltab[w].setup(s) != 0)
+            s->failed = 1;
+
+        pthread_barrier_wait(&barrier);     /* setup done */
+
+        s->measure = 1;
+        for (i = 0; !s->failed && !stop && (count == 0 || i < count); i++) {
+            if (wltab[w].run(s) != 0)
+                s->failed = 1;
+            else
+                s->ops++;
+        }
+        s->measure = 0;
+
+        pthread_barrier_wait(&barrier);     /* run done */
+        pthread_barrier_wait(&barrier);     /* results reported */
+
+        if (s->sock != -1)
+            cleanup(s);
+    }
+
+    if (s->sock != -1) {
+        if (s->wdid)
+            (void)fp_delete(s, DIRID_ROOT, s->wname);
+        fp_logout(s);
+        dsi_disconnect(s);
+    }
+    return NULL;
+}
+
+static void report(const char *name, struct session *sess, double secs)
+{
+    struct lat all;
+    uint64_t ops = 0, total = 0;
+    int i, c, failed = 0;
+
+    for (i = 0; i < nsessions; i++) {
+        ops += sess[i].ops;
+        failed += sess[i].failed;
+    }
+
+    printf("\n%s: %d sessions, %.1f s, %llu ops, %.1f ops/s%s\n",
+           name, nsessions, secs, (unsigned long long)ops, ops / secs,
+           failed ? " (sessions failed)" : "");
+    printf("  %-20s %10s %10s %10s %10s %10s %10s\n",
+           "command", "count", "req/s", "p50 us", "p99 us", "p999 us", "max us");
+
+    for (c = 0; c < NCMDS; c++) {
+        all.n = 0;
+        for (i = 0; i < nsessions; i++)
+            all.n += sess[i].lat[c].n;
+        if (all.n == 0)
+            continue;
+        if ((all.ns = malloc(all.n * sizeof(uint64_t))) == NULL)
+            continue;
+        all.size = 0;
+        for (i = 0; i < nsessions; i++) {
+            memcpy(all.ns + all.size, sess[i].lat[c].ns, sess[i].lat[c].n * sizeof(uint64_t));
+            all.size += sess[i].lat[c].n;
+            sess[i].lat[c].n = 0;
+        }
+        qsort(all.ns, all.n, sizeof(uint64_t), cmp_u64);
+        total += all.n;
+
+        printf("  %-20s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               cmdname(c), all.n, all.n / secs,
+               all.ns[(size_t)(0.5 * (all.n - 1))] / 1000.0,
+               all.ns[(size_t)(0.99 * (all.n - 1))] / 1000.0,
+               all.ns[(size_t)(0.999 * (all.n - 1))] / 1000.0,
+               all.ns[all.n - 1] / 1000.0);
+        free(all.ns);
+    }
+    printf("  %-20s %10llu %10.1f\n", "total", (unsigned long long)total, total / secs);
+    fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-h host] [-p port] [-u user [-w password]] -V volume [-n sessions]\n"
+           "       [-t seconds | -c count] [-W workloads] [-b blocksize] [-s filesize]\n"
+           "       [-d depth] [-f fanout] [-F files]\n"
+           "\n"
+           "  -W   comma separated list of workloads, default: %s\n"
+           "  -t   run each workload for seconds (default 10)\n"
+           "  -c   run each workload count times per session\n"
+           "  -b   FPReadExt/FPWriteExt block size (default 131072)\n"
+           "  -s   size of the read/write file (default 64 MB)\n"
+           "  -d, -f, -F  depth, subdirectories and files per directory of the\n"
+           "       enumerated tree (default 2, 4, 32)\n"
+           "\nWithout -u the guest UAM is used.\n",
+           name, workloads);
+}
+
+int main(int argc, char **argv)
+{
+    struct workload wl[sizeof(workload_tab) / sizeof(workload_tab[0])];
+    struct session *sess;
+    char *list, *tok, *save;
+    uint64_t start;
+    size_t i;
+    int opt, w;
+
+    while ((opt = getopt(argc, argv, "h:p:u:w:V:n:t:c:W:b:s:d:f:F:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'u': user = optarg; break;
+        case 'w': passwd = optarg; break;
+        case 'V': volname = optarg; break;
+        case 'n': nsessions = atoi(optarg); break;
+        case 't': duration = atoi(optarg); break;
+        case 'c': count = atol(optarg); break;
+        case 'W': workloads = optarg; break;
+        case 'b': blocksize = strtoul(optarg, NULL, 0); break;
+        case 's': filesize = strtoull(optarg, NULL, 0); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'f': fanout = atoi(optarg); break;
+        case 'F': nfiles = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (volname == NULL || nsessions < 1 || blocksize < SMALLFILE_SIZE || filesize < blocksize
+        || (duration < 1 && count < 1) || nfiles < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    list = strdup(workloads);
+    for (nwl = 0, tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < sizeof(workload_tab) / sizeof(workload_tab[0]); i++)
+            if (strcmp(tok, workload_tab[i].name) == 0)
+                break;
+        if (i == sizeof(workload_tab) / sizeof(workload_tab[0])
+            || nwl == sizeof(wl) / sizeof(wl[0])) {
+            fprintf(stderr, "unknown workload: %s\n", tok);
+            return 1;
+        }
+        wl[nwl++] = workload_tab[i];
+    }
+    wltab = wl;
+
+    if ((sess = calloc(nsessions, sizeof(struct session))) == NULL)
+        return 1;
+    pthread_barrier_init(&barrier, NULL, nsessions + 1);
+
+    for (w = 0; w < nsessions; w++) {
+        sess[w].id = w;
+        sess[w].sock = -1;
+        sess[w].bufsize = blocksize + 65536 + 1024;
+        if ((sess[w].buf = malloc(sess[w].bufsize)) == NULL
+            || (sess[w].data = malloc(blocksize)) == NULL)
+            return 1;
+        memset(sess[w].data, 'x', blocksize);
+        if (pthread_create(&sess[w].tid, NULL, session_thread, &sess[w]) != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    for (w = 0; w < nwl; w++) {
+        stop = 0;
+        pthread_barrier_wait(&barrier);     /* setup done */
+        start = now_ns();
+        if (count == 0) {
+            sleep(duration);
+            stop = 1;
+        }
+        pthread_barrier_wait(&barrier);     /* run done */
+        report(wl[w].name, sess, (now_ns() - start) / 1e9);
+        pthread_barrier_wait(&barrier);     /* results reported */
+    }
+
+    for (w = 0; w < nsessions; w++)
+        pthread_join(sess[w].tid, NULL);
+
+    for (w = 0; w < nsessions; w++)
+        if (sess[w].failed)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Start an afpd from the build tree on the loopback interface and run
+# afpbench against it, arguments are passed to afpbench. Must be run as
+# root, the sessions log in as guest.
+#
+# AFPBENCH_DIR   directory for the volume and afpd files (default /tmp/afpbench)
+# AFPBENCH_PORT  AFP port (default 10549)
+# AFPBENCH_CNID  CNID scheme of the volume (default tdb, dbd needs cnid_metad)
+# AFPBENCH_CONF  additional [Global] options, eg to compare settings
+
+top_builddir=`cd ${top_builddir:-../..} && pwd`
+dir=${AFPBENCH_DIR:-/tmp/afpbench}
+port=${AFPBENCH_PORT:-10549}
+cnid=${AFPBENCH_CNID:-tdb}
+
+mkdir -p "$dir/volume" "$dir/db"
+if [ $? -ne 0 ] ; then
+    echo Error creating AFP benchmark volume $dir/volume
+    exit 1
+fi
+chmod 1777 "$dir/volume"
+
+cat > "$dir/afp.conf" <<EOF
+[Global]
+afp port = $port
+afp listen = 127.0.0.1
+zeroconf = no
+uam list = uams_guest.so
+uam path = $top_builddir/etc/uams/.libs
+log file = $dir/afpd.log
+vol dbpath = $dir/db
+$AFPBENCH_CONF
+
+[bench]
+path = $dir/volume
+cnid scheme = $cnid
+EOF
+
+$top_builddir/etc/afpd/afpd -d -F "$dir/afp.conf" &
+afpd=$!
+trap 'kill $afpd 2>/dev/null' 0 1 2 15
+sleep 2
+
+$top_builddir/test/afpbench/afpbench -p $port -V bench "$@"
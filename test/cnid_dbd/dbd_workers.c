@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYRIGHT.
+ *
+ * Run cnid_dbd with worker threads for read-only requests and check the
+ * replies of GET, RESOLVE, SEARCH and GETSTAMP requests from several
+ * connections while the same connections keep adding entries. The workers
+ * log every request at level debug, so this also runs the logger from
+ * several threads at once.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <atalk/util.h>
+#include <atalk/cnid_bdb_private.h>
+
+#define WORKERS   4
+#define CONNS     6
+#define FILES     300
+#define READS     4     /* read requests per added entry */
+#define ROOT_DID  htonl(2)
+
+static char tmpdir[] = "/tmp/dbd_workers.XXXXXX";
+static char volpath[MAXPATHLEN];
+static int failed;
+
+#define CHECK(cond, ...) do {                                       \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "conn %d: ", c->num);                   \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fputc('\n', stderr);                                    \
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);         \
+            return NULL;                                            \
+        }                                                           \
+    } while (0)
+
+struct conn {
+    int     num;
+    int     fd;
+    cnid_t  cnid[FILES];
+    char    name[FILES][32];
+};
+
+static struct conn conns[CONNS];
+
+static int xwrite(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int xread(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        if ((n = read(fd, p, len)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int rpc(struct conn *c, struct cnid_dbd_rqst *rqst,
+               struct cnid_dbd_rply *rply, char *name, size_t namesize)
+{
+    if (xwrite(c->fd, rqst, sizeof(*rqst)) != 0
+        || (rqst->namelen && xwrite(c->fd, rqst->name, rqst->namelen) != 0))
+        return -1;
+    if (xread(c->fd, rply, sizeof(*rply)) != 0)
+        return -1;
+    if (rply->namelen > namesize)
+        return -1;
+    if (rply->namelen && xread(c->fd, name, rply->namelen) != 0)
+        return -1;
+    return 0;
+}
+
+static void *client(void *arg)
+{
+    struct conn *c = arg;
+    struct cnid_dbd_rqst rqst;
+    struct cnid_dbd_rply rply;
+    char buf[DBD_MAX_SRCH_RSLTS * sizeof(cnid_t) + CNID_HEADER_LEN + MAXPATHLEN];
+    cnid_t cnid;
+    int i, j, k, n;
+
+    for (i = 0; i < FILES; i++) {
+        snprintf(c->name[i], sizeof(c->name[i]), "conn%d file%d", c->num, i);
+
+        memset(&rqst, 0, sizeof(rqst));
+        rqst.op = CNID_DBD_OP_ADD;
+        rqst.dev = 1;
+        rqst.ino = c->num * FILES + i + 100;
+        rqst.did = ROOT_DID;
+        rqst.name = c->name[i];
+        rqst.namelen = strlen(c->name[i]);
+        CHECK(rpc(c, &rqst, &rply, buf, sizeof(buf)) == 0, "ADD: connection lost");
+        CHECK(rply.result == CNID_DBD_RES_OK, "ADD \"%s\": result %d", c->name[i], rply.result);
+        c->cnid[i] = rply.cnid;
+
+        /* read back random earlier entries through the workers */
+        for (j = 0; j < READS; j++) {
+            k = random() % (i + 1);
+
+            memset(&rqst, 0, sizeof(rqst));
+            switch (j) {
+            case 0:
+                rqst.op = CNID_DBD_OP_RESOLVE;
+                rqst.cnid = c->cnid[k];
+                CHECK(rpc(c, &rqst, &rply, buf, sizeof(buf)) == 0, "RESOLVE: connection lost");
+                CHECK(rply.result == CNID_DBD_RES_OK, "RESOLVE %u: result %d",
+                      ntohl(c->cnid[k]), rply.result);
+                CHECK(rply.did == ROOT_DID
+                      && rply.namelen > CNID_NAME_OFS
+                      && strcmp(buf + CNID_NAME_OFS, c->name[k]) == 0,
+                      "RESOLVE %u: wrong entry", ntohl(c->cnid[k]));
+                break;
+            case 1:
+                rqst.op = CNID_DBD_OP_GET;
+                rqst.did = ROOT_DID;
+                rqst.name = c->name[k];
+                rqst.namelen = strlen(c->name[k]);
+                CHECK(rpc(c, &rqst, &rply, buf, sizeof(buf)) == 0, "GET: connection lost");
+                CHECK(rply.result == CNID_DBD_RES_OK && rply.cnid == c->cnid[k],
+                      "GET \"%s\": result %d, CNID %u instead of %u", c->name[k],
+                      rply.result, ntohl(rply.cnid), ntohl(c->cnid[k]));
+                break;
+            case 2:
+                rqst.op = CNID_DBD_OP_SEARCH;
+                rqst.name = c->name[k];
+                rqst.namelen = strlen(c->name[k]);
+                CHECK(rpc(c, &rqst, &rply, buf, sizeof(buf)) == 0, "SEARCH: connection lost");
+                CHECK(rply.result == CNID_DBD_RES_OK, "SEARCH \"%s\": result %d",
+                      c->name[k], rply.result);
+                for (n = 0; n < (int)(rply.namelen / sizeof(cnid_t)); n++) {
+                    memcpy(&cnid, buf + n * sizeof(cnid_t), sizeof(cnid_t));
+                    if (cnid == c->cnid[k])
+                        break;
+                }
+                CHECK(n < (int)(rply.namelen / sizeof(cnid_t)),
+                      "SEARCH \"%s\": CNID %u not found", c->name[k], ntohl(c->cnid[k]));
+                break;
+            default:
+                rqst.op = CNID_DBD_OP_GETSTAMP;
+                CHECK(rpc(c, &rqst, &rply, buf, sizeof(buf)) == 0, "GETSTAMP: connection lost");
+                CHECK(rply.result == CNID_DBD_RES_OK && rply.namelen == CNID_DEV_LEN,
+                      "GETSTAMP: result %d", rply.result);
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int write_file(const char *path, const char *content)
+{
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL)
+        return -1;
+    fputs(content, fp);
+    return fclose(fp);
+}
+
+static int setup(char *conf, size_t size)
+{
+    char path[MAXPATHLEN], buf[4 * MAXPATHLEN];
+
+    if (mkdtemp(tmpdir) == NULL)
+        return -1;
+
+    snprintf(volpath, sizeof(volpath), "%s/vol", tmpdir);
+    if (mkdir(volpath, 0755) != 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/db", tmpdir);
+    if (mkdir(path, 0755) != 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/db/.AppleDB", tmpdir);
+    if (mkdir(path, 0755) != 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/db/.AppleDB/db_param", tmpdir);
+    snprintf(buf, sizeof(buf), "workers %d\n", WORKERS);
+    if (write_file(path, buf) != 0)
+        return -1;
+
+    snprintf(conf, size, "%s/afp.conf", tmpdir);
+    snprintf(buf, sizeof(buf),
+             "[Global]\n"
+             "vol dbpath = %s/db/\n"
+             "log file = %s/cnid_dbd.log\n"
+             "log level = default:note cnid:debug\n"
+             "[test]\n"
+             "path = %s\n",
+             tmpdir, tmpdir, volpath);
+    return write_file(conf, buf);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dbd = argc > 1 ? argv[1] : CNID_DBD;
+    char conf[MAXPATHLEN], ctrlarg[16], clntarg[16], cmd[MAXPATHLEN + 16];
+    int ctrl[2], sv[CONNS][2];
+    pthread_t threads[CONNS];
+    pid_t pid;
+    int i, status;
+
+    if (setup(conf, sizeof(conf)) != 0) {
+        perror("setup");
+        return 1;
+    }
+
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, ctrl) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    for (i = 0; i < CONNS; i++) {
+        if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv[i]) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+    }
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(ctrl[0]);
+        for (i = 0; i < CONNS; i++) {
+            close(sv[i][0]);
+            if (i > 0)
+                close(sv[i][1]);
+        }
+        snprintf(ctrlarg, sizeof(ctrlarg), "%d", ctrl[1]);
+        snprintf(clntarg, sizeof(clntarg), "%d", sv[0][1]);
+        execl(dbd, "cnid_dbd", "-F", conf, "-p", volpath, "-t", ctrlarg, "-l", clntarg, (char *)NULL);
+        perror(dbd);
+        _exit(1);
+    }
+
+    /* the other connections are handed over like cnid_metad does it */
+    close(ctrl[1]);
+    close(sv[0][1]);
+    for (i = 1; i < CONNS; i++) {
+        if (send_fd(ctrl[0], sv[i][1]) != 0) {
+            perror("send_fd");
+            return 1;
+        }
+        close(sv[i][1]);
+    }
+
+    for (i = 0; i < CONNS; i++) {
+        conns[i].num = i;
+        conns[i].fd = sv[i][0];
+        pthread_create(&threads[i], NULL, client, &conns[i]);
+    }
+    for (i = 0; i < CONNS; i++)
+        pthread_join(threads[i], NULL);
+
+    kill(pid, SIGTERM);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "cnid_dbd did not exit cleanly\n");
+        failed = 1;
+    }
+
+    if (failed) {
+        fprintf(stderr, "failed, see %s/cnid_dbd.log\n", tmpdir);
+        return 1;
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+    system(cmd);
+    return 0;
+}
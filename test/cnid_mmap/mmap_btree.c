@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2026 Netatalk Team
+ * All Rights Reserved.  See COPYRIGHT.
+ *
+ * Tests of the B+trees of the mmap CNID backend: put, get, seek and delete
+ * of many keys, reopening the file, isolation of a reader from a writer,
+ * writers that die before commit and files whose creation was cut short.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <atalk/util.h>
+
+#include "cnid_mmap.h"
+
+#define NKEYS 20000
+
+static char tmpdir[] = "/tmp/cnid_mmap.XXXXXX";
+static char dbpath[MAXPATHLEN];
+
+#define CHECK(cond, ...) do {                                       \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: ", __func__, __LINE__);         \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fputc('\n', stderr);                                    \
+            return -1;                                              \
+        }                                                           \
+    } while (0)
+
+/* keys sort like their numbers, values differ with gen */
+static size_t mkkey(char *buf, int i)
+{
+    return sprintf(buf, "key%08d", i);
+}
+
+static size_t mkval(char *buf, int i, int gen)
+{
+    return sprintf(buf, "value %d of generation %d", i, gen);
+}
+
+static int put_range(MM_ENV *env, int from, int to, int step, int gen)
+{
+    char key[32], val[64];
+    size_t klen, vlen;
+    int i;
+
+    for (i = from; i < to; i += step) {
+        klen = mkkey(key, i);
+        vlen = mkval(val, i, gen);
+        CHECK(mm_put(env, MM_CNID, key, klen, val, vlen) == 0, "put %d: %s", i, strerror(errno));
+    }
+    return 0;
+}
+
+/* Check that exactly the keys from, from + step, ... below to are there */
+static int check_range(MM_ENV *env, int from, int to, int step, int gen)
+{
+    char key[32], val[64];
+    struct mm_val k, v;
+    size_t klen, vlen;
+    int i, rc;
+
+    CHECK(mm_read_begin(env) == 0, "read_begin");
+    k.data = "";
+    k.size = 0;
+    for (i = from; i < to; i += step) {
+        klen = mkkey(key, i);
+        vlen = mkval(val, i, gen);
+        rc = mm_seek(env, MM_CNID, k.data, k.size, &k, &v);
+        if (rc != 1 || k.size != klen || memcmp(k.data, key, klen) != 0
+            || v.size != vlen || memcmp(v.data, val, vlen) != 0) {
+            mm_read_end(env);
+            CHECK(0, "seek to %d: rc %d, wrong entry", i, rc);
+        }
+        if (i % 97 == 0 && (mm_get(env, MM_CNID, key, klen, &v) != 1
+                            || v.size != vlen || memcmp(v.data, val, vlen) != 0)) {
+            mm_read_end(env);
+            CHECK(0, "get %d", i);
+        }
+    }
+    rc = mm_seek(env, MM_CNID, k.data, k.size, &k, &v);
+    mm_read_end(env);
+    CHECK(rc == 0, "entries after %d", to);
+    return 0;
+}
+
+static int test_put_del_reopen(void)
+{
+    MM_ENV *env;
+    char key[32];
+    struct mm_val v;
+    int i;
+
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "open");
+
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    CHECK(put_range(env, 0, NKEYS, 1, 1) == 0, "put");
+    mm_set_lastid(env, NKEYS);
+    CHECK(mm_write_commit(env) == 0, "commit");
+    CHECK(check_range(env, 0, NKEYS, 1, 1) == 0, "after put");
+
+    /* delete the odd keys, overwrite the even ones */
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    for (i = 1; i < NKEYS; i += 2)
+        CHECK(mm_del(env, MM_CNID, key, mkkey(key, i)) == 1, "del %d", i);
+    CHECK(mm_del(env, MM_CNID, key, mkkey(key, NKEYS + 1)) == 0, "del of a missing key");
+    CHECK(put_range(env, 0, NKEYS, 2, 2) == 0, "overwrite");
+    CHECK(mm_write_commit(env) == 0, "commit");
+    CHECK(check_range(env, 0, NKEYS, 2, 2) == 0, "after delete");
+    mm_close(env);
+
+    CHECK(mm_open(&env, dbpath, 0644, MM_NOSYNC) == 0, "reopen");
+    CHECK(check_range(env, 0, NKEYS, 2, 2) == 0, "after reopen");
+    CHECK(mm_read_begin(env) == 0, "read_begin");
+    i = mm_get_lastid(env);
+    mm_read_end(env);
+    CHECK(i == NKEYS, "lastid %d", i);
+
+    /* an aborted transaction leaves no trace */
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    for (i = 0; i < NKEYS; i += 2)
+        CHECK(mm_del(env, MM_CNID, key, mkkey(key, i)) == 1, "del %d", i);
+    mm_write_abort(env);
+    CHECK(check_range(env, 0, NKEYS, 2, 2) == 0, "after abort");
+
+    /* deleting everything leaves an empty tree */
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    for (i = 0; i < NKEYS; i += 2)
+        CHECK(mm_del(env, MM_CNID, key, mkkey(key, i)) == 1, "del %d", i);
+    CHECK(mm_write_commit(env) == 0, "commit");
+    CHECK(mm_read_begin(env) == 0, "read_begin");
+    i = mm_seek(env, MM_CNID, "", 0, &v, &v);
+    mm_read_end(env);
+    CHECK(i == 0, "tree not empty");
+
+    mm_close(env);
+    return 0;
+}
+
+/* A writer that dies before it commits must not change the database */
+static int test_crash(void)
+{
+    MM_ENV *env;
+    pid_t pid;
+    int status;
+
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "open");
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    CHECK(put_range(env, 0, NKEYS, 1, 3) == 0, "put");
+    CHECK(mm_write_commit(env) == 0, "commit");
+    mm_close(env);
+
+    if ((pid = fork()) == 0) {
+        if (mm_open(&env, dbpath, 0644, 0) != 0 || mm_write_begin(env) != 0)
+            _exit(1);
+        /* enough changes to reuse freed pages and grow the file */
+        if (put_range(env, 0, NKEYS, 1, 4) != 0 || put_range(env, NKEYS, 2 * NKEYS, 1, 4) != 0)
+            _exit(1);
+        _exit(0);
+    }
+    CHECK(pid > 0, "fork");
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+          "writer failed");
+
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "open after crash");
+    CHECK(check_range(env, 0, NKEYS, 1, 3) == 0, "after crash");
+    CHECK(mm_write_begin(env) == 0, "write_begin after crash");
+    CHECK(put_range(env, 0, NKEYS, 1, 5) == 0, "put after crash");
+    CHECK(mm_write_commit(env) == 0, "commit after crash");
+    mm_close(env);
+
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "reopen");
+    CHECK(check_range(env, 0, NKEYS, 1, 5) == 0, "after crash and commit");
+    mm_close(env);
+    return 0;
+}
+
+/* A reader keeps its snapshot while another process commits */
+static int test_snapshot(void)
+{
+    MM_ENV *env, *wenv;
+    struct mm_val v;
+    char key[32];
+    uint64_t stamp;
+    pid_t pid;
+    int status, rc;
+
+    unlink(dbpath);
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "open");
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    CHECK(put_range(env, 0, 1000, 1, 1) == 0, "put");
+    CHECK(mm_write_commit(env) == 0, "commit");
+    stamp = mm_stamp(env);
+
+    CHECK(mm_read_begin(env) == 0, "read_begin");
+    if ((pid = fork()) == 0) {
+        if (mm_open(&wenv, dbpath, 0644, 0) != 0 || mm_write_begin(wenv) != 0
+            || mm_wipe(wenv) != 0 || put_range(wenv, 1000, 2000, 1, 2) != 0
+            || mm_write_commit(wenv) != 0)
+            _exit(1);
+        mm_close(wenv);
+        _exit(0);
+    }
+    CHECK(pid > 0, "fork");
+    rc = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (rc)
+        rc = mm_get(env, MM_CNID, key, mkkey(key, 500), &v) == 1
+            && mm_get(env, MM_CNID, key, mkkey(key, 1500), &v) == 0;
+    mm_read_end(env);
+    CHECK(rc, "snapshot changed by the writer");
+
+    CHECK(check_range(env, 1000, 2000, 1, 2) == 0, "after wipe");
+    CHECK(mm_stamp(env) != stamp, "stamp not changed by wipe");
+    mm_close(env);
+    return 0;
+}
+
+/* Files left by a creation that was cut short are initialized again */
+static int test_short_file(void)
+{
+    MM_ENV *env;
+    int fd;
+
+    unlink(dbpath);
+    CHECK((fd = open(dbpath, O_RDWR | O_CREAT, 0644)) >= 0, "create");
+    close(fd);
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "open of an empty file");
+    mm_close(env);
+
+    CHECK((fd = open(dbpath, O_RDWR | O_TRUNC)) >= 0, "truncate");
+    CHECK(ftruncate(fd, 1024 * 1024) == 0, "ftruncate");
+    close(fd);
+    CHECK(mm_open(&env, dbpath, 0644, 0) == 0, "open of a file of zeros");
+    CHECK(mm_write_begin(env) == 0, "write_begin");
+    CHECK(put_range(env, 0, 100, 1, 1) == 0, "put");
+    CHECK(mm_write_commit(env) == 0, "commit");
+    CHECK(check_range(env, 0, 100, 1, 1) == 0, "after init");
+    mm_close(env);
+    return 0;
+}
+
+int main(void)
+{
+    char cmd[MAXPATHLEN + 16];
+    int failed = 0;
+
+    if (mkdtemp(tmpdir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(dbpath, sizeof(dbpath), "%s/cnid2.mmap", tmpdir);
+
+    failed |= test_put_del_reopen();
+    failed |= test_crash();
+    failed |= test_snapshot();
+    failed |= test_short_file();
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+    system(cmd);
+    return failed ? 1 : 0;
+}